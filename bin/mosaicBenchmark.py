@@ -0,0 +1,155 @@
+#!/usr/bin/env python
+"""Time the stages of the mosaic solve on synthetic surveys
+
+Each scale is run in a child process so that the peak RSS reported for
+it is its own.  Results are written as a JSON list with one record per
+scale.
+
+    mosaicBenchmark.py --scales 5:10:2000 10:40:5000 --output bench.json
+"""
+
+import sys
+import math
+import json
+import time
+import argparse
+import resource
+import subprocess
+
+def peakRss():
+    """Peak resident set size of this process (kB on Linux)"""
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+def runScale(nVisit, nCcd, density, args):
+    import lsst.afw.geom                    as afwGeom
+    import lsst.meas.mosaic.mosaicLib       as measMosaic
+    from lsst.meas.mosaic.synthetic import SyntheticSurveyConfig, makeSyntheticSurvey
+
+    config = SyntheticSurveyConfig()
+    config.nVisit = nVisit
+    config.nCcd = nCcd
+    config.starDensity = density
+    config.posNoise = args.posNoise
+    config.fluxNoise = args.fluxNoise
+    config.outlierFraction = args.outlierFraction
+    config.seed = args.seed
+
+    measMosaic.Metrics.get().reset()
+    result = dict(nVisit=nVisit, nCcd=nCcd, starDensity=density)
+    times = dict()
+    rss = dict()
+
+    def stage(name, func, *a):
+        t0 = time.time()
+        value = func(*a)
+        times[name] = time.time() - t0
+        rss[name] = peakRss()
+        return value
+
+    survey = stage("generate", makeSyntheticSurvey, config)
+    result["nSource"] = survey.nSource()
+    result["nMatch"] = survey.nMatch()
+
+    d_lim = afwGeom.Angle(args.radXMatch, afwGeom.arcseconds)
+    rootMat = stage("kdtreeMat", measMosaic.kdtreeMat, survey.matchList)
+    allMat = stage("mergeMat", rootMat.mergeMat)
+    rootSource = stage("kdtreeSource", measMosaic.kdtreeSource, survey.sourceSet, rootMat,
+                       survey.ccdSet, d_lim, args.nBrightest)
+    allSource = stage("mergeSource", rootSource.mergeSource)
+
+    matchVec = stage("obsVecMatch", measMosaic.obsVecFromSourceGroup,
+                     allMat, survey.wcsDic, survey.ccdSet)
+    sourceVec = stage("obsVecSource", measMosaic.obsVecFromSourceGroup,
+                      allSource, survey.wcsDic, survey.ccdSet)
+    result["nMatchObs"] = len(matchVec)
+    result["nSourceObs"] = len(sourceVec)
+
+    ffp = measMosaic.FluxFitParams(args.fluxFitOrder, False, True)
+    u_max = max([math.fabs(m.u) for m in matchVec])
+    v_max = max([math.fabs(m.v) for m in matchVec])
+    ffp.u_max = (math.floor(u_max / 10.) + 1) * 10
+    ffp.v_max = (math.floor(v_max / 10.) + 1) * 10
+    fexp = measMosaic.map_exptype_float()
+    fchip = measMosaic.map_chiptype_float()
+    stats = measMosaic.SolveStatistics()
+
+    backend = {"dense": measMosaic.SolverPlan.DENSE,
+               "starEliminated": measMosaic.SolverPlan.STAR_ELIMINATED}[args.backend]
+    plan = measMosaic.planSolve(len(survey.wcsDic), len(survey.ccdSet), args.fittingOrder, args.fluxFitOrder,
+                                allSource.size(), len(matchVec), len(sourceVec), backend)
+    result["plan"] = dict(astromSize=plan.astromSize, fluxSize=plan.fluxSize, peakBytes=plan.peakBytes,
+                          astromFlops=plan.astromFlops, fluxFlops=plan.fluxFlops)
+
+    stage("solveMosaic_CCD", measMosaic.solveMosaic_CCD,
+          args.fittingOrder, allMat.size(), allSource.size(), matchVec, sourceVec,
+          survey.wcsDic, survey.ccdSet, ffp, fexp, fchip,
+          True, True, False, 0.0, False, ".",
+          measMosaic.ConvergenceCriteria(args.maxIter), measMosaic.ConvergenceCriteria(args.maxIter),
+          measMosaic.ConvergenceCriteria(2), measMosaic.CoeffSet(), measMosaic.RobustWeight(), stats, backend)
+    times["astrometry"] = stats.astromTime
+    times["fluxFit"] = stats.fluxTime
+
+    metrics = measMosaic.Metrics.get()
+    result["time"] = times
+    result["stages"] = dict([(name, metrics.getTime(name)) for name in metrics.getTimerNames()])
+    result["counts"] = dict([(name, metrics.getCount(name)) for name in metrics.getCounterNames()])
+    result["maxRss"] = rss
+    result["rms"] = stats.rms
+    result["fluxRms"] = stats.fluxRms
+    result["nIter"] = stats.nIter
+    result["nReject"] = stats.nReject
+    return result
+
+def parseScale(s):
+    nVisit, nCcd, density = s.split(":")
+    return int(nVisit), int(nCcd), float(density)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--scales", nargs="+", default=["5:10:2000", "10:40:5000", "20:104:10000"],
+                        help="nVisit:nCcd:starDensity for each run")
+    parser.add_argument("--output", default=None, help="JSON output file (default: stdout)")
+    parser.add_argument("--fittingOrder", type=int, default=5)
+    parser.add_argument("--fluxFitOrder", type=int, default=5)
+    parser.add_argument("--maxIter", type=int, default=3)
+    parser.add_argument("--nBrightest", type=int, default=300)
+    parser.add_argument("--radXMatch", type=float, default=1.0, help="arcsec")
+    parser.add_argument("--posNoise", type=float, default=0.05, help="pixels")
+    parser.add_argument("--fluxNoise", type=float, default=0.01)
+    parser.add_argument("--outlierFraction", type=float, default=0.001)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--backend", choices=["dense", "starEliminated"], default="dense")
+    parser.add_argument("--single", action="store_true", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.single:
+        nVisit, nCcd, density = parseScale(args.scales[0])
+        result = runScale(nVisit, nCcd, density, args)
+        sys.stdout.write("\n")
+        json.dump(result, sys.stdout)
+        sys.stdout.write("\n")
+        return
+
+    results = []
+    for s in args.scales:
+        argv = [sys.executable, sys.argv[0], "--single", "--scales", s]
+        for name in ("fittingOrder", "fluxFitOrder", "maxIter", "nBrightest", "radXMatch",
+                     "posNoise", "fluxNoise", "outlierFraction", "seed", "backend"):
+            argv += ["--" + name, str(getattr(args, name))]
+        child = subprocess.Popen(argv, stdout=subprocess.PIPE)
+        out = child.communicate()[0]
+        if child.returncode != 0:
+            print >> sys.stderr, "scale %s failed with status %d" % (s, child.returncode)
+            continue
+        # Anything logged to stdout comes first; the record is the last line
+        results.append(json.loads(out.strip().splitlines()[-1]))
+
+    if args.output is None:
+        json.dump(results, sys.stdout, indent=2)
+    else:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=2)
+
+if __name__ == "__main__":
+    main()
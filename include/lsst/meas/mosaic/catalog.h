@@ -0,0 +1,38 @@
+#ifndef MEAS_MOSAIC_catalog_h_INCLUDED
+#define MEAS_MOSAIC_catalog_h_INCLUDED
+
+#include "lsst/meas/mosaic/mosaicfit.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+/*
+ * Star selection of MosaicTask.selectStars, applied while a catalog is
+ * read: sources classified as extended, saturated at the center or
+ * deblended into children are left out.
+ */
+class StarSelection {
+public:
+    double maxExtendedness;     /* classification.extendedness must be below this */
+    bool rejectSaturated;       /* flags.pixel.saturated.center */
+    bool rejectParents;         /* deblend.nchild > 0 */
+
+    StarSelection() : maxExtendedness(0.5), rejectSaturated(true), rejectParents(true) {}
+};
+
+/*
+ * Read the stars of a src (or icSrc) catalog file written by afw::table.
+ * Only the columns a Source needs are read: id, coord, the centroid and
+ * aperture flux slots with their errors and flags, and the columns of the
+ * selection.  Rows are read and selected in chunks of the cfitsio buffer
+ * size, so the whole catalog is never in memory.  Sources with a
+ * non-finite position are dropped, and iexp and ichip are set on the rest.
+ * If the file cannot be read, a warning is logged and the set is empty.
+ */
+SourceSet readSourceCatalog(std::string const & filename,
+                            ExpType iexp,
+                            ChipType ichip,
+                            StarSelection const & selection = StarSelection());
+
+}}} // namespace lsst::meas::mosaic
+
+#endif // !MEAS_MOSAIC_catalog_h_INCLUDED
@@ -0,0 +1,84 @@
+#ifndef MEAS_MOSAIC_checkpoint_h_INCLUDED
+#define MEAS_MOSAIC_checkpoint_h_INCLUDED
+
+#include "lsst/meas/mosaic/mosaicfit.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+/*
+ * State of solveMosaic_CCD, saved after each astrometric iteration (phase
+ * ASTROMETRY, or FLUX once the iteration has stopped) and after the flux
+ * fit (DONE).  The observations keep only their measured quantities, good
+ * flags and star positions; everything derived from the solution is
+ * recomputed on resume.
+ */
+class Checkpoint {
+public:
+    typedef boost::shared_ptr<Checkpoint> Ptr;
+
+    enum Phase { ASTROMETRY, FLUX, DONE };
+
+    Phase phase;
+    int niter;          /* astrometric iterations done */
+    double chi2Prev;    /* chi2 after the last of them */
+    int nmatch;
+    int nsource;
+    ObsVec matchVec;
+    ObsVec sourceVec;
+    CoeffSet coeffSet;
+    FluxFitParams::Ptr ffp;
+    std::map<ExpType, float> fexp;
+    std::map<ChipType, float> fchip;
+
+    Checkpoint();
+};
+
+/*
+ * Save a checkpoint with the current CCD geometry.  The file is written
+ * under a temporary name and renamed, so an interrupted write leaves the
+ * previous checkpoint intact; a failed rename is logged as a warning and
+ * leaves the new state in filename + ".tmp".  The first three tables are those of
+ * writeSolution; they are followed by the solver state and the matched and
+ * source observations.
+ */
+void writeCheckpoint(std::string const & filename,
+                     Checkpoint const & checkpoint,
+                     CcdSet const & ccdSet);
+
+/*
+ * Read a checkpoint written by writeCheckpoint, applying the saved CCD
+ * geometry to ccdSet as readSolution does.
+ */
+Checkpoint::Ptr readCheckpoint(std::string const & filename, CcdSet & ccdSet);
+
+/*
+ * Continue solveMosaic_CCD from a checkpoint, without the catalog input,
+ * the matching and the iterations already done.  matchVec and sourceVec
+ * are set to copies of the observations of the checkpoint, which is left
+ * as read and can be resumed again; wcsDic and ccdSet must be
+ * those of the original solve (ccdSet as returned by readCheckpoint).  The
+ * statistics only cover the iterations run after the resume.  With a
+ * non-empty checkpointFile the solve keeps checkpointing there.
+ */
+CoeffSet resumeMosaic_CCD(Checkpoint::Ptr const & checkpoint,
+                          ObsVec &matchVec,
+                          ObsVec &sourceVec,
+                          WcsDic &wcsDic,
+                          CcdSet &ccdSet,
+                          FluxFitParams::Ptr &ffp,
+                          std::map<ExpType, float> &fexp,
+                          std::map<ChipType, float> &fchip,
+                          bool solveCcd = true,
+                          bool allowRotation = true,
+                          double catRMS = 0.0,
+                          ConvergenceCriteria const & astromCriteria = ConvergenceCriteria(3),
+                          ConvergenceCriteria const & fluxCriteria = ConvergenceCriteria(3),
+                          RobustWeight const & fluxRobust = RobustWeight(),
+                          SolveStatistics::Ptr const & stats = SolveStatistics::Ptr(),
+                          SolverPlan::Backend backend = SolverPlan::DENSE,
+                          std::string const & checkpointFile = std::string(),
+                          SolveControl::Ptr const & control = SolveControl::Ptr());
+
+}}} // namespace lsst::meas::mosaic
+
+#endif // !MEAS_MOSAIC_checkpoint_h_INCLUDED
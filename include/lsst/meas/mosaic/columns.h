@@ -0,0 +1,185 @@
+#ifndef MEAS_MOSAIC_columns_h_INCLUDED
+#define MEAS_MOSAIC_columns_h_INCLUDED
+
+#include "ndarray.h"
+#include "lsst/meas/mosaic/mosaicfit.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+/*
+ * The fields of an ObsVec gathered into one array per field, in the order
+ * of the vector.  The arrays are owned here and are returned to Python as
+ * numpy arrays over the same memory, so a diagnostic reads a whole column
+ * with one call instead of one attribute lookup per Obs.  The Obs are not
+ * referenced after construction; update() gathers the fields again into
+ * the same arrays (e.g. after another fit), which the numpy views see.
+ */
+class ObsColumns {
+public:
+    typedef boost::shared_ptr<ObsColumns> Ptr;
+
+    explicit ObsColumns(ObsVec const & obsVec);
+
+    /* Gather obsVec, which must have the size of the original, again */
+    void update(ObsVec const & obsVec);
+
+    int size() const { return _size; }
+
+    ndarray::Array<double,1,1> getRa() const { return _ra; }
+    ndarray::Array<double,1,1> getDec() const { return _dec; }
+    ndarray::Array<double,1,1> getXi() const { return _xi; }
+    ndarray::Array<double,1,1> getEta() const { return _eta; }
+    ndarray::Array<double,1,1> getXiFit() const { return _xi_fit; }
+    ndarray::Array<double,1,1> getEtaFit() const { return _eta_fit; }
+    ndarray::Array<double,1,1> getX() const { return _x; }
+    ndarray::Array<double,1,1> getY() const { return _y; }
+    ndarray::Array<double,1,1> getU() const { return _u; }
+    ndarray::Array<double,1,1> getV() const { return _v; }
+    ndarray::Array<double,1,1> getXerr() const { return _xerr; }
+    ndarray::Array<double,1,1> getYerr() const { return _yerr; }
+    ndarray::Array<double,1,1> getMag() const { return _mag; }
+    ndarray::Array<double,1,1> getMag0() const { return _mag0; }
+    ndarray::Array<double,1,1> getErr() const { return _err; }
+    ndarray::Array<double,1,1> getMagCat() const { return _mag_cat; }
+    ndarray::Array<double,1,1> getErrCat() const { return _err_cat; }
+    ndarray::Array<int,1,1> getId() const { return _id; }
+    ndarray::Array<int,1,1> getIstar() const { return _istar; }
+    ndarray::Array<int,1,1> getJstar() const { return _jstar; }
+    ndarray::Array<ExpType,1,1> getIexp() const { return _iexp; }
+    ndarray::Array<ChipType,1,1> getIchip() const { return _ichip; }
+    ndarray::Array<int,1,1> getJexp() const { return _jexp; }
+    ndarray::Array<int,1,1> getJchip() const { return _jchip; }
+    ndarray::Array<bool,1,1> getGood() const { return _good; }
+
+private:
+    int _size;
+    ndarray::Array<double,1,1> _ra, _dec, _xi, _eta, _xi_fit, _eta_fit;
+    ndarray::Array<double,1,1> _x, _y, _u, _v, _xerr, _yerr;
+    ndarray::Array<double,1,1> _mag, _mag0, _err, _mag_cat, _err_cat;
+    ndarray::Array<int,1,1> _id, _istar, _jstar, _jexp, _jchip;
+    ndarray::Array<ExpType,1,1> _iexp;
+    ndarray::Array<ChipType,1,1> _ichip;
+    ndarray::Array<bool,1,1> _good;
+};
+
+/*
+ * The coefficients of a CoeffSet, one row per exposure in the order of the
+ * map.  a, b, ap and bp have a column per polynomial term; all the Coeff
+ * must be of the same order.
+ */
+class CoeffColumns {
+public:
+    typedef boost::shared_ptr<CoeffColumns> Ptr;
+
+    explicit CoeffColumns(CoeffSet const & coeffSet);
+
+    int size() const { return _size; }
+    int getNcoeff() const { return _ncoeff; }
+
+    ndarray::Array<ExpType,1,1> getIexp() const { return _iexp; }
+    ndarray::Array<double,1,1> getA() const { return _A; }
+    ndarray::Array<double,1,1> getD() const { return _D; }
+    ndarray::Array<double,1,1> getX0() const { return _x0; }
+    ndarray::Array<double,1,1> getY0() const { return _y0; }
+    ndarray::Array<double,2,2> get_a() const { return _a; }
+    ndarray::Array<double,2,2> get_b() const { return _b; }
+    ndarray::Array<double,2,2> get_ap() const { return _ap; }
+    ndarray::Array<double,2,2> get_bp() const { return _bp; }
+
+private:
+    int _size;
+    int _ncoeff;
+    ndarray::Array<ExpType,1,1> _iexp;
+    ndarray::Array<double,1,1> _A, _D, _x0, _y0;
+    ndarray::Array<double,2,2> _a, _b, _ap, _bp;
+};
+
+/*
+ * The Sources of a SourceGroup (e.g. from mergeMat or mergeSource), one row
+ * per Source in group order.  group is the index of the group and member
+ * the index within it, so the first (catalog or averaged) entry of each
+ * group has member 0.  ra and dec are in degrees.
+ */
+class SourceColumns {
+public:
+    typedef boost::shared_ptr<SourceColumns> Ptr;
+
+    explicit SourceColumns(SourceGroup const & sourceGroup);
+
+    int size() const { return _size; }
+    int getNgroup() const { return _ngroup; }
+
+    ndarray::Array<int,1,1> getGroup() const { return _group; }
+    ndarray::Array<int,1,1> getMember() const { return _member; }
+    ndarray::Array<ExpType,1,1> getIexp() const { return _iexp; }
+    ndarray::Array<ChipType,1,1> getIchip() const { return _ichip; }
+    ndarray::Array<double,1,1> getX() const { return _x; }
+    ndarray::Array<double,1,1> getY() const { return _y; }
+    ndarray::Array<double,1,1> getRa() const { return _ra; }
+    ndarray::Array<double,1,1> getDec() const { return _dec; }
+    ndarray::Array<double,1,1> getFlux() const { return _flux; }
+    ndarray::Array<double,1,1> getFluxErr() const { return _fluxErr; }
+
+private:
+    int _size;
+    int _ngroup;
+    ndarray::Array<int,1,1> _group, _member;
+    ndarray::Array<ExpType,1,1> _iexp;
+    ndarray::Array<ChipType,1,1> _ichip;
+    ndarray::Array<double,1,1> _x, _y, _ra, _dec, _flux, _fluxErr;
+};
+
+/*
+ * The per-exposure and per-chip entries of a SolveStatistics, one row per
+ * exposure in the order of expId and one per chip in the order of chipId.
+ */
+class StatisticsColumns {
+public:
+    typedef boost::shared_ptr<StatisticsColumns> Ptr;
+
+    explicit StatisticsColumns(SolveStatistics const & stats);
+
+    ndarray::Array<ExpType,1,1> getExpId() const { return _expId; }
+    ndarray::Array<double,1,1> getExpRms() const { return _expRms; }
+    ndarray::Array<int,1,1> getExpNObs() const { return _expNObs; }
+    ndarray::Array<int,1,1> getExpNReject() const { return _expNReject; }
+    ndarray::Array<double,1,1> getExpFluxRms() const { return _expFluxRms; }
+    ndarray::Array<int,1,1> getExpFluxNObs() const { return _expFluxNObs; }
+    ndarray::Array<int,1,1> getExpFluxNReject() const { return _expFluxNReject; }
+
+    ndarray::Array<ChipType,1,1> getChipId() const { return _chipId; }
+    ndarray::Array<double,1,1> getChipRms() const { return _chipRms; }
+    ndarray::Array<int,1,1> getChipNObs() const { return _chipNObs; }
+    ndarray::Array<int,1,1> getChipNReject() const { return _chipNReject; }
+    ndarray::Array<double,1,1> getChipFluxRms() const { return _chipFluxRms; }
+    ndarray::Array<int,1,1> getChipFluxNObs() const { return _chipFluxNObs; }
+    ndarray::Array<int,1,1> getChipFluxNReject() const { return _chipFluxNReject; }
+
+private:
+    ndarray::Array<ExpType,1,1> _expId;
+    ndarray::Array<double,1,1> _expRms, _expFluxRms;
+    ndarray::Array<int,1,1> _expNObs, _expNReject, _expFluxNObs, _expFluxNReject;
+    ndarray::Array<ChipType,1,1> _chipId;
+    ndarray::Array<double,1,1> _chipRms, _chipFluxRms;
+    ndarray::Array<int,1,1> _chipNObs, _chipNReject, _chipFluxNObs, _chipFluxNReject;
+};
+
+/*
+ * ffp evaluated at each (u[i], v[i]), as FluxFitParams::eval on a block of
+ * points; LengthErrorException if u and v differ in length.
+ */
+ndarray::Array<double,1,1> evalFluxFitParams(FluxFitParams & ffp,
+                                             ndarray::Array<double const,1,1> const & u,
+                                             ndarray::Array<double const,1,1> const & v);
+
+/*
+ * Sky positions (ra, dec in degrees, one row per point) of the pixel
+ * positions (x[i], y[i]); LengthErrorException if x and y differ in length.
+ */
+ndarray::Array<double,2,2> pixelsToSky(lsst::afw::image::Wcs::Ptr const & wcs,
+                                       ndarray::Array<double const,1,1> const & x,
+                                       ndarray::Array<double const,1,1> const & y);
+
+}}} // namespace lsst::meas::mosaic
+
+#endif // !MEAS_MOSAIC_columns_h_INCLUDED
@@ -0,0 +1,120 @@
+#ifndef MEAS_MOSAIC_metrics_h_INCLUDED
+#define MEAS_MOSAIC_metrics_h_INCLUDED
+
+#include <map>
+#include <string>
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+/*
+ * Wall-clock timers and counters of the solver stages, kept in one
+ * process-wide registry (Metrics::get()).  Names are dotted stage names
+ * such as "astrom.assembly" or "crossmatch.kdtreeMat".  Timers add up the
+ * time and the number of calls; counters hold the last value set or the
+ * sum of the values added.  Updates are serialised, so they may be made
+ * from OpenMP threads.
+ */
+class Metrics {
+public:
+    typedef boost::shared_ptr<Metrics> Ptr;
+
+    static Metrics::Ptr get();
+
+    void reset();
+    void addTime(std::string const & name, double seconds);
+    void addCount(std::string const & name, long n = 1);
+    void setCount(std::string const & name, long n);
+
+    std::vector<std::string> getTimerNames() const;
+    double getTime(std::string const & name) const;
+    int getCalls(std::string const & name) const;
+    std::vector<std::string> getCounterNames() const;
+    long getCount(std::string const & name) const;
+
+private:
+    std::map<std::string, double> _time;
+    std::map<std::string, int> _calls;
+    std::map<std::string, long> _count;
+};
+
+/*
+ * Progress and cancellation of a long solve or cross-match, shared
+ * between the thread running it and any other thread.  The solvers
+ * record the stage, iteration and chi2 they have reached with update(),
+ * and stop at the next poll once cancel() has been called or the timeout
+ * has passed.  What a cancelled call returns is the state reached, not a
+ * solution; a cancelled solve leaves its last checkpoint to resume from.
+ * A solve that stops at a poll marks itself stopped(), and one that
+ * finishes records the stage "done", so a timeout that passes after the
+ * last poll does not make a finished solve look cancelled.
+ */
+class SolveControl {
+public:
+    typedef boost::shared_ptr<SolveControl> Ptr;
+
+    SolveControl();
+
+    void cancel();
+    /* Cancel once seconds have passed from now; 0 for no timeout */
+    void setTimeout(double seconds);
+    bool isCancelled() const;
+
+    /* Record the progress of the solve; returns isCancelled() */
+    bool update(std::string const & stage, int iteration = 0, double chi2 = 0.0);
+    /* Record that the solve stopped early because it was cancelled */
+    void stop();
+    bool isStopped() const;
+
+    std::string getStage() const;
+    int getIteration() const;
+    double getChi2() const;
+    /* Seconds since construction */
+    double getElapsed() const;
+
+private:
+    mutable boost::mutex _mutex;
+    bool _cancelled;
+    bool _stopped;
+    double _start;
+    double _deadline;
+    std::string _stage;
+    int _iteration;
+    double _chi2;
+};
+
+#if !defined(SWIG)
+double wallTime();
+
+/*
+ * Adds the time from construction to destruction (or stop()) to the
+ * timer name of the registry.  An inactive timer records nothing, for
+ * recursive functions that only time their outermost call.
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(char const * name, bool active = true);
+    ~ScopedTimer();
+    void stop();
+
+private:
+    char const * _name;
+    double _start;
+};
+
+/*
+ * printf-style message to the "meas.mosaic" log; importance is one of
+ * the lsst::pex::logging::Log levels.
+ */
+void mosaicLog(int importance, char const * fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+#endif
+
+}}} // namespace lsst::meas::mosaic
+
+#endif // !MEAS_MOSAIC_metrics_h_INCLUDED
@@ -9,6 +9,7 @@
 #include "lsst/afw/table.h"
 #include "lsst/utils/ieee.h"
 #include "boost/enable_shared_from_this.hpp"
+#include "lsst/meas/mosaic/metrics.h"
 
 namespace lsst {
     namespace meas {
@@ -37,6 +38,11 @@ namespace lsst {
                     _pixels(lsst::afw::geom::Point2D(std::numeric_limits<double>::quiet_NaN(),
                                                      std::numeric_limits<double>::quiet_NaN())),
                     _flux(flux), _astromBad(false) {}
+                // For simulated catalogs and catalogs read column by column
+                Source(IdType id, lsst::afw::coord::Coord coord, lsst::afw::geom::Point2D pixels,
+                       double flux, double err, double xerr, double yerr, bool astromBad=false) :
+                    _id(id), _chip(UNSET), _exp(UNSET), _sky(coord), _pixels(pixels),
+                    _flux(flux), _err(err), _xerr(xerr), _yerr(yerr), _astromBad(astromBad) {}
 
                 IdType getId() const { return _id; }
                 ChipType getChip() const { return _chip; }
@@ -222,8 +228,9 @@ namespace lsst {
 		void add(PTR(Source) s,
                          lsst::afw::geom::Angle d_lim=lsst::afw::geom::Angle(0, lsst::afw::geom::degrees));
 		int count(void);
-		SourceGroup mergeMat() const;
-		SourceGroup mergeSource();
+		// A cancelled merge returns the groups found so far
+		SourceGroup mergeMat(SolveControl::Ptr const & control = SolveControl::Ptr()) const;
+		SourceGroup mergeSource(SolveControl::Ptr const & control = SolveControl::Ptr());
 		void printMat() const;
 		void printSource() const;
 		bool isLeaf(void) const { return left == NULL && right == NULL; }
@@ -260,6 +267,15 @@ namespace lsst {
 		~FluxFitParams();
 		FluxFitParams(const FluxFitParams &p);
 		double eval(double u, double v);
+		std::vector<double> eval(std::vector<double> const &u,
+					 std::vector<double> const &v);
+#if !defined(SWIG)
+		// Evaluate at n points; the T_n (or power) tables are built
+		// once per point and the points are processed in blocks.
+		void eval(int n, double const *u, double const *v, double *val);
+		// Basis functions k0..ncoeff-1 at normalized (uu, vv)
+		void evalBasis(double uu, double vv, double *b, int k0=0);
+#endif
 		int getXorder(int i) { return xorder[i]; }
 		int getYorder(int i) { return yorder[i]; }
 		int getCoeff(int i) { return coeff[i]; }
@@ -270,16 +286,199 @@ namespace lsst {
 	    typedef std::map<ExpType, Coeff::Ptr> CoeffSet;
 	    typedef std::vector<Obs::Ptr> ObsVec;
 
+	    /*
+	     * Stopping rule for the iterative fits (linearised global solve,
+	     * per-exposure initial fit and flux fit).  An iteration loop stops
+	     * after maxIter passes, or earlier once at least minIter passes have
+	     * been done and the norm of the parameter update, the relative change
+	     * in chi2 and the number of newly rejected objects are all within
+	     * tolerance.  The default tolerances never trigger, so the default
+	     * criteria just run maxIter passes.
+	     */
+	    class ConvergenceCriteria {
+	    public:
+		int maxIter;
+		double paramTol;	/* tolerance on the norm of the parameter update */
+		double chi2Tol;		/* tolerance on |chi2_prev - chi2| / chi2 */
+		int rejectTol;		/* max. number of newly rejected objects */
+		int minIter;
+
+		ConvergenceCriteria(int maxIter=3, double paramTol=0.0, double chi2Tol=0.0,
+				    int rejectTol=0, int minIter=1);
+		bool converged(int niter, double dParam,
+			       double chi2Prev, double chi2, int nReject) const;
+	    };
+
+	    /*
+	     * M-estimator for the robust flux fit.  Residuals are taken in
+	     * units of their errors times a MAD estimate of the residual
+	     * spread and down-weighted beyond scale (Huber) or given zero
+	     * weight beyond it (Tukey biweight).  A scale of 0 selects the
+	     * usual constant of the estimator.  With NONE the flux fit is plain
+	     * least squares with hard clipping between passes.  Measurements
+	     * left with zero weight are rejected (marked bad); as Huber weights
+	     * never reach zero, the Huber fit is clipped once and repeated
+	     * (within the maxIter of the flux convergence criteria).
+	     */
+	    class RobustWeight {
+	    public:
+		enum Type { NONE, HUBER, TUKEY };
+
+		Type type;
+		double scale;
+
+		RobustWeight(Type type=NONE, double scale=0.0);
+		double weight(double t) const;
+	    };
+
+	    /*
+	     * Residual statistics of a mosaic solve, filled by the solvers as
+	     * a by-product of their residual sweeps.  Per-exposure and per-chip
+	     * entries are in the order of expId and chipId (the WcsDic and
+	     * CcdSet keys).  The rms and object counts are those of the last
+	     * astrometric iteration (arcsec) and of the last flux fit pass
+	     * (mag); the rejection counts add up over all iterations.
+	     * astromTime and fluxTime are the wall-clock seconds spent up to
+	     * and including the SIP fit, and in the flux fit.
+	     */
+	    class SolveStatistics {
+	    public:
+		typedef boost::shared_ptr<SolveStatistics> Ptr;
+
+		std::vector<ExpType> expId;
+		std::vector<ChipType> chipId;
+
+		int nIter;
+		double rms;
+		int nObs;
+		int nReject;
+		std::vector<double> expRms;
+		std::vector<int> expNObs;
+		std::vector<int> expNReject;
+		std::vector<double> chipRms;
+		std::vector<int> chipNObs;
+		std::vector<int> chipNReject;
+
+		int fluxNIter;
+		double fluxRms;
+		double fluxChi2;
+		int fluxNObs;
+		int fluxNReject;
+		std::vector<double> expFluxRms;
+		std::vector<int> expFluxNObs;
+		std::vector<int> expFluxNReject;
+		std::vector<double> chipFluxRms;
+		std::vector<int> chipFluxNObs;
+		std::vector<int> chipFluxNReject;
+
+		double astromTime;
+		double fluxTime;
+
+		SolveStatistics();
+		void reset(WcsDic const &wcsDic, CcdSet const &ccdSet);
+	    };
+
+	    /* File format of the ObsVec snapshots written during the solve (snapshot.h) */
+	    enum SnapshotFormat { SNAPSHOT_FITS, SNAPSHOT_BINARY };
+
+	    /*
+	     * Predicted size and cost of a mosaic solve, from planSolve().
+	     * With the DENSE backend the astrometric normal equations,
+	     * star positions included, are factored as one dense matrix;
+	     * STAR_ELIMINATED folds the star positions into the exposure and
+	     * chip parameters first (as the flux fit always does), so only a
+	     * matrix of order astromSize < astromFullSize is held.  Bytes are
+	     * the peak of the matrices, right hand sides and factorisation
+	     * workspace of each phase; obsBytes is the resident observation
+	     * list.  Flops are per iteration (per pass for the flux fit),
+	     * assembly and factorisation together.
+	     */
+	    class SolverPlan {
+	    public:
+		enum Backend { DENSE, STAR_ELIMINATED };
+
+		Backend backend;
+		long astromSize;
+		long astromFullSize;
+		long fluxSize;
+		double astromBytes;
+		double fluxBytes;
+		double obsBytes;
+		double peakBytes;
+		double astromFlops;
+		double fluxFlops;
+
+		SolverPlan();
+	    };
+
+	    /*
+	     * Plan a solve of nexp exposures and nchip chips with polynomials
+	     * of the given orders, nstar stars (at most; the solvers drop
+	     * those with fewer than two measurements) and nMatchObs and
+	     * nSourceObs measurements of catalog matches and of stars.
+	     */
+	    SolverPlan planSolve(int nexp, int nchip, int order, int fluxFitOrder,
+				 int nstar, long nMatchObs, long nSourceObs,
+				 SolverPlan::Backend backend = SolverPlan::DENSE,
+				 bool solveCcd = true, bool allowRotation = true);
+
 	    KDTree::Ptr kdtreeMat(SourceMatchGroup &matchList);
 	    KDTree::Ptr kdtreeSource(SourceGroup const &sourceSet,
 				     KDTree::Ptr rootMat,
 				     CcdSet &ccdSet,
-				     lsst::afw::geom::Angle d_lim, unsigned int nbrightest);
+				     lsst::afw::geom::Angle d_lim, unsigned int nbrightest,
+				     SolveControl::Ptr const & control = SolveControl::Ptr());
+
+	    /*
+	     * kdtreeMat and kdtreeSource fed one CCD at a time, so that the
+	     * trees are built while the catalogs are still being read.  The
+	     * CCDs must come in the order of the exposures, all the CCDs of an
+	     * exposure together, and all the matches before the sources, which
+	     * are left out if they are in the matched tree; the trees are then
+	     * those of kdtreeMat and kdtreeSource.  As there, only the
+	     * nbrightest sources of each CCD are used, and the first exposure
+	     * is built into a tree at once (when the next exposure starts or
+	     * the tree is asked for) while the later ones are merged into it
+	     * within d_lim.
+	     */
+	    class CatalogMerger {
+	    public:
+		typedef boost::shared_ptr<CatalogMerger> Ptr;
+
+		CatalogMerger(lsst::afw::geom::Angle d_lim, unsigned int nbrightest);
+
+		void addMatches(ExpType iexp, SourceMatchSet const &matches);
+		void addSources(ExpType iexp, SourceSet const &sources);
+
+		KDTree::Ptr getMatchTree();
+		KDTree::Ptr getSourceTree();
+
+	    private:
+		void _buildMatchRoot();
+		void _buildSourceRoot();
+
+		lsst::afw::geom::Angle _d_lim;
+		unsigned int _nbrightest;
+		KDTree::Ptr _rootMat;
+		KDTree::Ptr _rootSource;
+		bool _matchRootDone;
+		bool _sourceRootDone;
+		bool _sourceRootStarted;
+		ExpType _matchRootExp;
+		ExpType _sourceRootExp;
+		SourceMatchSet _matchRootSet;	// the first exposure until its tree is built
+		SourceSet _sourceRootSet;
+	    };
 
 	    ObsVec obsVecFromSourceGroup(SourceGroup const &all,
 					 WcsDic &wcsDic,
 					 CcdSet &ccdSet);
 
+	    /*
+	     * The mosaic solves.  With a control, they record their progress
+	     * in it and return the coefficients reached once it is cancelled,
+	     * at the start of an iteration or after the current flux fit pass.
+	     */
 	    CoeffSet solveMosaic_CCD_shot(int order,
 					  int nmatch,
 					  ObsVec &matchVec,
@@ -293,7 +492,15 @@ namespace lsst {
 					  bool verbose = false,
 					  double catRMS = 0.0,
                                           bool writeSnapshots = false,
-                                          std::string const & snapshotDir = ".");
+                                          std::string const & snapshotDir = ".",
+					  ConvergenceCriteria const & astromCriteria = ConvergenceCriteria(3),
+					  ConvergenceCriteria const & fluxCriteria = ConvergenceCriteria(3),
+					  ConvergenceCriteria const & initCriteria = ConvergenceCriteria(2),
+					  CoeffSet const & coeffSeed = CoeffSet(),
+					  RobustWeight const & fluxRobust = RobustWeight(),
+					  SolveStatistics::Ptr const & stats = SolveStatistics::Ptr(),
+					  SnapshotFormat snapshotFormat = SNAPSHOT_FITS,
+					  SolveControl::Ptr const & control = SolveControl::Ptr());
 
 	    CoeffSet solveMosaic_CCD(int order,
 				     int nmatch,
@@ -310,11 +517,67 @@ namespace lsst {
 				     bool verbose = false,
 				     double catRMS = 0.0,
                                      bool writeSnapshots = false,
-                                     std::string const & snapshotDir = ".");
+                                     std::string const & snapshotDir = ".",
+				     ConvergenceCriteria const & astromCriteria = ConvergenceCriteria(3),
+				     ConvergenceCriteria const & fluxCriteria = ConvergenceCriteria(3),
+				     ConvergenceCriteria const & initCriteria = ConvergenceCriteria(2),
+				     CoeffSet const & coeffSeed = CoeffSet(),
+				     RobustWeight const & fluxRobust = RobustWeight(),
+				     SolveStatistics::Ptr const & stats = SolveStatistics::Ptr(),
+				     SolverPlan::Backend backend = SolverPlan::DENSE,
+				     std::string const & checkpointFile = std::string(),
+				     SnapshotFormat snapshotFormat = SNAPSHOT_FITS,
+				     SolveControl::Ptr const & control = SolveControl::Ptr());
+
+	    /*
+	     * Position (u, v) in the focal plane where |detJ| of the polynomial
+	     * peaks, found by a Newton iteration on the analytic derivatives,
+	     * starting from the origin and stopping when the step is below tol.
+	     */
+	    lsst::afw::geom::Point2D detJPeak(Coeff::Ptr& coeff, double tol=0.01, int maxIter=50);
+
+	    /*
+	     * Move the crval (A, D) of all exposures to the sky position of
+	     * the peak of detJ.
+	     */
+	    void setCRVALtoDetJPeak(CoeffSet& coeffSet);
+
+#if !defined(SWIG)
+	    /*
+	     * Coefficients of a polynomial in (u, v) re-expressed in (u', v')
+	     * for the linear substitution
+	     *   u = c11 * u' + c12 * v'
+	     *   v = c21 * u' + c22 * v'
+	     * xorder/yorder list the terms (Poly or FluxFitParams layout).  The
+	     * substitution matrix is built once from a Pascal triangle and
+	     * tables of powers, so a conversion is a matrix-vector product.
+	     */
+	    class PolyTransform {
+	    public:
+		int ncoeff;
+		std::vector<double> matrix;	/* term k -> term l at [l*ncoeff+k] */
+
+		PolyTransform(int order, int ncoeff, int const *xorder, int const *yorder,
+			      double c11, double c12, double c21, double c22);
+		// out[l] += sum_k matrix[l*ncoeff+k] * in[k]
+		void apply(double const *in, double *out) const;
+	    };
+#endif
+
+	    typedef std::map<ChipType, Coeff::Ptr> CcdCoeffSet;
+	    typedef std::map<ExpType, CcdCoeffSet> ExpCcdCoeffSet;
+	    typedef std::map<ChipType, FluxFitParams::Ptr> CcdFluxFitParamsSet;
+	    typedef std::map<ExpType, CcdFluxFitParamsSet> ExpCcdFluxFitParamsSet;
 
 	    Coeff::Ptr convertCoeff(Coeff::Ptr& coeff,
 				    lsst::afw::cameraGeom::Ccd::Ptr& ccd);
 
+	    /*
+	     * convertCoeff for every exposure and chip, in parallel.  The
+	     * rotation of each chip is expanded once for all exposures.
+	     */
+	    ExpCcdCoeffSet convertCoeffSet(CoeffSet& coeffSet, CcdSet& ccdSet);
+
 	    lsst::afw::image::TanWcs::Ptr wcsFromCoeff(Coeff::Ptr& coeff);
 
             Coeff::Ptr coeffFromTanWcs(lsst::afw::image::Wcs::Ptr& wcs);
@@ -324,9 +587,44 @@ namespace lsst {
 				   lsst::afw::cameraGeom::Ccd::Ptr& ccd,
 				   FluxFitParams::Ptr& ffp);
 
+	    /*
+	     * convertFluxFitParams for every exposure and chip, in parallel.
+	     * ffp is converted to the power basis first, as the FluxFitParams
+	     * copy constructor does.
+	     */
+	    ExpCcdFluxFitParamsSet convertFluxFitParamsSet(CoeffSet& coeffSet, CcdSet& ccdSet,
+							   FluxFitParams::Ptr& ffp);
+
 	    lsst::daf::base::PropertySet::Ptr
 	      metadataFromFluxFitParams(FluxFitParams::Ptr& ffp);
 
+	    /*
+	     * Output products of one exposure and chip: the new WCS, the
+	     * flux correction header and the zero point from fexp and fchip.
+	     */
+	    class CcdProducts {
+	    public:
+		typedef boost::shared_ptr<CcdProducts> Ptr;
+
+		ExpType iexp;
+		ChipType ichip;
+		lsst::afw::image::TanWcs::Ptr wcs;
+		lsst::daf::base::PropertySet::Ptr fcrMetadata;
+		double fluxMag0;
+	    };
+
+	    typedef std::vector<CcdProducts::Ptr> CcdProductsVec;
+
+	    /*
+	     * Compute the products of every exposure and chip in parallel,
+	     * in coeffSet and ccdSet order, so that the caller only has to
+	     * write them out.
+	     */
+	    CcdProductsVec makeCcdProducts(CoeffSet& coeffSet, CcdSet& ccdSet,
+					   FluxFitParams::Ptr& ffp,
+					   std::map<ExpType, float> &fexp,
+					   std::map<ChipType, float> &fchip);
+
 	    lsst::afw::image::Image<float>::Ptr
 	      getJImg(Coeff::Ptr& coeff,
 		      lsst::afw::cameraGeom::Ccd::Ptr& ccd);
@@ -354,6 +652,38 @@ namespace lsst {
 	      getFCorImg(FluxFitParams::Ptr& p,
 			 lsst::afw::cameraGeom::Ccd::Ptr& ccd);
 
+	    /*
+	     * Grid-interpolated versions of getJImg and getFCorImg.  The
+	     * model is evaluated every spacing pixels in both directions and
+	     * interpolated bilinearly; the grid is refined until the relative
+	     * interpolation error at the cell centres is below tolerance
+	     * (no refinement if tolerance <= 0).
+	     */
+	    lsst::afw::image::Image<float>::Ptr
+	      getJImg(Coeff::Ptr& coeff,
+		      lsst::afw::cameraGeom::Ccd::Ptr& ccd,
+		      int spacing, double tolerance);
+
+	    lsst::afw::image::Image<float>::Ptr
+	      getFCorImg(FluxFitParams::Ptr& p,
+			 lsst::afw::cameraGeom::Ccd::Ptr& ccd,
+			 Coeff::Ptr& coeff,
+			 int spacing, double tolerance);
+
+	    /*
+	     * Multiply the image by the flux correction and the variance by
+	     * its square in place, one row at a time, without building the
+	     * correction image.  bbox is the position of mi in the frame of
+	     * the correction, as in getFCorImg; it must have the size of mi
+	     * (LengthErrorException otherwise).
+	     */
+	    void applyFCor(FluxFitParams::Ptr& p,
+			   lsst::afw::image::MaskedImage<float>& mi);
+
+	    void applyFCor(FluxFitParams::Ptr& p,
+			   lsst::afw::image::MaskedImage<float>& mi,
+			   lsst::afw::geom::Box2I const & bbox);
+
 #include "chebyshev.h"
     }
   }
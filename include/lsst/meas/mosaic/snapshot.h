@@ -3,10 +3,51 @@
 
 #include "lsst/meas/mosaic/mosaicfit.h"
 
+#if !defined(SWIG)
+#include "boost/noncopyable.hpp"
+#include "boost/scoped_ptr.hpp"
+#endif
+
 namespace lsst { namespace meas { namespace mosaic {
 
 void writeObsVec(std::string const & filename, ObsVec const & obsVec);
 
+/*
+ * The same columns in a flat binary file: an 8 byte magic "MOSOBS01", the
+ * number of rows (int64) and of columns (int32), then for each column a
+ * 16 byte NUL-padded name, a 1 byte type code ('i' int32, 'l' int64, 'd'
+ * double) and the data of all rows, in native byte order.
+ */
+void writeObsVecBinary(std::string const & filename, ObsVec const & obsVec);
+
+/* File name extension of a snapshot format: ".fits" or ".obs" */
+std::string snapshotExtension(SnapshotFormat format);
+
+#if !defined(SWIG)
+/*
+ * Writes ObsVec snapshots on a background thread.  write() copies the
+ * columns into one of two buffers and returns; it only waits when both
+ * buffers are still being written.  The destructor waits for the pending
+ * writes.  Errors are logged, not thrown.
+ */
+class SnapshotWriter : private boost::noncopyable {
+public:
+    explicit SnapshotWriter(SnapshotFormat format = SNAPSHOT_FITS);
+    ~SnapshotWriter();
+
+    void write(std::string const & filename, ObsVec const & obsVec);
+    void flush();
+
+    SnapshotFormat getFormat() const { return _format; }
+
+    class Impl;
+
+private:
+    SnapshotFormat _format;
+    boost::scoped_ptr<Impl> _impl;
+};
+#endif
+
 }}} // namespace lsst::meas::mosaic
 
 #endif // !MEAS_MOSAIC_snapshot_h_INCLUDED
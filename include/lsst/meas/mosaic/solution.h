@@ -0,0 +1,36 @@
+#ifndef MEAS_MOSAIC_solution_h_INCLUDED
+#define MEAS_MOSAIC_solution_h_INCLUDED
+
+#include "lsst/meas/mosaic/mosaicfit.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+/*
+ * Save the result of a mosaic solve: the per-exposure polynomials and flux
+ * scales (first HDU), the solved CCD centers, yaws and flux scales
+ * (second HDU) and the flux fit polynomial (third HDU).
+ */
+void writeSolution(std::string const & filename,
+                   CoeffSet const & coeffSet,
+                   CcdSet const & ccdSet,
+                   std::map<ExpType, float> const & fexp,
+                   std::map<ChipType, float> const & fchip,
+                   FluxFitParams::Ptr const & ffp);
+
+/*
+ * Read a solution written by writeSolution.  Exposures are added to coeffSet
+ * and fexp, CCDs to fchip, and the saved center and yaw are applied to the
+ * CCDs of ccdSet (CCDs not in ccdSet are ignored); the flux fit polynomial
+ * is returned.  The coeffSet can then be passed to solveMosaic_CCD as the
+ * initial guess to skip initialFit for those exposures, and fexp, fchip and
+ * the polynomial as the starting point of the flux fit.
+ */
+FluxFitParams::Ptr readSolution(std::string const & filename,
+                                CoeffSet & coeffSet,
+                                CcdSet & ccdSet,
+                                std::map<ExpType, float> & fexp,
+                                std::map<ChipType, float> & fchip);
+
+}}} // namespace lsst::meas::mosaic
+
+#endif // !MEAS_MOSAIC_solution_h_INCLUDED
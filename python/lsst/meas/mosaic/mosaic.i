@@ -1,5 +1,11 @@
 %{
 #include "lsst/meas/mosaic/mosaicfit.h"
+#include "lsst/meas/mosaic/solution.h"
+#include "lsst/meas/mosaic/checkpoint.h"
+#include "lsst/meas/mosaic/snapshot.h"
+#include "lsst/meas/mosaic/catalog.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/meas/mosaic/columns.h"
 %}
 
 %include "std_vector.i"
@@ -17,11 +23,54 @@
 %shared_ptr(lsst::meas::mosaic::Source);
 %shared_ptr(lsst::meas::mosaic::Coeff);
 %shared_ptr(lsst::meas::mosaic::KDTree);
+%shared_ptr(lsst::meas::mosaic::CatalogMerger);
 %shared_ptr(lsst::meas::mosaic::Obs);
 %shared_ptr(lsst::meas::mosaic::FluxFitParams);
+%shared_ptr(lsst::meas::mosaic::SolveStatistics);
+%shared_ptr(lsst::meas::mosaic::CcdProducts);
+%shared_ptr(lsst::meas::mosaic::Metrics);
+%shared_ptr(lsst::meas::mosaic::SolveControl);
+%shared_ptr(lsst::meas::mosaic::Checkpoint);
+%shared_ptr(lsst::meas::mosaic::ObsColumns);
+%shared_ptr(lsst::meas::mosaic::CoeffColumns);
+%shared_ptr(lsst::meas::mosaic::SourceColumns);
+%shared_ptr(lsst::meas::mosaic::StatisticsColumns);
+
+// The solves, cross-matches and catalog reads run without the GIL, so that
+// other Python threads can do I/O or cancel them through a SolveControl.
+// Their arguments must not be used from Python until they return.
+%nothread;
+%thread lsst::meas::mosaic::solveMosaic_CCD;
+%thread lsst::meas::mosaic::solveMosaic_CCD_shot;
+%thread lsst::meas::mosaic::resumeMosaic_CCD;
+%thread lsst::meas::mosaic::kdtreeMat;
+%thread lsst::meas::mosaic::kdtreeSource;
+%thread lsst::meas::mosaic::KDTree::mergeMat;
+%thread lsst::meas::mosaic::KDTree::mergeSource;
+%thread lsst::meas::mosaic::CatalogMerger::addMatches;
+%thread lsst::meas::mosaic::CatalogMerger::addSources;
+%thread lsst::meas::mosaic::obsVecFromSourceGroup;
+%thread lsst::meas::mosaic::readSourceCatalog;
+
+%declareNumPyConverters(ndarray::Array<double,1,1>);
+%declareNumPyConverters(ndarray::Array<double,2,2>);
+%declareNumPyConverters(ndarray::Array<double const,1,1>);
+%declareNumPyConverters(ndarray::Array<int,1,1>);
+%declareNumPyConverters(ndarray::Array<boost::int64_t,1,1>);
+%declareNumPyConverters(ndarray::Array<bool,1,1>);
 
 %include "lsst/meas/mosaic/mosaicfit.h"
+%include "lsst/meas/mosaic/solution.h"
+%include "lsst/meas/mosaic/checkpoint.h"
+%include "lsst/meas/mosaic/snapshot.h"
+%include "lsst/meas/mosaic/catalog.h"
+%include "lsst/meas/mosaic/metrics.h"
+%include "lsst/meas/mosaic/columns.h"
 
+%template(vector_double) std::vector<double>;
+%template(vector_int) std::vector<int>;
+%template(vector_int64) std::vector<boost::int64_t>;
+%template(vector_string) std::vector<std::string>;
 %template(map_int_float) std::map<boost::int32_t, float>;
 %template(map_int64_float) std::map<boost::int64_t, float>;
 
@@ -44,3 +93,8 @@
 %template(CcdSet) std::map<lsst::meas::mosaic::ChipType, lsst::afw::cameraGeom::Ccd::Ptr>;
 %template(CoeffSet) std::map<lsst::meas::mosaic::ExpType, lsst::meas::mosaic::Coeff::Ptr>;
 %template(ObsVec) std::vector<lsst::meas::mosaic::Obs::Ptr>;
+%template(CcdCoeffSet) std::map<lsst::meas::mosaic::ChipType, lsst::meas::mosaic::Coeff::Ptr>;
+%template(ExpCcdCoeffSet) std::map<lsst::meas::mosaic::ExpType, lsst::meas::mosaic::CcdCoeffSet>;
+%template(CcdFluxFitParamsSet) std::map<lsst::meas::mosaic::ChipType, lsst::meas::mosaic::FluxFitParams::Ptr>;
+%template(ExpCcdFluxFitParamsSet) std::map<lsst::meas::mosaic::ExpType, lsst::meas::mosaic::CcdFluxFitParamsSet>;
+%template(CcdProductsVec) std::vector<lsst::meas::mosaic::CcdProducts::Ptr>;
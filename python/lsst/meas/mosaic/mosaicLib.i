@@ -6,16 +6,24 @@ Python interface to lsst::meas::mosaic
 %enddef
 
 %feature("autodoc", "1");
-%module(package="lsst.meas.mosaic", docstring=fitLib_DOCSTRING) mosaicLib
+%module(package="lsst.meas.mosaic", docstring=fitLib_DOCSTRING, threads="1") mosaicLib
 
 %{
 #include "lsst/afw/image.h"
 #include "lsst/pex/logging.h"
 #include "lsst/afw/detection.h"
 #include "lsst/afw/math.h"
+#define PY_ARRAY_UNIQUE_SYMBOL LSST_MEAS_MOSAIC_NUMPY_ARRAY_API
+#include "numpy/arrayobject.h"
+#include "ndarray/swig.h"
+%}
+
+%init %{
+    import_array();
 %}
 
 %include "lsst/p_lsstSwig.i"
+%include "ndarray.i"
 
 %import "lsst/afw/image/imageLib.i"
 %import "lsst/afw/geom/geomLib.i"
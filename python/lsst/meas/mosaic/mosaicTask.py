@@ -3,6 +3,8 @@
 import os
 import math
 import numpy
+import Queue
+import threading
 
 import matplotlib
 matplotlib.use('Agg')
@@ -15,12 +17,16 @@ import lsst.afw.geom                    as afwGeom
 import lsst.afw.image                   as afwImage
 import lsst.afw.table                   as afwTable
 import lsst.pex.config                  as pexConfig
+import lsst.pex.logging                 as pexLog
 import lsst.pipe.base                   as pipeBase
 import lsst.meas.mosaic.mosaicLib       as measMosaic
 import lsst.meas.astrom.astrom          as measAstrom
 from lsst.meas.photocal.colorterms import Colorterm
 import lsst.pipe.base.argumentParser    as argParser
 
+# The astrometry index behind joinMatchListWithCatalog is not thread safe
+_astromLock = threading.Lock()
+
 class MosaicRunner(pipeBase.TaskRunner):
     """Subclass of TaskRunner for MosaicTask
 
@@ -46,6 +52,32 @@ class MosaicRunner(pipeBase.TaskRunner):
         task = self.TaskClass(config=self.config, log=self.log)
         result = task.run(*args)
 
+class ConvergenceConfig(pexConfig.Config):
+    maxIter = pexConfig.RangeField(
+        doc="maximum number of iterations",
+        dtype=int,
+        default=3, min=1)
+    minIter = pexConfig.RangeField(
+        doc="minimum number of iterations before the convergence test is applied",
+        dtype=int,
+        default=1, min=1)
+    paramTol = pexConfig.Field(
+        doc="converged when the norm of the parameter update is below this value",
+        dtype=float,
+        default=0.0)
+    chi2Tol = pexConfig.Field(
+        doc="converged when the relative change in chi2 is below this value",
+        dtype=float,
+        default=0.0)
+    rejectTol = pexConfig.Field(
+        doc="converged when no more than this number of objects is newly rejected",
+        dtype=int,
+        default=0)
+
+    def makeCriteria(self):
+        return measMosaic.ConvergenceCriteria(self.maxIter, self.paramTol, self.chi2Tol,
+                                              self.rejectTol, self.minIter)
+
 class MosaicConfig(pexConfig.Config):
     nBrightest = pexConfig.RangeField(
         doc="number of stars used for fitting per exposure",
@@ -87,6 +119,16 @@ class MosaicConfig(pexConfig.Config):
         doc="Fit to catalog flux?",
         dtype=bool,
         default=False)
+    nReadThreads = pexConfig.RangeField(
+        doc="Threads reading the per-CCD inputs while the kd-trees are built from them (0: read, then merge); "
+            "the afw catalog reads hold the GIL, so mostly the butler lookups and the merge overlap them "
+            "unless nativeCatalogReader, which reads without it, is set",
+        dtype=int,
+        default=0, min=0)
+    nativeCatalogReader = pexConfig.Field(
+        doc="Read the src catalogs directly from their files: only the columns used, and only the stars",
+        dtype=bool,
+        default=False)
     outputDir = pexConfig.Field(
         doc="Output directory to write diagnostics plots",
         dtype=str,
@@ -96,9 +138,110 @@ class MosaicConfig(pexConfig.Config):
         dtype=bool,
         default=False)
     outputSnapshots = pexConfig.Field(
-        doc="Output FITS tables of ObsVecs during iteration",
+        doc="Output tables of ObsVecs during iteration (written in the background)",
         dtype=bool,
         default=False)
+    snapshotFormat = pexConfig.ChoiceField(
+        doc="File format of the ObsVec snapshots",
+        dtype=str,
+        default="fits",
+        allowed={
+            "fits": "FITS binary tables (.fits)",
+            "binary": "flat columnar files (.obs), read with lsst.meas.mosaic.snapshot",
+            })
+    saveSolution = pexConfig.Field(
+        doc="Write the solution (coefficients, CCD geometry, flux scales and flux fit) to outputDir/solution.fits",
+        dtype=bool,
+        default=False)
+    warmStart = pexConfig.Field(
+        doc="Solution file of a previous run used as initial guess of the astrometric and flux fits (None: fit from calexp WCS)",
+        dtype=str,
+        optional=True,
+        default=None)
+    checkpoint = pexConfig.Field(
+        doc="Write the solver state to outputDir/checkpoint.fits after each iteration (internalFitting only)",
+        dtype=bool,
+        default=False)
+    resume = pexConfig.Field(
+        doc="Checkpoint file to resume the solve from, skipping the catalog input and matching (None: start afresh)",
+        dtype=str,
+        optional=True,
+        default=None)
+    solveTimeout = pexConfig.RangeField(
+        doc="Cancel the solve after this many seconds (0: no limit); with checkpoint set it can be resumed",
+        dtype=float,
+        default=0.0, min=0.0)
+    progressInterval = pexConfig.RangeField(
+        doc="Seconds between progress messages while the solve runs",
+        dtype=float,
+        default=60.0, min=1.0)
+    astromConvergence = pexConfig.ConfigField(
+        doc="Convergence criteria for the global astrometric iteration",
+        dtype=ConvergenceConfig)
+    fluxConvergence = pexConfig.ConfigField(
+        doc="Convergence criteria for the flux fitting iteration",
+        dtype=ConvergenceConfig)
+    initConvergence = pexConfig.ConfigField(
+        doc="Convergence criteria for the per-exposure initial fit",
+        dtype=ConvergenceConfig)
+    fluxRobust = pexConfig.ChoiceField(
+        doc="M-estimator for the flux fit",
+        dtype=str,
+        default="none",
+        allowed={
+            "none": "least squares with 9-sigma clipping between passes",
+            "huber": "iteratively reweighted with Huber weights, then 9-sigma clipped and refit once",
+            "tukey": "iteratively reweighted with Tukey biweights; zero weights are rejected",
+            })
+    fluxRobustScale = pexConfig.Field(
+        doc="Scale of the M-estimator in units of the MAD residual (0: 1.345 for huber, 4.685 for tukey)",
+        dtype=float,
+        default=0.0)
+    solverLogLevel = pexConfig.ChoiceField(
+        doc="Threshold of the progress messages of the C++ solvers (meas.mosaic log)",
+        dtype=str,
+        default="info",
+        allowed={
+            "debug": "per-exposure fits and coefficients",
+            "info": "iterations, chi2 and rejections",
+            "warn": "warnings and errors only",
+            })
+    metricsLogLevel = pexConfig.ChoiceField(
+        doc="Level at which the stage timers and counters are written to the task log",
+        dtype=str,
+        default="info",
+        allowed={
+            "debug": "debug",
+            "info": "info",
+            "none": "do not log",
+            })
+
+    solverBackend = pexConfig.ChoiceField(
+        doc="Linear solver of the astrometric fit",
+        dtype=str,
+        default="auto",
+        allowed={
+            "auto": "the cheapest backend that fits in memoryLimit",
+            "dense": "one dense matrix with the star positions included",
+            "starEliminated": "star positions eliminated before factorisation",
+            })
+    memoryLimit = pexConfig.Field(
+        doc="Memory available to the solve (GB); 0 for the physical memory of the node",
+        dtype=float,
+        default=0.0)
+
+    def setDefaults(self):
+        self.astromConvergence.maxIter = 10
+        self.astromConvergence.paramTol = 1.0e-6
+        self.astromConvergence.chi2Tol = 1.0e-3
+        self.astromConvergence.rejectTol = 0
+        self.fluxConvergence.maxIter = 10
+        self.fluxConvergence.paramTol = 1.0e-4
+        self.fluxConvergence.chi2Tol = 1.0e-3
+        self.fluxConvergence.rejectTol = 0
+        self.initConvergence.maxIter = 5
+        self.initConvergence.paramTol = 1.0e-6
+        self.initConvergence.chi2Tol = 1.0e-3
 
 class MosaicTask(pipeBase.CmdLineTask):
 
@@ -144,24 +287,25 @@ class MosaicTask(pipeBase.CmdLineTask):
         
         self.log.info("Reading WCS ...")
 
-        wcsDic = measMosaic.WcsDic()
-        for frameId in frameIds:
-            found = 0
+        def readFrame(frameId):
             for ccdId in ccdSet.keys():
-                ccd = ccdSet[ccdId]
                 dataId = self.getDataId(butler, frameId, ccdId)
                 if (butler.datasetExists('calexp',  dataId) and
                     butler.datasetExists('src',     dataId) and
                     butler.datasetExists('icSrc',   dataId) and
                     butler.datasetExists('icMatch', dataId)):
-                    found = 1
-                    break
-            if found:
-                wcs = self.getWcsForCcd(butler, frameId, ccdId)
-                ccd = ccdSet[ccdId]
-                offset = ccd.getCenter().getPixels(ccd.getPixelSize())
-                wcs.shiftReferencePixel(offset[0], offset[1])
-                wcsDic[frameId] = wcs
+                    wcs = self.getWcsForCcd(butler, frameId, ccdId)
+                    ccd = ccdSet[ccdId]
+                    offset = ccd.getCenter().getPixels(ccd.getPixelSize())
+                    wcs.shiftReferencePixel(offset[0], offset[1])
+                    return wcs
+            return None
+
+        wcsDic = measMosaic.WcsDic()
+        def addFrame(job, wcs):
+            if wcs is not None:
+                wcsDic[job[0]] = wcs
+        self.runConcurrently([(frameId,) for frameId in frameIds], readFrame, addFrame)
 
         return wcsDic
 
@@ -218,47 +362,54 @@ class MosaicTask(pipeBase.CmdLineTask):
                 stars.append(includeSource)
         return stars
 
-    def getAllForCcd(self, butler, astrom, frame, ccd, ct=None):
-
+    def getSourcesForCcd(self, butler, frame, ccd):
+        """Selected stars of the src catalog of a CCD, or None if it cannot be read"""
         data = self.getDataId(butler, frame, ccd)
-
         try:
             if not butler.datasetExists('src', data):
                 raise RuntimeError("no data for src %s" % (data))
+            if self.config.nativeCatalogReader:
+                return measMosaic.readSourceCatalog(butler.get('src_filename', data)[0],
+                                                    frame, ccd, measMosaic.StarSelection())
+            return self.selectStars(butler.get('src', data))
+        except Exception, e:
+            print "Failed to read: %s" % (e)
+            return None
+
+    def getMatchesForCcd(self, butler, astrom, frame, ccd, ct=None):
+        """Selected reference matches and WCS of a CCD, or None, None if they cannot be read"""
+        data = self.getDataId(butler, frame, ccd)
+        try:
             if not butler.datasetExists('calexp_md', data):
                 raise RuntimeError("no data for calexp_md %s" % (data))
             md = butler.get('calexp_md', data)
             wcs = afwImage.makeWcs(md)
 
-            sources = butler.get('src', data)
-            if False:
-                matches = measAstrom.readMatches(butler, data)
-            else:
-                icSrces = butler.get('icSrc', data)
-                packedMatches = butler.get('icMatch', data)
+            icSrces = butler.get('icSrc', data)
+            packedMatches = butler.get('icMatch', data)
+            with _astromLock:
                 matches = astrom.joinMatchListWithCatalog(packedMatches, icSrces, True)
-                if ct != None:
-                    if matches[0].first != None:
-                        refSchema = matches[0].first.schema
-                    else:
-                        refSchema = matches[1].first.schema
-                    key_p = refSchema.find(ct.primary).key
-                    key_s = refSchema.find(ct.secondary).key
-                    key_f = refSchema.find("flux").key
-                    for m in matches:
-                        if m.first != None:
-                            refFlux1 = m.first.get(key_p)
-                            refFlux2 = m.first.get(key_s)
-                            refMag1 = -2.5*math.log10(refFlux1)
-                            refMag2 = -2.5*math.log10(refFlux2)
-                            refMag = ct.transformMags(ct.primary, refMag1, refMag2)
-                            refFlux = math.pow(10.0, -0.4*refMag)
-                            if refFlux == refFlux:
-                                m.first.set(key_f, refFlux)
-                            else:
-                                m.first = None
+            if ct != None:
+                if matches[0].first != None:
+                    refSchema = matches[0].first.schema
+                else:
+                    refSchema = matches[1].first.schema
+                key_p = refSchema.find(ct.primary).key
+                key_s = refSchema.find(ct.secondary).key
+                key_f = refSchema.find("flux").key
+                for m in matches:
+                    if m.first != None:
+                        refFlux1 = m.first.get(key_p)
+                        refFlux2 = m.first.get(key_s)
+                        refMag1 = -2.5*math.log10(refFlux1)
+                        refMag2 = -2.5*math.log10(refFlux2)
+                        refMag = ct.transformMags(ct.primary, refMag1, refMag2)
+                        refFlux = math.pow(10.0, -0.4*refMag)
+                        if refFlux == refFlux:
+                            m.first.set(key_f, refFlux)
+                        else:
+                            m.first = None
 
-            sources = self.selectStars(sources)
             selMatches = self.selectStars(matches)
             if len(selMatches) < 10:
                 matches = self.selectStars(matches, True)
@@ -266,8 +417,17 @@ class MosaicTask(pipeBase.CmdLineTask):
                 matches = selMatches
         except Exception, e:
             print "Failed to read: %s" % (e)
+            return None, None
+
+        return matches, wcs
+
+    def getAllForCcd(self, butler, astrom, frame, ccd, ct=None):
+        sources = self.getSourcesForCcd(butler, frame, ccd)
+        if sources is None:
+            return None, None, None
+        matches, wcs = self.getMatchesForCcd(butler, astrom, frame, ccd, ct)
+        if matches is None:
             return None, None, None
-    
         return sources, matches, wcs
 
     def readCatalog(self, butler, frameIds, ccdIds, ct=None):
@@ -282,12 +442,15 @@ class MosaicTask(pipeBase.CmdLineTask):
             for ccdId in ccdIds:
                 sources, matches, wcs = self.getAllForCcd(butler, astrom, frameId, ccdId, ct)
                 if sources != None:
-                    for s in sources:
-                        if numpy.isfinite(s.getRa().asDegrees()): # get rid of NaN
-                            src = measMosaic.Source(s)
-                            src.setExp(frameId)
-                            src.setChip(ccdId)
-                            ss.append(src)
+                    if self.config.nativeCatalogReader:
+                        ss.extend(sources)  # already selected, with exp and chip set
+                    else:
+                        for s in sources:
+                            if numpy.isfinite(s.getRa().asDegrees()): # get rid of NaN
+                                src = measMosaic.Source(s)
+                                src.setExp(frameId)
+                                src.setChip(ccdId)
+                                ss.append(src)
                     for m in matches:
                         if m.first != None and m.second != None:
                             match = measMosaic.SourceMatch(measMosaic.Source(m.first, wcs), measMosaic.Source(m.second))
@@ -326,53 +489,164 @@ class MosaicTask(pipeBase.CmdLineTask):
 
         return allMat, allSource
 
-    def writeNewWcs(self):
-        self.log.info("Write New WCS ...")
-        exp = afwImage.ExposureI(0,0)
-        for iexp in self.coeffSet.keys():
-            for ichip in self.ccdSet.keys():
-                c = measMosaic.convertCoeff(self.coeffSet[iexp], self.ccdSet[ichip]);
-                wcs = measMosaic.wcsFromCoeff(c);
-                exp.setWcs(wcs)
-                scale = self.fexp[iexp] * self.fchip[ichip]
-                calib = afwImage.Calib()
-                calib.setFluxMag0(1.0/scale)
-                exp.setCalib(calib)
+    def runConcurrently(self, jobs, read, consume):
+        """Call read(*job) for each job on nReadThreads threads, and consume(job, result)
+        on this thread in the order of the jobs
+
+        The results are consumed in job order whatever order the reads
+        finish in, so the output does not depend on the scheduling.  At
+        most 2*nReadThreads jobs are read but not yet consumed, so the
+        readers stop rather than run ahead of a slow read or consumer.
+        With nReadThreads = 0 each job is read and consumed in turn.
+        """
+        nThread = min(self.config.nReadThreads, len(jobs))
+        if nThread == 0:
+            for job in jobs:
+                consume(job, read(*job))
+            return
+
+        pending = Queue.Queue()
+        for index, job in enumerate(jobs):
+            pending.put((index, job))
+        results = Queue.Queue()
+        window = threading.Semaphore(2*nThread)
+
+        def worker():
+            while True:
+                window.acquire()
+                try:
+                    index, job = pending.get_nowait()
+                except Queue.Empty:
+                    window.release()
+                    return
                 try:
-                    dataId = self.getDataId(self.butler, iexp, ichip)
-                    self.butler.put(exp, 'wcs', dataId)
+                    result = read(*job)
                 except Exception, e:
-                    print "failed to write something: %s" % (e)
+                    self.log.warn("Failed to read %s: %s" % (job, e))
+                    result = None
+                results.put((index, result))
+
+        threads = [threading.Thread(target=worker) for i in range(nThread)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        done = dict()
+        for index, job in enumerate(jobs):
+            while index not in done:
+                i, result = results.get()
+                done[i] = result
+            consume(job, done.pop(index))
+            window.release()
+        for t in threads:
+            t.join()
+
+    def ingestCatalog(self, butler, wcsDic, ccdSet, d_lim, nbrightest, ct=None):
+        """Read the catalogs of all CCDs concurrently and build the kd-trees as they arrive
+
+        Does the work of readCatalog, checkInputs and mergeCatalog.  As in
+        readCatalog a CCD is left out altogether unless both its matches
+        and its sources can be read.  The matches are merged as they are
+        read; the sources are merged once all the matches are in, as
+        sources in the matched tree are left out of the source tree.  The
+        CCDs are merged exposure by exposure in the order of wcsDic, so the
+        trees are those of kdtreeMat and kdtreeSource however the reads
+        finish.
+        """
+        self.log.info("Reading catalogs on %d threads ..." % self.config.nReadThreads)
+
+        merger = measMosaic.CatalogMerger(d_lim, nbrightest)
+        astrom = measAstrom.Astrometry(measAstrom.MeasAstromConfig())
+        jobs = [(frameId, ccdId) for frameId in wcsDic.keys() for ccdId in ccdSet.keys()]
+        sourceSets = []
+        found = set()
+
+        def readCcd(frameId, ccdId):
+            sources, matches, wcs = self.getAllForCcd(butler, astrom, frameId, ccdId, ct)
+            if sources is None:
+                return None
+            if self.config.nativeCatalogReader:
+                ss = sources  # already selected, with exp and chip set
+            else:
+                ss = measMosaic.SourceSet()
+                for s in sources:
+                    if numpy.isfinite(s.getRa().asDegrees()): # get rid of NaN
+                        src = measMosaic.Source(s)
+                        src.setExp(frameId)
+                        src.setChip(ccdId)
+                        ss.push_back(src)
+            ml = measMosaic.SourceMatchSet()
+            for m in matches:
+                if m.first != None and m.second != None:
+                    match = measMosaic.SourceMatch(measMosaic.Source(m.first, wcs), measMosaic.Source(m.second))
+                    match.second.setExp(frameId)
+                    match.second.setChip(ccdId)
+                    ml.push_back(match)
+            return ss, ml
+
+        def mergeCcd(job, result):
+            if result is None:
+                return
+            ss, ml = result
+            if len(ml) > 0:
+                merger.addMatches(job[0], ml)
+            sourceSets.append((job[0], ss))
+            if len(ml) > 0 or len(ss) > 0:
+                found.add(job[0])
+
+        self.runConcurrently(jobs, readCcd, mergeCcd)
+
+        for frameId, ss in sourceSets:
+            merger.addSources(frameId, ss)
 
-    def writeFcr(self):
+        newWcsDic = measMosaic.WcsDic()
+        for frameId, wcs in wcsDic.iteritems():
+            if frameId in found:
+                newWcsDic[frameId] = wcs
+
+        rootMat = merger.getMatchTree()
+        rootSource = merger.getSourceTree()
+        allMat = rootMat.mergeMat() if rootMat is not None else measMosaic.SourceGroup()
+        allSource = rootSource.mergeSource() if rootSource is not None else measMosaic.SourceGroup()
+        self.log.info("# of allMat : %d" % self.countObsInSourceGroup(allMat))
+        self.log.info('len(allMat) = %d' % len(allMat))
+        self.log.info("# of allSource : %d" % self.countObsInSourceGroup(allSource))
+        self.log.info('len(allSource) = %d' % len(allSource))
+
+        return newWcsDic, allMat, allSource
+
+    def writeNewWcs(self, products):
+        self.log.info("Write New WCS ...")
+        exp = afwImage.ExposureI(0,0)
+        for p in products:
+            exp.setWcs(p.wcs)
+            calib = afwImage.Calib()
+            calib.setFluxMag0(p.fluxMag0)
+            exp.setCalib(calib)
+            try:
+                dataId = self.getDataId(self.butler, p.iexp, p.ichip)
+                self.butler.put(exp, 'wcs', dataId)
+            except Exception, e:
+                print "failed to write something: %s" % (e)
+
+    def writeFcr(self, products):
         self.log.info("Write Fcr ...")
-        for iexp in self.coeffSet.keys():
-            for ichip in self.ccdSet.keys():
-                newP = measMosaic.convertFluxFitParams(self.coeffSet[iexp], self.ccdSet[ichip],
-                                                       measMosaic.FluxFitParams(self.ffp))
-                metadata = measMosaic.metadataFromFluxFitParams(newP)
-                exp = afwImage.ExposureI(0,0)
-                exp.getMetadata().combine(metadata)
-                scale = self.fexp[iexp] * self.fchip[ichip]
-                calib = afwImage.Calib()
-                calib.setFluxMag0(1.0/scale)
-                exp.setCalib(calib)
-                try:
-                    dataId = self.getDataId(self.butler, iexp, ichip)
-                    self.butler.put(exp, 'fcr', dataId)
-                except Exception, e:
-                    print "failed to write something: %s" % (e)
+        for p in products:
+            exp = afwImage.ExposureI(0,0)
+            exp.getMetadata().combine(p.fcrMetadata)
+            calib = afwImage.Calib()
+            calib.setFluxMag0(p.fluxMag0)
+            exp.setCalib(calib)
+            try:
+                dataId = self.getDataId(self.butler, p.iexp, p.ichip)
+                self.butler.put(exp, 'fcr', dataId)
+            except Exception, e:
+                print "failed to write something: %s" % (e)
 
     def getExtent(self, matchVec):
-        u_max = float("-inf")
-        v_max = float("-inf")
-        for m in matchVec:
-            if (math.fabs(m.u) > u_max):
-                u_max = math.fabs(m.u)
-            if (math.fabs(m.v) > v_max):
-                v_max = math.fabs(m.v)
-
-        return u_max, v_max
+        if len(matchVec) == 0:
+            return float("-inf"), float("-inf")
+        cols = measMosaic.ObsColumns(matchVec)
+        return float(numpy.fabs(cols.getU()).max()), float(numpy.fabs(cols.getV()).max())
 
     def checkInputs(self, wcsDic, sourceSet, matchList):
         newWcsDic = measMosaic.WcsDic()
@@ -461,37 +735,44 @@ class MosaicTask(pipeBase.CmdLineTask):
         
         plt.savefig(os.path.join(self.outputDir, "fcont_%d.png" % (iexp)), format='png')
 
+    def getObsColumns(self):
+        """Columns of matchVec and sourceVec; the source columns are empty without sourceVec"""
+        matchColumns = measMosaic.ObsColumns(self.matchVec)
+        if self.sourceVec != None:
+            sourceColumns = measMosaic.ObsColumns(self.sourceVec)
+        else:
+            sourceColumns = measMosaic.ObsColumns(measMosaic.ObsVec())
+        return matchColumns, sourceColumns
+
+    def getResPos(self, cols):
+        """Position residuals (arcsec) of ObsColumns cols"""
+        return (cols.getXiFit() - cols.getXi()) * 3600, (cols.getEtaFit() - cols.getEta()) * 3600
+
+    def getMagCorrection(self, cols):
+        """Exposure, chip and flat-field correction of the magnitudes of ObsColumns cols"""
+        expIds, expIndex = numpy.unique(cols.getIexp(), return_inverse=True)
+        chipIds, chipIndex = numpy.unique(cols.getIchip(), return_inverse=True)
+        exp_cor = numpy.array([-2.5 * math.log10(self.fexp[int(i)]) for i in expIds])
+        chip_cor = numpy.array([-2.5 * math.log10(self.fchip[int(i)]) for i in chipIds])
+        gain_cor = measMosaic.evalFluxFitParams(self.ffp, cols.getU(), cols.getV())
+        return exp_cor[expIndex] + chip_cor[chipIndex] + gain_cor
+
     def plotResPosArrow2D(self, iexp):
-        _xm = []
-        _ym = []
-        _dxm = []
-        _dym = []
-        for m in self.matchVec:
-            if (m.good == True and m.iexp == iexp):
-                _xm.append(m.u)
-                _ym.append(m.v)
-                _dxm.append((m.xi_fit - m.xi) * 3600)
-                _dym.append((m.eta_fit - m.eta) * 3600)
-        _xs = []
-        _ys = []
-        _dxs = []
-        _dys = []
-        if (self.sourceVec != None):
-            for s in self.sourceVec:
-                if (s.good == True and s.iexp == iexp):
-                    _xs.append(s.u)
-                    _ys.append(s.v)
-                    _dxs.append((s.xi_fit - s.xi) * 3600)
-                    _dys.append((s.eta_fit - s.eta) * 3600)
-
-        xm = numpy.array(_xm)
-        ym = numpy.array(_ym)
-        dxm = numpy.array(_dxm)
-        dym = numpy.array(_dym)
-        xs = numpy.array(_xs)
-        ys = numpy.array(_ys)
-        dxs = numpy.array(_dxs)
-        dys = numpy.array(_dys)
+        m = self.matchColumns
+        s = self.sourceColumns
+        sel_m = m.getGood() & (m.getIexp() == iexp)
+        sel_s = s.getGood() & (s.getIexp() == iexp)
+        dx_m, dy_m = self.getResPos(m)
+        dx_s, dy_s = self.getResPos(s)
+
+        xm = m.getU()[sel_m]
+        ym = m.getV()[sel_m]
+        dxm = dx_m[sel_m]
+        dym = dy_m[sel_m]
+        xs = s.getU()[sel_s]
+        ys = s.getV()[sel_s]
+        dxs = dx_s[sel_s]
+        dys = dy_s[sel_s]
 
         plt.clf()
         plt.rc('text', usetex=True)
@@ -520,52 +801,28 @@ class MosaicTask(pipeBase.CmdLineTask):
         return [std, avg, len(b)]
 
     def plotResPosScatter(self):
-        _x = []
-        _y = []
-        _xbad = []
-        _ybad = []
-        _xm = []
-        _ym = []
+        m = self.matchColumns
+        s = self.sourceColumns
         f = open(os.path.join(self.outputDir, "dpos.dat"), "wt")
-        for m in self.matchVec:
-            if (m.good == True):
-                _x.append((m.xi_fit - m.xi) * 3600)
-                _y.append((m.eta_fit - m.eta) * 3600)
-                _xm.append((m.xi_fit - m.xi) * 3600)
-                _ym.append((m.eta_fit - m.eta) * 3600)
-                f.write("m %f %f %f %f %f %f 1\n" % (m.xi_fit, m.eta_fit,
-                                                     m.xi, m.eta, m.u, m.v))
-            else:
-                _xbad.append((m.xi_fit - m.xi) * 3600)
-                _ybad.append((m.eta_fit - m.eta) * 3600)
-                f.write("m %f %f %f %f %f %f 0\n" % (m.xi_fit, m.eta_fit,
-                                                     m.xi, m.eta, m.u, m.v))
-        _xs = []
-        _ys = []
-        if (self.sourceVec != None):
-            for s in self.sourceVec:
-                if (s.good == True):
-                    _x.append((s.xi_fit - s.xi) * 3600)
-                    _y.append((s.eta_fit - s.eta) * 3600)
-                    _xs.append((s.xi_fit - s.xi) * 3600)
-                    _ys.append((s.eta_fit - s.eta) * 3600)
-                    f.write("s %f %f %f %f %f %f 1\n" % (s.xi_fit, s.eta_fit,
-                                                         s.xi, s.eta, s.u, s.v))
-                else:
-                    _xbad.append((s.xi_fit - s.xi) * 3600)
-                    _ybad.append((s.eta_fit - s.eta) * 3600)
-                    f.write("s %f %f %f %f %f %f 0\n" % (s.xi_fit, s.eta_fit,
-                                                         s.xi, s.eta, s.u, s.v))
+        for tag, cols in (("m", m), ("s", s)):
+            numpy.savetxt(f, numpy.column_stack([cols.getXiFit(), cols.getEtaFit(), cols.getXi(), cols.getEta(),
+                                                 cols.getU(), cols.getV(), cols.getGood()]),
+                          fmt=tag + " %f %f %f %f %f %f %d")
         f.close()
 
-        d_xi = numpy.array(_x)
-        d_eta = numpy.array(_y)
-        d_xi_m = numpy.array(_xm)
-        d_eta_m = numpy.array(_ym)
-        d_xi_s = numpy.array(_xs)
-        d_eta_s = numpy.array(_ys)
-        d_xi_bad = numpy.array(_xbad)
-        d_eta_bad = numpy.array(_ybad)
+        dx_m, dy_m = self.getResPos(m)
+        dx_s, dy_s = self.getResPos(s)
+        good_m = m.getGood()
+        good_s = s.getGood()
+
+        d_xi_m = dx_m[good_m]
+        d_eta_m = dy_m[good_m]
+        d_xi_s = dx_s[good_s]
+        d_eta_s = dy_s[good_s]
+        d_xi = numpy.concatenate([d_xi_m, d_xi_s])
+        d_eta = numpy.concatenate([d_eta_m, d_eta_s])
+        d_xi_bad = numpy.concatenate([dx_m[~good_m], dx_s[~good_s]])
+        d_eta_bad = numpy.concatenate([dy_m[~good_m], dy_s[~good_s]])
 
         xi_std,  xi_mean,  xi_n  = self.clippedStd(d_xi, 2)
         eta_std, eta_mean, eta_n = self.clippedStd(d_eta, 2)
@@ -624,90 +881,37 @@ class MosaicTask(pipeBase.CmdLineTask):
         plt.savefig(os.path.join(self.outputDir, "ResPosScatter.png"), format='png')
 
     def plotMdM(self):
-        _dmag_m = []
-        _dmag_cat_m = []
-        _dmag_s = []
-        _dmag_a = []
-        _dmag_bad = []
-        _dmag_cat_bad = []
-        _mag0_m = []
-        _mag_cat_m = []
-        _mag0_s = []
-        _mag0_bad = []
-        _mag_cat_bad = []
+        m = self.matchColumns
+        s = self.sourceColumns
+        mag_cor_m = m.getMag() + self.getMagCorrection(m)
+        mag_cor_s = s.getMag() + self.getMagCorrection(s)
+        good_m = (m.getGood() & (m.getMag() != -9999) & (m.getJstar() != -1) &
+                  (m.getMag0() != -9999) & (m.getMagCat() != -9999))
+        good_s = s.getGood() & (s.getMag() != -9999) & (s.getJstar() != -1)
+
         f = open(os.path.join(self.outputDir, 'dmag.dat'), 'wt')
-        for m in self.matchVec:
-            if (m.good == True and m.mag != -9999 and m.jstar != -1 and m.mag0 != -9999 and m.mag_cat != -9999):
-                mag = m.mag
-                mag0 = m.mag0
-                mag_cat = m.mag_cat
-                exp_cor = -2.5 * math.log10(self.fexp[m.iexp])
-                chip_cor = -2.5 * math.log10(self.fchip[m.ichip])
-                gain_cor = self.ffp.eval(m.u, m.v)
-                mag_cor = mag + exp_cor + chip_cor + gain_cor
-                diff = mag_cor - mag0
-                _dmag_m.append(diff)
-                _dmag_a.append(diff)
-                _mag0_m.append(mag0)
-                _dmag_cat_m.append(mag_cor - mag_cat)
-                _mag_cat_m.append(mag_cat)
-                f.write("m %f %f %f %f %f 1\n" % (mag_cor, mag0, mag_cat,
-                                                  m.u, m.v))
-            else:
-                mag = m.mag
-                mag0 = m.mag0
-                mag_cat = m.mag_cat
-                exp_cor = -2.5 * math.log10(self.fexp[m.iexp])
-                chip_cor = -2.5 * math.log10(self.fchip[m.ichip])
-                gain_cor = self.ffp.eval(m.u, m.v)
-                mag_cor = mag + exp_cor + chip_cor + gain_cor
-                diff = mag_cor - mag0
-                _dmag_bad.append(diff)
-                _mag0_bad.append(mag0)
-                _dmag_cat_bad.append(mag_cor - mag_cat)
-                _mag_cat_bad.append(mag_cat)
-                f.write("m %f %f %f %f %f 0\n" % (mag_cor, mag0, mag_cat,
-                                                  m.u, m.v))
-        if self.sourceVec != None:
-            for s in self.sourceVec:
-                if (s.good == True and s.mag != -9999 and s.jstar != -1):
-                    mag = s.mag
-                    mag0 = s.mag0
-                    exp_cor = -2.5 * math.log10(self.fexp[s.iexp])
-                    chip_cor = -2.5 * math.log10(self.fchip[s.ichip])
-                    gain_cor = self.ffp.eval(s.u, s.v)
-                    mag_cor = mag + exp_cor + chip_cor + gain_cor
-                    diff = mag_cor - mag0
-                    _dmag_s.append(diff)
-                    _dmag_a.append(diff)
-                    _mag0_s.append(mag0)
-                    f.write("s %f %f %f %f %f 1\n" % (mag_cor, mag0, -9999,
-                                                      s.u, s.v))
-                else:
-                    mag = s.mag
-                    mag0 = s.mag0
-                    exp_cor = -2.5 * math.log10(self.fexp[s.iexp])
-                    chip_cor = -2.5 * math.log10(self.fchip[s.ichip])
-                    gain_cor = self.ffp.eval(s.u, s.v)
-                    mag_cor = mag + exp_cor + chip_cor + gain_cor
-                    diff = mag_cor - mag0
-                    _dmag_bad.append(diff)
-                    _mag0_bad.append(mag0)
-                    f.write("s %f %f %f %f %f 0\n" % (mag_cor, mag0, -9999,
-                                                      s.u, s.v))
+        numpy.savetxt(f, numpy.column_stack([mag_cor_m, m.getMag0(), m.getMagCat(), m.getU(), m.getV(), good_m]),
+                      fmt="m %f %f %f %f %f %d")
+        numpy.savetxt(f, numpy.column_stack([mag_cor_s, s.getMag0(), numpy.zeros(s.size()) - 9999,
+                                             s.getU(), s.getV(), good_s]),
+                      fmt="s %f %f %f %f %f %d")
         f.close()
 
-        d_mag_m = numpy.array(_dmag_m)
-        d_mag_cat_m = numpy.array(_dmag_cat_m)
-        d_mag_s = numpy.array(_dmag_s)
-        d_mag_a = numpy.array(_dmag_a)
-        d_mag_bad = numpy.array(_dmag_bad)
-        d_mag_cat_bad = numpy.array(_dmag_cat_bad)
-        mag0_m = numpy.array(_mag0_m)
-        mag_cat_m = numpy.array(_mag_cat_m)
-        mag0_s = numpy.array(_mag0_s)
-        mag0_bad = numpy.array(_mag0_bad)
-        mag_cat_bad = numpy.array(_mag_cat_bad)
+        diff_m = mag_cor_m - m.getMag0()
+        diff_cat_m = mag_cor_m - m.getMagCat()
+        diff_s = mag_cor_s - s.getMag0()
+
+        d_mag_m = diff_m[good_m]
+        d_mag_cat_m = diff_cat_m[good_m]
+        d_mag_s = diff_s[good_s]
+        d_mag_a = numpy.concatenate([d_mag_m, d_mag_s])
+        d_mag_bad = numpy.concatenate([diff_m[~good_m], diff_s[~good_s]])
+        d_mag_cat_bad = diff_cat_m[~good_m]
+        mag0_m = m.getMag0()[good_m]
+        mag_cat_m = m.getMagCat()[good_m]
+        mag0_s = s.getMag0()[good_s]
+        mag0_bad = numpy.concatenate([m.getMag0()[~good_m], s.getMag0()[~good_s]])
+        mag_cat_bad = m.getMagCat()[~good_m]
 
         mag_std_m, mag_mean_m, mag_n_m  = self.clippedStd(d_mag_m, 3)
         mag_std_s, mag_mean_s, mag_n_s  = self.clippedStd(d_mag_s, 3)
@@ -755,28 +959,17 @@ class MosaicTask(pipeBase.CmdLineTask):
         plt.savefig(os.path.join(self.outputDir, "MdM.png"), format='png')
 
     def plotPosDPos(self):
-        _xi = []
-        _eta = []
-        _x = []
-        _y = []
-        for m in self.matchVec:
-            if (m.good == True):
-                _x.append((m.xi_fit - m.xi) * 3600)
-                _y.append((m.eta_fit - m.eta) * 3600)
-                _xi.append(m.xi * 3600)
-                _eta.append(m.eta * 3600)
-        if (self.sourceVec != None):
-            for s in self.sourceVec:
-                if (s.good == True):
-                    _x.append((s.xi_fit - s.xi) * 3600)
-                    _y.append((s.eta_fit - s.eta) * 3600)
-                    _xi.append(s.xi * 3600)
-                    _eta.append(s.eta * 3600)
-
-        xi = numpy.array(_xi)
-        eta = numpy.array(_eta)
-        d_xi = numpy.array(_x)
-        d_eta = numpy.array(_y)
+        m = self.matchColumns
+        s = self.sourceColumns
+        dx_m, dy_m = self.getResPos(m)
+        dx_s, dy_s = self.getResPos(s)
+        good_m = m.getGood()
+        good_s = s.getGood()
+
+        xi = numpy.concatenate([m.getXi()[good_m], s.getXi()[good_s]]) * 3600
+        eta = numpy.concatenate([m.getEta()[good_m], s.getEta()[good_s]]) * 3600
+        d_xi = numpy.concatenate([dx_m[good_m], dx_s[good_s]])
+        d_eta = numpy.concatenate([dy_m[good_m], dy_s[good_s]])
 
         plt.clf()
         plt.rc('text', usetex=True)
@@ -804,26 +997,11 @@ class MosaicTask(pipeBase.CmdLineTask):
         plt.savefig(os.path.join(self.outputDir, "PosDPos.png"), format='png')
 
     def plotResFlux(self):
-        _dmag = []
-        _iexp = []
-        _ichip = []
-        _r = []
-        for m in self.matchVec:
-            if (m.good == True and m.mag != -9999 and m.jstar != -1):
-                mag = m.mag
-                mag0 = m.mag0
-                exp_cor = -2.5 * math.log10(self.fexp[m.iexp])
-                chip_cor = -2.5 * math.log10(self.fchip[m.ichip])
-                gain_cor = self.ffp.eval(m.u, m.v)
-                mag_cor = mag + exp_cor + chip_cor + gain_cor
-                diff = mag_cor - mag0
-                _dmag.append(diff)
-                _iexp.append(m.iexp)
-                _ichip.append(m.ichip)
-
-        d_mag = numpy.array(_dmag)
-        iexp = numpy.array(_iexp)
-        ichip = numpy.array(_ichip)
+        m = self.matchColumns
+        sel = m.getGood() & (m.getMag() != -9999) & (m.getJstar() != -1)
+        d_mag = (m.getMag() + self.getMagCorrection(m) - m.getMag0())[sel]
+        iexp = m.getIexp()[sel]
+        ichip = m.getIchip()[sel]
 
         mag_std  = self.clippedStd(d_mag, 3)[0]
 
@@ -870,34 +1048,20 @@ class MosaicTask(pipeBase.CmdLineTask):
         plt.savefig(os.path.join(self.outputDir, "ResFlux.png"), format='png')
 
     def plotDFlux2D(self):
-        _dmag = []
-        _u = []
-        _v = []
-        for m in self.matchVec:
-            if (m.good == True and m.mag != -9999 and m.jstar != -1):
-                mag = m.mag
-                mag0 = m.mag0
-                exp_cor = -2.5 * math.log10(self.fexp[m.iexp])
-                chip_cor = -2.5 * math.log10(self.fchip[m.ichip])
-                gain_cor = self.ffp.eval(m.u, m.v)
-                mag_cor = mag + exp_cor + chip_cor + gain_cor
-                diff = mag_cor - mag0
-                _dmag.append(diff)
-                _u.append(m.u)
-                _v.append(m.v)
-
-        d_mag = numpy.array(_dmag)
-        u = numpy.array(_u)
-        v = numpy.array(_v)
-
-        s = numpy.absolute(d_mag) * 10
-
-        u1 = [u[i] for i in range(len(d_mag)) if d_mag[i] > 0]
-        v1 = [v[i] for i in range(len(d_mag)) if d_mag[i] > 0]
-        s1 = [math.fabs(d_mag[i])*20 for i in range(len(d_mag)) if d_mag[i] > 0]
-        u2 = [u[i] for i in range(len(d_mag)) if d_mag[i] < 0]
-        v2 = [v[i] for i in range(len(d_mag)) if d_mag[i] < 0]
-        s2 = [math.fabs(d_mag[i])*20 for i in range(len(d_mag)) if d_mag[i] < 0]
+        m = self.matchColumns
+        sel = m.getGood() & (m.getMag() != -9999) & (m.getJstar() != -1)
+        d_mag = (m.getMag() + self.getMagCorrection(m) - m.getMag0())[sel]
+        u = m.getU()[sel]
+        v = m.getV()[sel]
+
+        pos = d_mag > 0
+        neg = d_mag < 0
+        u1 = u[pos]
+        v1 = v[pos]
+        s1 = numpy.fabs(d_mag[pos]) * 20
+        u2 = u[neg]
+        v2 = v[neg]
+        s2 = numpy.fabs(d_mag[neg]) * 20
 
         plt.clf()
         plt.rc('text', usetex=True)
@@ -914,14 +1078,16 @@ class MosaicTask(pipeBase.CmdLineTask):
         if not os.path.isdir(self.outputDir):
             os.mkdir(self.outputDir)
 
+        coeffs = measMosaic.CoeffColumns(self.coeffSet)
+        A, D, x0, y0 = coeffs.getA(), coeffs.getD(), coeffs.getX0(), coeffs.getY0()
+        a, b, ap, bp = coeffs.get_a(), coeffs.get_b(), coeffs.get_ap(), coeffs.get_bp()
         f = open(os.path.join(self.outputDir, "coeffs.dat"), "wt")
-        for iexp in self.coeffSet.keys():
-            c = self.coeffSet[iexp]
-            f.write("%ld %12.5e %12.5e\n" % (iexp, c.A,  c.D));
-            f.write("%ld %12.5f %12.5f\n" % (iexp, c.x0, c.y0));
-            for k in range(c.getNcoeff()):
-                f.write("%ld %15.8e %15.8e %15.8e %15.8e\n" % (iexp, c.get_a(k), c.get_b(k), c.get_ap(k), c.get_bp(k)));
-            f.write("%5.3f\n" % (-2.5*math.log10(self.fexp[iexp])))
+        for i, iexp in enumerate(coeffs.getIexp()):
+            f.write("%ld %12.5e %12.5e\n" % (iexp, A[i],  D[i]));
+            f.write("%ld %12.5f %12.5f\n" % (iexp, x0[i], y0[i]));
+            for k in range(coeffs.getNcoeff()):
+                f.write("%ld %15.8e %15.8e %15.8e %15.8e\n" % (iexp, a[i,k], b[i,k], ap[i,k], bp[i,k]));
+            f.write("%5.3f\n" % (-2.5*math.log10(self.fexp[int(iexp)])))
         f.close()
 
         f = open(os.path.join(self.outputDir, "ccd.dat"), "wt")
@@ -932,6 +1098,8 @@ class MosaicTask(pipeBase.CmdLineTask):
             f.write("%3ld %10.3f %10.3f %10.7f %5.3f\n" % (ichip, center[0], center[1], orient.getYaw(), self.fchip[ichip]));
         f.close()
 
+        self.matchColumns, self.sourceColumns = self.getObsColumns()
+
         for iexp in self.coeffSet.keys():
             self.plotJCont(iexp)
             self.plotFCorCont(iexp)
@@ -943,11 +1111,152 @@ class MosaicTask(pipeBase.CmdLineTask):
         self.plotResFlux()
         self.plotDFlux2D()
 
+    def logStatistics(self, stats):
+        self.log.info("astrometry: %d iterations, rms %.3f arcsec, %d objects, %d rejected" %
+                      (stats.nIter, stats.rms, stats.nObs, stats.nReject))
+        self.log.info("photometry: %d iterations, rms %.4f mag, chi2 %.3f, %d objects, %d rejected" %
+                      (stats.fluxNIter, stats.fluxRms, stats.fluxChi2, stats.fluxNObs, stats.fluxNReject))
+
+        cols = measMosaic.StatisticsColumns(stats)
+        expId = cols.getExpId()
+        expRms = cols.getExpRms()
+        expFluxRms = cols.getExpFluxRms()
+        chipId = cols.getChipId()
+        chipRms = cols.getChipRms()
+        chipFluxRms = cols.getChipFluxRms()
+        if len(expId) > 0:
+            self.log.info("worst visits: %d (%.3f arcsec), %d (%.4f mag)" %
+                          (expId[expRms.argmax()], expRms.max(),
+                           expId[expFluxRms.argmax()], expFluxRms.max()))
+        if len(chipId) > 0:
+            self.log.info("worst ccds: %d (%.3f arcsec), %d (%.4f mag)" %
+                          (chipId[chipRms.argmax()], chipRms.max(),
+                           chipId[chipFluxRms.argmax()], chipFluxRms.max()))
+
+        rows = zip(expId, expRms, cols.getExpNObs(), cols.getExpNReject(),
+                   expFluxRms, cols.getExpFluxNObs(), cols.getExpFluxNReject())
+        for row in rows:
+            self.log.log(pexLog.Log.DEBUG, "visit %d: %.3f arcsec %d objs %d rej / %.4f mag %d objs %d rej" % row)
+        rows = zip(chipId, chipRms, cols.getChipNObs(), cols.getChipNReject(),
+                   chipFluxRms, cols.getChipFluxNObs(), cols.getChipFluxNReject())
+        for row in rows:
+            self.log.log(pexLog.Log.DEBUG, "ccd %d: %.3f arcsec %d objs %d rej / %.4f mag %d objs %d rej" % row)
+
+    def getMetrics(self):
+        """Stage timers and counters of the C++ code as a dict
+
+        {"time": {name: (seconds, calls)}, "count": {name: value}}
+        """
+        metrics = measMosaic.Metrics.get()
+        return {"time": dict([(name, (metrics.getTime(name), metrics.getCalls(name)))
+                              for name in metrics.getTimerNames()]),
+                "count": dict([(name, metrics.getCount(name))
+                               for name in metrics.getCounterNames()])}
+
+    def logMetrics(self, metrics):
+        levels = {"debug": pexLog.Log.DEBUG, "info": pexLog.Log.INFO}
+        if self.config.metricsLogLevel not in levels:
+            return
+        level = levels[self.config.metricsLogLevel]
+        for name in sorted(metrics["time"].keys()):
+            seconds, calls = metrics["time"][name]
+            self.log.log(level, "timer %s: %.3f sec in %d calls" % (name, seconds, calls))
+        for name in sorted(metrics["count"].keys()):
+            self.log.log(level, "count %s: %d" % (name, metrics["count"][name]))
+
+    def getMemoryLimit(self):
+        """Memory available to the solve in bytes"""
+        if self.config.memoryLimit > 0:
+            return self.config.memoryLimit * 1024**3
+        return os.sysconf("SC_PAGE_SIZE") * os.sysconf("SC_PHYS_PAGES")
+
+    def planSolve(self, nexp, nchip, nstar, nMatchObs, nSourceObs):
+        """Choose the solver backend from the predicted memory and cost
+
+        With solverBackend "auto" the backend with the fewest flops among
+        those that fit in memory is taken.  Raises RuntimeError before any
+        solving is done if no candidate fits.
+        """
+        backends = {"dense": measMosaic.SolverPlan.DENSE,
+                    "starEliminated": measMosaic.SolverPlan.STAR_ELIMINATED}
+        if self.config.solverBackend == "auto":
+            names = ["dense", "starEliminated"]
+        else:
+            names = [self.config.solverBackend]
+
+        limit = self.getMemoryLimit()
+        plans = []
+        for name in names:
+            plan = measMosaic.planSolve(nexp, nchip, self.config.fittingOrder, self.config.fluxFitOrder,
+                                        nstar, nMatchObs, nSourceObs, backends[name],
+                                        self.config.solveCcd, self.config.allowRotation)
+            self.log.info("plan %s: astrometric matrix %d (%d with stars), flux matrix %d, "
+                          "peak %.2f GB, %.3g + %.3g flops per iteration" %
+                          (name, plan.astromSize, plan.astromFullSize, plan.fluxSize,
+                           plan.peakBytes / 1024**3, plan.astromFlops, plan.fluxFlops))
+            plans.append((name, plan))
+
+        feasible = [(plan.astromFlops, name, plan) for name, plan in plans if plan.peakBytes <= limit]
+        if not feasible:
+            raise RuntimeError("Solve needs %s but only %.2f GB is available (memoryLimit); "
+                               "reduce the number of stars (nBrightest) or the fitting order" %
+                               (" or ".join(["%.2f GB (%s)" % (plan.peakBytes / 1024**3, name)
+                                             for name, plan in plans]), limit / 1024**3))
+        flops, name, plan = min(feasible)
+        self.log.info("Using the %s solver" % name)
+        return plan
+
+    def runSolve(self, control, solve, *args):
+        """Call solve(*args) on another thread, logging the progress recorded in control
+
+        The solvers release the GIL, so this thread stays responsive: an
+        interrupt cancels the solve, which stops at its next poll of
+        control.  A solve that was cancelled or timed out before it
+        finished raises RuntimeError; one that finished is returned even if
+        the timeout has passed since.
+        """
+        result = []
+        error = []
+        def target():
+            try:
+                result.append(solve(*args))
+            except Exception, e:
+                error.append(e)
+
+        thread = threading.Thread(target=target)
+        thread.daemon = True
+        thread.start()
+        try:
+            while thread.isAlive():
+                thread.join(self.config.progressInterval)
+                if thread.isAlive():
+                    self.log.info("%s: iteration %d, chi2 %e (%.0f s)" %
+                                  (control.getStage(), control.getIteration(), control.getChi2(),
+                                   control.getElapsed()))
+        except KeyboardInterrupt:
+            self.log.warn("Interrupted; cancelling the solve ...")
+            control.cancel()
+            thread.join()
+            raise
+        if error:
+            raise error[0]
+        if control.isStopped() or control.getStage() != "done":
+            raise RuntimeError("Solve cancelled in %s after %.0f s" % (control.getStage(), control.getElapsed()))
+        return result[0]
+
     def mosaic(self, butler, frameIds, ccdIds, ct=None, debug=False, verbose=False):
 
         self.log.info(str(self.config))
 
-        if ((self.config.outputDiag or self.config.outputSnapshots)
+        solverLevels = {"debug": pexLog.Log.DEBUG, "info": pexLog.Log.INFO, "warn": pexLog.Log.WARN}
+        pexLog.Log.getDefaultLog().setThresholdFor("meas.mosaic", solverLevels[self.config.solverLogLevel])
+        measMosaic.Metrics.get().reset()
+
+        if self.config.resume is not None and not self.config.internalFitting:
+            raise RuntimeError("resume needs internalFitting")
+
+        if ((self.config.outputDiag or self.config.outputSnapshots or self.config.saveSolution
+             or self.config.checkpoint)
             and not os.path.isdir(self.config.outputDir)):
             os.mkdir(self.config.outputDir)
         ccdSet = self.readCcd(butler.mapper.camera, ccdIds)
@@ -962,28 +1271,63 @@ class MosaicTask(pipeBase.CmdLineTask):
 
         self.removeNonExistCcd(butler, ccdSet, wcsDic)
 
-        if debug:
+        fexp = measMosaic.map_exptype_float()
+        fchip = measMosaic.map_chiptype_float()
+        ffpSeed = None
+
+        checkpoint = None
+        if self.config.resume is not None:
+            self.log.info("Resuming from checkpoint %s ..." % self.config.resume)
+            checkpoint = measMosaic.readCheckpoint(self.config.resume, ccdSet)
+            newWcsDic = measMosaic.WcsDic()
             for iexp, wcs in wcsDic.iteritems():
-                self.log.info(str(iexp)+" "+str(wcs.getPixelOrigin())+" "+
-                              str(wcs.getSkyOrigin().getPosition(afwGeom.degrees)))
+                if iexp in checkpoint.coeffSet:
+                    newWcsDic[iexp] = wcs
+            wcsDic = newWcsDic
+            nmatch = checkpoint.nmatch
+            nsource = checkpoint.nsource
+            matchVec = measMosaic.ObsVec()
+            sourceVec = measMosaic.ObsVec()
+            nMatchObs = len(checkpoint.matchVec)
+            nSourceObs = len(checkpoint.sourceVec)
+        else:
+            coeffSeed = measMosaic.CoeffSet()
+            if self.config.warmStart is not None:
+                self.log.info("Reading previous solution from %s ..." % self.config.warmStart)
+                ffpSeed = measMosaic.readSolution(self.config.warmStart, coeffSeed, ccdSet, fexp, fchip)
+                self.log.info("Previous solution found for %d exposures" %
+                              len([iexp for iexp in wcsDic.keys() if iexp in coeffSeed]))
+
+            if debug:
+                for iexp, wcs in wcsDic.iteritems():
+                    self.log.info(str(iexp)+" "+str(wcs.getPixelOrigin())+" "+
+                                  str(wcs.getSkyOrigin().getPosition(afwGeom.degrees)))
   
-        sourceSet, matchList = self.readCatalog(butler, wcsDic.keys(), ccdSet.keys(), ct)
-        wcsDic, sourceSet, matchList = self.checkInputs(wcsDic, sourceSet, matchList)
+            d_lim = afwGeom.Angle(self.config.radXMatch, afwGeom.arcseconds)
+            nbrightest = self.config.nBrightest
+            if debug:
+                self.log.info("d_lim : %f" % d_lim)
+                self.log.info("nbrightest : %d" % nbrightest)
+
+            if self.config.nReadThreads > 0:
+                wcsDic, allMat, allSource = self.ingestCatalog(butler, wcsDic, ccdSet, d_lim, nbrightest, ct)
+                self.log.info("frameIds : "+str(wcsDic.keys()))
+                self.log.info("ccdIds : "+str(ccdSet.keys()))
+            else:
+                sourceSet, matchList = self.readCatalog(butler, wcsDic.keys(), ccdSet.keys(), ct)
+                wcsDic, sourceSet, matchList = self.checkInputs(wcsDic, sourceSet, matchList)
 
-        self.log.info("frameIds : "+str(wcsDic.keys()))
-        self.log.info("ccdIds : "+str(ccdSet.keys()))
+                self.log.info("frameIds : "+str(wcsDic.keys()))
+                self.log.info("ccdIds : "+str(ccdSet.keys()))
 
-        d_lim = afwGeom.Angle(self.config.radXMatch, afwGeom.arcseconds)
-        nbrightest = self.config.nBrightest
-        if debug:
-            self.log.info("d_lim : %f" % d_lim)
-            self.log.info("nbrightest : %d" % nbrightest)
+                allMat, allSource =self.mergeCatalog(sourceSet, matchList, ccdSet, d_lim, nbrightest)
+            nmatch  = allMat.size()
+            nsource = allSource.size()
+            matchVec  = measMosaic.obsVecFromSourceGroup(allMat,    wcsDic, ccdSet)
+            sourceVec = measMosaic.obsVecFromSourceGroup(allSource, wcsDic, ccdSet)
 
-        allMat, allSource =self.mergeCatalog(sourceSet, matchList, ccdSet, d_lim, nbrightest)
-        nmatch  = allMat.size()
-        nsource = allSource.size()
-        matchVec  = measMosaic.obsVecFromSourceGroup(allMat,    wcsDic, ccdSet)
-        sourceVec = measMosaic.obsVecFromSourceGroup(allSource, wcsDic, ccdSet)
+            nMatchObs = len(matchVec)
+            nSourceObs = len(sourceVec)
 
         self.log.info("Solve mosaic ...")
         order = self.config.fittingOrder
@@ -994,8 +1338,19 @@ class MosaicTask(pipeBase.CmdLineTask):
         chebyshev = self.config.chebyshev
         absolute = self.config.fluxFitAbsolute
         catRMS = self.config.catRMS
+        astromCriteria = self.config.astromConvergence.makeCriteria()
+        fluxCriteria = self.config.fluxConvergence.makeCriteria()
+        initCriteria = self.config.initConvergence.makeCriteria()
+        robustTypes = {"none": measMosaic.RobustWeight.NONE,
+                       "huber": measMosaic.RobustWeight.HUBER,
+                       "tukey": measMosaic.RobustWeight.TUKEY}
+        fluxRobust = measMosaic.RobustWeight(robustTypes[self.config.fluxRobust],
+                                             self.config.fluxRobustScale)
 
-        if not internal:
+        if internal:
+            plan = self.planSolve(len(wcsDic), len(ccdSet), nsource, nMatchObs, nSourceObs)
+        else:
+            plan = self.planSolve(len(wcsDic), len(ccdSet), 0, nMatchObs, 0)
             sourceVec = None
 
         if debug:
@@ -1005,24 +1360,57 @@ class MosaicTask(pipeBase.CmdLineTask):
             self.log.info("allowRotation : %r" % allowRotation)
 
         ffp = measMosaic.FluxFitParams(fluxFitOrder, absolute, chebyshev)
-        u_max, v_max = self.getExtent(matchVec)
-        ffp.u_max = (math.floor(u_max / 10.) + 1) * 10
-        ffp.v_max = (math.floor(v_max / 10.) + 1) * 10
-
-        fexp = measMosaic.map_exptype_float()
-        fchip = measMosaic.map_chiptype_float()
-
-        if internal:
-            coeffSet = measMosaic.solveMosaic_CCD(order, nmatch, nsource,
-                                                  matchVec, sourceVec,
-                                                  wcsDic, ccdSet, ffp, fexp, fchip,
-                                                  solveCcd, allowRotation, verbose, catRMS, 
-                                                  self.config.outputSnapshots, self.config.outputDir)
+        if checkpoint is None:
+            u_max, v_max = self.getExtent(matchVec)
+            ffp.u_max = (math.floor(u_max / 10.) + 1) * 10
+            ffp.v_max = (math.floor(v_max / 10.) + 1) * 10
+            # The previous polynomial is the starting point of the flux fit if
+            # it is of the same kind and its normalisation covers these data
+            if (ffpSeed is not None and ffpSeed.order == fluxFitOrder and
+                ffpSeed.absolute == absolute and ffpSeed.chebyshev == chebyshev and
+                ffpSeed.u_max >= u_max and ffpSeed.v_max >= v_max):
+                ffp = ffpSeed
+            elif ffpSeed is not None:
+                self.log.info("Flux fit polynomial of %s not used: different order or extent" %
+                              self.config.warmStart)
+
+        stats = measMosaic.SolveStatistics()
+
+        snapshotFormat = {"fits": measMosaic.SNAPSHOT_FITS,
+                          "binary": measMosaic.SNAPSHOT_BINARY}[self.config.snapshotFormat]
+
+        checkpointFile = ""
+        if self.config.checkpoint:
+            checkpointFile = os.path.join(self.config.outputDir, "checkpoint.fits")
+            if not internal:
+                self.log.warn("checkpoint is only written with internalFitting")
+
+        control = measMosaic.SolveControl()
+        if self.config.solveTimeout > 0:
+            control.setTimeout(self.config.solveTimeout)
+
+        if checkpoint is not None:
+            coeffSet = self.runSolve(control, measMosaic.resumeMosaic_CCD, checkpoint, matchVec, sourceVec,
+                                     wcsDic, ccdSet, ffp, fexp, fchip,
+                                     solveCcd, allowRotation, catRMS,
+                                     astromCriteria, fluxCriteria, fluxRobust, stats,
+                                     plan.backend, checkpointFile, control)
+        elif internal:
+            coeffSet = self.runSolve(control, measMosaic.solveMosaic_CCD, order, nmatch, nsource,
+                                     matchVec, sourceVec,
+                                     wcsDic, ccdSet, ffp, fexp, fchip,
+                                     solveCcd, allowRotation, verbose, catRMS, 
+                                     self.config.outputSnapshots, self.config.outputDir,
+                                     astromCriteria, fluxCriteria, initCriteria,
+                                     coeffSeed, fluxRobust, stats, plan.backend,
+                                     checkpointFile, snapshotFormat, control)
         else:
-            coeffSet = measMosaic.solveMosaic_CCD_shot(order, nmatch, matchVec, 
-                                                       wcsDic, ccdSet, ffp, fexp, fchip,
-                                                       solveCcd, allowRotation, verbose, catRMS,
-                                                  self.config.outputSnapshots, self.config.outputDir)
+            coeffSet = self.runSolve(control, measMosaic.solveMosaic_CCD_shot, order, nmatch, matchVec, 
+                                     wcsDic, ccdSet, ffp, fexp, fchip,
+                                     solveCcd, allowRotation, verbose, catRMS,
+                                     self.config.outputSnapshots, self.config.outputDir,
+                                     astromCriteria, fluxCriteria, initCriteria,
+                                     coeffSeed, fluxRobust, stats, snapshotFormat, control)
 
         self.butler = butler
         self.outputDir = self.config.outputDir
@@ -1034,8 +1422,17 @@ class MosaicTask(pipeBase.CmdLineTask):
         self.ffp = ffp
         self.fexp = fexp
         self.fchip = fchip
-        self.writeNewWcs()
-        self.writeFcr()
+        self.stats = stats
+        self.logStatistics(stats)
+        if self.config.saveSolution:
+            measMosaic.writeSolution(os.path.join(self.config.outputDir, "solution.fits"),
+                                     coeffSet, ccdSet, fexp, fchip, ffp)
+        products = measMosaic.makeCcdProducts(coeffSet, ccdSet, ffp, fexp, fchip)
+        self.writeNewWcs(products)
+        self.writeFcr(products)
+
+        self.metrics = self.getMetrics()
+        self.logMetrics(self.metrics)
 
         if self.config.outputDiag:
             self.outputDiag()
@@ -1171,234 +1568,174 @@ class MosaicTask(pipeBase.CmdLineTask):
 
         return None
 
+    def groupByCcd(self, cols, rows):
+        """Yield (iexp, ichip, rows on that CCD) for the given rows of cols"""
+        iexp = cols.getIexp()
+        ichip = cols.getIchip()
+        for e in numpy.unique(iexp[rows]):
+            rows_e = rows[iexp[rows] == e]
+            for c in numpy.unique(ichip[rows_e]):
+                yield int(e), int(c), rows_e[ichip[rows_e] == c]
+
+    def getSkyPositions(self, cols, rows, wcsDic):
+        """ra, dec (degrees) of the given rows of SourceColumns cols from their pixel positions"""
+        ra = numpy.zeros(cols.size())
+        dec = numpy.zeros(cols.size())
+        x = cols.getX()
+        y = cols.getY()
+        for iexp, ichip, r in self.groupByCcd(cols, rows):
+            sky = measMosaic.pixelsToSky(wcsDic[iexp][ichip], x[r], y[r])
+            ra[r] = sky[:,0]
+            dec[r] = sky[:,1]
+        return ra, dec
+
+    def getFluxMag0(self, cols, rows, calibDic):
+        """Zero point flux of the CCD of each of the given rows of SourceColumns cols"""
+        fluxMag0 = numpy.zeros(cols.size())
+        for iexp, ichip, r in self.groupByCcd(cols, rows):
+            fluxMag0[r] = calibDic[iexp][ichip].getFluxMag0()[0]
+        return fluxMag0
+
+    def getMagnitudes(self, cols, rows, fluxMag0, ffpDic):
+        """Magnitudes, their errors and flat-field corrections of the given rows of SourceColumns cols"""
+        mag = numpy.zeros(cols.size())
+        err = numpy.zeros(cols.size())
+        mcor = numpy.zeros(cols.size())
+        flux = cols.getFlux()[rows]
+        mag[rows] = 2.5*numpy.log10(fluxMag0[rows]/flux)
+        err[rows] = 2.5 / math.log(10) * cols.getFluxErr()[rows] / flux
+        x = cols.getX()
+        y = cols.getY()
+        for iexp, ichip, r in self.groupByCcd(cols, rows):
+            mcor[r] = measMosaic.evalFluxFitParams(ffpDic[iexp][ichip], x[r], y[r])
+        return mag, err, mcor
+
+    def diffFromMean(self, group, ngroup, rows, ra, dec):
+        """Offsets (arcsec) of the given rows from the mean position of their group"""
+        g = group[rows]
+        n = numpy.maximum(numpy.bincount(g, minlength=ngroup), 1)
+        ra_mean = numpy.bincount(g, weights=ra[rows], minlength=ngroup) / n
+        dec_mean = numpy.bincount(g, weights=dec[rows], minlength=ngroup) / n
+        return (ra[rows] - ra_mean[g]) * 3600, (dec[rows] - dec_mean[g]) * 3600
+
+    def diffFromWeightedMean(self, group, ngroup, rows, mag, err, mcor, mag_lim):
+        """Weighted mean corrected magnitude of the group of each of the given rows, and the rows'
+        magnitudes and corrections, for the groups brighter than mag_lim"""
+        g = group[rows]
+        w = 1. / (err[rows]*err[rows])
+        S  = numpy.bincount(g, weights=w, minlength=ngroup)
+        Sx = numpy.bincount(g, weights=(mag[rows]+mcor[rows])*w, minlength=ngroup)
+        mag_mean = numpy.where(S > 0, Sx / numpy.where(S > 0, S, 1.), 99999.)
+        keep = mag_mean[g] < mag_lim
+        return mag_mean[g][keep], mag[rows][keep], mcor[rows][keep]
+
     def makeDiffPos(self, allMat, allSource, wcsDic):
-        dx_m = list()
-        dy_m = list()
-        dx_s = list()
-        dy_s = list()
-        for ss in allMat:
-            ra_cat = ss[0].getRa().asDegrees()
-            dec_cat = ss[0].getDec().asDegrees()
-            for j in range(1,len(ss)):
-                iexp = ss[j].getExp()
-                ichip = ss[j].getChip()
-                x = ss[j].getX()
-                y = ss[j].getY()
-                sky = wcsDic[iexp][ichip].pixelToSky(x, y).getPosition()
-                ra = sky[0]
-                dec = sky[1]
-                dx_m.append((ra - ra_cat) * 3600)
-                dy_m.append((dec - dec_cat) * 3600)
-            if len(ss) > 2:
-                n = 0
-                ra_cat = 0.0
-                dec_cat = 0.0
-                ra_source = list()
-                dec_source = list()
-                for j in range(1,len(ss)):
-                    iexp = ss[j].getExp()
-                    ichip = ss[j].getChip()
-                    x = ss[j].getX()
-                    y = ss[j].getY()
-                    sky = wcsDic[iexp][ichip].pixelToSky(x, y).getPosition()
-                    ra = sky[0]
-                    dec = sky[1]
-                    ra_source.append(ra)
-                    dec_source.append(dec)
-                    n += 1
-                    ra_cat += ra
-                    dec_cat += dec
-                ra_cat /= n
-                dec_cat /= n
-                for ra, dec in zip(ra_source, dec_source):
-                    dx_s.append((ra - ra_cat) * 3600)
-                    dy_s.append((dec - dec_cat) * 3600)
-        dx_m = numpy.array(dx_m)
-        dy_m = numpy.array(dy_m)
-
-        for ss in allSource:
-            n = 0
-            ra_cat = 0.0
-            dec_cat = 0.0
-            ra_source = list()
-            dec_source = list()
-            for j in range(1,len(ss)):
-                iexp = ss[j].getExp()
-                ichip = ss[j].getChip()
-                x = ss[j].getX()
-                y = ss[j].getY()
-                sky = wcsDic[iexp][ichip].pixelToSky(x, y).getPosition()
-                ra = sky[0]
-                dec = sky[1]
-                ra_source.append(ra)
-                dec_source.append(dec)
-                n += 1
-                ra_cat += ra
-                dec_cat += dec
-            ra_cat /= n
-            dec_cat /= n
-            for ra, dec in zip(ra_source, dec_source):
-                dx_s.append((ra - ra_cat) * 3600)
-                dy_s.append((dec - dec_cat) * 3600)
-        dx_s = numpy.array(dx_s)
-        dy_s = numpy.array(dy_s)
+        m = measMosaic.SourceColumns(allMat)
+        group = m.getGroup()
+        member = m.getMember()
+        ngroup = m.getNgroup()
+        obs = numpy.flatnonzero(member > 0)
+        ra, dec = self.getSkyPositions(m, obs, wcsDic)
+
+        cat = member == 0
+        ra_cat = numpy.zeros(ngroup)
+        dec_cat = numpy.zeros(ngroup)
+        ra_cat[group[cat]] = m.getRa()[cat]
+        dec_cat[group[cat]] = m.getDec()[cat]
+        dx_m = (ra[obs] - ra_cat[group[obs]]) * 3600
+        dy_m = (dec[obs] - dec_cat[group[obs]]) * 3600
+
+        multi = obs[numpy.bincount(group, minlength=ngroup)[group[obs]] > 2]
+        dx_sm, dy_sm = self.diffFromMean(group, ngroup, multi, ra, dec)
+
+        s = measMosaic.SourceColumns(allSource)
+        obs = numpy.flatnonzero(s.getMember() > 0)
+        ra, dec = self.getSkyPositions(s, obs, wcsDic)
+        dx_ss, dy_ss = self.diffFromMean(s.getGroup(), s.getNgroup(), obs, ra, dec)
+
+        dx_s = numpy.concatenate([dx_sm, dx_ss])
+        dy_s = numpy.concatenate([dy_sm, dy_ss])
 
         return dx_m, dy_m, dx_s, dy_s
 
     def makeDiffFlux(self, allMat, allSource, calibDic, ffpDic, mag_lim = 9999.0):
 
-        mag0_m = list()
-        mag_m  = list()
-        mcor_m = list()
-        mag0_s = list()
-        mag_s  = list()
-        mcor_s = list()
-        for ss in allMat:
-            mag_cat = -2.5*math.log10(ss[0].getFlux())
-            for j in range(1,len(ss)):
-                iexp = ss[j].getExp()
-                ichip = ss[j].getChip()
-                if (ss[j].getFlux() > 0):
-                    mag = 2.5*math.log10(calibDic[iexp][ichip].getFluxMag0()[0]/ss[j].getFlux())
-                    x = ss[j].getX()
-                    y = ss[j].getY()
-                    mcor = ffpDic[iexp][ichip].eval(x,y)
-                    mag0_m.append(mag_cat)
-                    mag_m.append(mag)
-                    mcor_m.append(mcor)
-            if len(ss) > 2:
-                Sx = 0.0
-                S  = 0.0
-                mag_source = list()
-                mcor_source = list()
-                iexp_source = list()
-                ichip_source = list()
-                for j in range(1,len(ss)):
-                    iexp = ss[j].getExp()
-                    ichip = ss[j].getChip()
-                    mag = 2.5*math.log10(calibDic[iexp][ichip].getFluxMag0()[0]/ss[j].getFlux())
-                    err = 2.5 / math.log(10) * ss[j].getFluxErr() / ss[j].getFlux()
-                    x = ss[j].getX()
-                    y = ss[j].getY()
-                    mcor = ffpDic[iexp][ichip].eval(x,y)
-                    mag_source.append(mag)
-                    mcor_source.append(mcor)
-                    iexp_source.append(iexp)
-                    ichip_source.append(ichip)
-                    Sx += (mag+mcor) / (err*err)
-                    S  += 1. / (err*err)
-                mag_cat = Sx / S
-                if mag_cat < mag_lim:
-                    for mag, mcor, iexp, ichip in zip(mag_source, mcor_source, iexp_source, ichip_source):
-                        mag0_s.append(mag_cat)
-                        mag_s.append(mag)
-                        mcor_s.append(mcor)
-        mag0_m = numpy.array(mag0_m)
-        mag_m  = numpy.array(mag_m)
-        mcor_m = numpy.array(mcor_m)
+        m = measMosaic.SourceColumns(allMat)
+        group = m.getGroup()
+        member = m.getMember()
+        ngroup = m.getNgroup()
+        cat = member == 0
+        mag_cat = numpy.zeros(ngroup)
+        mag_cat[group[cat]] = -2.5*numpy.log10(m.getFlux()[cat])
+
+        obs = numpy.flatnonzero((member > 0) & (m.getFlux() > 0))
+        fluxMag0 = self.getFluxMag0(m, obs, calibDic)
+        mag, err, mcor = self.getMagnitudes(m, obs, fluxMag0, ffpDic)
+        mag0_m = mag_cat[group[obs]]
+        mag_m  = mag[obs]
+        mcor_m = mcor[obs]
         dm_m = mag_m + mcor_m - mag0_m
 
-        for ss in allSource:
-            Sx = 0.0
-            S  = 0.0
-            mag_source = list()
-            mcor_source = list()
-            iexp_source = list()
-            ichip_source = list()
-            for j in range(1,len(ss)):
-                iexp = ss[j].getExp()
-                ichip = ss[j].getChip()
-                #print iexp, ichip, calibDic[iexp][ichip].getFluxMag0()[0], ss[j].getFlux()
-                if calibDic[iexp][ichip].getFluxMag0()[0] > 0:
-                    mag = 2.5*math.log10(calibDic[iexp][ichip].getFluxMag0()[0]/ss[j].getFlux())
-                    err = 2.5 / math.log(10) * ss[j].getFluxErr() / ss[j].getFlux()
-                    x = ss[j].getX()
-                    y = ss[j].getY()
-                    mcor = ffpDic[iexp][ichip].eval(x,y)
-                    mag_source.append(mag)
-                    mcor_source.append(mcor)
-                    iexp_source.append(iexp)
-                    ichip_source.append(ichip)
-                    Sx += (mag+mcor) / (err*err)
-                    S  += 1. / (err*err)
-            if S > 0:
-                mag_cat = Sx / S
-            else:
-                mag_cat = 99999.
-            if mag_cat < mag_lim:
-                for mag, mcor, iexp, ichip in zip(mag_source, mcor_source, iexp_source, ichip_source):
-                    mag0_s.append(mag_cat)
-                    mag_s.append(mag)
-                    mcor_s.append(mcor)
-        mag0_s = numpy.array(mag0_s)
-        mag_s  = numpy.array(mag_s)
-        mcor_s = numpy.array(mcor_s)
+        multi = obs[numpy.bincount(group, minlength=ngroup)[group[obs]] > 2]
+        mag0_sm, mag_sm, mcor_sm = self.diffFromWeightedMean(group, ngroup, multi, mag, err, mcor, mag_lim)
+
+        s = measMosaic.SourceColumns(allSource)
+        obs = numpy.flatnonzero(s.getMember() > 0)
+        fluxMag0 = self.getFluxMag0(s, obs, calibDic)
+        obs = obs[fluxMag0[obs] > 0]
+        mag, err, mcor = self.getMagnitudes(s, obs, fluxMag0, ffpDic)
+        mag0_ss, mag_ss, mcor_ss = self.diffFromWeightedMean(s.getGroup(), s.getNgroup(), obs,
+                                                             mag, err, mcor, mag_lim)
+
+        mag0_s = numpy.concatenate([mag0_sm, mag0_ss])
+        mag_s  = numpy.concatenate([mag_sm, mag_ss])
+        mcor_s = numpy.concatenate([mcor_sm, mcor_ss])
         dm_s = mag_s + mcor_s - mag0_s
 
         return mag0_m, dm_m, mag0_s, dm_s
 
+    def fluxStat(self, cols, rows, mag, err, mcor):
+        """Weighted mean and rms of the corrected magnitudes of the given rows of SourceColumns
+        cols, and the mean ra and dec, for each group with rows"""
+        group = cols.getGroup()
+        ngroup = cols.getNgroup()
+        g = group[rows]
+        w = 1. / (err[rows]*err[rows])
+        m = mag[rows] + mcor[rows]
+        S   = numpy.bincount(g, weights=w, minlength=ngroup)
+        Sx  = numpy.bincount(g, weights=m*w, minlength=ngroup)
+        Sxx = numpy.bincount(g, weights=m*m*w, minlength=ngroup)
+        Sr  = numpy.bincount(g, weights=cols.getRa()[rows], minlength=ngroup)
+        Sd  = numpy.bincount(g, weights=cols.getDec()[rows], minlength=ngroup)
+        n = numpy.bincount(group[cols.getMember() > 0], minlength=ngroup)
+
+        has = S > 0
+        avg = Sx[has] / S[has]
+        var = Sxx[has] / S[has] - avg*avg
+        ok = var >= 0
+        return avg[ok], numpy.sqrt(var[ok]), (Sr[has] / n[has])[ok], (Sd[has] / n[has])[ok]
+
     def makeFluxStat(self, allMat, allSource, calibDic, ffpDic, mag_lim = 9999.0):
 
-        x = list()
-        y = list()
-        ra = list()
-        dec = list()
-        id = list()
-        for ss in allMat:
-            Sxx = 0.0
-            Sx  = 0.0
-            S   = 0.0
-            Sr  = 0.0
-            Sd  = 0.0
-            if len(ss) > 2:
-                for j in range(1,len(ss)):
-                    iexp = ss[j].getExp()
-                    ichip = ss[j].getChip()
-                    mag = calibDic[iexp][ichip].getMagnitude(ss[j].getFlux())
-                    err = 2.5 / math.log(10) * ss[j].getFluxErr() / ss[j].getFlux()
-                    mcor = ffpDic[iexp][ichip].eval(ss[j].getX(), ss[j].getY())
-                    Sxx += (mag+mcor)*(mag+mcor) / (err*err)
-                    Sx  += (mag+mcor) / (err*err)
-                    S   += 1. / (err*err)
-                    Sr += ss[j].getRa().asDegrees()
-                    Sd += ss[j].getDec().asDegrees()
-                avg = Sx / S
-                sig = math.sqrt(Sxx/S - avg*avg)
-                x.append(avg)
-                y.append(sig)
-                ra.append(Sr / (len(ss)-1))
-                dec.append(Sd / (len(ss)-1))
-
-        for ss in allSource:
-            Sxx = 0.0
-            Sx = 0.0
-            S  = 0.0
-            Sr  = 0.0
-            Sd  = 0.0
-            for j in range(1,len(ss)):
-                iexp = ss[j].getExp()
-                ichip = ss[j].getChip()
-                #print iexp, ichip, calibDic[iexp][ichip].getFluxMag0()[0], ss[j].getFlux()
-                if calibDic[iexp][ichip].getFluxMag0()[0] > 0:
-                    mag = calibDic[iexp][ichip].getMagnitude(ss[j].getFlux())
-                    err = 2.5 / math.log(10) * ss[j].getFluxErr() / ss[j].getFlux()
-                    mcor = ffpDic[iexp][ichip].eval(ss[j].getX(), ss[j].getY())
-                    Sxx += (mag+mcor)*(mag+mcor) / (err*err)
-                    Sx  += (mag+mcor) / (err*err)
-                    S   += 1. / (err*err)
-                    Sr += ss[j].getRa().asDegrees()
-                    Sd += ss[j].getDec().asDegrees()
-            if S > 0:
-                try:
-                    avg = Sx / S
-                    sig = math.sqrt(Sxx/S - avg*avg)
-                    x.append(avg)
-                    y.append(sig)
-                    ra.append(Sr / (len(ss)-1))
-                    dec.append(Sd / (len(ss)-1))
-                except Exception, e:
-                    #print Sxx, S, avg, Sxx/S - avg*avg, len(ss)-1
-                    pass
+        m = measMosaic.SourceColumns(allMat)
+        group = m.getGroup()
+        obs = numpy.flatnonzero(m.getMember() > 0)
+        obs = obs[numpy.bincount(group, minlength=m.getNgroup())[group[obs]] > 2]
+        fluxMag0 = self.getFluxMag0(m, obs, calibDic)
+        mag, err, mcor = self.getMagnitudes(m, obs, fluxMag0, ffpDic)
+        x_m, y_m, ra_m, dec_m = self.fluxStat(m, obs, mag, err, mcor)
+
+        s = measMosaic.SourceColumns(allSource)
+        obs = numpy.flatnonzero(s.getMember() > 0)
+        fluxMag0 = self.getFluxMag0(s, obs, calibDic)
+        obs = obs[fluxMag0[obs] > 0]
+        mag, err, mcor = self.getMagnitudes(s, obs, fluxMag0, ffpDic)
+        x_s, y_s, ra_s, dec_s = self.fluxStat(s, obs, mag, err, mcor)
+
+        x = numpy.concatenate([x_m, x_s])
+        y = numpy.concatenate([y_m, y_s])
+        ra = numpy.concatenate([ra_m, ra_s])
+        dec = numpy.concatenate([dec_m, dec_s])
 
         if True:
             plt.clf()
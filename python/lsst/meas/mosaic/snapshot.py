@@ -0,0 +1,29 @@
+"""Read the ObsVec snapshots written with snapshotFormat="binary"
+
+    cols = readObsSnapshot("match-iter-0.obs")
+    good = cols["jexp"] == 0
+
+The file layout is described with writeObsVecBinary in snapshot.h.
+"""
+
+import numpy
+
+_types = {"i": numpy.int32, "l": numpy.int64, "d": numpy.float64}
+
+def readObsSnapshot(filename):
+    """Return the columns of a binary snapshot as a dict of numpy arrays"""
+    with open(filename, "rb") as f:
+        data = f.read()
+    if data[:8] != "MOSOBS01":
+        raise RuntimeError("%s is not an ObsVec snapshot" % filename)
+    nrow = int(numpy.frombuffer(data, numpy.int64, 1, 8)[0])
+    ncol = int(numpy.frombuffer(data, numpy.int32, 1, 16)[0])
+    offset = 20
+    columns = dict()
+    for i in range(ncol):
+        name = data[offset:offset+16].rstrip("\0")
+        dtype = _types[data[offset+16]]
+        offset += 17
+        columns[name] = numpy.frombuffer(data, dtype, nrow, offset)
+        offset += nrow * numpy.dtype(dtype).itemsize
+    return columns
@@ -0,0 +1,362 @@
+#!/usr/bin/env python
+"""Synthetic survey inputs for meas_mosaic
+
+Fabricates a camera, a set of visits with a known distortion and zero
+point, and a star field, and produces the SourceGroup/SourceMatchGroup
+pair that MosaicTask.readCatalog would return for real data.  Intended
+for benchmarking and for checking the solvers against a known truth.
+"""
+
+import math
+import numpy
+
+import lsst.afw.cameraGeom              as cameraGeom
+import lsst.afw.coord                   as afwCoord
+import lsst.afw.geom                    as afwGeom
+import lsst.afw.image                   as afwImage
+import lsst.pex.config                  as pexConfig
+import lsst.meas.mosaic.mosaicLib       as measMosaic
+
+__all__ = ("SyntheticSurveyConfig", "SyntheticSurvey", "makeSyntheticSurvey")
+
+class SyntheticSurveyConfig(pexConfig.Config):
+    nVisit = pexConfig.RangeField(
+        doc="number of visits",
+        dtype=int,
+        default=5, min=1)
+    nCcd = pexConfig.RangeField(
+        doc="number of CCDs in the camera",
+        dtype=int,
+        default=10, min=1)
+    ccdWidth = pexConfig.Field(
+        doc="CCD width (pixels)",
+        dtype=int,
+        default=2048)
+    ccdHeight = pexConfig.Field(
+        doc="CCD height (pixels)",
+        dtype=int,
+        default=4176)
+    ccdGap = pexConfig.Field(
+        doc="gap between CCDs (pixels)",
+        dtype=int,
+        default=100)
+    pixelSize = pexConfig.Field(
+        doc="pixel size (mm)",
+        dtype=float,
+        default=0.015)
+    pixelScale = pexConfig.Field(
+        doc="pixel scale (arcsec)",
+        dtype=float,
+        default=0.17)
+    ccdYaw = pexConfig.Field(
+        doc="rms of the CCD rotations (radian)",
+        dtype=float,
+        default=1.0e-3)
+    fittingOrder = pexConfig.RangeField(
+        doc="order of the true distortion polynomial",
+        dtype=int,
+        default=5, min=2)
+    distortion = pexConfig.Field(
+        doc="radial distortion at the edge of the field (pixels)",
+        dtype=float,
+        default=50.0)
+    ra = pexConfig.Field(
+        doc="right ascension of the field center (degree)",
+        dtype=float,
+        default=150.0)
+    dec = pexConfig.Field(
+        doc="declination of the field center (degree)",
+        dtype=float,
+        default=2.0)
+    dither = pexConfig.Field(
+        doc="radius of the dither pattern (arcsec)",
+        dtype=float,
+        default=120.0)
+    pointingError = pexConfig.Field(
+        doc="rms of the error of the initial WCS pointing (arcsec)",
+        dtype=float,
+        default=1.0)
+    starDensity = pexConfig.Field(
+        doc="number of stars per square degree",
+        dtype=float,
+        default=2000.0)
+    magBright = pexConfig.Field(
+        doc="bright end of the star magnitudes",
+        dtype=float,
+        default=16.0)
+    magFaint = pexConfig.Field(
+        doc="faint end of the star magnitudes",
+        dtype=float,
+        default=24.0)
+    refMagLimit = pexConfig.Field(
+        doc="faint limit of the reference catalog",
+        dtype=float,
+        default=21.0)
+    zeroPoint = pexConfig.Field(
+        doc="magnitude of unit flux",
+        dtype=float,
+        default=30.0)
+    zeroPointScatter = pexConfig.Field(
+        doc="rms of the visit and CCD zero points (mag)",
+        dtype=float,
+        default=0.05)
+    fluxVignetting = pexConfig.Field(
+        doc="flux correction at the edge of the field (mag)",
+        dtype=float,
+        default=0.05)
+    posNoise = pexConfig.Field(
+        doc="centroid error (pixels)",
+        dtype=float,
+        default=0.05)
+    fluxNoise = pexConfig.Field(
+        doc="fractional flux error",
+        dtype=float,
+        default=0.01)
+    outlierFraction = pexConfig.Field(
+        doc="fraction of detections with a bad centroid and flux",
+        dtype=float,
+        default=0.001)
+    outlierScale = pexConfig.Field(
+        doc="centroid offset of outliers (pixels)",
+        dtype=float,
+        default=5.0)
+    seed = pexConfig.Field(
+        doc="random seed",
+        dtype=int,
+        default=1)
+
+class SyntheticSurvey(object):
+    """Inputs and truth of a synthetic survey
+
+    ccdSet, wcsDic, sourceSet and matchList have the types MosaicTask
+    passes to mergeCatalog; truth is the CoeffSet the initial WCSs were
+    perturbed from, and fexp/fchip the true zero point factors.
+    """
+    def __init__(self, ccdSet, wcsDic, sourceSet, matchList, truth, fexp, fchip):
+        self.ccdSet = ccdSet
+        self.wcsDic = wcsDic
+        self.sourceSet = sourceSet
+        self.matchList = matchList
+        self.truth = truth
+        self.fexp = fexp
+        self.fchip = fchip
+
+    def nSource(self):
+        return sum([len(ss) for ss in self.sourceSet])
+
+    def nMatch(self):
+        return sum([len(ml) for ml in self.matchList])
+
+def makeCcd(serial, config, center, yaw):
+    ccd = cameraGeom.Ccd(cameraGeom.Id(serial), config.pixelSize)
+    allPixels = afwGeom.Box2I(afwGeom.Point2I(0, 0),
+                              afwGeom.Extent2I(config.ccdWidth, config.ccdHeight))
+    eParams = cameraGeom.ElectronicParams(1.0, 5.0, 65535)
+    amp = cameraGeom.Amp(cameraGeom.Id(0), allPixels, afwGeom.Box2I(), allPixels, eParams)
+    ccd.addAmp(afwGeom.Point2I(0, 0), amp)
+    ccd.setCenter(cameraGeom.FpPoint(center[0] * config.pixelSize, center[1] * config.pixelSize))
+    ccd.setOrientation(cameraGeom.Orientation(0, 0.0 * afwGeom.radians, 0.0 * afwGeom.radians,
+                                              yaw * afwGeom.radians))
+    return ccd
+
+def makeCcdSet(config, rng):
+    """CCDs on a regular grid around the optical axis, with small rotations"""
+    nx = int(math.ceil(math.sqrt(config.nCcd * config.ccdHeight / float(config.ccdWidth))))
+    ny = int(math.ceil(config.nCcd / float(nx)))
+    dx = config.ccdWidth + config.ccdGap
+    dy = config.ccdHeight + config.ccdGap
+
+    ccdSet = measMosaic.CcdSet()
+    for ichip in range(config.nCcd):
+        i = ichip % nx
+        j = ichip / nx
+        center = ((i - 0.5 * (nx - 1)) * dx, (j - 0.5 * (ny - 1)) * dy)
+        ccdSet[ichip] = makeCcd(ichip, config, center, rng.normal(0.0, config.ccdYaw))
+
+    return ccdSet
+
+def pixelTransform(ccd):
+    """Affine transform (offset, matrix) from focal plane to CCD pixels"""
+    def fp(x, y):
+        uv = ccd.getPositionFromPixel(afwGeom.Point2D(x, y)).getPixels(ccd.getPixelSize())
+        return numpy.array([uv[0], uv[1]])
+    origin = fp(0.0, 0.0)
+    m = numpy.array([fp(1.0, 0.0) - origin, fp(0.0, 1.0) - origin]).T
+    return origin, numpy.linalg.inv(m)
+
+def polyTerms(order):
+    p = measMosaic.Poly(order)
+    return (numpy.array([p.getXorder(k) for k in range(p.ncoeff)]),
+            numpy.array([p.getYorder(k) for k in range(p.ncoeff)]))
+
+def makeTruth(config, pointing, rng, fpRadius):
+    """Distortion of one visit: pixel scale, rotation and a radial term"""
+    xorder, yorder = polyTerms(config.fittingOrder)
+    scale = config.pixelScale / 3600.0
+    rot = rng.normal(0.0, 1.0e-4)
+    k3 = config.distortion / fpRadius**3 * scale
+
+    c = measMosaic.Coeff(config.fittingOrder)
+    for k in range(len(xorder)):
+        i, j = xorder[k], yorder[k]
+        a = b = 0.0
+        if (i, j) == (1, 0):
+            a, b = scale * math.cos(rot), scale * math.sin(rot)
+        elif (i, j) == (0, 1):
+            a, b = -scale * math.sin(rot), scale * math.cos(rot)
+        elif (i, j) == (3, 0):
+            a = k3
+        elif (i, j) == (1, 2):
+            a = k3
+        elif (i, j) == (2, 1):
+            b = k3
+        elif (i, j) == (0, 3):
+            b = k3
+        c.set_a(k, a)
+        c.set_b(k, b)
+    c.set_A(math.radians(pointing[0]))
+    c.set_D(math.radians(pointing[1]))
+    c.set_x0(0.0)
+    c.set_y0(0.0)
+    return c
+
+def gnomonic(ra, dec, ra_c, dec_c):
+    """(xi, eta) in degree of (ra, dec) in radian about (ra_c, dec_c)"""
+    cosc = math.sin(dec_c) * numpy.sin(dec) + math.cos(dec_c) * numpy.cos(dec) * numpy.cos(ra - ra_c)
+    xi = numpy.cos(dec) * numpy.sin(ra - ra_c) / cosc
+    eta = (math.cos(dec_c) * numpy.sin(dec) -
+           math.sin(dec_c) * numpy.cos(dec) * numpy.cos(ra - ra_c)) / cosc
+    return numpy.degrees(xi), numpy.degrees(eta)
+
+def xiEtaToUV(coeff, xorder, yorder, xi, eta, niter=5):
+    """Invert the distortion polynomial by Newton iterations"""
+    a = numpy.array([coeff.get_a(k) for k in range(len(xorder))])
+    b = numpy.array([coeff.get_b(k) for k in range(len(xorder))])
+    cd = numpy.linalg.inv(numpy.array([[a[0], a[1]], [b[0], b[1]]]))
+    u = cd[0,0] * xi + cd[0,1] * eta
+    v = cd[1,0] * xi + cd[1,1] * eta
+    for it in range(niter):
+        f = numpy.zeros_like(u); g = numpy.zeros_like(u)
+        fu = numpy.zeros_like(u); fv = numpy.zeros_like(u)
+        gu = numpy.zeros_like(u); gv = numpy.zeros_like(u)
+        for k in range(len(xorder)):
+            i, j = xorder[k], yorder[k]
+            t = u**i * v**j
+            f += a[k] * t
+            g += b[k] * t
+            if i > 0:
+                tu = i * u**(i-1) * v**j
+                fu += a[k] * tu
+                gu += b[k] * tu
+            if j > 0:
+                tv = j * u**i * v**(j-1)
+                fv += a[k] * tv
+                gv += b[k] * tv
+        det = fu * gv - fv * gu
+        du = ( gv * (xi - f) - fv * (eta - g)) / det
+        dv = (-gu * (xi - f) + fu * (eta - g)) / det
+        u += du
+        v += dv
+    return u, v
+
+def makeSyntheticSurvey(config):
+    """Generate a SyntheticSurvey from a SyntheticSurveyConfig"""
+    rng = numpy.random.RandomState(config.seed)
+
+    ccdSet = makeCcdSet(config, rng)
+    transforms = dict()
+    fpRadius = 0.0
+    for ichip, ccd in ccdSet.iteritems():
+        transforms[ichip] = pixelTransform(ccd)
+        center = ccd.getCenter().getPixels(ccd.getPixelSize())
+        r = math.hypot(abs(center[0]) + 0.5 * config.ccdWidth, abs(center[1]) + 0.5 * config.ccdHeight)
+        fpRadius = max(fpRadius, r)
+    xorder, yorder = polyTerms(config.fittingOrder)
+
+    # Star field covering all visits
+    radius = fpRadius * config.pixelScale / 3600.0 + config.dither / 3600.0
+    cosDec = math.cos(math.radians(config.dec))
+    area = math.pi * radius**2
+    nStar = rng.poisson(config.starDensity * area)
+    r = radius * numpy.sqrt(rng.uniform(0.0, 1.0, nStar))
+    phi = rng.uniform(0.0, 2.0 * math.pi, nStar)
+    starRa = numpy.radians(config.ra + r * numpy.cos(phi) / cosDec)
+    starDec = numpy.radians(config.dec + r * numpy.sin(phi))
+    # Number counts rising as 10^(0.3 m)
+    x = rng.uniform(0.0, 1.0, nStar)
+    lo, hi = 10**(0.3 * config.magBright), 10**(0.3 * config.magFaint)
+    starMag = numpy.log10(lo + x * (hi - lo)) / 0.3
+    starCoord = [afwCoord.IcrsCoord(afwGeom.Angle(starRa[i], afwGeom.radians),
+                                    afwGeom.Angle(starDec[i], afwGeom.radians)) for i in range(nStar)]
+    refFlux = 10**(-0.4 * (starMag - config.zeroPoint))
+
+    fchip = measMosaic.map_chiptype_float()
+    for ichip in ccdSet.keys():
+        fchip[ichip] = 10**(-0.4 * rng.normal(0.0, config.zeroPointScatter))
+
+    wcsDic = measMosaic.WcsDic()
+    truth = measMosaic.CoeffSet()
+    fexp = measMosaic.map_exptype_float()
+    sourceSet = measMosaic.SourceGroup()
+    matchList = measMosaic.SourceMatchGroup()
+    nan = float("nan")
+    sourceId = 0
+    for iexp in range(config.nVisit):
+        angle = 2.0 * math.pi * iexp / config.nVisit
+        pointing = (config.ra + config.dither / 3600.0 * math.cos(angle) / cosDec,
+                    config.dec + config.dither / 3600.0 * math.sin(angle))
+        coeff = makeTruth(config, pointing, rng, fpRadius)
+        coeff.set_iexp(iexp)
+        truth[iexp] = coeff
+        fexp[iexp] = 10**(-0.4 * rng.normal(0.0, config.zeroPointScatter))
+
+        # Initial WCS: the linear part of the truth with a pointing error
+        err = rng.normal(0.0, config.pointingError / 3600.0, 2)
+        crval = afwCoord.IcrsCoord(afwGeom.Angle(pointing[0] + err[0] / cosDec, afwGeom.degrees),
+                                   afwGeom.Angle(pointing[1] + err[1], afwGeom.degrees))
+        wcsDic[iexp] = afwImage.makeWcs(crval, afwGeom.Point2D(0.0, 0.0),
+                                        coeff.get_a(0), coeff.get_a(1),
+                                        coeff.get_b(0), coeff.get_b(1))
+
+        xi, eta = gnomonic(starRa, starDec, math.radians(pointing[0]), math.radians(pointing[1]))
+        u, v = xiEtaToUV(coeff, xorder, yorder, xi, eta)
+        rfp2 = (u**2 + v**2) / fpRadius**2
+
+        ss = []
+        ml = []
+        for ichip in ccdSet.keys():
+            origin, m = transforms[ichip]
+            x = m[0,0] * (u - origin[0]) + m[0,1] * (v - origin[1])
+            y = m[1,0] * (u - origin[0]) + m[1,1] * (v - origin[1])
+            on = numpy.where((x >= 0) & (x < config.ccdWidth) & (y >= 0) & (y < config.ccdHeight))[0]
+            n = len(on)
+            if n == 0:
+                continue
+
+            scale = fexp[iexp] * fchip[ichip]
+            flux = refFlux[on] / scale * 10**(-0.4 * config.fluxVignetting * rfp2[on])
+            fluxErr = config.fluxNoise * flux
+            flux = flux + rng.normal(0.0, 1.0, n) * fluxErr
+            xm = x[on] + rng.normal(0.0, config.posNoise, n)
+            ym = y[on] + rng.normal(0.0, config.posNoise, n)
+            bad = rng.uniform(0.0, 1.0, n) < config.outlierFraction
+            nbad = bad.sum()
+            xm[bad] += rng.normal(0.0, config.outlierScale, nbad)
+            ym[bad] += rng.normal(0.0, config.outlierScale, nbad)
+            flux[bad] *= rng.uniform(0.5, 1.5, nbad)
+
+            for k, istar in enumerate(on):
+                src = measMosaic.Source(sourceId, starCoord[istar], afwGeom.Point2D(xm[k], ym[k]),
+                                        flux[k], fluxErr[k], config.posNoise, config.posNoise)
+                src.setExp(iexp)
+                src.setChip(ichip)
+                sourceId += 1
+                ss.append(src)
+                if starMag[istar] < config.refMagLimit:
+                    ref = measMosaic.Source(int(istar), starCoord[istar], afwGeom.Point2D(nan, nan),
+                                            refFlux[istar], config.fluxNoise * refFlux[istar], nan, nan)
+                    ml.append(measMosaic.SourceMatch(ref, src))
+        sourceSet.push_back(ss)
+        matchList.push_back(ml)
+
+    return SyntheticSurvey(ccdSet, wcsDic, sourceSet, matchList, truth, fexp, fchip)
@@ -1,4 +1,4 @@
-from .mosaicLib import getFCorImg, FluxFitParams
+from .mosaicLib import applyFCor, FluxFitParams
 import lsst.afw.image
 
 __all__ = ("applyMosaicResults",)
@@ -22,8 +22,7 @@ def applyMosaicResults(dataRef, calexp=None, bbox=None):
     ffp = FluxFitParams(ffp_md)
     mi = calexp.getMaskedImage()
     if bbox is not None:
-        fcor = getFCorImg(ffp, bbox)
+        applyFCor(ffp, mi, bbox)
     else:
-        fcor = getFCorImg(ffp, mi.getWidth(), mi.getHeight())
-    mi *= fcor
+        applyFCor(ffp, mi)
     return calexp
@@ -0,0 +1,293 @@
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include "fitsio.h"
+#include "lsst/meas/mosaic/catalog.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/pex/logging/Log.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+namespace {
+
+/*
+ * A column of a FITS binary table; num is 0 if the table has no such
+ * column.
+ */
+struct Column {
+    int num;
+    long repeat;
+
+    Column() : num(0), repeat(0) {}
+    bool exists() const { return num > 0; }
+};
+
+/*
+ * Read access to the first table of a catalog file written by afw::table.
+ * Field names are looked up with the dots written as underscores, as afw
+ * does, and then as given.  Flag fields are bits of the "flags" column (an
+ * X column), named by the TFLAGn keywords, or (in newer files) logical
+ * columns of their own.
+ * cfitsio errors are kept in the status and make later calls no-ops.
+ */
+class CatalogFile {
+public:
+    explicit CatalogFile(std::string const & filename) : _fptr(NULL), _status(0), _nrows(0) {
+        fits_open_table(&_fptr, filename.c_str(), READONLY, &_status);
+        fits_get_num_rowsll(_fptr, &_nrows, &_status);
+        if (_status != 0) return;
+
+        for (int i = 1; ; i++) {
+            char key[FLEN_KEYWORD];
+            char value[FLEN_VALUE];
+            int status = 0;
+            std::snprintf(key, sizeof(key), "TFLAG%d", i);
+            if (fits_read_key(_fptr, TSTRING, key, value, NULL, &status) != 0) break;
+            _flagNames.push_back(value);
+        }
+        if (!_flagNames.empty()) {
+            _flags = findColumn("flags");
+        }
+    }
+
+    ~CatalogFile() {
+        if (_fptr != NULL) {
+            int status = 0;
+            fits_close_file(_fptr, &status);
+        }
+    }
+
+    int getStatus() const { return _status; }
+    LONGLONG getNumRows() const { return _nrows; }
+
+    std::string getErrorText() const {
+        char text[FLEN_STATUS];
+        fits_get_errstatus(_status, text);
+        return text;
+    }
+
+    /* Field name of a slot (e.g. CENTROID_SLOT) from the header */
+    std::string getSlot(char const * key, char const * defaultName) const {
+        char value[FLEN_VALUE];
+        int status = 0;
+        if (_fptr == NULL ||
+            fits_read_key(_fptr, TSTRING, const_cast<char *>(key), value, NULL, &status) != 0) {
+            return defaultName;
+        }
+        return value;
+    }
+
+    Column findColumn(std::string const & name) const {
+        Column column;
+        if (_fptr == NULL) return column;
+
+        std::string fitsName(name);
+        std::replace(fitsName.begin(), fitsName.end(), '.', '_');
+        std::string const candidates[2] = { fitsName, name };
+        for (int i = 0; i < 2 && column.num == 0; i++) {
+            int status = 0;
+            int num = 0;
+            fits_get_colnum(_fptr, CASEINSEN, const_cast<char *>(candidates[i].c_str()), &num, &status);
+            if (status == 0 || status == COL_NOT_UNIQUE) {
+                int typecode = 0;
+                long width = 0;
+                status = 0;
+                fits_get_coltype(_fptr, num, &typecode, &column.repeat, &width, &status);
+                if (status == 0) column.num = num;
+            }
+        }
+        return column;
+    }
+
+    int findFlagBit(std::string const & name) const {
+        std::vector<std::string>::const_iterator it = std::find(_flagNames.begin(), _flagNames.end(), name);
+        return (it == _flagNames.end() || !_flags.exists()) ? -1 : it - _flagNames.begin();
+    }
+
+    /* All elements of the column for nrow rows from row (1-indexed) */
+    template <typename T>
+    void read(Column const & column, int datatype, LONGLONG row, long nrow, std::vector<T> & values) {
+        values.resize(nrow * column.repeat);
+        if (!column.exists() || values.empty()) return;
+        int anynul = 0;
+        fits_read_col(_fptr, datatype, column.num, row, 1, values.size(), NULL, &values[0], &anynul,
+                      &_status);
+    }
+
+    /*
+     * The first nbits bits of the flags column for nrow rows from row, one
+     * char per bit and nbits per row.  Read as TBYTE, an X column comes
+     * packed 8 bits to a byte, first bit in the most significant one, so
+     * the chunk is read at once and unpacked here.
+     */
+    void readFlagBits(LONGLONG row, long nrow, int nbits, std::vector<char> & bits) {
+        bits.resize(nrow * nbits);
+        if (!_flags.exists() || bits.empty()) return;
+        long const nbytes = (_flags.repeat + 7) / 8;
+        _packed.resize(nrow * nbytes);
+        int anynul = 0;
+        fits_read_col(_fptr, TBYTE, _flags.num, row, 1, _packed.size(), NULL, &_packed[0], &anynul,
+                      &_status);
+        if (_status != 0) return;
+        for (long i = 0; i < nrow; i++) {
+            unsigned char const * packed = &_packed[i*nbytes];
+            for (int b = 0; b < nbits; b++) {
+                bits[i*nbits + b] = (packed[b/8] >> (7 - b%8)) & 1;
+            }
+        }
+    }
+
+    /* Number of rows that fit in the cfitsio buffers */
+    long getRowChunk() const {
+        long nrow = 0;
+        int status = 0;
+        fits_get_rowsize(_fptr, &nrow, &status);
+        return nrow;
+    }
+
+private:
+    fitsfile * _fptr;
+    int _status;
+    LONGLONG _nrows;
+    std::vector<std::string> _flagNames;
+    Column _flags;
+    std::vector<unsigned char> _packed;
+};
+
+/*
+ * A flag field read in chunks, either a bit of the flags column or a
+ * logical column; a flag the file does not have is never set.
+ */
+class FlagField {
+public:
+    FlagField(CatalogFile const & file, std::string const & name) :
+        _bit(file.findFlagBit(name)), _column(_bit < 0 ? file.findColumn(name) : Column()) {}
+
+    bool exists() const { return _bit >= 0 || _column.exists(); }
+
+    /* Number of leading bits of the flags column this field needs */
+    int getNbits() const { return _bit + 1; }
+
+    /* flags holds nbits bits per row, from CatalogFile::readFlagBits */
+    void read(CatalogFile & file, std::vector<char> const & flags, int nbits, LONGLONG row, long nrow) {
+        if (_bit >= 0) {
+            _values.resize(nrow);
+            for (long i = 0; i < nrow; i++) {
+                _values[i] = flags[i*nbits + _bit];
+            }
+        } else if (_column.exists()) {
+            file.read(_column, TLOGICAL, row, nrow, _values);
+        } else {
+            _values.assign(nrow, 0);
+        }
+    }
+
+    bool operator[](long i) const { return _values[i] != 0; }
+
+private:
+    int _bit;
+    Column _column;
+    std::vector<char> _values;
+};
+
+} // anonymous
+
+SourceSet readSourceCatalog(std::string const & filename,
+                            ExpType iexp,
+                            ChipType ichip,
+                            StarSelection const & selection) {
+    ScopedTimer timer("ingest.readSourceCatalog");
+    SourceSet sources;
+
+    CatalogFile file(filename);
+    if (file.getStatus() != 0) {
+        mosaicLog(pex::logging::Log::WARN, "cannot read %s: %s", filename.c_str(),
+                  file.getErrorText().c_str());
+        return sources;
+    }
+
+    std::string const centroid = file.getSlot("CENTROID_SLOT", "centroid.sdss");
+    std::string const apFlux = file.getSlot("AP_FLUX_SLOT", "flux.sinc");
+
+    Column const idCol = file.findColumn("id");
+    Column const coordCol = file.findColumn("coord");
+    Column const centroidCol = file.findColumn(centroid);
+    Column const centroidErrCol = file.findColumn(centroid + ".err");
+    Column const fluxCol = file.findColumn(apFlux);
+    Column const fluxErrCol = file.findColumn(apFlux + ".err");
+    Column const extendednessCol = file.findColumn("classification.extendedness");
+    Column const nchildCol = file.findColumn("deblend.nchild");
+    if (!idCol.exists() || coordCol.repeat != 2 || centroidCol.repeat != 2 || !fluxCol.exists()) {
+        mosaicLog(pex::logging::Log::WARN, "%s lacks the id, coord, %s or %s columns",
+                  filename.c_str(), centroid.c_str(), apFlux.c_str());
+        return sources;
+    }
+
+    FlagField centroidFlag(file, centroid + ".flags");
+    FlagField fluxFlag(file, apFlux + ".flags");
+    FlagField saturated(file, "flags.pixel.saturated.center");
+
+    long const chunk = std::max(file.getRowChunk(), 1024L);
+    int const nbits = std::max(std::max(centroidFlag.getNbits(), fluxFlag.getNbits()), saturated.getNbits());
+
+    std::vector<LONGLONG> id;
+    std::vector<double> coord, xy, xyErr, flux, fluxErr, extendedness;
+    std::vector<int> nchild;
+    std::vector<char> flags;
+    LONGLONG const nrows = file.getNumRows();
+    for (LONGLONG row = 1; row <= nrows; row += chunk) {
+        long const n = std::min<LONGLONG>(chunk, nrows - row + 1);
+
+        file.read(extendednessCol, TDOUBLE, row, n, extendedness);
+        file.read(nchildCol, TINT, row, n, nchild);
+        file.readFlagBits(row, n, nbits, flags);
+        saturated.read(file, flags, nbits, row, n);
+        file.read(idCol, TLONGLONG, row, n, id);
+        file.read(coordCol, TDOUBLE, row, n, coord);
+        file.read(centroidCol, TDOUBLE, row, n, xy);
+        file.read(centroidErrCol, TDOUBLE, row, n, xyErr);
+        file.read(fluxCol, TDOUBLE, row, n, flux);
+        file.read(fluxErrCol, TDOUBLE, row, n, fluxErr);
+        centroidFlag.read(file, flags, nbits, row, n);
+        fluxFlag.read(file, flags, nbits, row, n);
+        if (file.getStatus() != 0) break;
+
+        for (long i = 0; i < n; i++) {
+            if (extendednessCol.exists() && !(extendedness[i] < selection.maxExtendedness)) continue;
+            if (selection.rejectSaturated && saturated[i]) continue;
+            if (selection.rejectParents && nchildCol.exists() && nchild[i] != 0) continue;
+
+            double const ra = coord[2*i];
+            double const dec = coord[2*i+1];
+            if (!lsst::utils::isfinite(ra) || !lsst::utils::isfinite(dec)) continue;
+
+            // Packed covariance: xx first and yy last
+            long const ne = centroidErrCol.repeat;
+            double const xerr = (ne > 0) ? std::sqrt(xyErr[ne*i]) : 0.0;
+            double const yerr = (ne > 0) ? std::sqrt(xyErr[ne*i+ne-1]) : 0.0;
+
+            PTR(Source) source(new Source(id[i],
+                                          afw::coord::Coord(afw::geom::Point2D(ra, dec), afw::geom::radians),
+                                          afw::geom::Point2D(xy[2*i], xy[2*i+1]),
+                                          flux[i], fluxErrCol.exists() ? fluxErr[i] : 0.0,
+                                          xerr, yerr,
+                                          centroidFlag[i] || fluxFlag[i]));
+            source->setExp(iexp);
+            source->setChip(ichip);
+            sources.push_back(source);
+        }
+    }
+
+    if (file.getStatus() != 0) {
+        mosaicLog(pex::logging::Log::WARN, "error reading %s: %s", filename.c_str(),
+                  file.getErrorText().c_str());
+        sources.clear();
+        return sources;
+    }
+
+    Metrics::get()->addCount("ingest.rowsRead", nrows);
+    Metrics::get()->addCount("ingest.starsSelected", sources.size());
+    return sources;
+}
+
+}}} // namespace lsst::meas::mosaic
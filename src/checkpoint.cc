@@ -0,0 +1,199 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "lsst/meas/mosaic/checkpoint.h"
+#include "lsst/meas/mosaic/solution.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/pex/logging/Log.h"
+#include "lsst/afw/table.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+namespace {
+
+struct StateKeys {
+    afw::table::Schema schema;
+    afw::table::Key<int> phase;
+    afw::table::Key<int> niter;
+    afw::table::Key<double> chi2Prev;
+    afw::table::Key<int> nmatch, nsource;
+
+    StateKeys() :
+        schema(),
+        phase(schema.addField<int>("phase", "solver phase (Checkpoint::Phase)")),
+        niter(schema.addField<int>("niter", "astrometric iterations done")),
+        chi2Prev(schema.addField<double>("chi2Prev", "chi2 after the last iteration")),
+        nmatch(schema.addField<int>("nmatch", "number of catalog stars")),
+        nsource(schema.addField<int>("nsource", "number of internal stars"))
+        {}
+
+    explicit StateKeys(afw::table::Schema const & s) :
+        schema(s),
+        phase(s.find<int>("phase").key),
+        niter(s.find<int>("niter").key),
+        chi2Prev(s.find<double>("chi2Prev").key),
+        nmatch(s.find<int>("nmatch").key),
+        nsource(s.find<int>("nsource").key)
+        {}
+};
+
+struct ObsKeys {
+    afw::table::Schema schema;
+    afw::table::Key<int> id;
+    afw::table::Key<double> ra, dec;
+    afw::table::Key<double> x, y;
+    afw::table::Key<double> xerr, yerr;
+    afw::table::Key<boost::int64_t> iexp;
+    afw::table::Key<int> ichip;
+    afw::table::Key<int> jexp, jchip;
+    afw::table::Key<int> istar;
+    afw::table::Key<afw::table::Flag> good;
+    afw::table::Key<double> mag, err, mag0;
+    afw::table::Key<double> magCat, errCat;
+
+    ObsKeys() :
+        schema(),
+        id(schema.addField<int>("id", "source id")),
+        ra(schema.addField<double>("ra", "star position", "radians")),
+        dec(schema.addField<double>("dec", "star position", "radians")),
+        x(schema.addField<double>("x", "position on the ccd", "pixels")),
+        y(schema.addField<double>("y", "position on the ccd", "pixels")),
+        xerr(schema.addField<double>("xerr", "error in x", "pixels")),
+        yerr(schema.addField<double>("yerr", "error in y", "pixels")),
+        iexp(schema.addField<boost::int64_t>("iexp", "exposure id")),
+        ichip(schema.addField<int>("ichip", "ccd id")),
+        jexp(schema.addField<int>("jexp", "exposure index")),
+        jchip(schema.addField<int>("jchip", "ccd index")),
+        istar(schema.addField<int>("istar", "star index")),
+        good(schema.addField<afw::table::Flag>("good", "used in the fit")),
+        mag(schema.addField<double>("mag", "instrumental magnitude")),
+        err(schema.addField<double>("err", "error in mag")),
+        mag0(schema.addField<double>("mag0", "reference magnitude")),
+        magCat(schema.addField<double>("mag_cat", "catalog magnitude")),
+        errCat(schema.addField<double>("err_cat", "error in mag_cat"))
+        {}
+
+    explicit ObsKeys(afw::table::Schema const & s) :
+        schema(s),
+        id(s.find<int>("id").key),
+        ra(s.find<double>("ra").key), dec(s.find<double>("dec").key),
+        x(s.find<double>("x").key), y(s.find<double>("y").key),
+        xerr(s.find<double>("xerr").key), yerr(s.find<double>("yerr").key),
+        iexp(s.find<boost::int64_t>("iexp").key),
+        ichip(s.find<int>("ichip").key),
+        jexp(s.find<int>("jexp").key), jchip(s.find<int>("jchip").key),
+        istar(s.find<int>("istar").key),
+        good(s.find<afw::table::Flag>("good").key),
+        mag(s.find<double>("mag").key), err(s.find<double>("err").key),
+        mag0(s.find<double>("mag0").key),
+        magCat(s.find<double>("mag_cat").key), errCat(s.find<double>("err_cat").key)
+        {}
+};
+
+void writeObs(std::string const & filename, ObsVec const & obsVec) {
+    ObsKeys const keys;
+    afw::table::BaseCatalog catalog(keys.schema);
+    catalog.reserve(obsVec.size());
+    for (ObsVec::const_iterator iter = obsVec.begin(); iter != obsVec.end(); ++iter) {
+        Obs const & obs = **iter;
+        PTR(afw::table::BaseRecord) record = catalog.addNew();
+        record->set(keys.id, obs.id);
+        record->set(keys.ra, obs.ra);
+        record->set(keys.dec, obs.dec);
+        record->set(keys.x, obs.x);
+        record->set(keys.y, obs.y);
+        record->set(keys.xerr, obs.xerr);
+        record->set(keys.yerr, obs.yerr);
+        record->set(keys.iexp, obs.iexp);
+        record->set(keys.ichip, obs.ichip);
+        record->set(keys.jexp, obs.jexp);
+        record->set(keys.jchip, obs.jchip);
+        record->set(keys.istar, obs.istar);
+        record->set(keys.good, obs.good);
+        record->set(keys.mag, obs.mag);
+        record->set(keys.err, obs.err);
+        record->set(keys.mag0, obs.mag0);
+        record->set(keys.magCat, obs.mag_cat);
+        record->set(keys.errCat, obs.err_cat);
+    }
+    catalog.writeFits(filename, "a");
+}
+
+ObsVec readObs(std::string const & filename, int hdu) {
+    afw::table::BaseCatalog catalog = afw::table::BaseCatalog::readFits(filename, hdu);
+    ObsKeys const keys(catalog.getSchema());
+    ObsVec obsVec;
+    obsVec.reserve(catalog.size());
+    for (size_t n = 0; n < catalog.size(); ++n) {
+        afw::table::BaseRecord const & record = catalog[n];
+        Obs::Ptr obs(new Obs(record.get(keys.id), record.get(keys.ra), record.get(keys.dec),
+                             record.get(keys.x), record.get(keys.y),
+                             record.get(keys.ichip), record.get(keys.iexp)));
+        obs->xerr = record.get(keys.xerr);
+        obs->yerr = record.get(keys.yerr);
+        obs->jexp = record.get(keys.jexp);
+        obs->jchip = record.get(keys.jchip);
+        obs->istar = record.get(keys.istar);
+        obs->good = record.get(keys.good);
+        obs->mag = record.get(keys.mag);
+        obs->err = record.get(keys.err);
+        obs->mag0 = record.get(keys.mag0);
+        obs->mag_cat = record.get(keys.magCat);
+        obs->err_cat = record.get(keys.errCat);
+        obsVec.push_back(obs);
+    }
+    return obsVec;
+}
+
+} // anonymous
+
+Checkpoint::Checkpoint() :
+    phase(ASTROMETRY), niter(0), chi2Prev(0.0), nmatch(0), nsource(0)
+{
+}
+
+void writeCheckpoint(std::string const & filename,
+                     Checkpoint const & checkpoint,
+                     CcdSet const & ccdSet) {
+    std::string const tmpName = filename + ".tmp";
+    writeSolution(tmpName, checkpoint.coeffSet, ccdSet, checkpoint.fexp, checkpoint.fchip, checkpoint.ffp);
+
+    StateKeys const keys;
+    afw::table::BaseCatalog state(keys.schema);
+    PTR(afw::table::BaseRecord) record = state.addNew();
+    record->set(keys.phase, static_cast<int>(checkpoint.phase));
+    record->set(keys.niter, checkpoint.niter);
+    record->set(keys.chi2Prev, checkpoint.chi2Prev);
+    record->set(keys.nmatch, checkpoint.nmatch);
+    record->set(keys.nsource, checkpoint.nsource);
+    state.writeFits(tmpName, "a");
+
+    writeObs(tmpName, checkpoint.matchVec);
+    writeObs(tmpName, checkpoint.sourceVec);
+
+    if (std::rename(tmpName.c_str(), filename.c_str()) != 0) {
+        mosaicLog(pex::logging::Log::WARN, "cannot rename %s to %s: %s; %s is not up to date",
+                  tmpName.c_str(), filename.c_str(), std::strerror(errno), filename.c_str());
+    }
+}
+
+Checkpoint::Ptr readCheckpoint(std::string const & filename, CcdSet & ccdSet) {
+    Checkpoint::Ptr checkpoint(new Checkpoint());
+    checkpoint->ffp = readSolution(filename, checkpoint->coeffSet, ccdSet, checkpoint->fexp, checkpoint->fchip);
+
+    afw::table::BaseCatalog state = afw::table::BaseCatalog::readFits(filename, 5);
+    StateKeys const keys(state.getSchema());
+    afw::table::BaseRecord const & record = state[0];
+    checkpoint->phase = static_cast<Checkpoint::Phase>(record.get(keys.phase));
+    checkpoint->niter = record.get(keys.niter);
+    checkpoint->chi2Prev = record.get(keys.chi2Prev);
+    checkpoint->nmatch = record.get(keys.nmatch);
+    checkpoint->nsource = record.get(keys.nsource);
+
+    checkpoint->matchVec = readObs(filename, 6);
+    checkpoint->sourceVec = readObs(filename, 7);
+
+    return checkpoint;
+}
+
+}}} // namespace lsst::meas::mosaic
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include "lsst/meas/mosaic/columns.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/pex/logging/Log.h"
+#include "lsst/pex/exceptions.h"
+#include "boost/format.hpp"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+namespace {
+
+template <typename T>
+ndarray::Array<T,1,1> allocateColumn(int n) {
+    return ndarray::allocate(ndarray::makeVector(n));
+}
+
+ndarray::Array<double,2,2> allocateTable(int nrow, int ncol) {
+    return ndarray::allocate(ndarray::makeVector(nrow, ncol));
+}
+
+template <typename T>
+ndarray::Array<T,1,1> copyColumn(std::vector<T> const & values) {
+    ndarray::Array<T,1,1> column = allocateColumn<T>(values.size());
+    std::copy(values.begin(), values.end(), column.begin());
+    return column;
+}
+
+} // anonymous
+
+ObsColumns::ObsColumns(ObsVec const & obsVec) :
+    _size(obsVec.size()),
+    _ra(allocateColumn<double>(_size)), _dec(allocateColumn<double>(_size)),
+    _xi(allocateColumn<double>(_size)), _eta(allocateColumn<double>(_size)),
+    _xi_fit(allocateColumn<double>(_size)), _eta_fit(allocateColumn<double>(_size)),
+    _x(allocateColumn<double>(_size)), _y(allocateColumn<double>(_size)),
+    _u(allocateColumn<double>(_size)), _v(allocateColumn<double>(_size)),
+    _xerr(allocateColumn<double>(_size)), _yerr(allocateColumn<double>(_size)),
+    _mag(allocateColumn<double>(_size)), _mag0(allocateColumn<double>(_size)),
+    _err(allocateColumn<double>(_size)),
+    _mag_cat(allocateColumn<double>(_size)), _err_cat(allocateColumn<double>(_size)),
+    _id(allocateColumn<int>(_size)), _istar(allocateColumn<int>(_size)),
+    _jstar(allocateColumn<int>(_size)),
+    _jexp(allocateColumn<int>(_size)), _jchip(allocateColumn<int>(_size)),
+    _iexp(allocateColumn<ExpType>(_size)), _ichip(allocateColumn<ChipType>(_size)),
+    _good(allocateColumn<bool>(_size))
+{
+    update(obsVec);
+}
+
+void ObsColumns::update(ObsVec const & obsVec) {
+    if (static_cast<int>(obsVec.size()) != _size) {
+        mosaicLog(pex::logging::Log::WARN, "ObsColumns of %d rows cannot hold %d Obs",
+                  _size, static_cast<int>(obsVec.size()));
+        return;
+    }
+    ScopedTimer timer("diag.obsColumns");
+    for (int i = 0; i < _size; i++) {
+        Obs const & o = *obsVec[i];
+        _ra[i] = o.ra;
+        _dec[i] = o.dec;
+        _xi[i] = o.xi;
+        _eta[i] = o.eta;
+        _xi_fit[i] = o.xi_fit;
+        _eta_fit[i] = o.eta_fit;
+        _x[i] = o.x;
+        _y[i] = o.y;
+        _u[i] = o.u;
+        _v[i] = o.v;
+        _xerr[i] = o.xerr;
+        _yerr[i] = o.yerr;
+        _mag[i] = o.mag;
+        _mag0[i] = o.mag0;
+        _err[i] = o.err;
+        _mag_cat[i] = o.mag_cat;
+        _err_cat[i] = o.err_cat;
+        _id[i] = o.id;
+        _istar[i] = o.istar;
+        _jstar[i] = o.jstar;
+        _iexp[i] = o.iexp;
+        _ichip[i] = o.ichip;
+        _jexp[i] = o.jexp;
+        _jchip[i] = o.jchip;
+        _good[i] = o.good;
+    }
+}
+
+CoeffColumns::CoeffColumns(CoeffSet const & coeffSet) :
+    _size(coeffSet.size()),
+    _ncoeff(coeffSet.empty() ? 0 : coeffSet.begin()->second->getNcoeff()),
+    _iexp(allocateColumn<ExpType>(_size)),
+    _A(allocateColumn<double>(_size)), _D(allocateColumn<double>(_size)),
+    _x0(allocateColumn<double>(_size)), _y0(allocateColumn<double>(_size)),
+    _a(allocateTable(_size, _ncoeff)), _b(allocateTable(_size, _ncoeff)),
+    _ap(allocateTable(_size, _ncoeff)), _bp(allocateTable(_size, _ncoeff))
+{
+    int i = 0;
+    for (CoeffSet::const_iterator it = coeffSet.begin(); it != coeffSet.end(); ++it, ++i) {
+        Coeff::Ptr const & c = it->second;
+        _iexp[i] = it->first;
+        _A[i] = c->A;
+        _D[i] = c->D;
+        _x0[i] = c->x0;
+        _y0[i] = c->y0;
+        if (c->getNcoeff() != _ncoeff) {
+            mosaicLog(pex::logging::Log::WARN, "Coeff of exposure %ld has %d terms, not %d",
+                      static_cast<long>(it->first), c->getNcoeff(), _ncoeff);
+            std::fill(_a[i].begin(), _a[i].end(), 0.0);
+            std::fill(_b[i].begin(), _b[i].end(), 0.0);
+            std::fill(_ap[i].begin(), _ap[i].end(), 0.0);
+            std::fill(_bp[i].begin(), _bp[i].end(), 0.0);
+            continue;
+        }
+        std::copy(c->a, c->a + _ncoeff, _a[i].begin());
+        std::copy(c->b, c->b + _ncoeff, _b[i].begin());
+        std::copy(c->ap, c->ap + _ncoeff, _ap[i].begin());
+        std::copy(c->bp, c->bp + _ncoeff, _bp[i].begin());
+    }
+}
+
+SourceColumns::SourceColumns(SourceGroup const & sourceGroup) :
+    _size(0), _ngroup(sourceGroup.size())
+{
+    for (SourceGroup::const_iterator it = sourceGroup.begin(); it != sourceGroup.end(); ++it) {
+        _size += it->size();
+    }
+    _group = allocateColumn<int>(_size);
+    _member = allocateColumn<int>(_size);
+    _iexp = allocateColumn<ExpType>(_size);
+    _ichip = allocateColumn<ChipType>(_size);
+    _x = allocateColumn<double>(_size);
+    _y = allocateColumn<double>(_size);
+    _ra = allocateColumn<double>(_size);
+    _dec = allocateColumn<double>(_size);
+    _flux = allocateColumn<double>(_size);
+    _fluxErr = allocateColumn<double>(_size);
+
+    int i = 0;
+    for (int g = 0; g < _ngroup; g++) {
+        std::vector<PTR(Source)> const & ss = sourceGroup[g];
+        for (size_t j = 0; j < ss.size(); j++, i++) {
+            Source const & s = *ss[j];
+            _group[i] = g;
+            _member[i] = j;
+            _iexp[i] = s.getExp();
+            _ichip[i] = s.getChip();
+            _x[i] = s.getX();
+            _y[i] = s.getY();
+            _ra[i] = s.getRa().asDegrees();
+            _dec[i] = s.getDec().asDegrees();
+            _flux[i] = s.getFlux();
+            _fluxErr[i] = s.getFluxErr();
+        }
+    }
+}
+
+StatisticsColumns::StatisticsColumns(SolveStatistics const & stats) :
+    _expId(copyColumn(stats.expId)),
+    _expRms(copyColumn(stats.expRms)), _expFluxRms(copyColumn(stats.expFluxRms)),
+    _expNObs(copyColumn(stats.expNObs)), _expNReject(copyColumn(stats.expNReject)),
+    _expFluxNObs(copyColumn(stats.expFluxNObs)), _expFluxNReject(copyColumn(stats.expFluxNReject)),
+    _chipId(copyColumn(stats.chipId)),
+    _chipRms(copyColumn(stats.chipRms)), _chipFluxRms(copyColumn(stats.chipFluxRms)),
+    _chipNObs(copyColumn(stats.chipNObs)), _chipNReject(copyColumn(stats.chipNReject)),
+    _chipFluxNObs(copyColumn(stats.chipFluxNObs)), _chipFluxNReject(copyColumn(stats.chipFluxNReject))
+{
+}
+
+/* The length of two columns that go together, which must be the same */
+static int checkSameSize(ndarray::Array<double const,1,1> const & a,
+                         ndarray::Array<double const,1,1> const & b,
+                         char const * names) {
+    if (a.getSize<0>() != b.getSize<0>()) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthErrorException,
+                          (boost::format("%s have lengths %d and %d") %
+                           names % a.getSize<0>() % b.getSize<0>()).str());
+    }
+    return a.getSize<0>();
+}
+
+ndarray::Array<double,1,1> evalFluxFitParams(FluxFitParams & ffp,
+                                             ndarray::Array<double const,1,1> const & u,
+                                             ndarray::Array<double const,1,1> const & v) {
+    int const n = checkSameSize(u, v, "u and v");
+    ndarray::Array<double,1,1> val = allocateColumn<double>(n);
+    if (n > 0) {
+        ffp.eval(n, u.getData(), v.getData(), val.getData());
+    }
+    return val;
+}
+
+ndarray::Array<double,2,2> pixelsToSky(lsst::afw::image::Wcs::Ptr const & wcs,
+                                       ndarray::Array<double const,1,1> const & x,
+                                       ndarray::Array<double const,1,1> const & y) {
+    int const n = checkSameSize(x, y, "x and y");
+    ndarray::Array<double,2,2> sky = allocateTable(n, 2);
+    for (int i = 0; i < n; i++) {
+        afw::geom::Point2D const p = wcs->pixelToSky(x[i], y[i])->getPosition(afw::geom::degrees);
+        sky[i][0] = p.getX();
+        sky[i][1] = p.getY();
+    }
+    return sky;
+}
+
+}}} // namespace lsst::meas::mosaic
@@ -0,0 +1,167 @@
+#include <cstdarg>
+#include <cstdio>
+#include <sys/time.h>
+#include "lsst/pex/logging/Log.h"
+#include "lsst/meas/mosaic/metrics.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+Metrics::Ptr Metrics::get() {
+    static Metrics::Ptr const instance(new Metrics());
+    return instance;
+}
+
+void Metrics::reset() {
+    #pragma omp critical(mosaicMetrics)
+    {
+        _time.clear();
+        _calls.clear();
+        _count.clear();
+    }
+}
+
+void Metrics::addTime(std::string const & name, double seconds) {
+    #pragma omp critical(mosaicMetrics)
+    {
+        _time[name] += seconds;
+        _calls[name] += 1;
+    }
+}
+
+void Metrics::addCount(std::string const & name, long n) {
+    #pragma omp critical(mosaicMetrics)
+    _count[name] += n;
+}
+
+void Metrics::setCount(std::string const & name, long n) {
+    #pragma omp critical(mosaicMetrics)
+    _count[name] = n;
+}
+
+std::vector<std::string> Metrics::getTimerNames() const {
+    std::vector<std::string> names;
+    for (std::map<std::string, double>::const_iterator it = _time.begin(); it != _time.end(); ++it) {
+        names.push_back(it->first);
+    }
+    return names;
+}
+
+double Metrics::getTime(std::string const & name) const {
+    std::map<std::string, double>::const_iterator it = _time.find(name);
+    return (it == _time.end()) ? 0.0 : it->second;
+}
+
+int Metrics::getCalls(std::string const & name) const {
+    std::map<std::string, int>::const_iterator it = _calls.find(name);
+    return (it == _calls.end()) ? 0 : it->second;
+}
+
+std::vector<std::string> Metrics::getCounterNames() const {
+    std::vector<std::string> names;
+    for (std::map<std::string, long>::const_iterator it = _count.begin(); it != _count.end(); ++it) {
+        names.push_back(it->first);
+    }
+    return names;
+}
+
+long Metrics::getCount(std::string const & name) const {
+    std::map<std::string, long>::const_iterator it = _count.find(name);
+    return (it == _count.end()) ? 0 : it->second;
+}
+
+SolveControl::SolveControl() :
+    _cancelled(false), _stopped(false), _start(wallTime()), _deadline(0.0), _iteration(0), _chi2(0.0)
+{
+}
+
+void SolveControl::cancel() {
+    boost::mutex::scoped_lock lock(_mutex);
+    _cancelled = true;
+}
+
+void SolveControl::setTimeout(double seconds) {
+    boost::mutex::scoped_lock lock(_mutex);
+    _deadline = (seconds > 0.0) ? wallTime() + seconds : 0.0;
+}
+
+bool SolveControl::isCancelled() const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _cancelled || (_deadline > 0.0 && wallTime() > _deadline);
+}
+
+bool SolveControl::update(std::string const & stage, int iteration, double chi2) {
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        _stage = stage;
+        _iteration = iteration;
+        _chi2 = chi2;
+    }
+    return isCancelled();
+}
+
+void SolveControl::stop() {
+    boost::mutex::scoped_lock lock(_mutex);
+    _stopped = true;
+}
+
+bool SolveControl::isStopped() const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _stopped;
+}
+
+std::string SolveControl::getStage() const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _stage;
+}
+
+int SolveControl::getIteration() const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _iteration;
+}
+
+double SolveControl::getChi2() const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _chi2;
+}
+
+double SolveControl::getElapsed() const {
+    return wallTime() - _start;
+}
+
+double wallTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+
+ScopedTimer::ScopedTimer(char const * name, bool active) :
+    _name(active ? name : NULL), _start(wallTime())
+{
+}
+
+ScopedTimer::~ScopedTimer() {
+    stop();
+}
+
+void ScopedTimer::stop() {
+    if (_name != NULL) {
+        Metrics::get()->addTime(_name, wallTime() - _start);
+        _name = NULL;
+    }
+}
+
+void mosaicLog(int importance, char const * fmt, ...) {
+    static pex::logging::Log log(pex::logging::Log::getDefaultLog(), "meas.mosaic");
+    if (!log.sends(importance)) return;
+
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    #pragma omp critical(mosaicLog)
+    log.log(importance, buf);
+}
+
+}}} // namespace lsst::meas::mosaic
@@ -5,6 +5,10 @@
 #include "lsst/utils/ieee.h"
 #include "lsst/meas/mosaic/mosaicfit.h"
 #include "lsst/meas/mosaic/snapshot.h"
+#include "lsst/meas/mosaic/checkpoint.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/pex/logging/Log.h"
+#include "lsst/pex/exceptions.h"
 #include "lsst/afw/coord/Coord.h"
 #include "lsst/afw/table/Match.h"
 #include "boost/make_shared.hpp"
@@ -15,6 +19,7 @@
 #define R2D (180./M_PI)
 
 using namespace lsst::meas::mosaic;
+namespace pexLog = lsst::pex::logging;
 
 #ifdef USE_MKL
 #include <mkl_lapack.h>
@@ -22,7 +27,6 @@ using namespace lsst::meas::mosaic;
 #include "Eigen/Core"
 #include "Eigen/LU"
 #endif
-double* solveMatrix(long size, double *a_data, double *b_data);
 
 static void decodeSipHeader(CONST_PTR(lsst::daf::base::PropertySet) const& fitsMetadata,
                             std::string const& which,
@@ -469,22 +473,86 @@ FluxFitParams::FluxFitParams(const FluxFitParams &p) {
     }
 }
 
+/*
+ * Points are evaluated in blocks of evalBlock; the T_n (or power) tables
+ * of a block live on the stack up to maxTableOrder.
+ */
+static int const evalBlock = 16;
+static int const maxTableOrder = 32;
+
+static void fillTable(bool chebyshev, int order, double x, double *t, int stride)
+{
+    t[0] = 1.0;
+    if (order == 0) return;
+    t[stride] = x;
+    for (int l = 2; l <= order; l++) {
+	if (chebyshev) {
+	    t[l*stride] = 2.0 * x * t[(l-1)*stride] - t[(l-2)*stride];
+	} else {
+	    t[l*stride] = x * t[(l-1)*stride];
+	}
+    }
+}
+
 double FluxFitParams::eval(double u, double v) {
-   double uu = (u + x0) / u_max;
-   double vv = (v + y0) / v_max;
-   double val = 0.0;
+   double val;
+   this->eval(1, &u, &v, &val);
+   return val;
+}
 
-   if (this->chebyshev) {
-      for (int k = 0; k < ncoeff; k++) {
-	 val += coeff[k] * Tn(xorder[k], uu) * Tn(yorder[k], vv);
+std::vector<double> FluxFitParams::eval(std::vector<double> const &u,
+					std::vector<double> const &v) {
+   assert(u.size() == v.size());
+   std::vector<double> val(u.size());
+   if (!val.empty()) {
+      this->eval(val.size(), &u[0], &v[0], &val[0]);
+   }
+   return val;
+}
+
+void FluxFitParams::eval(int n, double const *u, double const *v, double *val) {
+   double buf[2*(maxTableOrder+1)*evalBlock];
+   std::vector<double> heap;
+   double *tu = buf;
+   if (order > maxTableOrder) {
+      heap.resize(2*(order+1)*evalBlock);
+      tu = &heap[0];
+   }
+   double *tv = tu + (order+1)*evalBlock;
+
+   for (int i0 = 0; i0 < n; i0 += evalBlock) {
+      int nb = std::min(evalBlock, n - i0);
+      for (int b = 0; b < nb; b++) {
+	 fillTable(chebyshev, order, (u[i0+b] + x0) / u_max, &tu[b], evalBlock);
+	 fillTable(chebyshev, order, (v[i0+b] + y0) / v_max, &tv[b], evalBlock);
+	 val[i0+b] = 0.0;
       }
-   } else {
       for (int k = 0; k < ncoeff; k++) {
-	 val += coeff[k] * pow(uu, xorder[k]) * pow(vv, yorder[k]);
+	 double c = coeff[k];
+	 double const *pu = &tu[xorder[k]*evalBlock];
+	 double const *pv = &tv[yorder[k]*evalBlock];
+	 for (int b = 0; b < nb; b++) {
+	    val[i0+b] += c * pu[b] * pv[b];
+	 }
       }
    }
+}
+
+void FluxFitParams::evalBasis(double uu, double vv, double *b, int k0) {
+   double buf[2*(maxTableOrder+1)];
+   std::vector<double> heap;
+   double *tu = buf;
+   if (order > maxTableOrder) {
+      heap.resize(2*(order+1));
+      tu = &heap[0];
+   }
+   double *tv = tu + (order+1);
 
-   return val;
+   fillTable(chebyshev, order, uu, tu, 1);
+   fillTable(chebyshev, order, vv, tv, 1);
+   for (int k = k0; k < ncoeff; k++) {
+      b[k-k0] = tu[xorder[k]] * tv[yorder[k]];
+   }
 }
 
 int FluxFitParams::getIndex(int i, int j) {
@@ -870,18 +938,22 @@ void KDTree::add(PTR(Source) s, lsst::afw::geom::Angle d_lim) {
     }
 }
 
-SourceGroup KDTree::mergeMat() const {
+SourceGroup KDTree::mergeMat(SolveControl::Ptr const & control) const {
+    ScopedTimer timer("crossmatch.mergeMat", depth == 0);
     SourceGroup sg;
     sg.push_back(this->set);
 
+    if (control && (depth == 0 ? control->update("mergeMat") : control->isCancelled())) {
+        return sg;
+    }
     if (this->left != NULL) {
-        SourceGroup sg_left = this->left->mergeMat();
+        SourceGroup sg_left = this->left->mergeMat(control);
         for (size_t i = 0; i < sg_left.size(); i++) {
             sg.push_back(sg_left[i]);
         }
     }
     if (this->right != NULL) {
-        SourceGroup sg_right = this->right->mergeMat();
+        SourceGroup sg_right = this->right->mergeMat(control);
         for (size_t i = 0; i < sg_right.size(); i++) {
             sg.push_back(sg_right[i]);
         }
@@ -890,7 +962,8 @@ SourceGroup KDTree::mergeMat() const {
     return sg;
 }
 
-SourceGroup KDTree::mergeSource() {
+SourceGroup KDTree::mergeSource(SolveControl::Ptr const & control) {
+    ScopedTimer timer("crossmatch.mergeSource", depth == 0);
     SourceGroup sg;
     if (this->set.size() >= 2) {
 	double sr = 0.0;
@@ -912,14 +985,17 @@ SourceGroup KDTree::mergeSource() {
 	sg.push_back(this->set);
     }
 
+    if (control && (depth == 0 ? control->update("mergeSource") : control->isCancelled())) {
+	return sg;
+    }
     if (this->left != NULL) {
-	SourceGroup sg_left = this->left->mergeSource();
+	SourceGroup sg_left = this->left->mergeSource(control);
 	for (size_t i = 0; i < sg_left.size(); i++) {
 	    sg.push_back(sg_left[i]);
 	}
     }
     if (this->right != NULL) {
-	SourceGroup sg_right = this->right->mergeSource();
+	SourceGroup sg_right = this->right->mergeSource(control);
 	for (size_t i = 0; i < sg_right.size(); i++) {
 	    sg.push_back(sg_right[i]);
 	}
@@ -969,6 +1045,7 @@ void KDTree::printSource() const {
 
 KDTree::Ptr
 lsst::meas::mosaic::kdtreeMat(SourceMatchGroup &matchList) {
+    ScopedTimer timer("crossmatch.kdtreeMat");
 
     KDTree::Ptr root = KDTree::Ptr(new KDTree(matchList[0], 0));
     //std::cout << "root->count() : " << root->count() << std::endl;
@@ -985,11 +1062,31 @@ lsst::meas::mosaic::kdtreeMat(SourceMatchGroup &matchList) {
     return root;
 }
 
+/*
+ * Add s to the group of its nearest neighbour in the source tree if that
+ * is within d_lim, or else as a new node.
+ */
+static void mergeSource(KDTree::Ptr &rootSource, PTR(Source) const &s, lsst::afw::geom::Angle d_lim)
+{
+    if (rootSource) {
+	KDTree::Ptr leaf = rootSource->findNearest(*s);
+	if (leaf->distance(*s) < d_lim) {
+	    leaf->set.push_back(s);
+	} else {
+	    rootSource->add(s);
+	}
+    } else {
+	rootSource = KDTree::Ptr(new KDTree(s, 0));
+    }
+}
+
 KDTree::Ptr
 lsst::meas::mosaic::kdtreeSource(SourceGroup const &sourceSet,
 				 KDTree::Ptr rootMat,
 				 CcdSet &ccdSet,
-				 lsst::afw::geom::Angle d_lim, unsigned int nbrightest) {
+				 lsst::afw::geom::Angle d_lim, unsigned int nbrightest,
+				 SolveControl::Ptr const & control) {
+    ScopedTimer timer("crossmatch.kdtreeSource");
     int nchip = ccdSet.size();
     double fluxlim[sourceSet.size()*nchip];
 
@@ -1033,6 +1130,11 @@ lsst::meas::mosaic::kdtreeSource(SourceGroup const &sourceSet,
 
     //std::cout << "(3) " << rootSource->count() << std::endl;
     for (size_t j = 1; j < sourceSet.size(); j++) {
+	if (control && control->update("kdtreeSource", j)) {
+	    mosaicLog(pexLog::Log::WARN, "kdtreeSource cancelled after %d of %d exposures",
+		      static_cast<int>(j), static_cast<int>(sourceSet.size()));
+	    break;
+	}
 	for (size_t i = 0; i < sourceSet[j].size(); i++) {
 	    //int k = sourceSet[j][i]->getChip();
 	    int k = 0;
@@ -1041,16 +1143,7 @@ lsst::meas::mosaic::kdtreeSource(SourceGroup const &sourceSet,
 	    }
 	    if (sourceSet[j][i]->getFlux() >= fluxlim[j*nchip+k] &&
 		rootMat->findSource(*sourceSet[j][i]) == NULL) {
-                if (rootSource) {
-                    KDTree::Ptr leaf = rootSource->findNearest(*sourceSet[j][i]);
-                    if (leaf->distance(*sourceSet[j][i]) < d_lim) {
-                        leaf->set.push_back(sourceSet[j][i]);
-                    } else {
-                        rootSource->add(sourceSet[j][i]);
-                    }
-                } else {
-                    rootSource = KDTree::Ptr(new KDTree(sourceSet[j][i], 0));
-                }
+		mergeSource(rootSource, sourceSet[j][i], d_lim);
 	    }
 	}
 	//std::cout << "(3) " << rootSource->count() << std::endl;
@@ -1060,6 +1153,105 @@ lsst::meas::mosaic::kdtreeSource(SourceGroup const &sourceSet,
     return rootSource;
 }
 
+CatalogMerger::CatalogMerger(lsst::afw::geom::Angle d_lim, unsigned int nbrightest) :
+    _d_lim(d_lim), _nbrightest(nbrightest),
+    _matchRootDone(false), _sourceRootDone(false), _sourceRootStarted(false),
+    _matchRootExp(0), _sourceRootExp(0)
+{
+}
+
+void CatalogMerger::_buildMatchRoot() {
+    _matchRootDone = true;
+    if (!_matchRootSet.empty()) {
+	_rootMat = KDTree::Ptr(new KDTree(_matchRootSet, 0));
+    }
+    SourceMatchSet().swap(_matchRootSet);
+}
+
+void CatalogMerger::_buildSourceRoot() {
+    _sourceRootDone = true;
+    if (!_sourceRootSet.empty()) {
+	_rootSource = KDTree::Ptr(new KDTree(_sourceRootSet, 0));
+    }
+    SourceSet().swap(_sourceRootSet);
+}
+
+KDTree::Ptr CatalogMerger::getMatchTree() {
+    if (!_matchRootDone) _buildMatchRoot();
+    return _rootMat;
+}
+
+KDTree::Ptr CatalogMerger::getSourceTree() {
+    if (!_sourceRootDone) _buildSourceRoot();
+    return _rootSource;
+}
+
+void CatalogMerger::addMatches(ExpType iexp, SourceMatchSet const &matches) {
+    ScopedTimer timer("crossmatch.kdtreeMat");
+
+    // As kdtreeMat, the root is the first exposure with matches
+    if (!_matchRootDone) {
+	if (_matchRootSet.empty() || iexp == _matchRootExp) {
+	    _matchRootExp = iexp;
+	    _matchRootSet.insert(_matchRootSet.end(), matches.begin(), matches.end());
+	    return;
+	}
+	_buildMatchRoot();
+    }
+    for (size_t i = 0; i < matches.size(); i++) {
+	if (!_rootMat) {
+	    _rootMat = KDTree::Ptr(new KDTree(matches[i], 0));
+	} else {
+	    _rootMat->add(matches[i]);
+	}
+    }
+}
+
+void CatalogMerger::addSources(ExpType iexp, SourceSet const &sources) {
+    ScopedTimer timer("crossmatch.kdtreeSource");
+
+    if (!_matchRootDone) _buildMatchRoot();
+
+    // Flux of the nbrightest-th source of each chip in the batch
+    std::map<ChipType, std::vector<double> > fluxes;
+    for (size_t i = 0; i < sources.size(); i++) {
+	fluxes[sources[i]->getChip()].push_back(sources[i]->getFlux());
+    }
+    std::map<ChipType, double> fluxlim;
+    for (std::map<ChipType, std::vector<double> >::iterator it = fluxes.begin(); it != fluxes.end(); it++) {
+	std::vector<double> &v = it->second;
+	if (_nbrightest < v.size()) {
+	    std::sort(v.begin(), v.end(), std::greater<double>());
+	    fluxlim[it->first] = v[_nbrightest-1];
+	} else {
+	    fluxlim[it->first] = 0.0;
+	}
+    }
+
+    SourceSet set;
+    for (size_t i = 0; i < sources.size(); i++) {
+	if (sources[i]->getFlux() >= fluxlim[sources[i]->getChip()] &&
+	    (!_rootMat || _rootMat->findSource(*sources[i]) == NULL)) {
+	    set.push_back(sources[i]);
+	}
+    }
+
+    // As kdtreeSource, the root is the first exposure, even if none of
+    // its sources are left
+    if (!_sourceRootDone) {
+	if (!_sourceRootStarted || iexp == _sourceRootExp) {
+	    _sourceRootStarted = true;
+	    _sourceRootExp = iexp;
+	    _sourceRootSet.insert(_sourceRootSet.end(), set.begin(), set.end());
+	    return;
+	}
+	_buildSourceRoot();
+    }
+    for (size_t i = 0; i < set.size(); i++) {
+	mergeSource(_rootSource, set[i], _d_lim);
+    }
+}
+
 double calXi(double a, double d, double A, double D) {
     return cos(d)*sin(a-A)/(sin(D)*sin(d)+cos(D)*cos(d)*cos(a-A));
 }
@@ -1106,76 +1298,92 @@ double calEta_D(double a, double d, double A, double D) {
     return -pow(cos(D)*sin(d)-sin(D)*cos(d)*cos(a-A),2.)/pow(sin(D)*sin(d)+cos(D)*cos(d)*cos(a-A),2.)-1.;
 }
 
-#ifdef USE_MKL
-double* solveMatrix_MKL(long size, double *a_data, double *b_data) {
-    //char L = 'L';
-    MKL_INT n = size;
-    MKL_INT nrhs = 1;
-    MKL_INT lda = size;
-    MKL_INT *ipiv = new MKL_INT[size];
-    MKL_INT ldb = size;
-    MKL_INT info = 0;
-
-    //double *a = new double[size*size];
-    //double *b = new double[size];
+/*
+ * Buffers of the normal equations a x = b of the solvers, owned across the
+ * iterations and the astrometric and photometric phases of a solve.  They
+ * grow to the largest system met and are only zeroed for the next one, and
+ * solve() factors the matrix in place and leaves x in the right hand side,
+ * so a solve costs neither a new matrix nor a copy of it.  A workspace must
+ * not be shared between threads.
+ */
+class SolverWorkspace {
+public:
+    SolverWorkspace() : _n(0), _nrhs(1) {}
 
-    //memcpy(a, a_data, sizeof(double)*size*size);
-    //memcpy(b, b_data, sizeof(double)*size);
+    // Zeroed n x n matrix (column-major) and n x nrhs right hand side
+    double *matrix(long n) {
+	_n = n;
+	_a.assign(n*n, 0.0);
+	return &_a[0];
+    }
+    double *rhs(long n, int nrhs=1) {
+	_nrhs = nrhs;
+	_b.assign(n*nrhs, 0.0);
+	return &_b[0];
+    }
 
-    //dgesv(&n, &nrhs, a, &lda, ipiv, b, &ldb, &info);
-    dgesv(&n, &nrhs, a_data, &lda, ipiv, b_data, &ldb, &info);
-    //dposv(&L, &n, &nrhs, a, &lda, b, &ldb, &info);
+    // Scratch space for the polynomial terms in u and v
+    double *pu(int n) { _pu.resize(n); return &_pu[0]; }
+    double *pv(int n) { _pv.resize(n); return &_pv[0]; }
 
-    double *c_data = new double[size];
-    //memcpy(c_data, b, sizeof(double)*size);
-    memcpy(c_data, b_data, sizeof(double)*size);
+    // Overwrites the matrix with its factors and the right hand side with x
+    double *solve();
 
-    delete [] ipiv;
-    //delete [] a;
-    //delete [] b;
+    // Copy of x for callers that keep it past the next solve
+    double *solution() const {
+	double *x = new double[_n*_nrhs];
+	std::copy(_b.begin(), _b.begin() + _n*_nrhs, x);
+	return x;
+    }
 
-    return c_data;
-}
-#else
-double* solveMatrix_Eigen(long size, double *a_data, double *b_data) {
-    Eigen::Map<Eigen::MatrixXd> a(a_data, size, size);
-    Eigen::Map<Eigen::VectorXd> b(b_data, size);
-    double *c_data = new double[size];
-    Eigen::Map<Eigen::VectorXd> c(c_data, size);
-    Eigen::PartialPivLU<Eigen::MatrixXd> lu(a);
-    c = lu.solve(b);
-    return c_data;
-}
+private:
+    long _n;
+    int _nrhs;
+    std::vector<double> _a;
+    std::vector<double> _b;
+    std::vector<double> _pu;
+    std::vector<double> _pv;
+#ifdef USE_MKL
+    std::vector<MKL_INT> _ipiv;
+#elif !EIGEN_VERSION_AT_LEAST(3,3,0)
+    Eigen::PartialPivLU<Eigen::MatrixXd> _lu;
 #endif
+};
 
-double* solveMatrix(long size, double *a_data, double *b_data) {
+double *SolverWorkspace::solve() {
 #ifdef USE_MKL
-    return solveMatrix_MKL(size, a_data, b_data);
+    MKL_INT n = _n;
+    MKL_INT nrhs = _nrhs;
+    MKL_INT info = 0;
+    _ipiv.resize(_n);
+    dgesv(&n, &nrhs, &_a[0], &n, &_ipiv[0], &_b[0], &n, &info);
+#else
+    Eigen::Map<Eigen::MatrixXd> a(&_a[0], _n, _n);
+    Eigen::Map<Eigen::MatrixXd> b(&_b[0], _n, _nrhs);
+#if EIGEN_VERSION_AT_LEAST(3,3,0)
+    Eigen::PartialPivLU<Eigen::Ref<Eigen::MatrixXd> > lu(a);
+    b = lu.solve(b);
 #else
-    return solveMatrix_Eigen(size, a_data, b_data);
+    // No in-place decomposition before Eigen 3.3; at least keep its storage
+    _lu.compute(a);
+    b = _lu.solve(b);
 #endif
+#endif
+    return &_b[0];
 }
     
 
-double* solveForCoeff(std::vector<Obs::Ptr>& objList, Poly::Ptr p) {
+double* solveForCoeff(std::vector<Obs::Ptr>& objList, Poly::Ptr p, SolverWorkspace &ws) {
     int ncoeff = p->ncoeff;
     int size = 2 * ncoeff + 2;
 
     int *xorder = p->xorder;
     int *yorder = p->yorder;
 
-    double *a_data = new double[size*size];
-    double *b_data = new double[size];
-
-    for (int j = 0; j < size; j++) {
-	b_data[j] = 0.0;
-	for (int i = 0; i < size; i++) {
-	    a_data[i+j*size] = 0.0;
-	}
-    }
-
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    double *a_data = ws.matrix(size);
+    double *b_data = ws.rhs(size);
+    double *pu = ws.pu(ncoeff);
+    double *pv = ws.pv(ncoeff);
 
     for (size_t k = 0; k < objList.size(); k++) {
 	Obs::Ptr o = objList[k];
@@ -1209,17 +1417,13 @@ double* solveForCoeff(std::vector<Obs::Ptr>& objList, Poly::Ptr p) {
 	}
     }
 
-    double *coeff = solveMatrix(size, a_data, b_data);
-
-    delete [] a_data;
-    delete [] b_data;
-    delete [] pu;
-    delete [] pv;
+    ws.solve();
 
-    return coeff;
+    return ws.solution();
 }
 
-double* solveForCoeffWithOffset(std::vector<Obs::Ptr>& objList, Coeff::Ptr& c, Poly::Ptr p) {
+double* solveForCoeffWithOffset(std::vector<Obs::Ptr>& objList, Coeff::Ptr& c, Poly::Ptr p,
+				SolverWorkspace &ws) {
     int ncoeff = p->ncoeff;
     int size = 2 * ncoeff + 2;
 
@@ -1229,18 +1433,10 @@ double* solveForCoeffWithOffset(std::vector<Obs::Ptr>& objList, Coeff::Ptr& c, P
     double *a = c->a;
     double *b = c->b;
 
-    double *a_data = new double[size*size];
-    double *b_data = new double[size];
-
-    for (int j = 0; j < size; j++) {
-	b_data[j] = 0.0;
-	for (int i = 0; i < size; i++) {
-	    a_data[i+j*size] = 0.0;
-	}
-    }
-
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    double *a_data = ws.matrix(size);
+    double *b_data = ws.rhs(size);
+    double *pu = ws.pu(ncoeff);
+    double *pv = ws.pv(ncoeff);
 
     for (size_t i = 0; i < objList.size(); i++) {
 	Obs::Ptr o = objList[i];
@@ -1294,14 +1490,9 @@ double* solveForCoeffWithOffset(std::vector<Obs::Ptr>& objList, Coeff::Ptr& c, P
 	}
     }
 
-    double *coeff = solveMatrix(size, a_data, b_data);
-
-    delete [] a_data;
-    delete [] b_data;
-    delete [] pu;
-    delete [] pv;
+    ws.solve();
 
-    return coeff;
+    return ws.solution();
 }
 
 double calcChi(std::vector<Obs::Ptr>& objList, double *a, Poly::Ptr p) {
@@ -1356,17 +1547,19 @@ double flagObj(std::vector<Obs::Ptr>& objList, double *a, Poly::Ptr p, double e2
 	    //o->good = true;
 	}
     }
-    printf("nrejected = %d\n", nrejected);
+    mosaicLog(pexLog::Log::DEBUG, "nrejected = %d", nrejected);
 
     return chi2;
 }
 
 double *
 solveLinApprox(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, int nchip, Poly::Ptr p,
+	       SolverWorkspace &ws,
 	       bool solveCcd=true,
 	       bool allowRotation=true,
 	       double catRMS=0.0)
 {
+    ScopedTimer assembly("astrom.assembly");
     int nobs  = o.size();
     int nexp = coeffVec.size();
 
@@ -1399,18 +1592,10 @@ solveLinApprox(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, int nchip, Poly::Pt
     } else {
 	size = 2 * ncoeff * nexp;
     }
-    double *a_data = new double[size*size];
-    double *b_data = new double[size];
-
-    for (ExpType j = 0; j < size; j++) {
-	b_data[j] = 0.0;
-	for (long i = 0; i < size; i++) {
-	    a_data[i+j*size] = 0.0;
-	}
-    }
-
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    double *a_data = ws.matrix(size);
+    double *b_data = ws.rhs(size);
+    double *pu = ws.pu(ncoeff);
+    double *pv = ws.pv(ncoeff);
 
     double isx2 = 1.0;
     double isy2 = 1.0;
@@ -1541,12 +1726,277 @@ solveLinApprox(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, int nchip, Poly::Pt
 //    delete [] a;
 //    delete [] b;
 
-    double *coeff = solveMatrix(size, a_data, b_data);
+    assembly.stop();
+    Metrics::get()->setCount("astrom.ndim", size);
+    ScopedTimer factorisation("astrom.factorisation");
+    ws.solve();
+
+    return ws.solution();
+}
+
+/*
+ * The xi (row 0) and eta (row 1) rows of the linearised astrometric fit
+ * for measurement o.  The entries by the exposure and chip parameters of
+ * row r are idx/val[r*n, r*n+n) with n = ncoeff + np; star holds the
+ * derivatives by the star position (zero for catalog matches), resid the
+ * residual and weight its inverse variance.  Returns n.
+ */
+static int astromDesignRows(Obs const *o, double const *a, double const *b,
+			    Poly::Ptr const &p, int nexp, int np, double catRMS,
+			    int *idx, double *val, double star[2][2],
+			    double resid[2], double weight[2])
+{
+    int ncoeff = p->ncoeff;
+    int *xorder = p->xorder;
+    int *yorder = p->yorder;
+    int n = ncoeff + np;
+
+    double Ax = o->xi;
+    double Ay = o->eta;
+    double Bx = 0.0, By = 0.0, Cx = 0.0, Cy = 0.0, Dx = 0.0, Dy = 0.0;
+    for (int k = 0; k < ncoeff; k++) {
+	double puv = pow(o->u, xorder[k]) * pow(o->v, yorder[k]);
+	Ax -= a[k] * puv;
+	Ay -= b[k] * puv;
+	Bx += a[k] * pow(o->u, xorder[k]-1) * pow(o->v, yorder[k]) * xorder[k];
+	By += b[k] * pow(o->u, xorder[k]-1) * pow(o->v, yorder[k]) * xorder[k];
+	Cx += a[k] * pow(o->u, xorder[k]) * pow(o->v, yorder[k]-1) * yorder[k];
+	Cy += b[k] * pow(o->u, xorder[k]) * pow(o->v, yorder[k]-1) * yorder[k];
+	Dx += a[k] * pow(o->u, xorder[k]-1) * pow(o->v, yorder[k]-1) * (-xorder[k]*o->v*o->v0+yorder[k]*o->u*o->u0);
+	Dy += b[k] * pow(o->u, xorder[k]-1) * pow(o->v, yorder[k]-1) * (-xorder[k]*o->v*o->v0+yorder[k]*o->u*o->u0);
+	idx[k]   = k +          ncoeff*2*o->jexp;
+	idx[n+k] = k + ncoeff + ncoeff*2*o->jexp;
+	val[k]   = puv;
+	val[n+k] = puv;
+    }
+    double dxi  = Bx * o->xerr + Cx * o->yerr;
+    double deta = By * o->xerr + Cy * o->yerr;
+    weight[0] = 1.0 / (pow(dxi,  2) + pow(catRMS, 2));
+    weight[1] = 1.0 / (pow(deta, 2) + pow(catRMS, 2));
+    resid[0] = Ax;
+    resid[1] = Ay;
+
+    double dx[3] = {Bx, Cx, Dx};
+    double dy[3] = {By, Cy, Dy};
+    for (int k = 0; k < np; k++) {
+	idx[ncoeff+k]   = ncoeff*2*nexp + o->jchip*np + k;
+	idx[n+ncoeff+k] = ncoeff*2*nexp + o->jchip*np + k;
+	val[ncoeff+k]   = dx[k];
+	val[n+ncoeff+k] = dy[k];
+    }
+
+    if (o->jstar >= 0) {
+	star[0][0] = -o->xi_a;
+	star[0][1] = -o->xi_d;
+	star[1][0] = -o->eta_a;
+	star[1][1] = -o->eta_d;
+    } else {
+	star[0][0] = star[0][1] = star[1][0] = star[1][1] = 0.0;
+    }
+
+    return n;
+}
+
+/*
+ * solveLinApprox_Star with the star positions eliminated.
+ *
+ * Each star position couples only to the measurements of that star, so its
+ * 2x2 block of the normal equations is folded into the exposure/chip system
+ * with a Schur complement while the measurements are accumulated, as in
+ * solveFluxReduced.  Only the system of size size0 is factored; the star
+ * corrections are recovered from it afterwards.  The returned array has the
+ * layout of the full system (size0 + 2 * nstar).
+ */
+static double *
+solveLinApprox_StarReduced(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, int nstar,
+			   std::map<ExpType, double*> &a, std::map<ExpType, double*> &b,
+			   int nexp, int nchip, Poly::Ptr p, int np, long size0,
+			   bool allowRotation, double catRMS, SolverWorkspace &ws,
+			   ScopedTimer &assembly)
+{
+    int nobs  = o.size();
+    int nSobs = s.size();
+    int ncoeff = p->ncoeff;
+
+    double *a_data = ws.matrix(size0);
+    double *b_data = ws.rhs(size0);
+
+    int n2 = 2 * (ncoeff + np);
+    int *idx = new int[n2];
+    double *val = new double[n2];
+    double star[2][2], resid[2], weight[2];
+
+    int numObsGood = 0, numStarGood = 0;
+
+    // Catalog matches enter the normal equations directly
+    for (int i = 0; i < nobs; i++) {
+	if (!o[i]->good) continue;
+	++numObsGood;
+	int n = astromDesignRows(o[i].get(), a[o[i]->iexp], b[o[i]->iexp], p, nexp, np, catRMS,
+				 idx, val, star, resid, weight);
+	for (int r = 0; r < 2; r++) {
+	    int *ir = idx + r*n;
+	    double *vr = val + r*n;
+	    for (int j = 0; j < n; j++) {
+		for (int k = 0; k < n; k++) {
+		    a_data[ir[j]*size0+ir[k]] += vr[j] * vr[k] * weight[r];
+		}
+		b_data[ir[j]] += resid[r] * vr[j] * weight[r];
+	    }
+	}
+    }
+
+    // Measurements of each star, in order of jstar
+    std::vector<int> starStart(nstar+1, 0);
+    for (int i = 0; i < nSobs; i++) {
+	if (!s[i]->good || s[i]->jstar == -1) continue;
+	starStart[s[i]->jstar+1]++;
+    }
+    for (int j = 0; j < nstar; j++) {
+	starStart[j+1] += starStart[j];
+    }
+    std::vector<int> starObs(starStart[nstar]);
+    std::vector<int> fill(starStart.begin(), starStart.end()-1);
+    for (int i = 0; i < nSobs; i++) {
+	if (!s[i]->good || s[i]->jstar == -1) continue;
+	starObs[fill[s[i]->jstar]++] = i;
+    }
+
+    // Inverse of the star block and the star part of the right hand side,
+    // kept for the back substitution
+    std::vector<double> dinv(4*nstar);
+    std::vector<double> bstar(2*nstar);
+
+    // Coupling of the current star to the global parameters
+    double *h0 = new double[size0];
+    double *h1 = new double[size0];
+    bool *touched = new bool[size0];
+    for (long i = 0; i < size0; i++) {
+	h0[i] = h1[i] = 0.0;
+	touched[i] = false;
+    }
+    std::vector<int> hlist;
+
+    for (int js = 0; js < nstar; js++) {
+	double d00 = 0.0, d01 = 0.0, d11 = 0.0;
+	double bs0 = 0.0, bs1 = 0.0;
+	hlist.clear();
+	for (int l = starStart[js]; l < starStart[js+1]; l++) {
+	    Obs const *so = s[starObs[l]].get();
+	    ++numStarGood;
+	    int n = astromDesignRows(so, a[so->iexp], b[so->iexp], p, nexp, np, 0.0,
+				     idx, val, star, resid, weight);
+	    for (int r = 0; r < 2; r++) {
+		int *ir = idx + r*n;
+		double *vr = val + r*n;
+		double w = weight[r];
+		for (int j = 0; j < n; j++) {
+		    for (int k = 0; k < n; k++) {
+			a_data[ir[j]*size0+ir[k]] += vr[j] * vr[k] * w;
+		    }
+		    b_data[ir[j]] += resid[r] * vr[j] * w;
+		    if (!touched[ir[j]]) {
+			touched[ir[j]] = true;
+			hlist.push_back(ir[j]);
+		    }
+		    h0[ir[j]] += vr[j] * star[r][0] * w;
+		    h1[ir[j]] += vr[j] * star[r][1] * w;
+		}
+		d00 += star[r][0] * star[r][0] * w;
+		d01 += star[r][0] * star[r][1] * w;
+		d11 += star[r][1] * star[r][1] * w;
+		bs0 += resid[r] * star[r][0] * w;
+		bs1 += resid[r] * star[r][1] * w;
+	    }
+	}
+
+	// A star without observations, or whose block is singular, is kept
+	// where it is (zero inverse, so no step in the back substitution)
+	double det = d00 * d11 - d01 * d01;
+	if (hlist.empty() || !(det > 0.0)) {
+	    for (int k = 0; k < 4; k++) dinv[4*js+k] = 0.0;
+	    bstar[2*js] = bstar[2*js+1] = 0.0;
+	    for (size_t j = 0; j < hlist.size(); j++) {
+		h0[hlist[j]] = h1[hlist[j]] = 0.0;
+		touched[hlist[j]] = false;
+	    }
+	    continue;
+	}
+	double i00 =  d11 / det;
+	double i01 = -d01 / det;
+	double i11 =  d00 / det;
+	dinv[4*js  ] = i00;
+	dinv[4*js+1] = i01;
+	dinv[4*js+2] = i01;
+	dinv[4*js+3] = i11;
+	bstar[2*js  ] = bs0;
+	bstar[2*js+1] = bs1;
+
+	// Schur complement of the star's 2x2 block
+	double t0 = i00 * bs0 + i01 * bs1;
+	double t1 = i01 * bs0 + i11 * bs1;
+	for (size_t j = 0; j < hlist.size(); j++) {
+	    int jj = hlist[j];
+	    double g0 = i00 * h0[jj] + i01 * h1[jj];
+	    double g1 = i01 * h0[jj] + i11 * h1[jj];
+	    for (size_t k = 0; k < hlist.size(); k++) {
+		int kk = hlist[k];
+		a_data[jj*size0+kk] -= g0 * h0[kk] + g1 * h1[kk];
+	    }
+	    b_data[jj] -= h0[jj] * t0 + h1[jj] * t1;
+	}
+	for (size_t j = 0; j < hlist.size(); j++) {
+	    h0[hlist[j]] = h1[hlist[j]] = 0.0;
+	    touched[hlist[j]] = false;
+	}
+    }
+
+    delete [] h0;
+    delete [] h1;
+    delete [] touched;
+
+    if (allowRotation) {
+	// \Sum d_theta = 0.0
+	for (int i = 0; i < nchip; i++) {
+	    a_data[ncoeff*2*nexp+i*np+2+(ncoeff*2*nexp+nchip*np)*size0] = 1;
+	    a_data[ncoeff*2*nexp+nchip*np+(ncoeff*2*nexp+i*np+2)*size0] = 1;
+	}
+    }
+
+    mosaicLog(pexLog::Log::INFO, "Number good: %d, %d", numObsGood, numStarGood);
+
+    assembly.stop();
+    Metrics::get()->setCount("astrom.ndim", size0);
+    ScopedTimer factorisation("astrom.factorisation");
+    double *x = ws.solve();
+    factorisation.stop();
+
+    // Back substitution: dstar = Dinv (bstar - H^T x)
+    double *coeff = new double[size0+2*nstar];
+    std::copy(x, x + size0, coeff);
+
+    for (int js = 0; js < nstar; js++) {
+	double r0 = bstar[2*js];
+	double r1 = bstar[2*js+1];
+	for (int l = starStart[js]; l < starStart[js+1]; l++) {
+	    Obs const *so = s[starObs[l]].get();
+	    int n = astromDesignRows(so, a[so->iexp], b[so->iexp], p, nexp, np, 0.0,
+				     idx, val, star, resid, weight);
+	    for (int r = 0; r < 2; r++) {
+		double dot = 0.0;
+		for (int j = 0; j < n; j++) {
+		    dot += val[r*n+j] * coeff[idx[r*n+j]];
+		}
+		r0 -= star[r][0] * dot * weight[r];
+		r1 -= star[r][1] * dot * weight[r];
+	    }
+	}
+	coeff[size0+2*js  ] = dinv[4*js  ] * r0 + dinv[4*js+1] * r1;
+	coeff[size0+2*js+1] = dinv[4*js+2] * r0 + dinv[4*js+3] * r1;
+    }
 
-    delete [] a_data;
-    delete [] b_data;
-    delete [] pu;
-    delete [] pv;
+    delete [] idx;
+    delete [] val;
 
     return coeff;
 }
@@ -1554,10 +2004,13 @@ solveLinApprox(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, int nchip, Poly::Pt
 double *
 solveLinApprox_Star(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, int nstar,
 		    CoeffSet coeffVec, int nchip, Poly::Ptr p,
+		    SolverWorkspace &ws,
 		    bool solveCcd=true,
 		    bool allowRotation=true,
-		    double catRMS=0.0)
+		    double catRMS=0.0,
+		    SolverPlan::Backend backend=SolverPlan::DENSE)
 {
+    ScopedTimer assembly("astrom.assembly");
     int nobs  = o.size();
     int nSobs = s.size();
     int nexp = coeffVec.size();
@@ -1596,7 +2049,8 @@ solveLinApprox_Star(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, int nsta
     }
     delete [] num;
     int nstar2 = v_istar.size();
-    std::cout << "nstar: " << nstar2 << std::endl;
+    mosaicLog(pexLog::Log::INFO, "nstar: %d", nstar2);
+    Metrics::get()->setCount("astrom.nstar", nstar2);
 
     for (int i = 0; i < nSobs; i++) {
 	std::vector<int>::iterator it = std::find(v_istar.begin(), v_istar.end(), s[i]->istar);
@@ -1623,33 +2077,33 @@ solveLinApprox_Star(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, int nsta
 	size0 = 2 * ncoeff * nexp;
     }
 
-    std::cout << "size : " << size << std::endl;
+    mosaicLog(pexLog::Log::DEBUG, "size : %ld", size);
+
+    if (backend == SolverPlan::STAR_ELIMINATED) {
+	mosaicLog(pexLog::Log::DEBUG, "size : %ld (%d stars eliminated)", size0, nstar2);
+	return solveLinApprox_StarReduced(o, s, nstar2, a, b, nexp, nchip, p, np, size0,
+					  solveCcd && allowRotation, catRMS, ws, assembly);
+    }
 
     double *a_data;
     double *b_data;
     try {
-	a_data = new double[size*size];
+	a_data = ws.matrix(size);
     } catch (std::bad_alloc) {
-	std::cerr << "Memory allocation error: for a_data" << std::endl;
-	fprintf(stderr, "You need %5.1f GB memory\n", size*size*sizeof(double)/double(1024*1024*1024));
+	mosaicLog(pexLog::Log::FATAL, "Memory allocation error: for a_data");
+	mosaicLog(pexLog::Log::FATAL, "You need %5.1f GB memory",
+		  size*size*sizeof(double)/double(1024*1024*1024));
 	abort();
     }
     try {
-	b_data = new double[size];
+	b_data = ws.rhs(size);
     } catch (std::bad_alloc) {
-	std::cerr << "Memory allocation error: for b_data" << std::endl;
+	mosaicLog(pexLog::Log::FATAL, "Memory allocation error: for b_data");
 	abort();
     }
 
-    for (ExpType j = 0; j < size; j++) {
-	b_data[j] = 0.0;
-	for (ExpType i = 0; i < size; i++) {
-	    a_data[i+j*size] = 0.0;
-	}
-    }
-
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    double *pu = ws.pu(ncoeff);
+    double *pv = ws.pv(ncoeff);
 
     int numObsGood = 0, numStarGood = 0;
 
@@ -1946,224 +2400,519 @@ solveLinApprox_Star(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, int nsta
 	}
     }
 
-    std::cout << "Number good: " << numObsGood << ", " << numStarGood << std::endl;
+    mosaicLog(pexLog::Log::INFO, "Number good: %d, %d", numObsGood, numStarGood);
 
 //    delete [] a;
 //    delete [] b;
 
-    double *coeff = solveMatrix(size, a_data, b_data);
+    assembly.stop();
+    Metrics::get()->setCount("astrom.ndim", size);
+    ScopedTimer factorisation("astrom.factorisation");
+    ws.solve();
 
-    delete [] a_data;
-    delete [] b_data;
-    delete [] pu;
-    delete [] pv;
-
-    return coeff;
+    return ws.solution();
 }
 
-double *fluxFit_rel(std::vector<Obs::Ptr> &m,
-		    int nmatch,
-		    std::vector<Obs::Ptr> &s,
-		    int nsource,
-		    int nexp,
-		    int nchip,
-		    FluxFitParams::Ptr p)
-{
-    int nMobs = m.size();
-    int nSobs = s.size();
+/*
+ * One photometric measurement entering the flux fit.  The model is
+ *
+ *   mag + e[jexp] + c[jchip] + P(u, v) = M[jstar]
+ *
+ * For measurements tied to the catalog (jstar < 0) the catalog magnitude
+ * has already been subtracted from mag and the right hand side is zero.
+ */
+struct FluxTerm {
+    Obs *o;
+    double mag;
+    double is2;
+    int jstar;
+    int iobs;	// index of o in the matches followed by the sources
+};
 
-    int* num = new int[nmatch+nsource];
-    for (int i = 0; i < nmatch+nsource; i++) {
-	num[i] = 0;
-    }
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->good && m[i]->mag != -9999 && m[i]->err != -9999) {
-	    num[m[i]->istar] += 1;
+/*
+ * The measurements of a flux fit together with their polynomial basis
+ * values, which are evaluated once and reused by every (re)weighted solve.
+ * terms[0, nfixed) are tied to the catalog; the measurements of star j
+ * follow in terms[starStart[j], starStart[j+1]).
+ */
+struct FluxSystem {
+    int nexp;
+    int nchip;
+    int ncoeff;
+    int nfixed;
+    std::vector<FluxTerm> terms;
+    std::vector<int> starStart;
+    std::vector<double> basis;	// ncoeff values per term
+
+    int nstar() const { return starStart.size() - 1; }
+    int ng() const { return nexp + nchip + ncoeff; }
+
+    // Take the basis from basisCache (indexed by iobs) if given
+    void setBasis(FluxFitParams::Ptr const &p, std::vector<double> const *basisCache) {
+	basis.resize(terms.size() * ncoeff);
+	for (size_t i = 0; i < terms.size(); i++) {
+	    if (basisCache) {
+		std::copy(&(*basisCache)[terms[i].iobs*ncoeff],
+			  &(*basisCache)[terms[i].iobs*ncoeff] + ncoeff, &basis[i*ncoeff]);
+	    } else {
+		p->evalBasis(terms[i].o->u / p->u_max, terms[i].o->v / p->v_max,
+			     &basis[i*ncoeff], 3);	// Fit from 2nd order only
+	    }
 	}
     }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->good && s[i]->mag != -9999 && s[i]->err != -9999) {
-	    num[nmatch+s[i]->istar] += 1;
+
+    // Non-zero entries of the design row of term i
+    int designRow(int i, int *idx, double *val) const {
+	idx[0] = terms[i].o->jexp;
+	val[0] = 1.0;
+	idx[1] = nexp + terms[i].o->jchip;
+	val[1] = 1.0;
+	for (int k = 0; k < ncoeff; k++) {
+	    idx[2+k] = nexp + nchip + k;
+	    val[2+k] = basis[i*ncoeff+k];
 	}
+	return ncoeff + 2;
     }
-    std::vector<int> v_istar;
-    for (int i = 0; i < nmatch+nsource; i++) {
-	if (num[i] >= 2) {
-	    v_istar.push_back(i);
+};
+
+/*
+ * Solve the flux fit with the star magnitudes eliminated, weighting term i
+ * by w[i].
+ *
+ * Each star magnitude couples only to the measurements of that star, so
+ * its block of the normal equations is diagonal and can be folded into
+ * the exposure/chip/polynomial system with a Schur complement while the
+ * measurements are accumulated.  Only the small system of size
+ * nexp + nchip + ncoeff (plus the Lagrange multipliers) is factored; the
+ * star magnitudes are recovered afterwards as weighted means of the
+ * corrected measurements.
+ *
+ * If fixFirstExp is set the zero point of the first exposure is held at 0,
+ * and the chip zero points always sum to 0.
+ *
+ * The returned array has the layout of the full system:
+ * exposures, chips, polynomial, stars, Lagrange multipliers.
+ */
+double *solveFluxReduced(FluxSystem const &sys,
+			 std::vector<double> const &w,
+			 bool fixFirstExp,
+			 SolverWorkspace &ws)
+{
+    int nstar = sys.nstar();
+    int ng = sys.ng();
+    int ncon = fixFirstExp ? 2 : 1;
+    int ndim = ng + ncon;
+    ScopedTimer assembly("flux.assembly");
+    mosaicLog(pexLog::Log::INFO, "ndim: %d (%d stars eliminated)", ndim, nstar);
+    Metrics::get()->setCount("flux.ndim", ndim);
+    Metrics::get()->setCount("flux.nstar", nstar);
+
+    double *a_data = ws.matrix(ndim);
+    double *b_data = ws.rhs(ndim);
+
+    int *idx = new int[sys.ncoeff+2];
+    double *val = new double[sys.ncoeff+2];
+
+    // Measurements tied to the catalog enter the normal equations directly
+    for (int i = 0; i < sys.nfixed; i++) {
+	int n = sys.designRow(i, idx, val);
+	for (int j = 0; j < n; j++) {
+	    for (int k = 0; k < n; k++) {
+		a_data[idx[j]*ndim+idx[k]] += val[j] * val[k] * w[i];
+	    }
+	    b_data[idx[j]] -= sys.terms[i].mag * val[j] * w[i];
 	}
     }
-    delete [] num;
-    int nstar = v_istar.size();
-    std::cout << "nstar: " << nstar << std::endl;
 
-    for (int i = 0; i < nMobs; i++) {
-	std::vector<int>::iterator it = std::find(v_istar.begin(), v_istar.end(), m[i]->istar);
-	if (it != v_istar.end()) {
-	    m[i]->jstar = it - v_istar.begin();
-	} else {
-	    m[i]->jstar = -1;
-	}
+    // Coupling of the current star to the global parameters
+    double *h = new double[ng];
+    bool *touched = new bool[ng];
+    for (int i = 0; i < ng; i++) {
+	h[i] = 0.0;
+	touched[i] = false;
     }
-    for (int i = 0; i < nSobs; i++) {
-	std::vector<int>::iterator it = std::find(v_istar.begin(), v_istar.end(), nmatch+s[i]->istar);
-	if (it != v_istar.end()) {
-	    s[i]->jstar = it - v_istar.begin();
-	} else {
-	    s[i]->jstar = -1;
+    std::vector<int> hlist;
+
+    for (int js = 0; js < nstar; js++) {
+	double W = 0.0;
+	double S = 0.0;
+	hlist.clear();
+	for (int i = sys.starStart[js]; i < sys.starStart[js+1]; i++) {
+	    if (w[i] == 0.0) continue;
+	    int n = sys.designRow(i, idx, val);
+	    for (int j = 0; j < n; j++) {
+		for (int k = 0; k < n; k++) {
+		    a_data[idx[j]*ndim+idx[k]] += val[j] * val[k] * w[i];
+		}
+		b_data[idx[j]] -= sys.terms[i].mag * val[j] * w[i];
+		if (!touched[idx[j]]) {
+		    touched[idx[j]] = true;
+		    hlist.push_back(idx[j]);
+		}
+		h[idx[j]] += val[j] * w[i];
+	    }
+	    W += w[i];
+	    S += sys.terms[i].mag * w[i];
+	}
+
+	// Schur complement of the star's diagonal entry
+	for (size_t j = 0; j < hlist.size(); j++) {
+	    int jj = hlist[j];
+	    for (size_t k = 0; k < hlist.size(); k++) {
+		int kk = hlist[k];
+		a_data[jj*ndim+kk] -= h[jj] * h[kk] / W;
+	    }
+	    b_data[jj] += h[jj] * S / W;
+	}
+	for (size_t j = 0; j < hlist.size(); j++) {
+	    h[hlist[j]] = 0.0;
+	    touched[hlist[j]] = false;
 	}
     }
 
-    int ncoeff = p->ncoeff - 3;	// Fit from 2nd order only
-    int *xorder = &p->xorder[3];
-    int *yorder = &p->yorder[3];
-    double u_max = p->u_max;
-    double v_max = p->v_max;
+    delete [] h;
+    delete [] touched;
 
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    int icon = ng;
+    if (fixFirstExp) {
+	a_data[icon] = 1;
+	a_data[icon*ndim] = 1;
+	icon++;
+    }
+    for (int i = 0; i < sys.nchip; i++) {
+	a_data[(sys.nexp+i)*ndim+icon] = 1;
+	a_data[icon*ndim+(sys.nexp+i)] = 1;
+    }
 
-    int ndim = nexp + nchip + ncoeff + nstar + 2;
-    std::cout << "ndim: " << ndim << std::endl;
+    assembly.stop();
+    ScopedTimer factorisation("flux.factorisation");
+    double *x = ws.solve();
+    factorisation.stop();
 
-    double *a_data = new double[ndim*ndim];
-    double *b_data = new double[ndim];
+    double *solution = new double[ng+nstar+ncon];
+    for (int i = 0; i < ng; i++) {
+	solution[i] = x[i];
+    }
+    for (int i = 0; i < ncon; i++) {
+	solution[ng+nstar+i] = x[ng+i];
+    }
 
-    for (int i = 0; i < ndim; i++) {
-	for (int j = 0; j < ndim; j++) {
-	    a_data[i*ndim+j] = 0.0;
+    // Back substitution: weighted mean of the corrected measurements.
+    // A star whose measurements all have zero weight falls back to the
+    // error weights.
+    for (int js = 0; js < nstar; js++) {
+	double W = 0.0;
+	double S = 0.0;
+	double W0 = 0.0;
+	double S0 = 0.0;
+	for (int i = sys.starStart[js]; i < sys.starStart[js+1]; i++) {
+	    int n = sys.designRow(i, idx, val);
+	    double corr = sys.terms[i].mag;
+	    for (int j = 0; j < n; j++) {
+		corr += val[j] * x[idx[j]];
+	    }
+	    W += w[i];
+	    S += corr * w[i];
+	    W0 += sys.terms[i].is2;
+	    S0 += corr * sys.terms[i].is2;
 	}
-	b_data[i] = 0.0;
+	solution[ng+js] = (W > 0.0) ? S / W : S0 / W0;
     }
 
-    double is2 = 1.0;
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 || m[i]->err == -9999) continue;
+    delete [] idx;
+    delete [] val;
 
-	if (p->chebyshev) {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = Tn(xorder[k], m[i]->u/u_max);
-	      pv[k] = Tn(yorder[k], m[i]->v/v_max);
-	   }
-	} else {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = pow(m[i]->u/u_max, xorder[k]);
-	      pv[k] = pow(m[i]->v/v_max, yorder[k]);
-	   }
-	}
- 
-	is2 = 1.0 / pow(m[i]->err, 2);
+    return solution;
+}
 
-	a_data[m[i]->jexp*ndim+m[i]->jexp] -= is2;
-	a_data[m[i]->jexp*ndim+(nexp+m[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[m[i]->jexp*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
+double fluxUpdateNorm(double *fsol, double *fsolPrev, int nparam);
+
+/*
+ * Starting point of a flux fit taken from a previous solution: the zero
+ * points (mag) of the exposures and chips, indexed by jexp and jchip and
+ * NaN where the solution has none, and the flux fit polynomial.
+ */
+struct FluxSeed {
+    std::vector<double> expMag;
+    std::vector<double> chipMag;
+    FluxFitParams::Ptr ffp;
+    int nexpSeeded;
+
+    FluxSeed(WcsDic const &wcsDic, CcdSet const &ccdSet,
+	     std::map<ExpType, float> const &fexp, std::map<ChipType, float> const &fchip,
+	     FluxFitParams::Ptr const &p) :
+	ffp(new FluxFitParams(*p)), nexpSeeded(0)
+    {
+	double const nan = std::numeric_limits<double>::quiet_NaN();
+	for (WcsDic::const_iterator it = wcsDic.begin(); it != wcsDic.end(); it++) {
+	    std::map<ExpType, float>::const_iterator f = fexp.find(it->first);
+	    expMag.push_back((f != fexp.end() && f->second > 0.0) ? -2.5 * log10(f->second) : nan);
+	    if (expMag.back() == expMag.back()) nexpSeeded++;
 	}
-	a_data[m[i]->jexp*ndim+(nexp+nchip+ncoeff+m[i]->jstar)] += is2;
-
-	a_data[(nexp+m[i]->jchip)*ndim+m[i]->jexp] -= is2;
-	a_data[(nexp+m[i]->jchip)*ndim+(nexp+m[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+m[i]->jchip)*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
+	for (CcdSet::const_iterator it = ccdSet.begin(); it != ccdSet.end(); it++) {
+	    std::map<ChipType, float>::const_iterator f = fchip.find(it->first);
+	    chipMag.push_back((f != fchip.end() && f->second > 0.0) ? -2.5 * log10(f->second) : nan);
 	}
-	a_data[(nexp+m[i]->jchip)*ndim+(nexp+nchip+ncoeff+m[i]->jstar)] += is2;
+    }
+};
 
-	for (int j = 0; j < ncoeff; j++) {
-	   a_data[(nexp+nchip+j)*ndim+m[i]->jexp] -= pu[j] * pv[j] * is2;
-	   a_data[(nexp+nchip+j)*ndim+(nexp+m[i]->jchip)] -= pu[j] * pv[j] * is2;
-	   for (int k = 0; k < ncoeff; k++) {
-	      a_data[(nexp+nchip+j)*ndim+(nexp+nchip+k)] -= pu[j] * pv[j] * 
-		                                            pu[k] * pv[k] * is2;
-	   }
-	   a_data[(nexp+nchip+j)*ndim+(nexp+nchip+ncoeff+m[i]->jstar)] += pu[j] * pv[j] * is2;
-	}
+/*
+ * Weights of the first solve of a flux fit from the residuals of the seed:
+ * the robust weights, or for the plain fit the error weights with the
+ * measurements beyond the clip of sweepFluxResiduals (chi2 of 9) left out.
+ * Star magnitudes are the weighted means of the seeded measurements.
+ * Measurements of exposures or chips the seed lacks keep their error
+ * weight.  False if no measurement could be seeded.
+ */
+bool seedFluxWeights(FluxSystem const &sys, FluxSeed const &seed,
+		     RobustWeight const &robust, std::vector<double> &w)
+{
+    int nterm = sys.terms.size();
+    double const nan = std::numeric_limits<double>::quiet_NaN();
 
-	a_data[(nexp+nchip+ncoeff+m[i]->jstar)*ndim+m[i]->jexp] += is2;
-	a_data[(nexp+nchip+ncoeff+m[i]->jstar)*ndim+(nexp+m[i]->jchip)] += is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+nchip+ncoeff+m[i]->jstar)*ndim+(nexp+nchip+k)] += pu[k] * pv[k] * is2;
+    std::vector<double> r(nterm);
+    for (int i = 0; i < nterm; i++) {
+	Obs const *o = sys.terms[i].o;
+	r[i] = sys.terms[i].mag + seed.expMag[o->jexp] + seed.chipMag[o->jchip] +
+	       seed.ffp->eval(o->u, o->v);
+    }
+    for (int js = 0; js < sys.nstar(); js++) {
+	double W = 0.0;
+	double S = 0.0;
+	for (int i = sys.starStart[js]; i < sys.starStart[js+1]; i++) {
+	    if (r[i] != r[i]) continue;
+	    W += sys.terms[i].is2;
+	    S += r[i] * sys.terms[i].is2;
 	}
-	a_data[(nexp+nchip+ncoeff+m[i]->jstar)*ndim+(nexp+nchip+ncoeff+m[i]->jstar)] -= is2;
-
-	b_data[m[i]->jexp] += m[i]->mag * is2;
-	b_data[nexp+m[i]->jchip] += m[i]->mag * is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   b_data[nexp+nchip+k] += m[i]->mag * pu[k] * pv[k] * is2;
+	for (int i = sys.starStart[js]; i < sys.starStart[js+1]; i++) {
+	    r[i] = (W > 0.0) ? r[i] - S / W : nan;
 	}
-	b_data[nexp+nchip+ncoeff+m[i]->jstar] -= m[i]->mag * is2;
     }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
 
-	if (p->chebyshev) {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = Tn(xorder[k], s[i]->u/u_max);
-	      pv[k] = Tn(yorder[k], s[i]->v/v_max);
-	   }
+    std::vector<double> at;
+    for (int i = 0; i < nterm; i++) {
+	r[i] *= sqrt(sys.terms[i].is2);
+	if (r[i] == r[i]) at.push_back(fabs(r[i]));
+    }
+    if (at.empty()) return false;
+
+    std::nth_element(at.begin(), at.begin() + at.size()/2, at.end());
+    double sigma = 1.4826 * at[at.size()/2];
+    if (sigma <= 0.0) sigma = 1.0;
+
+    w.resize(nterm);
+    for (int i = 0; i < nterm; i++) {
+	w[i] = sys.terms[i].is2;
+	if (r[i] != r[i]) continue;
+	if (robust.type == RobustWeight::NONE) {
+	    if (r[i] * r[i] > 9.0) w[i] = 0.0;
 	} else {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = pow(s[i]->u/u_max, xorder[k]);
-	      pv[k] = pow(s[i]->v/v_max, yorder[k]);
-	   }
+	    w[i] *= robust.weight(r[i] / sigma);
 	}
+    }
 
-	is2 = 1.0 / pow(s[i]->err, 2);
+    return true;
+}
 
-	a_data[s[i]->jexp*ndim+s[i]->jexp] -= is2;
-	a_data[s[i]->jexp*ndim+(nexp+s[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[s[i]->jexp*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
+/*
+ * Solve the flux fit, by iteratively reweighted least squares when a
+ * robust estimator is selected.  The basis values and the grouping of the
+ * measurements are kept between passes; only the weights change.  The
+ * reweighting stops when criteria are met, counting measurements that
+ * newly get zero weight as rejections.  The first pass uses the weights
+ * in w if it is not empty (see seedFluxWeights), else the error weights;
+ * on return w holds the weights of the returned solution.
+ */
+double *solveFluxRobust(FluxSystem const &sys,
+			bool fixFirstExp,
+			RobustWeight const &robust,
+			ConvergenceCriteria const &criteria,
+			SolverWorkspace &ws,
+			std::vector<double> &w)
+{
+    int nterm = sys.terms.size();
+    int ng = sys.ng();
+
+    if (w.empty()) {
+	w.resize(nterm);
+	for (int i = 0; i < nterm; i++) {
+	    w[i] = sys.terms[i].is2;
+	}
+    }
+
+    double *solution = solveFluxReduced(sys, w, fixFirstExp, ws);
+    if (robust.type == RobustWeight::NONE || nterm == 0) {
+	return solution;
+    }
+
+    int *idx = new int[sys.ncoeff+2];
+    double *val = new double[sys.ncoeff+2];
+    std::vector<double> t(nterm);
+    std::vector<double> at(nterm);
+    double chi2Prev = std::numeric_limits<double>::quiet_NaN();
+    int nReject = 0;
+    double *solPrev = NULL;
+
+    for (int k = 0; ; k++) {
+	// Normalised residuals and their weighted chi2
+	double chi2 = 0.0;
+	double wsum = 0.0;
+	for (int i = 0; i < nterm; i++) {
+	    int n = sys.designRow(i, idx, val);
+	    double r = sys.terms[i].mag;
+	    for (int j = 0; j < n; j++) {
+		r += val[j] * solution[idx[j]];
+	    }
+	    if (sys.terms[i].jstar >= 0) {
+		r -= solution[ng+sys.terms[i].jstar];
+	    }
+	    t[i] = r * sqrt(sys.terms[i].is2);
+	    at[i] = fabs(t[i]);
+	    chi2 += w[i] * r * r;
+	    wsum += w[i] / sys.terms[i].is2;
 	}
-	a_data[s[i]->jexp*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += is2;
+	chi2 = (wsum > 0.0) ? chi2 / wsum : 0.0;
+	double dParam = fluxUpdateNorm(solution, solPrev, ng);
+	mosaicLog(pexLog::Log::INFO, "fluxFit robust %d: chi2 %e nReject %d", k, chi2, nReject);
 
-	a_data[(nexp+s[i]->jchip)*ndim+s[i]->jexp] -= is2;
-	a_data[(nexp+s[i]->jchip)*ndim+(nexp+s[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+s[i]->jchip)*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
+	delete [] solPrev;
+	solPrev = NULL;
+	if (k + 1 == criteria.maxIter ||
+	    criteria.converged(k+1, dParam, chi2Prev, chi2, nReject)) {
+	    break;
 	}
-	a_data[(nexp+s[i]->jchip)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += is2;
 
-	for (int j = 0; j < ncoeff; j++) {
-	   a_data[(nexp+nchip+j)*ndim+s[i]->jexp] -= pu[j] * pv[j] * is2;
-	   a_data[(nexp+nchip+j)*ndim+(nexp+s[i]->jchip)] -= pu[j] * pv[j] * is2;
-	   for (int k = 0; k < ncoeff; k++) {
-	      a_data[(nexp+nchip+j)*ndim+(nexp+nchip+k)] -= pu[j] * pv[j] * 
-		                                            pu[k] * pv[k] * is2;
-	   }
-	   a_data[(nexp+nchip+j)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += pu[j] * pv[j] * is2;
-	}
+	std::nth_element(at.begin(), at.begin() + nterm/2, at.end());
+	double sigma = 1.4826 * at[nterm/2];
+	if (sigma <= 0.0) sigma = 1.0;
 
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+s[i]->jexp] += is2;
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+s[i]->jchip)] += is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+nchip+k)] += pu[k] * pv[k] * is2;
+	nReject = 0;
+	for (int i = 0; i < nterm; i++) {
+	    double wi = sys.terms[i].is2 * robust.weight(t[i] / sigma);
+	    if (wi == 0.0 && w[i] != 0.0) nReject++;
+	    w[i] = wi;
 	}
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] -= is2;
 
-	b_data[s[i]->jexp] += s[i]->mag * is2;
-	b_data[nexp+s[i]->jchip] += s[i]->mag * is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   b_data[nexp+nchip+k] += s[i]->mag * pu[k] * pv[k] * is2;
-	}
-	b_data[nexp+nchip+ncoeff+s[i]->jstar] -= s[i]->mag * is2;
+	chi2Prev = chi2;
+	solPrev = solution;
+	solution = solveFluxReduced(sys, w, fixFirstExp, ws);
     }
 
-    a_data[nexp+nchip+ncoeff+nstar] = 1;
-    a_data[(nexp+nchip+ncoeff+nstar)*ndim] = 1;
-    b_data[ndim-2] = 0;
+    delete [] idx;
+    delete [] val;
 
-    for (int i = 0; i < nchip; i++) {
-	a_data[(nexp+i)*ndim+(nexp+nchip+ncoeff+nstar+1)] = -1;
-	a_data[(nexp+nchip+ncoeff+nstar+1)*ndim+(nexp+i)] = -1;
-    }
-    b_data[ndim-1] = 0;
+    return solution;
+}
 
-    delete [] pu;
-    delete [] pv;
+/*
+ * Append the measurements of each multiply observed star to the system,
+ * grouped by the jstar assigned to every observation.  nobs[j] is the
+ * number of measurements of star j; obs[i] gets iobs = offset + i.
+ */
+void groupFluxTerms(FluxSystem &sys,
+		    std::vector<Obs::Ptr> const &obs,
+		    std::vector<int> const &nobs,
+		    int offset)
+{
+    int nstar = nobs.size();
+
+    sys.nfixed = sys.terms.size();
+    sys.starStart.resize(nstar+1);
+    sys.starStart[0] = sys.nfixed;
+    for (int j = 0; j < nstar; j++) {
+	sys.starStart[j+1] = sys.starStart[j] + nobs[j];
+    }
+    sys.terms.resize(sys.starStart[nstar]);
+
+    std::vector<int> next(sys.starStart.begin(), sys.starStart.end()-1);
+    for (size_t i = 0; i < obs.size(); i++) {
+	Obs *o = obs[i].get();
+	if (o->jstar < 0 || !o->good || o->mag == -9999 || o->err == -9999) continue;
+	FluxTerm &t = sys.terms[next[o->jstar]++];
+	t.o = o;
+	t.mag = o->mag;
+	t.is2 = 1.0 / pow(o->err, 2);
+	t.jstar = o->jstar;
+	t.iobs = offset + i;
+    }
+}
 
-    double *solution = solveMatrix(ndim, a_data, b_data);
+/*
+ * Mark the measurements that the fit gave zero weight bad, and collect
+ * them in rejected if given.
+ */
+void rejectUnweighted(FluxSystem const &sys, std::vector<double> const &w,
+		      std::vector<Obs*> *rejected)
+{
+    for (size_t i = 0; i < sys.terms.size(); i++) {
+	if (w[i] != 0.0) continue;
+	sys.terms[i].o->good = false;
+	if (rejected) rejected->push_back(sys.terms[i].o);
+    }
+}
 
-    delete [] a_data;
-    delete [] b_data;
+double *fluxFit_rel(std::vector<Obs::Ptr> &m,
+		    int nmatch,
+		    std::vector<Obs::Ptr> &s,
+		    int nsource,
+		    int nexp,
+		    int nchip,
+		    FluxFitParams::Ptr p,
+		    SolverWorkspace &ws,
+		    RobustWeight const &robust = RobustWeight(),
+		    ConvergenceCriteria const &criteria = ConvergenceCriteria(1),
+		    std::vector<double> const *basisCache = NULL,
+		    FluxSeed const *seed = NULL,
+		    std::vector<Obs*> *rejected = NULL)
+{
+    int nMobs = m.size();
+    int nSobs = s.size();
+
+    std::vector<int> num(nmatch+nsource, 0);
+    for (int i = 0; i < nMobs; i++) {
+	if (m[i]->good && m[i]->mag != -9999 && m[i]->err != -9999) {
+	    num[m[i]->istar] += 1;
+	}
+    }
+    for (int i = 0; i < nSobs; i++) {
+	if (s[i]->good && s[i]->mag != -9999 && s[i]->err != -9999) {
+	    num[nmatch+s[i]->istar] += 1;
+	}
+    }
+    std::vector<int> starIndex(nmatch+nsource, -1);
+    std::vector<int> nobs;
+    for (int i = 0; i < nmatch+nsource; i++) {
+	if (num[i] >= 2) {
+	    starIndex[i] = nobs.size();
+	    nobs.push_back(num[i]);
+	}
+    }
+    int nstar = nobs.size();
+    mosaicLog(pexLog::Log::INFO, "nstar: %d", nstar);
+
+    for (int i = 0; i < nMobs; i++) {
+	m[i]->jstar = starIndex[m[i]->istar];
+    }
+    for (int i = 0; i < nSobs; i++) {
+	s[i]->jstar = starIndex[nmatch+s[i]->istar];
+    }
+
+    int ncoeff = p->ncoeff - 3;	// Fit from 2nd order only
+
+    FluxSystem sys;
+    sys.nexp = nexp;
+    sys.nchip = nchip;
+    sys.ncoeff = ncoeff;
+    std::vector<Obs::Ptr> all(m);
+    all.insert(all.end(), s.begin(), s.end());
+    groupFluxTerms(sys, all, nobs, 0);
+    sys.setBasis(p, basisCache);
+
+    std::vector<double> w;
+    if (seed && !seedFluxWeights(sys, *seed, robust, w)) w.clear();
+
+    double *solution = solveFluxRobust(sys, true, robust, criteria, ws, w);
+    rejectUnweighted(sys, w, rejected);
 
     std::vector<double> v;
     std::vector<double> e;
@@ -2184,7 +2933,7 @@ double *fluxFit_rel(std::vector<Obs::Ptr> &m,
     }
     double avg = Sx / S;
     double std = sqrt((Sxx-Sx*Sx/S)/S);
-    std::cout << avg << " " << std << std::endl;
+    mosaicLog(pexLog::Log::DEBUG, "catalog offset: %f rms: %f", avg, std);
 
     for (int k = 0; k < 2; k++) {
 	S = Sx = Sxx = 0.;
@@ -2197,7 +2946,7 @@ double *fluxFit_rel(std::vector<Obs::Ptr> &m,
 	}
 	avg = Sx / S;
 	std = sqrt((Sxx-Sx*Sx/S)/S);
-	std::cout << avg << " " << std << std::endl;
+	mosaicLog(pexLog::Log::DEBUG, "catalog offset: %f rms: %f", avg, std);
     }
 
     double dmag = avg;
@@ -2231,177 +2980,63 @@ double *fluxFit_abs(std::vector<Obs::Ptr> &m,
 		    int nsource,
 		    int nexp,
 		    int nchip,
-		    FluxFitParams::Ptr p)
+		    FluxFitParams::Ptr p,
+		    SolverWorkspace &ws,
+		    RobustWeight const &robust = RobustWeight(),
+		    ConvergenceCriteria const &criteria = ConvergenceCriteria(1),
+		    std::vector<double> const *basisCache = NULL,
+		    FluxSeed const *seed = NULL,
+		    std::vector<Obs*> *rejected = NULL)
 {
     int nMobs = m.size();
     int nSobs = s.size();
 
-    int* num = new int[nsource];
-    for (int i = 0; i < nsource; i++) {
-	num[i] = 0;
-    }
+    std::vector<int> num(nsource, 0);
     for (int i = 0; i < nSobs; i++) {
 	if (s[i]->good && s[i]->mag != -9999 && s[i]->err != -9999) {
 	    num[s[i]->istar] += 1;
 	}
     }
-    std::vector<int> v_istar;
+    std::vector<int> starIndex(nsource, -1);
+    std::vector<int> nobs;
     for (int i = 0; i < nsource; i++) {
 	if (num[i] >= 2) {
-	    v_istar.push_back(i);
+	    starIndex[i] = nobs.size();
+	    nobs.push_back(num[i]);
 	}
     }
-    delete [] num;
-    int nstar = v_istar.size();
-    std::cout << "nstar: " << nstar << std::endl;
+    int nstar = nobs.size();
+    mosaicLog(pexLog::Log::INFO, "nstar: %d", nstar);
 
     for (int i = 0; i < nSobs; i++) {
-	std::vector<int>::iterator it = std::find(v_istar.begin(), v_istar.end(), s[i]->istar);
-	if (it != v_istar.end()) {
-	    s[i]->jstar = it - v_istar.begin();
-	} else {
-	    s[i]->jstar = -1;
-	}
+	s[i]->jstar = starIndex[s[i]->istar];
     }
 
     int ncoeff = p->ncoeff - 3;
-    int *xorder = &p->xorder[3];
-    int *yorder = &p->yorder[3];
-    double u_max = p->u_max;
-    double v_max = p->v_max;
 
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
-
-    int ndim = nexp + nchip + ncoeff + nstar + 1;
-    std::cout << "ndim: " << ndim << std::endl;
-
-    double *a_data = new double[ndim*ndim];
-    double *b_data = new double[ndim];
-
-    for (int i = 0; i < ndim; i++) {
-	for (int j = 0; j < ndim; j++) {
-	    a_data[i*ndim+j] = 0.0;
-	}
-	b_data[i] = 0.0;
-    }
-
-    double is2 = 1.0;
+    FluxSystem sys;
+    sys.nexp = nexp;
+    sys.nchip = nchip;
+    sys.ncoeff = ncoeff;
     for (int i = 0; i < nMobs; i++) {
 	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 ||
 	    m[i]->err == -9999 || m[i]->mag_cat == -9999) continue;
-
-	if (p->chebyshev) {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = Tn(xorder[k], m[i]->u/u_max);
-	      pv[k] = Tn(yorder[k], m[i]->v/v_max);
-	   }
-	} else {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = pow(m[i]->u/u_max, xorder[k]);
-	      pv[k] = pow(m[i]->v/v_max, yorder[k]);
-	   }
-	}
-
-	is2 = 1.0 / (pow(m[i]->err, 2) + pow(m[i]->err_cat, 2));
-
-	a_data[m[i]->jexp*ndim+m[i]->jexp] -= is2;
-	a_data[m[i]->jexp*ndim+(nexp+m[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[m[i]->jexp*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
-	}
-
-	a_data[(nexp+m[i]->jchip)*ndim+m[i]->jexp] -= is2;
-	a_data[(nexp+m[i]->jchip)*ndim+(nexp+m[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+m[i]->jchip)*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
-	}
-
-	for (int j = 0; j < ncoeff; j++) {
-	   a_data[(nexp+nchip+j)*ndim+m[i]->jexp] -= pu[j] * pv[j] * is2;
-	   a_data[(nexp+nchip+j)*ndim+(nexp+m[i]->jchip)] -= pu[j] * pv[j] * is2;
-	   for (int k = 0; k < ncoeff; k++) {
-	      a_data[(nexp+nchip+j)*ndim+(nexp+nchip+k)] -= pu[j] * pv[j] * 
-		                                            pu[k] * pv[k] * is2;
-	   }
-	}
-
-	b_data[m[i]->jexp] += (m[i]->mag - m[i]->mag_cat) * is2;
-	b_data[nexp+m[i]->jchip] += (m[i]->mag - m[i]->mag_cat) * is2;
-	for (int k = 0; k < ncoeff; k++) {
-	    b_data[nexp+nchip+k] += (m[i]->mag - m[i]->mag_cat) * pu[k] * pv[k] * is2;
-	}
-    }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
-
-	if (p->chebyshev) {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = Tn(xorder[k], s[i]->u/u_max);
-	      pv[k] = Tn(yorder[k], s[i]->v/v_max);
-	   }
-	} else {
-	   for (int k = 0; k < ncoeff; k++) {
-	      pu[k] = pow(s[i]->u/u_max, xorder[k]);
-	      pv[k] = pow(s[i]->v/v_max, yorder[k]);
-	   }
-	}
-
-	is2 = 1.0 / pow(s[i]->err, 2);
-
-	a_data[s[i]->jexp*ndim+s[i]->jexp] -= is2;
-	a_data[s[i]->jexp*ndim+(nexp+s[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[s[i]->jexp*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
-	}
-	a_data[s[i]->jexp*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += is2;
-
-	a_data[(nexp+s[i]->jchip)*ndim+s[i]->jexp] -= is2;
-	a_data[(nexp+s[i]->jchip)*ndim+(nexp+s[i]->jchip)] -= is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+s[i]->jchip)*ndim+(nexp+nchip+k)] -= pu[k] * pv[k] * is2;
-	}
-	a_data[(nexp+s[i]->jchip)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += is2;
-
-	for (int j = 0; j < ncoeff; j++) {
-	   a_data[(nexp+nchip+j)*ndim+s[i]->jexp] -= pu[j] * pv[j] * is2;
-	   a_data[(nexp+nchip+j)*ndim+(nexp+s[i]->jchip)] -= pu[j] * pv[j] * is2;
-	   for (int k = 0; k < ncoeff; k++) {
-	      a_data[(nexp+nchip+j)*ndim+(nexp+nchip+k)] -= pu[j] * pv[j] * 
-		                                            pu[k] * pv[k] * is2;
-	   }
-	   a_data[(nexp+nchip+j)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] += pu[j] * pv[j] * is2;
-	}
-
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+s[i]->jexp] += is2;
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+s[i]->jchip)] += is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+nchip+k)] += pu[k] * pv[k] * is2;
-	}
-	a_data[(nexp+nchip+ncoeff+s[i]->jstar)*ndim+(nexp+nchip+ncoeff+s[i]->jstar)] -= is2;
-
-	b_data[s[i]->jexp] += s[i]->mag * is2;
-	b_data[nexp+s[i]->jchip] += s[i]->mag * is2;
-	for (int k = 0; k < ncoeff; k++) {
-	   b_data[nexp+nchip+k] += s[i]->mag * pu[k] * pv[k] * is2;
-	}
-	b_data[nexp+nchip+ncoeff+s[i]->jstar] -= s[i]->mag * is2;
-    }
-
-    for (int i = 0; i < nchip; i++) {
-	a_data[(nexp+i)*ndim+(nexp+nchip+ncoeff+nstar)] = -1;
-	a_data[(nexp+nchip+ncoeff+nstar)*ndim+(nexp+i)] = -1;
+	FluxTerm t;
+	t.o = m[i].get();
+	t.mag = m[i]->mag - m[i]->mag_cat;
+	t.is2 = 1.0 / (pow(m[i]->err, 2) + pow(m[i]->err_cat, 2));
+	t.jstar = -1;
+	t.iobs = i;
+	sys.terms.push_back(t);
     }
+    groupFluxTerms(sys, s, nobs, nMobs);
+    sys.setBasis(p, basisCache);
 
-    b_data[ndim-1] = 0;
-
-    delete [] pu;
-    delete [] pv;
+    std::vector<double> w;
+    if (seed && !seedFluxWeights(sys, *seed, robust, w)) w.clear();
 
-    double *solution = solveMatrix(ndim, a_data, b_data);
-
-    delete [] a_data;
-    delete [] b_data;
+    double *solution = solveFluxRobust(sys, false, robust, criteria, ws, w);
+    rejectUnweighted(sys, w, rejected);
 
     for (int i = 0; i < nSobs; i++) {
 	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999) continue;
@@ -2415,160 +3050,217 @@ double *fluxFit_abs(std::vector<Obs::Ptr> &m,
     return solution;
 }
 
-double calcChi2_rel(std::vector<Obs::Ptr> &m, 
-		    std::vector<Obs::Ptr> &s,
-		    int nexp,
-		    int nchip,
-		    double *fsol,
-		    FluxFitParams::Ptr p,
-		    bool mag=false)
-{
-    int nMobs = m.size();
-    int nSobs = s.size();
+/*
+ * Residuals of one sweep over the observations.  chi2 is the sum of the
+ * squared residuals and nchi2 the sum normalised by the errors, over the
+ * num good objects; chi2 and num are also kept per exposure and per chip
+ * (indexed by jexp and jchip).  Objects whose normalised residual exceeds
+ * the rejection threshold are collected in rejected; flagRejected() marks
+ * them bad.
+ */
+struct ResidualSums {
+    double chi2;
+    double nchi2;
+    int num;
+    std::vector<double> chi2Exp;
+    std::vector<double> chi2Chip;
+    std::vector<int> numExp;
+    std::vector<int> numChip;
+    std::vector<int> rejectExp;
+    std::vector<int> rejectChip;
+    std::vector<Obs*> rejected;
+
+    ResidualSums(int nexp, int nchip) :
+	chi2(0.0), nchi2(0.0), num(0),
+	chi2Exp(nexp, 0.0), chi2Chip(nchip, 0.0),
+	numExp(nexp, 0), numChip(nchip, 0),
+	rejectExp(nexp, 0), rejectChip(nchip, 0) {}
+
+    void add(Obs *o, double r2, double nr2, bool reject) {
+	chi2 += r2;
+	nchi2 += nr2;
+	num++;
+	chi2Exp[o->jexp] += r2;
+	numExp[o->jexp]++;
+	chi2Chip[o->jchip] += r2;
+	numChip[o->jchip]++;
+	if (reject) this->reject(o);
+    }
 
-    int ncoeff = p->ncoeff - 3;
+    void reject(Obs *o) {
+	rejected.push_back(o);
+	rejectExp[o->jexp]++;
+	rejectChip[o->jchip]++;
+    }
 
-    double chi2 = 0.0;
-    double mag2 = 0.0;
-    int num = 0;
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 || m[i]->err == -9999) continue;
-	double val = m[i]->mag + fsol[m[i]->jexp] + fsol[nexp+m[i]->jchip];
-	val += p->eval(m[i]->u, m[i]->v);
-	chi2 += pow((val - fsol[nexp+nchip+ncoeff+m[i]->jstar])/m[i]->err, 2.0);
-	mag2 += pow((val - fsol[nexp+nchip+ncoeff+m[i]->jstar]), 2.0);
-	num++;
+    void merge(ResidualSums const &r) {
+	chi2 += r.chi2;
+	nchi2 += r.nchi2;
+	num += r.num;
+	for (size_t j = 0; j < chi2Exp.size(); j++) {
+	    chi2Exp[j] += r.chi2Exp[j];
+	    numExp[j] += r.numExp[j];
+	    rejectExp[j] += r.rejectExp[j];
+	}
+	for (size_t j = 0; j < chi2Chip.size(); j++) {
+	    chi2Chip[j] += r.chi2Chip[j];
+	    numChip[j] += r.numChip[j];
+	    rejectChip[j] += r.rejectChip[j];
+	}
+	rejected.insert(rejected.end(), r.rejected.begin(), r.rejected.end());
     }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
-	double val = s[i]->mag + fsol[s[i]->jexp] + fsol[nexp+s[i]->jchip];
-	val += p->eval(s[i]->u, s[i]->v);
-	chi2 += pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar])/s[i]->err, 2.0);
-	mag2 += pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar]), 2.0);
-	num++;
+};
+
+int flagRejected(ResidualSums const &sums)
+{
+    for (size_t i = 0; i < sums.rejected.size(); i++) {
+	sums.rejected[i]->good = false;
     }
 
-    if (mag)
-	return mag2 / num;
-    else
-	return chi2 / num;
+    return sums.rejected.size();
 }
 
-double calcChi2_abs(std::vector<Obs::Ptr> &m, 
-		    std::vector<Obs::Ptr> &s,
-		    int nexp,
-		    int nchip,
-		    double *fsol,
-		    FluxFitParams::Ptr p,
-		    bool mag=false)
+SolveStatistics::SolveStatistics() :
+    nIter(0), rms(0.0), nObs(0), nReject(0),
+    fluxNIter(0), fluxRms(0.0), fluxChi2(0.0), fluxNObs(0), fluxNReject(0),
+    astromTime(0.0), fluxTime(0.0)
 {
-    int nMobs = m.size();
-    int nSobs = s.size();
+}
 
-    int ncoeff = p->ncoeff - 3;
+void SolveStatistics::reset(WcsDic const &wcsDic, CcdSet const &ccdSet)
+{
+    *this = SolveStatistics();
+
+    for (WcsDic::const_iterator it = wcsDic.begin(); it != wcsDic.end(); it++) {
+	expId.push_back(it->first);
+    }
+    for (CcdSet::const_iterator it = ccdSet.begin(); it != ccdSet.end(); it++) {
+	chipId.push_back(it->first);
+    }
+    int nexp = expId.size();
+    int nchip = chipId.size();
+
+    expRms.assign(nexp, 0.0);
+    expNObs.assign(nexp, 0);
+    expNReject.assign(nexp, 0);
+    chipRms.assign(nchip, 0.0);
+    chipNObs.assign(nchip, 0);
+    chipNReject.assign(nchip, 0);
+    expFluxRms.assign(nexp, 0.0);
+    expFluxNObs.assign(nexp, 0);
+    expFluxNReject.assign(nexp, 0);
+    chipFluxRms.assign(nchip, 0.0);
+    chipFluxNObs.assign(nchip, 0);
+    chipFluxNReject.assign(nchip, 0);
+}
 
-    double chi2 = 0.0;
-    double mag2 = 0.0;
-    int num = 0;
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 ||
-	    m[i]->err == -9999 || m[i]->mag_cat == -9999) continue;
-	double val = m[i]->mag + fsol[m[i]->jexp] + fsol[nexp+m[i]->jchip];
-	val += p->eval(m[i]->u, m[i]->v);
-	chi2 += pow(val - m[i]->mag_cat, 2.0) / (pow(m[i]->err, 2.0) + pow(m[i]->err_cat, 2.0));
-	mag2 += pow(val - m[i]->mag_cat, 2.0);
-	num++;
-    }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
-	double val = s[i]->mag + fsol[s[i]->jexp] + fsol[nexp+s[i]->jchip];
-	val += p->eval(s[i]->u, s[i]->v);
-	chi2 += pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar])/s[i]->err, 2.0);
-	mag2 += pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar]), 2.0);
-	num++;
+/*
+ * rms[j] = scale * sqrt(sum of chi2[j] over parts / sum of num[j])
+ */
+static void setRms(std::vector<double> &rms, std::vector<int> &nobs,
+		   std::vector<double> const &chi2a, std::vector<int> const &numa,
+		   std::vector<double> const *chi2b, std::vector<int> const *numb,
+		   double scale)
+{
+    for (size_t j = 0; j < rms.size(); j++) {
+	double chi2 = chi2a[j] + (chi2b ? (*chi2b)[j] : 0.0);
+	nobs[j] = numa[j] + (numb ? (*numb)[j] : 0);
+	rms[j] = (nobs[j] > 0) ? scale * sqrt(chi2 / nobs[j]) : 0.0;
     }
-
-    if (mag)
-	return mag2 / num;
-    else
-	return chi2 / num;
 }
 
-void flagObj_rel(std::vector<Obs::Ptr> &m,
-		 std::vector<Obs::Ptr> &s,
-		 int nexp,
-		 int nchip,
-		 double *fsol,
-		 double e2,
-		 FluxFitParams::Ptr p)
+/*
+ * Record the residuals of an astrometric iteration (matches a and, for
+ * the full solve, sources b) in stats.
+ */
+void setAstromStatistics(SolveStatistics &stats, int niter,
+			 ResidualSums const &a, ResidualSums const *b)
 {
-    int nMobs = m.size();
-    int nSobs = s.size();
+    double chi2 = a.chi2 + (b ? b->chi2 : 0.0);
+    stats.nIter = niter;
+    stats.nObs = a.num + (b ? b->num : 0);
+    stats.rms = (stats.nObs > 0) ? sqrt(chi2 / stats.nObs) * 3600.0 : 0.0;
+    setRms(stats.expRms, stats.expNObs, a.chi2Exp, a.numExp,
+	   b ? &b->chi2Exp : NULL, b ? &b->numExp : NULL, 3600.0);
+    setRms(stats.chipRms, stats.chipNObs, a.chi2Chip, a.numChip,
+	   b ? &b->chi2Chip : NULL, b ? &b->numChip : NULL, 3600.0);
+}
 
-    int ncoeff = p->ncoeff - 3;
+void setFluxStatistics(SolveStatistics &stats, int niter, ResidualSums const &a)
+{
+    stats.fluxNIter = niter;
+    stats.fluxNObs = a.num;
+    stats.fluxRms = (a.num > 0) ? sqrt(a.chi2 / a.num) : 0.0;
+    stats.fluxChi2 = (a.num > 0) ? a.nchi2 / a.num : 0.0;
+    setRms(stats.expFluxRms, stats.expFluxNObs, a.chi2Exp, a.numExp, NULL, NULL, 1.0);
+    setRms(stats.chipFluxRms, stats.chipFluxNObs, a.chi2Chip, a.numChip, NULL, NULL, 1.0);
+}
 
-    int nreject = 0;
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 || m[i]->err == -9999) continue;
-	double val = m[i]->mag + fsol[m[i]->jexp] + fsol[nexp+m[i]->jchip];
-	val += p->eval(m[i]->u, m[i]->v);
-	double r2 = pow((val - fsol[nexp+nchip+ncoeff+m[i]->jstar])/m[i]->err, 2.0);
-	if (r2 > e2) {
-	    m[i]->good = false;
-	    nreject++;
-	}
+/*
+ * Add the rejections applied from a sweep to the counts in stats.
+ */
+void addRejections(SolveStatistics &stats, ResidualSums const &a, bool flux)
+{
+    std::vector<int> &exp  = flux ? stats.expFluxNReject  : stats.expNReject;
+    std::vector<int> &chip = flux ? stats.chipFluxNReject : stats.chipNReject;
+    for (size_t j = 0; j < exp.size(); j++) {
+	exp[j] += a.rejectExp[j];
     }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
-	double val = s[i]->mag + fsol[s[i]->jexp] + fsol[nexp+s[i]->jchip];
-	val += p->eval(s[i]->u, s[i]->v);
-	double r2 = pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar])/s[i]->err, 2.0);
-	if (r2 > e2) {
-	    s[i]->good = false;
-	    nreject++;
-	}
+    for (size_t j = 0; j < chip.size(); j++) {
+	chip[j] += a.rejectChip[j];
+    }
+    if (flux) {
+	stats.fluxNReject += a.rejected.size();
+    } else {
+	stats.nReject += a.rejected.size();
     }
-
-    printf("nreject: %d\n", nreject);
 }
 
-void flagObj_abs(std::vector<Obs::Ptr> &m,
-		 std::vector<Obs::Ptr> &s,
-		 int nexp,
-		 int nchip,
-		 double *fsol,
-		 double e2,
-		 FluxFitParams::Ptr p)
+/*
+ * Fused residual kernel of the flux fit: one parallel pass over the
+ * matches and sources gives the chi2 and the mag residuals (calcChi2_*
+ * before) together with the objects beyond e2 (flagObj_* before).  In the
+ * absolute fit the matches are compared with the catalog magnitudes.
+ */
+void sweepFluxResiduals(ObsVec &m, ObsVec &s, int nexp, int nchip,
+			double *fsol, FluxFitParams::Ptr const &p, double e2,
+			ResidualSums &sums)
 {
-    int nMobs = m.size();
-    int nSobs = s.size();
+    ScopedTimer timer("flux.residuals");
+    int nM = m.size();
+    int nobs = nM + s.size();
 
     int ncoeff = p->ncoeff - 3;
+    int nstar0 = nexp + nchip + ncoeff;
 
-    int nreject = 0;
-    for (int i = 0; i < nMobs; i++) {
-	if (m[i]->jstar == -1 || !m[i]->good || m[i]->mag == -9999 ||
-	    m[i]->err == -9999 || m[i]->mag_cat == -9999) continue;
-	double val = m[i]->mag + fsol[m[i]->jexp] + fsol[nexp+m[i]->jchip];
-	val += p->eval(m[i]->u, m[i]->v);
-	double r2 = pow(val - m[i]->mag_cat, 2.0) / (pow(m[i]->err, 2.0) + pow(m[i]->err_cat, 2.0));
-	if (r2 > e2) {
-	    m[i]->good = false;
-	    nreject++;
-	}
-    }
-    for (int i = 0; i < nSobs; i++) {
-	if (s[i]->jstar == -1 || !s[i]->good || s[i]->mag == -9999 || s[i]->err == -9999) continue;
-	double val = s[i]->mag + fsol[s[i]->jexp] + fsol[nexp+s[i]->jchip];
-	val += p->eval(s[i]->u, s[i]->v);
-	double r2 = pow((val - fsol[nexp+nchip+ncoeff+s[i]->jstar])/s[i]->err, 2.0);
-	if (r2 > e2) {
-	    s[i]->good = false;
-	    nreject++;
+    #pragma omp parallel
+    {
+	ResidualSums local(nexp, nchip);
+
+	#pragma omp for schedule(static)
+	for (int i = 0; i < nobs; i++) {
+	    Obs *o = (i < nM) ? m[i].get() : s[i-nM].get();
+	    if (o->jstar == -1 || !o->good || o->mag == -9999 || o->err == -9999) continue;
+	    bool cat = p->absolute && i < nM;
+	    if (cat && o->mag_cat == -9999) continue;
+
+	    double val = o->mag + fsol[o->jexp] + fsol[nexp+o->jchip];
+	    val += p->eval(o->u, o->v);
+	    double r, is2;
+	    if (cat) {
+		r = val - o->mag_cat;
+		is2 = 1.0 / (pow(o->err, 2.0) + pow(o->err_cat, 2.0));
+	    } else {
+		r = val - fsol[nstar0+o->jstar];
+		is2 = 1.0 / pow(o->err, 2.0);
+	    }
+	    double nr2 = r * r * is2;
+	    local.add(o, r * r, nr2, nr2 > e2);
 	}
-    }
 
-    printf("nreject: %d\n", nreject);
+	#pragma omp critical
+	sums.merge(local);
+    }
 }
 
 double calcChi2(std::vector<Obs::Ptr>& o, Coeff::Ptr c, Poly::Ptr p)
@@ -2597,111 +3289,79 @@ double calcChi2(std::vector<Obs::Ptr>& o, Coeff::Ptr c, Poly::Ptr p)
     return chi2;
 }
 
-double calcChi2(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, Poly::Ptr p, bool norm=false)
+/*
+ * Fused residual kernel of the astrometric fit: one parallel pass gives
+ * the squared residuals (calcChi2 before) and, if e2 > 0, the objects whose
+ * residual normalised by the propagated position errors (plus catRMS)
+ * exceeds e2 (flagObj2 before).  The polynomial terms and their
+ * derivatives come from one table of powers per object.
+ */
+void sweepResiduals(ObsVec &o, CoeffSet &coeffVec, Poly::Ptr const &p,
+		    double e2, double catRMS, ResidualSums &sums)
 {
-    int nobs  = o.size();
+    ScopedTimer timer("astrom.residuals");
+    int nobs = o.size();
 
+    int order = p->order;
     int ncoeff = p->ncoeff;
     int *xorder = p->xorder;
     int *yorder = p->yorder;
 
-//    double **a = new double*[coeffVec.size()];
-//    double **b = new double*[coeffVec.size()];
-//    for (size_t i = 0; i < coeffVec.size(); i++) {
-//	a[i] = coeffVec[i]->a;
-//	b[i] = coeffVec[i]->b;
-//    }
-    std::map<ExpType, double*> a;
-    std::map<ExpType, double*> b;
+    std::vector<Coeff*> coeff;		// indexed by jexp
     for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	a.insert(std::map<ExpType, double*>::value_type(it->first, it->second->a));
-	b.insert(std::map<ExpType, double*>::value_type(it->first, it->second->b));
-    }
-
-    double chi2 = 0.0;
-    int num = 0;
-    for (int i = 0; i < nobs; i++) {
-	if (!o[i]->good) continue;
-	double Ax = o[i]->xi;
-	double Ay = o[i]->eta;
-	for (int k = 0; k < ncoeff; k++) {
-	    Ax -= a[o[i]->iexp][k] * pow(o[i]->u, xorder[k])   * pow(o[i]->v, yorder[k]);
-	    Ay -= b[o[i]->iexp][k] * pow(o[i]->u, xorder[k])   * pow(o[i]->v, yorder[k]);
-	}
-	chi2 += Ax * Ax + Ay * Ay;
-	num++;
+	coeff.push_back(it->second.get());
     }
+    int nchip = sums.chi2Chip.size();
 
-//    delete [] a;
-//    delete [] b;
-
-    if (norm)
-	return chi2/num;
-    else
-	return chi2;
-}
-
-void flagObj2(std::vector<Obs::Ptr>& o, CoeffSet& coeffVec, Poly::Ptr p, double e2, double catRMS=0.0)
-{
-    int nobs  = o.size();
-
-    int ncoeff = p->ncoeff;
-    int *xorder = p->xorder;
-    int *yorder = p->yorder;
+    #pragma omp parallel
+    {
+	ResidualSums local(coeff.size(), nchip);
+	std::vector<double> pu(order+1);
+	std::vector<double> pv(order+1);
 
-//    double **a = new double*[coeffVec.size()];
-//    double **b = new double*[coeffVec.size()];
-//    for (size_t i = 0; i < coeffVec.size(); i++) {
-//	a[i] = coeffVec[i]->a;
-//	b[i] = coeffVec[i]->b;
-//    }
-    std::map<ExpType, double*> a;
-    std::map<ExpType, double*> b;
-    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	a.insert(std::map<ExpType, double*>::value_type(it->first, it->second->a));
-	b.insert(std::map<ExpType, double*>::value_type(it->first, it->second->b));
-    }
+	#pragma omp for schedule(static)
+	for (int i = 0; i < nobs; i++) {
+	    Obs *obs = o[i].get();
+	    if (!obs->good) continue;
+	    double *a = coeff[obs->jexp]->a;
+	    double *b = coeff[obs->jexp]->b;
+
+	    pu[0] = pv[0] = 1.0;
+	    for (int l = 1; l <= order; l++) {
+		pu[l] = pu[l-1] * obs->u;
+		pv[l] = pv[l-1] * obs->v;
+	    }
 
-    int nreject = 0;
-    for (int i = 0; i < nobs; i++) {
-	if (!o[i]->good) continue;
-	double Ax = o[i]->xi;
-	double Ay = o[i]->eta;
-	double Bx = 0.0;
-	double By = 0.0;
-	double Cx = 0.0;
-	double Cy = 0.0;
-	for (int k = 0; k < ncoeff; k++) {
-	    Ax -= a[o[i]->iexp][k] * pow(o[i]->u, xorder[k])   * pow(o[i]->v, yorder[k]);
-	    Ay -= b[o[i]->iexp][k] * pow(o[i]->u, xorder[k])   * pow(o[i]->v, yorder[k]);
-	    Bx += a[o[i]->iexp][k] * pow(o[i]->u, xorder[k]-1) * pow(o[i]->v, yorder[k]) * xorder[k];
-	    By += b[o[i]->iexp][k] * pow(o[i]->u, xorder[k]-1) * pow(o[i]->v, yorder[k]) * xorder[k];
-	    Cx += a[o[i]->iexp][k] * pow(o[i]->u, xorder[k]) * pow(o[i]->v, yorder[k]-1) * yorder[k];
-	    Cy += b[o[i]->iexp][k] * pow(o[i]->u, xorder[k]) * pow(o[i]->v, yorder[k]-1) * yorder[k];
-	}
-	double dxi  = Bx * o[i]->xerr + Cx * o[i]->yerr;
-	double deta = By * o[i]->xerr + Cy * o[i]->yerr;
-	double chi2 = Ax * Ax / (dxi * dxi + catRMS * catRMS) + Ay * Ay / (deta * deta + catRMS * catRMS);
-	if (chi2 > e2) {
-	    o[i]->good = false;
-	    nreject++;
-	} else {
-	    //o[i]->good = true;
+	    double Ax = obs->xi;
+	    double Ay = obs->eta;
+	    double Bx = 0.0;
+	    double By = 0.0;
+	    double Cx = 0.0;
+	    double Cy = 0.0;
+	    for (int k = 0; k < ncoeff; k++) {
+		double t = pu[xorder[k]] * pv[yorder[k]];
+		Ax -= a[k] * t;
+		Ay -= b[k] * t;
+		if (xorder[k] > 0) {
+		    double tu = xorder[k] * pu[xorder[k]-1] * pv[yorder[k]];
+		    Bx += a[k] * tu;
+		    By += b[k] * tu;
+		}
+		if (yorder[k] > 0) {
+		    double tv = yorder[k] * pu[xorder[k]] * pv[yorder[k]-1];
+		    Cx += a[k] * tv;
+		    Cy += b[k] * tv;
+		}
+	    }
+	    double dxi  = Bx * obs->xerr + Cx * obs->yerr;
+	    double deta = By * obs->xerr + Cy * obs->yerr;
+	    double nr2 = Ax * Ax / (dxi * dxi + catRMS * catRMS) + Ay * Ay / (deta * deta + catRMS * catRMS);
+	    local.add(obs, Ax * Ax + Ay * Ay, nr2, e2 > 0.0 && nr2 > e2);
 	}
-    }
-    printf("nreject = %d\n", nreject);
-
-//    delete [] a;
-//    delete [] b;
-}
-
-double calcChi2_Star(std::vector<Obs::Ptr>& o, std::vector<Obs::Ptr>& s, CoeffSet& coeffVec, Poly::Ptr p)
-{
-    double chi2 = 0.0;
-    chi2 += calcChi2(o, coeffVec, p);
-    chi2 += calcChi2(s, coeffVec, p);
 
-    return chi2;
+	#pragma omp critical
+	sums.merge(local);
+    }
 }
 
 ObsVec
@@ -2709,6 +3369,7 @@ lsst::meas::mosaic::obsVecFromSourceGroup(SourceGroup const &all,
 					 WcsDic &wcsDic,
 					 CcdSet &ccdSet)
 {
+    ScopedTimer timer("crossmatch.obsVec");
     std::vector<Obs::Ptr> obsVec;
     for (size_t i = 0; i < all.size(); i++) {
         SourceSet ss = all[i];
@@ -2777,264 +3438,511 @@ lsst::meas::mosaic::obsVecFromSourceGroup(SourceGroup const &all,
     return obsVec;
 }
 
-void fluxFitRelative(ObsVec& matchVec,
-		     int nmatch,
-		     ObsVec& sourceVec,
-		     int nsource,
-		     WcsDic& wcsDic,
-		     CcdSet& ccdSet,
-		     std::map<ExpType, float>& fexp,
-		     std::map<ChipType, float>& fchip,
-		     FluxFitParams::Ptr& ffp) {
+ConvergenceCriteria::ConvergenceCriteria(int maxIter_, double paramTol_, double chi2Tol_,
+					 int rejectTol_, int minIter_) :
+    maxIter(std::max(maxIter_, 1)), paramTol(paramTol_), chi2Tol(chi2Tol_),
+    rejectTol(rejectTol_), minIter(minIter_)
+{
+}
 
-    int nexp = wcsDic.size();
-    int nchip = ccdSet.size();
+bool ConvergenceCriteria::converged(int niter, double dParam,
+				    double chi2Prev, double chi2, int nReject) const
+{
+    if (niter < minIter) return false;
 
-    double *fsol = fluxFit_rel(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    double chi2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    double e2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
-    flagObj_rel(matchVec, sourceVec, nexp, nchip, fsol, 9.0, ffp);
-    delete [] fsol;
+    double dChi2 = (chi2 > 0.0) ? fabs(chi2Prev - chi2) / chi2 : 0.0;
 
-    fsol = fluxFit_rel(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    chi2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    e2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
-    flagObj_rel(matchVec, sourceVec, nexp, nchip, fsol, 9.0, ffp);
-    delete [] fsol;
+    // NaN (e.g. no previous iteration) never compares as converged
+    return dParam < paramTol && dChi2 < chi2Tol && nReject <= rejectTol;
+}
 
-    fsol = fluxFit_rel(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    chi2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    e2f = calcChi2_rel(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
+RobustWeight::RobustWeight(Type type_, double scale_) :
+    type(type_), scale(scale_)
+{
+    if (scale <= 0.0) {
+	scale = (type == TUKEY) ? 4.685 : 1.345;
+    }
+}
 
-    int i = 0;
-    for (WcsDic::iterator it = wcsDic.begin();
-	 it != wcsDic.end(); it++, i++) {
-	fexp.insert(std::map<ExpType, float>::value_type(it->first, pow(10., -0.4*fsol[i])));
-    }
-    for (CcdSet::iterator it = ccdSet.begin();
-	 it != ccdSet.end(); it++, i++) {
-	fchip.insert(std::map<ExpType, float>::value_type(it->first, pow(10., -0.4*fsol[i])));
+double RobustWeight::weight(double t) const
+{
+    double at = fabs(t);
+
+    if (type == HUBER) {
+	return (at <= scale) ? 1.0 : scale / at;
+    } else if (type == TUKEY) {
+	if (at >= scale) return 0.0;
+	double q = 1.0 - (t / scale) * (t / scale);
+	return q * q;
     }
-    for (int i = 0; i < ffp->ncoeff; i++) {
-       printf("%2d %8.5f\n", i, ffp->coeff[i]);
+
+    return 1.0;
+}
+
+/*
+ * Norm of the change of the exposure, chip and polynomial terms of the flux
+ * solution (in mag).  The star magnitudes are excluded since their number
+ * changes as objects are rejected.
+ */
+double fluxUpdateNorm(double *fsol, double *fsolPrev, int nparam)
+{
+    if (fsolPrev == NULL || nparam == 0) return std::numeric_limits<double>::infinity();
+
+    double d2 = 0.0;
+    for (int i = 0; i < nparam; i++) {
+	d2 += pow(fsol[i] - fsolPrev[i], 2);
     }
-    delete [] fsol;
+
+    return sqrt(d2 / nparam);
 }
 
-void fluxFitAbsolute(ObsVec& matchVec,
-		     int nmatch,
-		     ObsVec& sourceVec,
-		     int nsource,
-		     WcsDic& wcsDic,
-		     CcdSet& ccdSet,
-		     std::map<ExpType, float>& fexp,
-		     std::map<ChipType, float>& fchip,
-		     FluxFitParams::Ptr& ffp) {
+/*
+ * Norm of the update of the linearised global solution, relative to the
+ * current parameter values.  The polynomial coefficients and the CCD
+ * offsets (pixels) are normalised separately and the larger of the two is
+ * returned, so neither block can hide the other.
+ */
+double astromUpdateNorm(double *coeff, CoeffSet& coeffVec, CcdSet& ccdSet,
+			int ncoeff, bool solveCcd, bool allowRotation)
+{
+    double da2 = 0.0;
+    double a2 = 0.0;
+    int j = 0;
+    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++, j++) {
+	for (int i = 0; i < ncoeff; i++) {
+	    da2 += pow(coeff[2*ncoeff*j+i], 2) + pow(coeff[2*ncoeff*j+i+ncoeff], 2);
+	    a2  += pow(it->second->a[i], 2) + pow(it->second->b[i], 2);
+	}
+    }
+    double dParam = (a2 > 0.0) ? sqrt(da2 / a2) : 0.0;
 
-    int nexp = wcsDic.size();
-    int nchip = ccdSet.size();
+    if (solveCcd) {
+	int np = allowRotation ? 3 : 2;
+	long offset = 2*ncoeff*coeffVec.size();
+	double dc2 = 0.0;
+	double c2 = 0.0;
+	int i = 0;
+	for (CcdSet::iterator it = ccdSet.begin(); it != ccdSet.end(); it++, i++) {
+	    lsst::afw::geom::Point2D center = it->second->getCenter().getPixels(it->second->getPixelSize());
+	    dc2 += pow(coeff[offset+np*i], 2) + pow(coeff[offset+np*i+1], 2);
+	    c2  += pow(center[0], 2) + pow(center[1], 2);
+	}
+	if (c2 > 0.0) {
+	    dParam = std::max(dParam, sqrt(dc2 / c2));
+	}
+    }
 
-    double *fsol = fluxFit_abs(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    double chi2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    double e2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
-    flagObj_abs(matchVec, sourceVec, nexp, nchip, fsol, 9.0, ffp);
-    delete [] fsol;
+    return dParam;
+}
 
-    fsol = fluxFit_abs(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    chi2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    e2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
-    flagObj_abs(matchVec, sourceVec, nexp, nchip, fsol, 9.0, ffp);
-    delete [] fsol;
+/*
+ * Record the progress of a solve in control, if there is one; true, with
+ * a warning, if the solve is to stop, which is then marked in control.
+ */
+static bool solveCancelled(SolveControl::Ptr const & control, char const * stage, int iteration, double chi2)
+{
+    if (!control || !control->update(stage, iteration, chi2)) return false;
+    control->stop();
+    mosaicLog(pexLog::Log::WARN, "solve cancelled in %s after %d iterations (%.1f s)",
+	      stage, iteration, control->getElapsed());
+    return true;
+}
 
-    fsol = fluxFit_abs(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp);
-    chi2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp);
-    printf("chi2f: %e\n", chi2f);
-    e2f = calcChi2_abs(matchVec, sourceVec, nexp, nchip, fsol, ffp, true);
-    printf("err: %f (mag)\n", sqrt(e2f));
+/*
+ * The clip-and-refit iterations of the relative or absolute flux fit,
+ * storing the solution in fexp, fchip and ffp.
+ */
+static void fluxFitIterate(bool absolute,
+			   ObsVec& matchVec,
+			   int nmatch,
+			   ObsVec& sourceVec,
+			   int nsource,
+			   WcsDic& wcsDic,
+			   CcdSet& ccdSet,
+			   std::map<ExpType, float>& fexp,
+			   std::map<ChipType, float>& fchip,
+			   FluxFitParams::Ptr& ffp,
+			   SolverWorkspace &ws,
+			   ConvergenceCriteria const& criteria,
+			   RobustWeight const& robust,
+			   std::vector<double> const *fluxBasis,
+			   SolveStatistics *stats,
+			   SolveControl::Ptr const & control) {
+    ScopedTimer timer("fluxFit");
+
+    int nexp = wcsDic.size();
+    int nchip = ccdSet.size();
+    int nparam = nexp + nchip + ffp->ncoeff - 3;
+
+    // The robust fit reweights internally, so a single pass replaces the
+    // clip-and-refit iterations.  Huber weights never reach zero, so its
+    // outliers are clipped after the reweighting and the fit is repeated.
+    int maxIter = (robust.type == RobustWeight::NONE) ? criteria.maxIter :
+		  std::min(criteria.maxIter, (robust.type == RobustWeight::HUBER) ? 2 : 1);
+
+    // fexp and fchip hold a previous solution on a warm start
+    FluxSeed seed(wcsDic, ccdSet, fexp, fchip, ffp);
+    if (seed.nexpSeeded > 0) {
+	mosaicLog(pexLog::Log::INFO, "fluxFit: starting from the previous solution of %d of %d exposures",
+		  seed.nexpSeeded, nexp);
+    }
+
+    double *fsol = NULL;
+    double *fsolPrev = NULL;
+    double chi2Prev = std::numeric_limits<double>::quiet_NaN();
+    int nReject = 0;
+    for (int k = 0; k < maxIter; k++) {
+	std::vector<Obs*> unweighted;
+	FluxSeed const *kseed = (k == 0 && seed.nexpSeeded > 0) ? &seed : NULL;
+	if (absolute) {
+	    fsol = fluxFit_abs(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp, ws,
+			       robust, criteria, fluxBasis, kseed, &unweighted);
+	} else {
+	    fsol = fluxFit_rel(matchVec, nmatch, sourceVec, nsource, nexp, nchip, ffp, ws,
+			       robust, criteria, fluxBasis, kseed, &unweighted);
+	}
+	if (!unweighted.empty()) {
+	    ResidualSums zero(nexp, nchip);
+	    for (size_t i = 0; i < unweighted.size(); i++) {
+		zero.reject(unweighted[i]);
+	    }
+	    mosaicLog(pexLog::Log::INFO, "nreject (zero weight): %d", static_cast<int>(unweighted.size()));
+	    Metrics::get()->addCount("flux.nReject", unweighted.size());
+	    if (stats) addRejections(*stats, zero, true);
+	}
+	ResidualSums res(nexp, nchip);
+	sweepFluxResiduals(matchVec, sourceVec, nexp, nchip, fsol, ffp, 9.0, res);
+	if (res.num == 0) {
+	    mosaicLog(pexLog::Log::WARN, "fluxFit: no measurements left after %d iterations", k+1);
+	    delete [] fsolPrev;
+	    fsolPrev = NULL;
+	    break;
+	}
+	double chi2f = res.nchi2 / res.num;
+	mosaicLog(pexLog::Log::INFO, "chi2f: %e", chi2f);
+	double e2f = res.chi2 / res.num;
+	mosaicLog(pexLog::Log::INFO, "err: %f (mag)", sqrt(e2f));
+	if (stats) setFluxStatistics(*stats, k+1, res);
+
+	double dParam = fluxUpdateNorm(fsol, fsolPrev, nparam);
+	delete [] fsolPrev;
+	fsolPrev = NULL;
+	if (solveCancelled(control, "fluxFit", k+1, chi2f) || k + 1 == maxIter ||
+	    criteria.converged(k+1, dParam, chi2Prev, chi2f, nReject)) {
+	    mosaicLog(pexLog::Log::INFO, "fluxFit: stopped after %d iterations", k+1);
+	    break;
+	}
+
+	nReject = flagRejected(res);
+	mosaicLog(pexLog::Log::INFO, "nreject: %d", nReject);
+	Metrics::get()->addCount("flux.nReject", nReject);
+	if (stats) addRejections(*stats, res, true);
+	chi2Prev = chi2f;
+	fsolPrev = fsol;
+    }
+    if (fsol == NULL) return;
 
     int i = 0;
     for (WcsDic::iterator it = wcsDic.begin();
 	 it != wcsDic.end(); it++, i++) {
-	fexp.insert(std::map<ExpType, float>::value_type(it->first, pow(10., -0.4*fsol[i])));
+	fexp[it->first] = pow(10., -0.4*fsol[i]);
     }
     for (CcdSet::iterator it = ccdSet.begin();
 	 it != ccdSet.end(); it++, i++) {
-	fchip.insert(std::map<ExpType, float>::value_type(it->first, pow(10., -0.4*fsol[i])));
+	fchip[it->first] = pow(10., -0.4*fsol[i]);
     }
     for (int i = 0; i < ffp->ncoeff; i++) {
-       printf("%2d %8.5f\n", i, ffp->coeff[i]);
+       mosaicLog(pexLog::Log::DEBUG, "%2d %8.5f", i, ffp->coeff[i]);
     }
     delete [] fsol;
 }
 
-double *solveSIP_P(Poly::Ptr p,
-		   std::vector<Obs::Ptr> &obsVec) {
+void fluxFitRelative(ObsVec& matchVec,
+		     int nmatch,
+		     ObsVec& sourceVec,
+		     int nsource,
+		     WcsDic& wcsDic,
+		     CcdSet& ccdSet,
+		     std::map<ExpType, float>& fexp,
+		     std::map<ChipType, float>& fchip,
+		     FluxFitParams::Ptr& ffp,
+		     SolverWorkspace &ws,
+		     ConvergenceCriteria const& criteria,
+		     RobustWeight const& robust,
+		     std::vector<double> const *fluxBasis = NULL,
+		     SolveStatistics *stats = NULL,
+		     SolveControl::Ptr const & control = SolveControl::Ptr()) {
+    fluxFitIterate(false, matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp, ws,
+		   criteria, robust, fluxBasis, stats, control);
+}
+
+void fluxFitAbsolute(ObsVec& matchVec,
+		     int nmatch,
+		     ObsVec& sourceVec,
+		     int nsource,
+		     WcsDic& wcsDic,
+		     CcdSet& ccdSet,
+		     std::map<ExpType, float>& fexp,
+		     std::map<ChipType, float>& fchip,
+		     FluxFitParams::Ptr& ffp,
+		     SolverWorkspace &ws,
+		     ConvergenceCriteria const& criteria,
+		     RobustWeight const& robust,
+		     std::vector<double> const *fluxBasis = NULL,
+		     SolveStatistics *stats = NULL,
+		     SolveControl::Ptr const & control = SolveControl::Ptr()) {
+    fluxFitIterate(true, matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp, ws,
+		   criteria, robust, fluxBasis, stats, control);
+}
+
+/*
+ * Add observation o to the normal equations of the SIP inverse (upper
+ * triangle of a_data only).  pu is scratch space of p->ncoeff.
+ */
+void accumulateSIP(Poly::Ptr const &p, Obs const *o,
+		   double *a_data, double *b_data, double *pu) {
     int ncoeff = p->ncoeff;
     int *xorder = p->xorder;
     int *yorder = p->yorder;
 
-    double *a_data = new double[ncoeff*ncoeff];
-    double *d_data = new double[ncoeff*ncoeff];
-    double *b_data = new double[ncoeff];
-    double *c_data = new double[ncoeff];
+    for (int j = 0; j < ncoeff; j++) {
+	pu[j] = pow(o->U, xorder[j]) * pow(o->V, yorder[j]);
+    }
+    for (int j = 0; j < ncoeff; j++) {
+	b_data[j]        += (o->u - o->U) * pu[j];
+	b_data[j+ncoeff] += (o->v - o->V) * pu[j];
+	for (int i = 0; i <= j; i++) {
+	    a_data[i+j*ncoeff] += pu[j] * pu[i];
+	}
+    }
+}
 
+/*
+ * Complete the lower triangle of the matrix accumulated in ws and solve
+ * for the ap and bp coefficients, which are left in its right hand side.
+ */
+double *solveSIPNormal(int ncoeff, double *a_data, SolverWorkspace &ws) {
     for (int j = 0; j < ncoeff; j++) {
-	for (int i = 0; i < ncoeff; i++) {
-	    a_data[i+j*ncoeff] = 0.0;
-	    d_data[i+j*ncoeff] = 0.0;
+	for (int i = j+1; i < ncoeff; i++) {
+	    a_data[i+j*ncoeff] = a_data[j+i*ncoeff];
 	}
-	b_data[j] = 0.0;
-	c_data[j] = 0.0;
     }
 
-    double *pu = new double[ncoeff];
-    double *pv = new double[ncoeff];
+    return ws.solve();
+}
 
-    for (size_t k = 0; k < obsVec.size(); k++) {
-	Obs::Ptr o = obsVec[k];
-	if (o->good) {
-	    for (int j = 0; j < ncoeff; j++) {
-		pu[j] = pow(o->U, xorder[j]);
-		pv[j] = pow(o->V, yorder[j]);
-	    }
-	    for (int j = 0; j < ncoeff; j++) {
-		b_data[j] += (o->u - o->U) * pu[j] * pv[j];
-		c_data[j] += (o->v - o->V) * pu[j] * pv[j];
-		for (int i = 0; i < ncoeff; i++) {
-		    a_data[i+j*ncoeff] += pu[j] * pv[j] * pu[i] * pv[i];
-		    d_data[i+j*ncoeff] += pu[j] * pv[j] * pu[i] * pv[i];
-		}
-	    }
+/*
+ * Final pass once the astrometric solution has converged.  In a single
+ * sweep over the observations of each exposure it sets (U, V) from the CD
+ * matrix, accumulates the normal equations of the SIP inverse and
+ * evaluates the flux fit basis at (u, v), so the flux fit does not go back
+ * over the data to recompute it.  The two systems are still solved
+ * independently.  Both coordinates of the inverse polynomial (U, V) ->
+ * (u, v) of an exposure share one normal matrix, which is factored once
+ * for the two right-hand sides.  The basis of the i-th observation of the matches
+ * followed by the sources is stored at fluxBasis[i*(ffp->ncoeff-3)].
+ */
+void fitSIP(ObsVec &matchVec, ObsVec &sourceVec, CoeffSet &coeffVec, Poly::Ptr &p,
+	    FluxFitParams::Ptr const &ffp, std::vector<double> &fluxBasis) {
+    ScopedTimer timer("sip");
+    int nM = matchVec.size();
+    int nobs = nM + sourceVec.size();
+    int nfc = ffp->ncoeff - 3;
+    fluxBasis.assign(nobs*nfc, 0.0);
+
+    std::vector<Coeff::Ptr> coeff;
+    std::map<ExpType, int> index;
+    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
+	index.insert(std::map<ExpType, int>::value_type(it->first, coeff.size()));
+	coeff.push_back(it->second);
+    }
+
+    std::vector<std::vector<int> > byExp(coeff.size());
+    for (int i = 0; i < nobs; i++) {
+	Obs::Ptr const &o = (i < nM) ? matchVec[i] : sourceVec[i-nM];
+	std::map<ExpType, int>::const_iterator it = index.find(o->iexp);
+	if (it != index.end()) {
+	    byExp[it->second].push_back(i);
 	}
     }
 
-    double *coeffA = solveMatrix(ncoeff, a_data, b_data);
-    double *coeffB = solveMatrix(ncoeff, d_data, c_data);
+    int ncoeff = p->ncoeff;
 
-    double *coeff = new double[2*ncoeff];
-    for (int i = 0; i < ncoeff; i++) {
-	coeff[i]        = coeffA[i];
-	coeff[i+ncoeff] = coeffB[i];
-    }
+    #pragma omp parallel
+    {
+    SolverWorkspace ws;
+    #pragma omp for schedule(dynamic)
+    for (int j = 0; j < static_cast<int>(coeff.size()); j++) {
+	double *a_data = ws.matrix(ncoeff);
+	double *b_data = ws.rhs(ncoeff, 2);
+	double *pu = ws.pu(ncoeff);
+
+	double CD1_1 = coeff[j]->a[0];
+	double CD1_2 = coeff[j]->a[1];
+	double CD2_1 = coeff[j]->b[0];
+	double CD2_2 = coeff[j]->b[1];
+	double det = CD1_1 * CD2_2 - CD1_2 * CD2_1;
 
-    delete [] a_data;
-    delete [] d_data;
-    delete [] b_data;
-    delete [] c_data;
-    delete [] coeffA;
-    delete [] coeffB;
-    delete [] pu;
-    delete [] pv;
+	for (size_t k = 0; k < byExp[j].size(); k++) {
+	    int i = byExp[j][k];
+	    Obs *o = (i < nM) ? matchVec[i].get() : sourceVec[i-nM].get();
+	    o->U = ( o->xi * CD2_2 - o->eta * CD1_2) / det;
+	    o->V = (-o->xi * CD2_1 + o->eta * CD1_1) / det;
+	    if (o->good) {
+		accumulateSIP(p, o, a_data, b_data, pu);
+	    }
+	    ffp->evalBasis(o->u / ffp->u_max, o->v / ffp->v_max, &fluxBasis[i*nfc], 3);
+	}
 
-    return coeff;
+	double *a = solveSIPNormal(ncoeff, a_data, ws);
+	for (int k = 0; k < ncoeff; k++) {
+	    coeff[j]->ap[k] = a[k];
+	    coeff[j]->bp[k] = a[k+ncoeff];
+	}
+    }
+    }
 }
 
-void setCRVALtoDetJPeak(Coeff::Ptr c) {
-    double w = (3.-sqrt(5.))/2.;
-    double ua, ub, uc, ux;
-    double va, vb, vc, vx;
-    double fb, fx;
-    double u, v, upre, vpre;
-
-    u = upre = 0.0;
-    v = vpre = 0.0;
-
-    for (int i = 0; i < 10; i++) {
-	ua = u - 3000 / pow(2, i);
-	uc = u + 3000 / pow(2, i);
-	ub = ua * (1-w) + uc * w;
-
-	//fa = c->detJ(ua, v);
-	fb = c->detJ(ub, v);
-	//fc = c->detJ(uc, v);
-
-	while (1) {
-	    if (uc - ub > ub - ua) {
-		ux = ub * (1-w) + uc * w;
-	    } else {
-		ux = ua * (1-w) + ub * w;
-	    }
-	    fx = c->detJ(ux, v);
-	    if (uc - ub > ub - ua) {
-		if (fx > fb) {
-		    ua = ub;
-		    ub = ux;
-		    //fa = c->detJ(ua, v);
-		    fb = c->detJ(ub, v);
-		} else {
-		    uc = ux;
-		    //fc = c->detJ(uc, v);
-		}
-	    } else {
-		if (fx > fb) {
-		    uc = ub;
-		    ub = ux;
-		    //fc = c->detJ(uc, v);
-		    fb = c->detJ(ub, v);
-		} else {
-		    ua = ux;
-		    //fa = c->detJ(ua, v);
+/*
+ * Partial derivatives d^(m+n)P/du^m dv^n, 1 <= m+n <= 3, of the polynomial
+ * with coefficients c at (u, v), stored in d[m][n].
+ */
+void polyDerivatives(Poly::Ptr const &p, double const *c, double u, double v, double d[4][4])
+{
+    std::vector<double> up(p->order+1);
+    std::vector<double> vp(p->order+1);
+    up[0] = vp[0] = 1.0;
+    for (int k = 1; k <= p->order; k++) {
+	up[k] = up[k-1] * u;
+	vp[k] = vp[k-1] * v;
+    }
+
+    for (int m = 0; m < 4; m++) {
+	for (int n = 0; n < 4; n++) {
+	    d[m][n] = 0.0;
+	}
+    }
+
+    for (int k = 0; k < p->ncoeff; k++) {
+	int i = p->xorder[k];
+	int j = p->yorder[k];
+	double fu = 1.0;
+	for (int m = 0; m <= 3 && m <= i; m++) {
+	    double fv = 1.0;
+	    for (int n = 0; m + n <= 3 && n <= j; n++) {
+		if (m + n > 0) {
+		    d[m][n] += c[k] * fu * up[i-m] * fv * vp[j-n];
 		}
+		fv *= (j - n);
 	    }
-	    if (uc - ua < 0.01) break;
+	    fu *= (i - m);
 	}
+    }
+}
 
-	u = ub;
+/*
+ * Value, gradient (f_u, f_v) and Hessian (f_uu, f_uv, f_vv) of the signed
+ * Jacobian determinant f = xi_u * eta_v - xi_v * eta_u.
+ */
+void detJDerivatives(Coeff::Ptr const &c, double u, double v, double *f, double g[2], double h[3])
+{
+    double X[4][4], Y[4][4];
+    polyDerivatives(c->p, c->a, u, v, X);
+    polyDerivatives(c->p, c->b, u, v, Y);
 
-	va = v - 3000 / pow(2, i);
-	vc = v + 3000 / pow(2, i);
-	vb = va * (1-w) + vc * w;
+    *f = X[1][0] * Y[0][1] - X[0][1] * Y[1][0];
 
-	//fa = c->detJ(u, va);
-	fb = c->detJ(u, vb);
-	//fc = c->detJ(u, vc);
+    g[0] = X[2][0] * Y[0][1] + X[1][0] * Y[1][1] - X[1][1] * Y[1][0] - X[0][1] * Y[2][0];
+    g[1] = X[1][1] * Y[0][1] + X[1][0] * Y[0][2] - X[0][2] * Y[1][0] - X[0][1] * Y[1][1];
 
-	while (1) {
-	    if (vc - vb > vb - va) {
-		vx = vb * (1-w) + vc * w;
-	    } else {
-		vx = va * (1-w) + vb * w;
-	    }
-	    fx = c->detJ(u, vx);
-	    if (vc - vb > vb - va) {
-		if (fx > fb) {
-		    va = vb;
-		    vb = vx;
-		    //fa = c->detJ(u, va);
-		    fb = c->detJ(u, vb);
-		} else {
-		    vc = vx;
-		    //fc = c->detJ(u, vc);
-		}
-	    } else {
-		if (fx > fb) {
-		    vc = vb;
-		    vb = vx;
-		    //fc = c->detJ(u, vc);
-		    fb = c->detJ(u, vb);
-		} else {
-		    va = vx;
-		    //fa = c->detJ(u, va);
-		}
+    h[0] = X[3][0] * Y[0][1] + 2.0 * X[2][0] * Y[1][1] + X[1][0] * Y[2][1]
+	 - X[2][1] * Y[1][0] - 2.0 * X[1][1] * Y[2][0] - X[0][1] * Y[3][0];
+    h[1] = X[2][1] * Y[0][1] + X[2][0] * Y[0][2] + X[1][0] * Y[1][2]
+	 - X[1][2] * Y[1][0] - X[0][2] * Y[2][0] - X[0][1] * Y[2][1];
+    h[2] = X[1][2] * Y[0][1] + 2.0 * X[1][1] * Y[0][2] + X[1][0] * Y[0][3]
+	 - X[0][3] * Y[1][0] - 2.0 * X[0][2] * Y[1][1] - X[0][1] * Y[1][2];
+}
+
+lsst::afw::geom::Point2D
+lsst::meas::mosaic::detJPeak(Coeff::Ptr &c, double tol, int maxIter)
+{
+    // Largest step, same as the widest bracket of the former line search
+    double const maxStep = 3000.0;
+
+    double u = 0.0;
+    double v = 0.0;
+    double f, g[2], h[3];
+    detJDerivatives(c, u, v, &f, g, h);
+
+    // Maximize |detJ|: work with s*f, which is positive near the origin
+    double s = (f < 0.0) ? -1.0 : 1.0;
+
+    for (int iter = 0; iter < maxIter; iter++) {
+	double gu  = s * g[0];
+	double gv  = s * g[1];
+	double huu = s * h[0];
+	double huv = s * h[1];
+	double hvv = s * h[2];
+
+	// Shift the Hessian to be negative definite if it is not
+	double tr = huu + hvv;
+	double disc = sqrt(std::max(0.25 * tr * tr - (huu * hvv - huv * huv), 0.0));
+	double emax = 0.5 * tr + disc;
+	if (emax >= 0.0) {
+	    double shift = emax + std::max(fabs(0.5 * tr - disc), emax);
+	    huu -= shift;
+	    hvv -= shift;
+	}
+	double det = huu * hvv - huv * huv;
+
+	double du, dv;
+	if (det > 0.0) {
+	    du = -( hvv * gu - huv * gv) / det;
+	    dv = -(-huv * gu + huu * gv) / det;
+	} else {
+	    // Flat: follow the gradient
+	    double gnorm = sqrt(gu * gu + gv * gv);
+	    if (gnorm == 0.0) break;
+	    du = gu / gnorm * maxStep;
+	    dv = gv / gnorm * maxStep;
+	}
+	double step = sqrt(du * du + dv * dv);
+	if (step > maxStep) {
+	    du *= maxStep / step;
+	    dv *= maxStep / step;
+	}
+
+	// Backtrack until |detJ| does not decrease
+	double fnew, gnew[2], hnew[3];
+	bool ascent = false;
+	for (int k = 0; k < 30; k++) {
+	    detJDerivatives(c, u + du, v + dv, &fnew, gnew, hnew);
+	    if (s * fnew >= s * f) {
+		ascent = true;
+		break;
 	    }
-	    if (vc - va < 0.01) break;
+	    du *= 0.5;
+	    dv *= 0.5;
 	}
+	if (!ascent) break;
 
-	v = vb;
+	u += du;
+	v += dv;
+	f = fnew;
+	for (int k = 0; k < 2; k++) g[k] = gnew[k];
+	for (int k = 0; k < 3; k++) h[k] = hnew[k];
 
-	if (fabs(u-upre) < 0.01 && fabs(v-vpre) < 0.01) break;
+	if (sqrt(du * du + dv * dv) < tol) break;
     }
 
+    return lsst::afw::geom::Point2D(u, v);
+}
+
+void setCRVALtoDetJPeak(Coeff::Ptr c) {
+    lsst::afw::geom::Point2D peak = detJPeak(c);
+    double u = peak.getX();
+    double v = peak.getY();
+
     double xi, eta;
     c->uvToXiEta(u, v, &xi, &eta);
     xi  = xi  * D2R;
@@ -3063,64 +3971,122 @@ void setCRVALtoDetJPeak(Coeff::Ptr c) {
     c->D = delta;
 }
 
-CoeffSet
-initialFit(int nexp,
-	   ObsVec &matchVec,
-	   WcsDic &wcsDic,
-	   CcdSet &ccdSet,
-	   Poly::Ptr &p) {
-    int nMobs = matchVec.size();
-
-    // Solve for polynomial coefficients and crvals
-    // for each exposure separately
-    // These values will be used as initial guess for
-    // the subsequent fitting
+void
+lsst::meas::mosaic::setCRVALtoDetJPeak(CoeffSet &coeffSet)
+{
+    std::vector<Coeff::Ptr> coeff;
+    for (CoeffSet::iterator it = coeffSet.begin(); it != coeffSet.end(); it++) {
+	coeff.push_back(it->second);
+    }
 
-    CoeffSet coeffVec;
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < static_cast<int>(coeff.size()); j++) {
+	::setCRVALtoDetJPeak(coeff[j]);
+    }
+}
 
-    for (WcsDic::iterator it =  wcsDic.begin(); it != wcsDic.end(); it++) {
-	ExpType iexp = it->first;
+/*
+ * Split obsVec into one ObsVec per exposure, in the key order of expMap
+ * (a WcsDic or CoeffSet).  Objects of unknown exposures are dropped.
+ */
+template <typename ExpMap>
+std::vector<ObsVec> partitionByExposure(ObsVec const &obsVec, ExpMap const &expMap)
+{
+    std::map<ExpType, int> index;
+    int j = 0;
+    for (typename ExpMap::const_iterator it = expMap.begin(); it != expMap.end(); it++, j++) {
+	index.insert(std::map<ExpType, int>::value_type(it->first, j));
+    }
 
-	// Select objects for a specific exposure id
-	std::vector<Obs::Ptr> obsVec_sub;
-	for (int j = 0; j < nMobs; j++) {
-	    if (matchVec[j]->iexp == iexp) {
-		obsVec_sub.push_back(matchVec[j]);
-	    }
+    std::vector<ObsVec> byExp(expMap.size());
+    for (size_t i = 0; i < obsVec.size(); i++) {
+	std::map<ExpType, int>::const_iterator it = index.find(obsVec[i]->iexp);
+	if (it != index.end()) {
+	    byExp[it->second].push_back(obsVec[i]);
 	}
+    }
 
-	// Solve for polinomial and crval
-	double* a = solveForCoeff(obsVec_sub, p);
+    return byExp;
+}
 
-	double chi2 = calcChi(obsVec_sub, a, p);
-	printf("calcChi: %e\n", chi2);
-	double e2 = chi2 / obsVec_sub.size();
-	flagObj(obsVec_sub, a, p, 9.0*e2);
+/*
+ * Initial fit of the polynomial, crval and offset of a single exposure.
+ * Only reads the shared inputs, so that exposures can be fitted concurrently.
+ */
+Coeff::Ptr
+initialFitExposure(ExpType iexp,
+		   ObsVec &obsVec_sub,
+		   lsst::afw::image::Wcs::Ptr const &wcs,
+		   CcdSet const &ccdSet,
+		   Poly::Ptr const &p,
+		   ConvergenceCriteria const &criteria,
+		   SolverWorkspace &ws) {
+    // Solve for polinomial and crval
+    double* a = solveForCoeff(obsVec_sub, p, ws);
+
+    double chi2 = calcChi(obsVec_sub, a, p);
+    mosaicLog(pexLog::Log::DEBUG, "exposure %lld calcChi: %e", (long long)iexp, chi2);
+    double e2 = chi2 / obsVec_sub.size();
+    flagObj(obsVec_sub, a, p, 9.0*e2);
+
+    delete [] a;
+    a = solveForCoeff(obsVec_sub, p, ws);
+    chi2 = calcChi(obsVec_sub, a, p);
+    mosaicLog(pexLog::Log::DEBUG, "exposure %lld calcChi: %e", (long long)iexp, chi2);
+
+    // Store solution into Coeff class
+    Coeff::Ptr c = Coeff::Ptr(new Coeff(p));
+    c->iexp = iexp;
+    for (int k = 0; k < p->ncoeff; k++) {
+	c->a[k] = a[k];
+	c->b[k] = a[k+p->ncoeff];
+    }
+    lsst::afw::geom::PointD crval
+	= wcs->getSkyOrigin()->getPosition(lsst::afw::geom::radians);
+    c->A = crval[0] + a[p->ncoeff*2];
+    c->D = crval[1] + a[p->ncoeff*2+1];
+    c->x0 = c->y0 = 0.0;
 
-	delete [] a;
-	a = solveForCoeff(obsVec_sub, p);
-	chi2 = calcChi(obsVec_sub, a, p);
-	printf("calcChi: %e\n", chi2);
+    for (size_t j = 0; j < obsVec_sub.size(); j++) {
+	obsVec_sub[j]->setXiEta(c->A, c->D);
+    }
 
-	// Store solution into Coeff class
-	Coeff::Ptr c = Coeff::Ptr(new Coeff(p));
-	c->iexp = iexp;
-	for (int k = 0; k < p->ncoeff; k++) {
-	    c->a[k] = a[k];
-	    c->b[k] = a[k+p->ncoeff];
-	}
-	lsst::afw::geom::PointD crval
-	    = wcsDic[iexp]->getSkyOrigin()->getPosition(lsst::afw::geom::radians);
-	c->A = crval[0] + a[p->ncoeff*2];
-	c->D = crval[1] + a[p->ncoeff*2+1];
-	c->x0 = c->y0 = 0.0;
+    delete [] a;
+    a = solveForCoeffWithOffset(obsVec_sub, c, p, ws);
 
-	for (size_t j = 0; j < obsVec_sub.size(); j++) {
-	    obsVec_sub[j]->setXiEta(c->A, c->D);
-	}
+    // Store solution into Coeff class
+    for (int k = 0; k < p->ncoeff; k++) {
+	c->a[k] += a[k];
+	c->b[k] += a[k+p->ncoeff];
+    }
+    c->x0 += a[2*p->ncoeff];
+    c->y0 += a[2*p->ncoeff+1];
+
+    for (size_t j = 0; j < obsVec_sub.size(); j++) {
+	obsVec_sub[j]->setUV(ccdSet.find(obsVec_sub[j]->ichip)->second, c->x0, c->y0);
+    }
+    chi2 = calcChi2(obsVec_sub, c, p);
+    mosaicLog(pexLog::Log::DEBUG, "exposure %lld calcChi2: %e", (long long)iexp, chi2);
 
+    setCRVALtoDetJPeak(c);
+
+    for (size_t j = 0; j < obsVec_sub.size(); j++) {
+	obsVec_sub[j]->setXiEta(c->A, c->D);
+    }
+
+    // Refine polynomial and offset around the new crval until converged
+    double chi2Prev = std::numeric_limits<double>::quiet_NaN();
+    for (int iter = 0; iter < criteria.maxIter; iter++) {
 	delete [] a;
-	a = solveForCoeffWithOffset(obsVec_sub, c, p);
+	a = solveForCoeffWithOffset(obsVec_sub, c, p, ws);
+
+	double da2 = 0.0;
+	double a2 = 0.0;
+	for (int k = 0; k < p->ncoeff; k++) {
+	    da2 += pow(a[k], 2) + pow(a[k+p->ncoeff], 2);
+	    a2  += pow(c->a[k], 2) + pow(c->b[k], 2);
+	}
+	double dParam = (a2 > 0.0) ? sqrt(da2 / a2) : 0.0;
 
 	// Store solution into Coeff class
 	for (int k = 0; k < p->ncoeff; k++) {
@@ -3131,61 +4097,149 @@ initialFit(int nexp,
 	c->y0 += a[2*p->ncoeff+1];
 
 	for (size_t j = 0; j < obsVec_sub.size(); j++) {
-	    obsVec_sub[j]->setUV(ccdSet[obsVec_sub[j]->ichip], c->x0, c->y0);
+	    obsVec_sub[j]->setUV(ccdSet.find(obsVec_sub[j]->ichip)->second, c->x0, c->y0);
 	}
 	chi2 = calcChi2(obsVec_sub, c, p);
-	printf("calcChi2: %e\n", chi2);
+	mosaicLog(pexLog::Log::DEBUG, "exposure %lld calcChi2: %e", (long long)iexp, chi2);
 
-	setCRVALtoDetJPeak(c);
+	if (criteria.converged(iter+1, dParam, chi2Prev, chi2, 0)) break;
+	chi2Prev = chi2;
+    }
 
-	for (size_t j = 0; j < obsVec_sub.size(); j++) {
-	    obsVec_sub[j]->setXiEta(c->A, c->D);
-	}
+    delete [] a;
 
-	delete [] a;
-	a = solveForCoeffWithOffset(obsVec_sub, c, p);
+    return c;
+}
 
-	// Store solution into Coeff class
-	for (int k = 0; k < p->ncoeff; k++) {
-	    c->a[k] += a[k];
-	    c->b[k] += a[k+p->ncoeff];
-	}
-	c->x0 += a[2*p->ncoeff];
-	c->y0 += a[2*p->ncoeff+1];
+CoeffSet
+initialFit(int nexp,
+	   ObsVec &matchVec,
+	   WcsDic &wcsDic,
+	   CcdSet &ccdSet,
+	   Poly::Ptr &p,
+	   ConvergenceCriteria const &criteria,
+	   CoeffSet const &coeffSeed) {
+    ScopedTimer timer("initialFit");
+    // Solve for polynomial coefficients and crvals
+    // for each exposure separately
+    // These values will be used as initial guess for
+    // the subsequent fitting
 
-	for (size_t j = 0; j < obsVec_sub.size(); j++) {
-	    obsVec_sub[j]->setUV(ccdSet[obsVec_sub[j]->ichip], c->x0, c->y0);
-	}
-	chi2 = calcChi2(obsVec_sub, c, p);
-	printf("calcChi2: %e\n", chi2);
+    std::vector<ObsVec> byExp = partitionByExposure(matchVec, wcsDic);
 
-	/////////////////////////////////////////////////////////////////////////////////
-	delete [] a;
-	a = solveForCoeffWithOffset(obsVec_sub, c, p);
+    std::vector<ExpType> iexp;
+    std::vector<lsst::afw::image::Wcs::Ptr> wcs;
+    for (WcsDic::iterator it = wcsDic.begin(); it != wcsDic.end(); it++) {
+	iexp.push_back(it->first);
+	wcs.push_back(it->second);
+    }
 
-	// Store solution into Coeff class
-	for (int k = 0; k < p->ncoeff; k++) {
-	    c->a[k] += a[k];
-	    c->b[k] += a[k+p->ncoeff];
-	}
-	c->x0 += a[2*p->ncoeff];
-	c->y0 += a[2*p->ncoeff+1];
+    std::vector<Coeff::Ptr> coeff(iexp.size());
 
-	for (size_t j = 0; j < obsVec_sub.size(); j++) {
-	    obsVec_sub[j]->setUV(ccdSet[obsVec_sub[j]->ichip], c->x0, c->y0);
+    #pragma omp parallel
+    {
+    SolverWorkspace ws;
+    #pragma omp for schedule(dynamic)
+    for (int j = 0; j < static_cast<int>(iexp.size()); j++) {
+	// Exposures with a previous solution start from it
+	CoeffSet::const_iterator seed = coeffSeed.find(iexp[j]);
+	if (seed != coeffSeed.end() && seed->second->p->order == p->order) {
+	    Coeff::Ptr c = Coeff::Ptr(new Coeff(p));
+	    c->iexp = iexp[j];
+	    for (int k = 0; k < p->ncoeff; k++) {
+		c->a[k]  = seed->second->a[k];
+		c->b[k]  = seed->second->b[k];
+		c->ap[k] = seed->second->ap[k];
+		c->bp[k] = seed->second->bp[k];
+	    }
+	    c->A  = seed->second->A;
+	    c->D  = seed->second->D;
+	    c->x0 = seed->second->x0;
+	    c->y0 = seed->second->y0;
+	    // As initialFitExposure, u,v are about the optical centre of the seed
+	    for (size_t i = 0; i < byExp[j].size(); i++) {
+		byExp[j][i]->setUV(ccdSet.find(byExp[j][i]->ichip)->second, c->x0, c->y0);
+	    }
+	    coeff[j] = c;
+	} else {
+	    coeff[j] = initialFitExposure(iexp[j], byExp[j], wcs[j], ccdSet, p, criteria, ws);
 	}
-	chi2 = calcChi2(obsVec_sub, c, p);
-	printf("calcChi2: %e\n", chi2);
-	/////////////////////////////////////////////////////////////////////////////////
-
-	coeffVec.insert(std::map<ExpType, Coeff::Ptr>::value_type(iexp, c));
+    }
+    }
 
-	delete [] a;
+    CoeffSet coeffVec;
+    for (size_t j = 0; j < iexp.size(); j++) {
+	coeffVec.insert(std::map<ExpType, Coeff::Ptr>::value_type(iexp[j], coeff[j]));
     }
 
     return coeffVec;
 }
 
+SolverPlan::SolverPlan() :
+    backend(DENSE),
+    astromSize(0), astromFullSize(0), fluxSize(0),
+    astromBytes(0.0), fluxBytes(0.0), obsBytes(0.0), peakBytes(0.0),
+    astromFlops(0.0), fluxFlops(0.0)
+{
+}
+
+SolverPlan
+lsst::meas::mosaic::planSolve(int nexp, int nchip, int order, int fluxFitOrder,
+			      int nstar, long nMatchObs, long nSourceObs,
+			      SolverPlan::Backend backend,
+			      bool solveCcd, bool allowRotation)
+{
+#if defined(USE_MKL)
+    double const luCopies = 1.0;	// SolverWorkspace factors in place
+#elif EIGEN_VERSION_AT_LEAST(3,3,0)
+    double const luCopies = 1.0;
+#else
+    double const luCopies = 2.0;	// PartialPivLU works on a copy
+#endif
+    double const d = sizeof(double);
+
+    SolverPlan plan;
+    plan.backend = backend;
+
+    // Astrometry: as in solveLinApprox_Star
+    int ncoeff = Poly(order).ncoeff;
+    int np = solveCcd ? (allowRotation ? 3 : 2) : 0;
+    long size0 = 2 * ncoeff * nexp + np * nchip + ((solveCcd && allowRotation) ? 1 : 0);
+    plan.astromFullSize = size0 + 2 * static_cast<long>(nstar);
+    double nObs = static_cast<double>(nMatchObs) + nSourceObs;
+    double nr = ncoeff + np;
+    double assembly = 4.0 * nr * nr * nObs;
+
+    if (backend == SolverPlan::STAR_ELIMINATED) {
+	double n = size0;
+	plan.astromSize = size0;
+	plan.astromBytes = d * (luCopies * n * n + 3.0 * n)
+	    + d * (8.0 * nstar + 2.0 * n)	// star blocks, solution, coupling
+	    + sizeof(int) * (nSourceObs + 2.0 * nstar);
+	double m = (nstar > 0) ? 2.0 * nr * nSourceObs / nstar : 0.0;
+	plan.astromFlops = assembly + 4.0 * m * m * nstar + 4.0 * nr * nSourceObs
+	    + 2.0 / 3.0 * n * n * n;
+    } else {
+	double n = plan.astromFullSize;
+	plan.astromSize = plan.astromFullSize;
+	plan.astromBytes = d * (luCopies * n * n + 3.0 * n);
+	plan.astromFlops = assembly + 2.0 / 3.0 * n * n * n;
+    }
+
+    // Photometry: as in solveFluxReduced, which always eliminates the stars
+    int fcoeff = (fluxFitOrder + 1) * (fluxFitOrder + 2) / 2 - 3;
+    double nf = nexp + nchip + fcoeff + 2;
+    plan.fluxSize = static_cast<long>(nf);
+    plan.fluxBytes = d * (luCopies * nf * nf + 3.0 * nf)
+	+ nObs * (sizeof(FluxTerm) + d * (2.0 * fcoeff + 1.0));	// terms, basis, cache, weights
+    plan.fluxFlops = 2.0 * (fcoeff + 2.0) * (fcoeff + 2.0) * nObs + 2.0 / 3.0 * nf * nf * nf;
+
+    plan.obsBytes = nObs * (sizeof(Obs) + sizeof(Obs::Ptr) + 2.0 * sizeof(long));
+    plan.peakBytes = plan.obsBytes + std::max(plan.astromBytes, plan.fluxBytes);
+
+    return plan;
+}
+
 CoeffSet
 lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
 					 int nmatch,
@@ -3200,13 +4254,29 @@ lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
 					 bool verbose,
                      double catRMS,
                      bool writeSnapshots,
-                     std::string const & snapshotDir
+                     std::string const & snapshotDir,
+					 ConvergenceCriteria const & astromCriteria,
+					 ConvergenceCriteria const & fluxCriteria,
+					 ConvergenceCriteria const & initCriteria,
+					 CoeffSet const & coeffSeed,
+					 RobustWeight const & fluxRobust,
+					 SolveStatistics::Ptr const & stats,
+					 SnapshotFormat snapshotFormat,
+					 SolveControl::Ptr const & control
 )
 {
+    ScopedTimer timer("solveMosaic");
+    double tStart = wallTime();
     boost::filesystem::path snapshotPath(snapshotDir);
+    std::string const snapshotExt = snapshotExtension(snapshotFormat);
+    boost::scoped_ptr<SnapshotWriter> snapshots;
+    if (writeSnapshots) snapshots.reset(new SnapshotWriter(snapshotFormat));
 
     Poly::Ptr p = Poly::Ptr(new Poly(order));
 
+    // Normal equations of the astrometric and flux fits, reused throughout
+    SolverWorkspace ws;
+
     int nMobs = matchVec.size();
 
     int nexp = wcsDic.size();
@@ -3214,7 +4284,7 @@ lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
     int ncoeff = p->ncoeff;
 
     if (writeSnapshots) {
-        writeObsVec((snapshotPath / "match-initial-0.fits").native(), matchVec);
+        snapshots->write((snapshotPath / ("match-initial-0" + snapshotExt)).native(), matchVec);
     }
 
     // Solve for polynomial coefficients and crvals
@@ -3222,7 +4292,8 @@ lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
     // These values will be used as initial guess for
     // the subsequent fitting
 
-    CoeffSet coeffVec = initialFit(nexp, matchVec, wcsDic, ccdSet, p);
+    CoeffSet coeffVec = initialFit(nexp, matchVec, wcsDic, ccdSet, p, initCriteria, coeffSeed);
+    if (stats) stats->reset(wcsDic, ccdSet);
 
     // Update Xi and Eta using new crval (rac and decc)
     for (int i = 0; i < nMobs; i++) {
@@ -3233,12 +4304,15 @@ lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
     }
 
     if (writeSnapshots) {
-        writeObsVec((snapshotPath / "match-initial-1.fits").native(), matchVec);
+        snapshots->write((snapshotPath / ("match-initial-1" + snapshotExt)).native(), matchVec);
     }
 
     double *coeff;
-    for (int k = 0; k < 3; k++) {
-	coeff = solveLinApprox(matchVec, coeffVec, nchip, p, solveCcd, allowRotation, catRMS);
+    double chi2Prev = std::numeric_limits<double>::quiet_NaN();
+    for (int k = 0; k < astromCriteria.maxIter; k++) {
+	if (solveCancelled(control, "astrometry", k, chi2Prev)) return coeffVec;
+	coeff = solveLinApprox(matchVec, coeffVec, nchip, p, ws, solveCcd, allowRotation, catRMS);
+	double dParam = astromUpdateNorm(coeff, coeffVec, ccdSet, ncoeff, solveCcd, allowRotation);
 
 	int j = 0;
 	for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++, j++) {
@@ -3278,88 +4352,149 @@ lsst::meas::mosaic::solveMosaic_CCD_shot(int order,
 	}
 
     if (writeSnapshots) {
-        writeObsVec((snapshotPath / (boost::format("match-iter-%d.fits") % k).str()).native(), matchVec);
+        snapshots->write((snapshotPath / ((boost::format("match-iter-%d") % k).str() + snapshotExt)).native(), matchVec);
     }
 
 	delete [] coeff;
 
-	double chi2 = calcChi2(matchVec, coeffVec, p);
-	printf("calcChi2: %e\n", chi2);
-	double e2 = chi2 / matchVec.size();
-	flagObj2(matchVec, coeffVec, p, 9.0, catRMS);
-    }
-
-    std::map<ExpType, Eigen::Matrix2d> cd;
-    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	Eigen::Matrix2d c;
-	c << it->second->a[0], it->second->a[1], it->second->b[0], it->second->b[1];
-	cd.insert(std::map<ExpType, Eigen::Matrix2d>::value_type(it->first, c));
-    }
-    for (int i = 0; i < nMobs; i++) {
-	double CD1_1 = cd[matchVec[i]->iexp](0,0);
-	double CD1_2 = cd[matchVec[i]->iexp](0,1);
-	double CD2_1 = cd[matchVec[i]->iexp](1,0);
-	double CD2_2 = cd[matchVec[i]->iexp](1,1);
-	double det = CD1_1 * CD2_2 - CD1_2 * CD2_1;
-	matchVec[i]->U = ( matchVec[i]->xi * CD2_2 - matchVec[i]->eta * CD1_2) / det;
-	matchVec[i]->V = (-matchVec[i]->xi * CD2_1 + matchVec[i]->eta * CD1_1) / det;
-    }
-
-    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	std::vector<Obs::Ptr> obsVec_sub;
-	for (size_t j = 0; j < matchVec.size(); j++) {
-	    Obs::Ptr iobs = matchVec[j];
-	    if (iobs->iexp == it->first) {
-		obsVec_sub.push_back(iobs);
-	    }
+	ResidualSums res(nexp, nchip);
+	sweepResiduals(matchVec, coeffVec, p, 9.0, catRMS, res);
+	double chi2 = res.chi2;
+	mosaicLog(pexLog::Log::INFO, "calcChi2: %e", chi2);
+	int nReject = flagRejected(res);
+	mosaicLog(pexLog::Log::INFO, "nreject = %d", nReject);
+	Metrics::get()->addCount("astrom.nReject", nReject);
+	if (stats) {
+	    setAstromStatistics(*stats, k+1, res, NULL);
+	    addRejections(*stats, res, false);
 	}
-	double *a = solveSIP_P(p, obsVec_sub);
-	for (int k = 0; k < p->ncoeff; k++) {
-	    it->second->ap[k] = a[k];
-	    it->second->bp[k] = a[k+p->ncoeff];
+
+	if (astromCriteria.converged(k+1, dParam, chi2Prev, chi2, nReject)) {
+	    mosaicLog(pexLog::Log::INFO, "converged after %d iterations", k+1);
+	    break;
 	}
-	delete [] a;
+	chi2Prev = chi2;
     }
 
-    printf("fluxFit ...\n");
+    if (solveCancelled(control, "fluxFit", 0, chi2Prev)) return coeffVec;
+
+    ObsVec sourceVec;
+    std::vector<double> fluxBasis;
+    fitSIP(matchVec, sourceVec, coeffVec, p, ffp, fluxBasis);
+
+    double tFlux = wallTime();
+    mosaicLog(pexLog::Log::INFO, "fluxFit ...");
     if (ffp->absolute) {
-	ObsVec sourceVec;
-	fluxFitAbsolute(matchVec, nmatch, sourceVec, 0, wcsDic, ccdSet, fexp, fchip, ffp);
+	fluxFitAbsolute(matchVec, nmatch, sourceVec, 0, wcsDic, ccdSet, fexp, fchip, ffp, ws, fluxCriteria,
+			fluxRobust, &fluxBasis, stats.get(), control);
     } else {
-	ObsVec sourceVec;
-	fluxFitRelative(matchVec, nmatch, sourceVec, 0, wcsDic, ccdSet, fexp, fchip, ffp);
+	fluxFitRelative(matchVec, nmatch, sourceVec, 0, wcsDic, ccdSet, fexp, fchip, ffp, ws, fluxCriteria,
+			fluxRobust, &fluxBasis, stats.get(), control);
     }
+    if (stats) {
+	stats->astromTime = tFlux - tStart;
+	stats->fluxTime = wallTime() - tFlux;
+    }
+
+    if (control && control->isStopped()) return coeffVec;
 
     for (int i = 0; i < nMobs; i++) {
 	matchVec[i]->setFitVal2(coeffVec[matchVec[i]->iexp], p);
     }
 
+    if (control) control->update("done");
     return coeffVec;
 }
 
-CoeffSet
-lsst::meas::mosaic::solveMosaic_CCD(int order,
-				    int nmatch,
-				    int nsource,
-				    ObsVec &matchVec,
-				    ObsVec &sourceVec,
-				    WcsDic &wcsDic,
-				    CcdSet &ccdSet,
-				    FluxFitParams::Ptr &ffp,
-				    std::map<ExpType, float> &fexp,
-				    std::map<ChipType, float> &fchip,
-				    bool solveCcd,
-				    bool allowRotation,
-				    bool verbose,
-				    double catRMS,
-                    bool writeSnapshots,
-                    std::string const & snapshotDir
-)
+/*
+ * Save the state of solveMosaic_CCD; nothing is done without a file name.
+ */
+static void saveCheckpoint(std::string const & filename,
+			   Checkpoint::Phase phase,
+			   int niter,
+			   double chi2Prev,
+			   int nmatch,
+			   int nsource,
+			   ObsVec const &matchVec,
+			   ObsVec const &sourceVec,
+			   CoeffSet const &coeffVec,
+			   CcdSet const &ccdSet,
+			   FluxFitParams::Ptr const &ffp,
+			   std::map<ExpType, float> const &fexp,
+			   std::map<ChipType, float> const &fchip)
+{
+    if (filename.empty()) return;
+
+    ScopedTimer timer("checkpoint");
+    Checkpoint cp;
+    cp.phase = phase;
+    cp.niter = niter;
+    cp.chi2Prev = chi2Prev;
+    cp.nmatch = nmatch;
+    cp.nsource = nsource;
+    cp.matchVec = matchVec;
+    cp.sourceVec = sourceVec;
+    cp.coeffSet = coeffVec;
+    cp.ffp = ffp;
+    cp.fexp = fexp;
+    cp.fchip = fchip;
+    writeCheckpoint(filename, cp, ccdSet);
+    mosaicLog(pexLog::Log::INFO, "checkpoint (phase %d, %d iterations) written to %s",
+	      static_cast<int>(phase), niter, filename.c_str());
+}
+
+/*
+ * Body of solveMosaic_CCD and resumeMosaic_CCD.  With resume set, the
+ * initial fit is replaced by the solution of the checkpoint, and the
+ * iterations (and the flux fit) it has already done are skipped.
+ */
+static CoeffSet
+solveMosaic(int order,
+	    int nmatch,
+	    int nsource,
+	    ObsVec &matchVec,
+	    ObsVec &sourceVec,
+	    WcsDic &wcsDic,
+	    CcdSet &ccdSet,
+	    FluxFitParams::Ptr &ffp,
+	    std::map<ExpType, float> &fexp,
+	    std::map<ChipType, float> &fchip,
+	    bool solveCcd,
+	    bool allowRotation,
+	    double catRMS,
+	    bool writeSnapshots,
+	    std::string const & snapshotDir,
+	    SnapshotFormat snapshotFormat,
+	    ConvergenceCriteria const & astromCriteria,
+	    ConvergenceCriteria const & fluxCriteria,
+	    ConvergenceCriteria const & initCriteria,
+	    CoeffSet const & coeffSeed,
+	    RobustWeight const & fluxRobust,
+	    SolveStatistics::Ptr const & stats,
+	    SolverPlan::Backend backend,
+	    std::string const & checkpointFile,
+	    Checkpoint const *resume,
+	    SolveControl::Ptr const & control)
 {
+    ScopedTimer timer("solveMosaic");
+    double tStart = wallTime();
     boost::filesystem::path snapshotPath(snapshotDir);
+    std::string const snapshotExt = snapshotExtension(snapshotFormat);
+    boost::scoped_ptr<SnapshotWriter> snapshots;
+    if (writeSnapshots) snapshots.reset(new SnapshotWriter(snapshotFormat));
+
+    if (resume && !resume->coeffSet.empty() &&
+	resume->coeffSet.begin()->second->p->order != order) {
+	mosaicLog(pexLog::Log::WARN, "checkpoint has fitting order %d; %d is ignored",
+		  resume->coeffSet.begin()->second->p->order, order);
+	order = resume->coeffSet.begin()->second->p->order;
+    }
 
     Poly::Ptr p = Poly::Ptr(new Poly(order));
 
+    // Normal equations of the astrometric and flux fits, reused throughout
+    SolverWorkspace ws;
+
     int nMobs = matchVec.size();
     int nSobs = sourceVec.size();
 
@@ -3368,17 +4503,34 @@ lsst::meas::mosaic::solveMosaic_CCD(int order,
     int ncoeff = p->ncoeff;
     int nstar = nsource;
 
-    if (writeSnapshots) {
-        writeObsVec((snapshotPath / "match-initial-0.fits").native(), matchVec);
-        writeObsVec((snapshotPath / "source-initial-0.fits").native(), sourceVec);
-    }
+    CoeffSet coeffVec;
+    int niter = 0;
+    double chi2Prev = 0.0;
+    Checkpoint::Phase phase = Checkpoint::ASTROMETRY;
+    if (resume) {
+	// Copy the coefficients, so that the checkpoint can be resumed again
+	for (CoeffSet::const_iterator it = resume->coeffSet.begin(); it != resume->coeffSet.end(); it++) {
+	    coeffVec[it->first] = Coeff::Ptr(new Coeff(*it->second));
+	}
+	niter = resume->niter;
+	chi2Prev = resume->chi2Prev;
+	phase = resume->phase;
+	mosaicLog(pexLog::Log::INFO, "resuming after %d iterations (phase %d)",
+		  niter, static_cast<int>(phase));
+    } else {
+	if (writeSnapshots) {
+	    snapshots->write((snapshotPath / ("match-initial-0" + snapshotExt)).native(), matchVec);
+	    snapshots->write((snapshotPath / ("source-initial-0" + snapshotExt)).native(), sourceVec);
+	}
 
-    // Solve for polynomial coefficients and crvals
-    // for each exposure separately
-    // These values will be used as initial guess for
-    // the subsequent fitting
+	// Solve for polynomial coefficients and crvals
+	// for each exposure separately
+	// These values will be used as initial guess for
+	// the subsequent fitting
 
-    CoeffSet coeffVec = initialFit(nexp, matchVec, wcsDic, ccdSet, p);
+	coeffVec = initialFit(nexp, matchVec, wcsDic, ccdSet, p, initCriteria, coeffSeed);
+    }
+    if (stats) stats->reset(wcsDic, ccdSet);
 
     // Update (xi, eta) and (u, v) using initial fitting resutls
     for (int i = 0; i < nMobs; i++) {
@@ -3398,21 +4550,34 @@ lsst::meas::mosaic::solveMosaic_CCD(int order,
 	sourceVec[i]->setFitVal(coeffVec[sourceVec[i]->iexp], p);
     }
 
-    if (writeSnapshots) {
-        writeObsVec((snapshotPath / "match-initial-1.fits").native(), matchVec);
-        writeObsVec((snapshotPath / "source-initial-1.fits").native(), sourceVec);
-    }
+    if (!resume) {
+	if (writeSnapshots) {
+	    snapshots->write((snapshotPath / ("match-initial-1" + snapshotExt)).native(), matchVec);
+	    snapshots->write((snapshotPath / ("source-initial-1" + snapshotExt)).native(), sourceVec);
+	}
 
-    printf("Before fitting calcChi2: %e %e\n",
-	   calcChi2(matchVec, coeffVec, p),
-	   calcChi2_Star(matchVec, sourceVec, coeffVec, p));
-    printf("Before fitting matched: %5.3f (arcsec) sources: %5.3f (arcsec)\n",
-	   sqrt(calcChi2(matchVec, coeffVec, p, true))*3600.0,
-	   sqrt(calcChi2(sourceVec, coeffVec, p, true))*3600.0);
+	ResidualSums resMatch0(nexp, nchip);
+	ResidualSums resSource0(nexp, nchip);
+	sweepResiduals(matchVec, coeffVec, p, 0.0, catRMS, resMatch0);
+	sweepResiduals(sourceVec, coeffVec, p, 0.0, 0.0, resSource0);
+	chi2Prev = resMatch0.chi2 + resSource0.chi2;
+	mosaicLog(pexLog::Log::INFO, "Before fitting calcChi2: %e %e",
+		  resMatch0.chi2, chi2Prev);
+	mosaicLog(pexLog::Log::INFO, "Before fitting matched: %5.3f (arcsec) sources: %5.3f (arcsec)",
+		  sqrt(resMatch0.chi2/resMatch0.num)*3600.0,
+		  sqrt(resSource0.chi2/resSource0.num)*3600.0);
+    }
 
+    // Iterations already done by the checkpoint are skipped, and all of
+    // them once it has stopped iterating
+    int kEnd = (phase == Checkpoint::ASTROMETRY) ? astromCriteria.maxIter : niter;
     double *coeff;
-    for (int k = 0; k < 3; k++) {
-	coeff = solveLinApprox_Star(matchVec, sourceVec, nstar, coeffVec, nchip, p, solveCcd, allowRotation, catRMS);
+    for (int k = niter; k < kEnd; k++) {
+	// The checkpoint of the last iteration is left to resume from
+	if (solveCancelled(control, "astrometry", k, chi2Prev)) return coeffVec;
+	coeff = solveLinApprox_Star(matchVec, sourceVec, nstar, coeffVec, nchip, p, ws, solveCcd, allowRotation, catRMS,
+				    backend);
+	double dParam = astromUpdateNorm(coeff, coeffVec, ccdSet, ncoeff, solveCcd, allowRotation);
 
 	int j = 0;
 	for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++, j++) {
@@ -3425,24 +4590,24 @@ lsst::meas::mosaic::solveMosaic_CCD(int order,
 	if (allowRotation) {
 	    int i = 0;
 	    for (CcdSet::iterator it = ccdSet.begin(); it != ccdSet.end(); it++, i++) {
-            afw::geom::Extent2D offset(coeff[2*ncoeff*nexp+3*i],
+            lsst::afw::geom::Extent2D offset(coeff[2*ncoeff*nexp+3*i],
                                       coeff[2*ncoeff*nexp+3*i+1]);
             offset *= it->second->getPixelSize();
-            it->second->shiftCenter(afw::cameraGeom::FpExtent(offset));
-            afw::cameraGeom::Orientation o = it->second->getOrientation();
-            afw::cameraGeom::Orientation o2(o.getNQuarter(),
+            it->second->shiftCenter(lsst::afw::cameraGeom::FpExtent(offset));
+            lsst::afw::cameraGeom::Orientation o = it->second->getOrientation();
+            lsst::afw::cameraGeom::Orientation o2(o.getNQuarter(),
                                             o.getPitch(),
                                             o.getRoll(),
-                                            o.getYaw() + coeff[2*ncoeff*nexp+3*i+2] * afw::geom::radians);
+                                            o.getYaw() + coeff[2*ncoeff*nexp+3*i+2] * lsst::afw::geom::radians);
             it->second->setOrientation(o2);
 	    }
 	} else {
 	    int i = 0;
 	    for (CcdSet::iterator it = ccdSet.begin(); it != ccdSet.end(); it++, i++) {
-            afw::geom::Extent2D offset(coeff[2*ncoeff*nexp+2*i],
+            lsst::afw::geom::Extent2D offset(coeff[2*ncoeff*nexp+2*i],
                                       coeff[2*ncoeff*nexp+2*i+1]);
             offset *= it->second->getPixelSize();
-            it->second->shiftCenter(afw::cameraGeom::FpExtent(offset));
+            it->second->shiftCenter(lsst::afw::cameraGeom::FpExtent(offset));
 	    }
 	}
 
@@ -3475,80 +4640,98 @@ lsst::meas::mosaic::solveMosaic_CCD(int order,
 	}
 
     if (writeSnapshots) {
-        writeObsVec((snapshotPath / (boost::format("match-iter-%d.fits") % k).str()).native(), matchVec);
-        writeObsVec((snapshotPath / (boost::format("source-iter-%d.fits") % k).str()).native(), sourceVec);
+        snapshots->write((snapshotPath / ((boost::format("match-iter-%d") % k).str() + snapshotExt)).native(), matchVec);
+        snapshots->write((snapshotPath / ((boost::format("source-iter-%d") % k).str() + snapshotExt)).native(), sourceVec);
     }
 
 	delete [] coeff;
 
-	double chi2 = calcChi2_Star(matchVec, sourceVec, coeffVec, p);
-	printf("%dth iteration calcChi2: %e %e\n", (k+1), calcChi2(matchVec, coeffVec, p), chi2);
-	printf("%dth iteration matched: %5.3f (arcsec) sources: %5.3f (arcsec)\n",
-	       (k+1),
-	       sqrt(calcChi2(matchVec, coeffVec, p, true))*3600.0,
-	       sqrt(calcChi2(sourceVec, coeffVec, p, true))*3600.0);
-	///double e2 = chi2 / (matchVec.size() + sourceVec.size());
-	//flagObj2(matchVec, coeffVec, p, 9.0*e2);
-	//flagObj2(sourceVec, coeffVec, p, 9.0*e2);
-	//flagObj2(matchVec, coeffVec, p, 9.0*calcChi2(matchVec, coeffVec, p, true));
-	//flagObj2(sourceVec, coeffVec, p, 9.0*calcChi2(sourceVec, coeffVec, p, true));
-	flagObj2(matchVec, coeffVec, p, 9.0, catRMS);
-	flagObj2(sourceVec, coeffVec, p, 9.0);
-    }
-
-    std::map<ExpType, Eigen::Matrix2d> cd;
-    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	Eigen::Matrix2d c;
-	c << it->second->a[0], it->second->a[1], it->second->b[0], it->second->b[1];
-	cd.insert(std::map<ExpType, Eigen::Matrix2d>::value_type(it->first, c));
-    }
-    for (int i = 0; i < nMobs; i++) {
-	double CD1_1 = cd[matchVec[i]->iexp](0,0);
-	double CD1_2 = cd[matchVec[i]->iexp](0,1);
-	double CD2_1 = cd[matchVec[i]->iexp](1,0);
-	double CD2_2 = cd[matchVec[i]->iexp](1,1);
-	double det = CD1_1 * CD2_2 - CD1_2 * CD2_1;
-	matchVec[i]->U = ( matchVec[i]->xi * CD2_2 - matchVec[i]->eta * CD1_2) / det;
-	matchVec[i]->V = (-matchVec[i]->xi * CD2_1 + matchVec[i]->eta * CD1_1) / det;
-    }
-    for (int i = 0; i < nSobs; i++) {
-	double CD1_1 = cd[sourceVec[i]->iexp](0,0);
-	double CD1_2 = cd[sourceVec[i]->iexp](0,1);
-	double CD2_1 = cd[sourceVec[i]->iexp](1,0);
-	double CD2_2 = cd[sourceVec[i]->iexp](1,1);
-	double det = CD1_1 * CD2_2 - CD1_2 * CD2_1;
-	sourceVec[i]->U = ( sourceVec[i]->xi * CD2_2 - sourceVec[i]->eta * CD1_2) / det;
-	sourceVec[i]->V = (-sourceVec[i]->xi * CD2_1 + sourceVec[i]->eta * CD1_1) / det;
-    }
-
-    for (CoeffSet::iterator it = coeffVec.begin(); it != coeffVec.end(); it++) {
-	std::vector<Obs::Ptr> obsVec_sub;
-	for (size_t j = 0; j < matchVec.size(); j++) {
-	    Obs::Ptr iobs = matchVec[j];
-	    if (iobs->iexp == it->first) {
-		obsVec_sub.push_back(iobs);
+	ResidualSums resMatch(nexp, nchip);
+	ResidualSums resSource(nexp, nchip);
+	sweepResiduals(matchVec, coeffVec, p, 9.0, catRMS, resMatch);
+	sweepResiduals(sourceVec, coeffVec, p, 9.0, 0.0, resSource);
+	double chi2 = resMatch.chi2 + resSource.chi2;
+	mosaicLog(pexLog::Log::INFO, "%dth iteration calcChi2: %e %e", (k+1), resMatch.chi2, chi2);
+	mosaicLog(pexLog::Log::INFO, "%dth iteration matched: %5.3f (arcsec) sources: %5.3f (arcsec)",
+		  (k+1),
+		  sqrt(resMatch.chi2/resMatch.num)*3600.0,
+		  sqrt(resSource.chi2/resSource.num)*3600.0);
+	int nReject = flagRejected(resMatch);
+	mosaicLog(pexLog::Log::INFO, "nreject = %d", nReject);
+	int nRejectSource = flagRejected(resSource);
+	mosaicLog(pexLog::Log::INFO, "nreject = %d", nRejectSource);
+	nReject += nRejectSource;
+	Metrics::get()->addCount("astrom.nReject", nReject);
+	if (stats) {
+	    setAstromStatistics(*stats, k+1, resMatch, &resSource);
+	    addRejections(*stats, resMatch, false);
+	    addRejections(*stats, resSource, false);
+	}
+
+	niter = k+1;
+	bool converged = astromCriteria.converged(k+1, dParam, chi2Prev, chi2, nReject);
+	if (converged) {
+	    mosaicLog(pexLog::Log::INFO, "converged after %d iterations", k+1);
+	}
+	// cfitsio is not reentrant in every build, so no snapshot may be
+	// written while the checkpoint is
+	if (snapshots && !checkpointFile.empty()) snapshots->flush();
+	saveCheckpoint(checkpointFile,
+		       (converged || k+1 == kEnd) ? Checkpoint::FLUX : Checkpoint::ASTROMETRY,
+		       niter, chi2, nmatch, nsource, matchVec, sourceVec, coeffVec, ccdSet, ffp, fexp, fchip);
+	if (converged) break;
+	chi2Prev = chi2;
+    }
+
+    if (phase == Checkpoint::DONE) {
+	FluxFitParams::Ptr const & saved = resume->ffp;
+	if (saved && saved->ncoeff == ffp->ncoeff &&
+	    saved->absolute == ffp->absolute && saved->chebyshev == ffp->chebyshev) {
+	    for (int i = 0; i < ffp->ncoeff; i++) {
+		ffp->coeff[i] = saved->coeff[i];
 	    }
-	}
-	for (size_t j = 0; j < sourceVec.size(); j++) {
-	    Obs::Ptr iobs = sourceVec[j];
-	    if (iobs->iexp == it->first) {
-		obsVec_sub.push_back(iobs);
+	    ffp->u_max = saved->u_max;
+	    ffp->v_max = saved->v_max;
+	    ffp->x0 = saved->x0;
+	    ffp->y0 = saved->y0;
+	    fexp = resume->fexp;
+	    fchip = resume->fchip;
+
+	    for (int i = 0; i < nMobs; i++) {
+		matchVec[i]->setFitVal2(coeffVec[matchVec[i]->iexp], p);
 	    }
+	    for (int i = 0; i < nSobs; i++) {
+		sourceVec[i]->setFitVal2(coeffVec[sourceVec[i]->iexp], p);
+	    }
+	    if (control) control->update("done", niter, chi2Prev);
+	    return coeffVec;
 	}
-	double *a = solveSIP_P(p, obsVec_sub);
-	for (int k = 0; k < p->ncoeff; k++) {
-	    it->second->ap[k] = a[k];
-	    it->second->bp[k] = a[k+p->ncoeff];
-	}
-	delete [] a;
+	mosaicLog(pexLog::Log::WARN, "flux fit of the checkpoint does not match the parameters; redoing it");
     }
 
-    printf("fluxFit ...\n");
+    if (solveCancelled(control, "fluxFit", 0, chi2Prev)) return coeffVec;
+
+    std::vector<double> fluxBasis;
+    fitSIP(matchVec, sourceVec, coeffVec, p, ffp, fluxBasis);
+
+    double tFlux = wallTime();
+    mosaicLog(pexLog::Log::INFO, "fluxFit ...");
     if (ffp->absolute) {
-	fluxFitAbsolute(matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp);
+	fluxFitAbsolute(matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp, ws, fluxCriteria,
+			fluxRobust, &fluxBasis, stats.get(), control);
     } else {
-	fluxFitRelative(matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp);
+	fluxFitRelative(matchVec, nmatch, sourceVec, nsource, wcsDic, ccdSet, fexp, fchip, ffp, ws, fluxCriteria,
+			fluxRobust, &fluxBasis, stats.get(), control);
+    }
+    if (stats) {
+	stats->astromTime = tFlux - tStart;
+	stats->fluxTime = wallTime() - tFlux;
     }
+    // A flux fit cut short is not saved as done
+    if (control && control->isStopped()) return coeffVec;
+    if (snapshots && !checkpointFile.empty()) snapshots->flush();
+    saveCheckpoint(checkpointFile, Checkpoint::DONE, niter, chi2Prev, nmatch, nsource,
+		   matchVec, sourceVec, coeffVec, ccdSet, ffp, fexp, fchip);
 
     for (int i = 0; i < nMobs; i++) {
 	matchVec[i]->setFitVal2(coeffVec[matchVec[i]->iexp], p);
@@ -3557,32 +4740,191 @@ lsst::meas::mosaic::solveMosaic_CCD(int order,
 	sourceVec[i]->setFitVal2(coeffVec[sourceVec[i]->iexp], p);
     }
 
+    if (control) control->update("done", niter, chi2Prev);
     return coeffVec;
 }
 
-int fact(int n)
+CoeffSet
+lsst::meas::mosaic::solveMosaic_CCD(int order,
+				    int nmatch,
+				    int nsource,
+				    ObsVec &matchVec,
+				    ObsVec &sourceVec,
+				    WcsDic &wcsDic,
+				    CcdSet &ccdSet,
+				    FluxFitParams::Ptr &ffp,
+				    std::map<ExpType, float> &fexp,
+				    std::map<ChipType, float> &fchip,
+				    bool solveCcd,
+				    bool allowRotation,
+				    bool verbose,
+				    double catRMS,
+                    bool writeSnapshots,
+                    std::string const & snapshotDir,
+				    ConvergenceCriteria const & astromCriteria,
+				    ConvergenceCriteria const & fluxCriteria,
+				    ConvergenceCriteria const & initCriteria,
+				    CoeffSet const & coeffSeed,
+				    RobustWeight const & fluxRobust,
+				    SolveStatistics::Ptr const & stats,
+				    SolverPlan::Backend backend,
+				    std::string const & checkpointFile,
+				    SnapshotFormat snapshotFormat,
+				    SolveControl::Ptr const & control
+)
+{
+    return solveMosaic(order, nmatch, nsource, matchVec, sourceVec, wcsDic, ccdSet, ffp, fexp, fchip,
+		       solveCcd, allowRotation, catRMS, writeSnapshots, snapshotDir, snapshotFormat,
+		       astromCriteria, fluxCriteria, initCriteria, coeffSeed, fluxRobust, stats,
+		       backend, checkpointFile, NULL, control);
+}
+
+static ObsVec copyObsVec(ObsVec const &obsVec)
 {
-    if (n == 1 || n == 0) {
-	return 1;
-    } else {
-	return n * fact(n-1);
+    ObsVec copy;
+    copy.reserve(obsVec.size());
+    for (size_t i = 0; i < obsVec.size(); i++) {
+	copy.push_back(Obs::Ptr(new Obs(*obsVec[i])));
     }
+    return copy;
 }
 
-int binomial(int n, int k)
+CoeffSet
+lsst::meas::mosaic::resumeMosaic_CCD(Checkpoint::Ptr const & checkpoint,
+				     ObsVec &matchVec,
+				     ObsVec &sourceVec,
+				     WcsDic &wcsDic,
+				     CcdSet &ccdSet,
+				     FluxFitParams::Ptr &ffp,
+				     std::map<ExpType, float> &fexp,
+				     std::map<ChipType, float> &fchip,
+				     bool solveCcd,
+				     bool allowRotation,
+				     double catRMS,
+				     ConvergenceCriteria const & astromCriteria,
+				     ConvergenceCriteria const & fluxCriteria,
+				     RobustWeight const & fluxRobust,
+				     SolveStatistics::Ptr const & stats,
+				     SolverPlan::Backend backend,
+				     std::string const & checkpointFile,
+				     SolveControl::Ptr const & control
+)
 {
-    return (fact(n)/(fact(n-k)*fact(k)));
+    // Copy the observations, which the solve updates, so that the
+    // checkpoint can be resumed again
+    matchVec = copyObsVec(checkpoint->matchVec);
+    sourceVec = copyObsVec(checkpoint->sourceVec);
+    if (checkpoint->ffp) {
+	// The normalisation was set from the positions before the original solve
+	ffp->u_max = checkpoint->ffp->u_max;
+	ffp->v_max = checkpoint->ffp->v_max;
+	ffp->x0 = checkpoint->ffp->x0;
+	ffp->y0 = checkpoint->ffp->y0;
+    }
+    int order = checkpoint->coeffSet.empty() ? 1 : checkpoint->coeffSet.begin()->second->p->order;
+
+    return solveMosaic(order, checkpoint->nmatch, checkpoint->nsource, matchVec, sourceVec,
+		       wcsDic, ccdSet, ffp, fexp, fchip, solveCcd, allowRotation, catRMS, false, ".", SNAPSHOT_FITS,
+		       astromCriteria, fluxCriteria, ConvergenceCriteria(), CoeffSet(), fluxRobust, stats,
+		       backend, checkpointFile, checkpoint.get(), control);
 }
 
-Coeff::Ptr
-lsst::meas::mosaic::convertCoeff(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::Ptr& ccd)
+PolyTransform::PolyTransform(int order, int ncoeff_, int const *xorder, int const *yorder,
+			     double c11, double c12, double c21, double c22) :
+    ncoeff(ncoeff_), matrix(ncoeff_*ncoeff_, 0.0)
+{
+    int n1 = order + 1;
+
+    // binomial coefficients from a Pascal triangle
+    std::vector<double> binom(n1*n1, 0.0);
+    for (int n = 0; n <= order; n++) {
+	binom[n*n1] = 1.0;
+	for (int k = 1; k <= n; k++) {
+	    binom[n*n1+k] = binom[(n-1)*n1+k-1] + binom[(n-1)*n1+k];
+	}
+    }
+
+    std::vector<double> p11(n1), p12(n1), p21(n1), p22(n1);
+    p11[0] = p12[0] = p21[0] = p22[0] = 1.0;
+    for (int n = 1; n <= order; n++) {
+	p11[n] = p11[n-1] * c11;
+	p12[n] = p12[n-1] * c12;
+	p21[n] = p21[n-1] * c21;
+	p22[n] = p22[n-1] * c22;
+    }
+
+    std::vector<int> index(n1*n1, -1);
+    for (int k = 0; k < ncoeff; k++) {
+	index[xorder[k]*n1+yorder[k]] = k;
+    }
+
+    // u^i * v^j = (c11 * u' + c12 * v')^i * (c21 * u' + c22 * v')^j
+    //           = \Sigma (i, n) * (c11 * u')^n * (c12 * v')^(i-n) *
+    //             \Sigma (j, m) * (c21 * u')^m * (c22 * v')^(j-m)
+    for (int k = 0; k < ncoeff; k++) {
+	int i = xorder[k];
+	int j = yorder[k];
+	for (int n = 0; n <= i; n++) {
+	    for (int m = 0; m <= j; m++) {
+		int l = index[(n+m)*n1+(i+j-n-m)];
+		matrix[l*ncoeff+k] += binom[i*n1+n] * binom[j*n1+m] *
+		                      p11[n] * p12[i-n] * p21[m] * p22[j-m];
+	    }
+	}
+    }
+}
+
+void PolyTransform::apply(double const *in, double *out) const
+{
+    for (int l = 0; l < ncoeff; l++) {
+	double const *row = &matrix[l*ncoeff];
+	double sum = 0.0;
+	for (int k = 0; k < ncoeff; k++) {
+	    sum += row[k] * in[k];
+	}
+	out[l] += sum;
+    }
+}
+
+/*
+ * Rotation of the focal plane coordinates into the frame of a chip:
+ *   u = cc * u' - ss * v'
+ *   v = ss * u' + cc * v'
+ */
+static PolyTransform rotationTransform(Poly::Ptr const &p,
+				       lsst::afw::cameraGeom::Ccd::Ptr const &ccd)
+{
+    lsst::afw::cameraGeom::Orientation ori = ccd->getOrientation();
+    double cosYaw = ori.getCosYaw();
+    double sinYaw = ori.getSinYaw();
+
+    return PolyTransform(p->order, p->ncoeff, p->xorder, p->yorder,
+			 cosYaw, -sinYaw, sinYaw, cosYaw);
+}
+
+/*
+ * As above for the flux correction, which is a polynomial in
+ * (u / u_max, v / v_max).
+ */
+static PolyTransform rotationTransform(FluxFitParams::Ptr const &ffp,
+				       lsst::afw::cameraGeom::Ccd::Ptr const &ccd)
+{
+    lsst::afw::cameraGeom::Orientation ori = ccd->getOrientation();
+    double cosYaw = ori.getCosYaw();
+    double sinYaw = ori.getSinYaw();
+
+    return PolyTransform(ffp->order, ffp->ncoeff, ffp->xorder, ffp->yorder,
+			 cosYaw / ffp->u_max, -sinYaw / ffp->u_max,
+			 sinYaw / ffp->v_max,  cosYaw / ffp->v_max);
+}
+
+static Coeff::Ptr convertCoeff(Coeff::Ptr const &coeff,
+			       lsst::afw::cameraGeom::Ccd::Ptr const &ccd,
+			       PolyTransform const &rot)
 {
     Poly::Ptr p = Poly::Ptr(new Poly(coeff->p->order));
     Coeff::Ptr newC = Coeff::Ptr(new Coeff(p));
 
-    int *xorder = p->xorder;
-    int *yorder = p->yorder;
-
     lsst::afw::cameraGeom::Orientation ori = ccd->getOrientation();
     double cosYaw = ori.getCosYaw();
     double sinYaw = ori.getSinYaw();
@@ -3590,28 +4932,10 @@ lsst::meas::mosaic::convertCoeff(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::
     newC->A = coeff->A;
     newC->D = coeff->D;
 
-    // u = cc * u' - ss * v'
-    // v = ss * u' + cc * v'
-    // u^i * v^j = (cc * u' - ss * v')^i * (ss * u' + cc * v')^j
-    //           = \Sigma (i, n) * (cc * u')^n * (-ss * v')^(i-n) *
-    //             \Sigma (j, m) * (ss * u')^m * ( cc * v')^(j-m)
-    for (int k = 0; k < p->ncoeff; k++) {
-	for (int n = 0; n <= xorder[k]; n++) {
-	    for (int m = 0; m <= yorder[k]; m++) {
-		int i = n + m;
-		int j = xorder[k] + yorder[k] - n - m;
-		int l = p->getIndex(i, j);
-		double C =  binomial(xorder[k], n) *
-		            binomial(yorder[k], m) *
-		            pow(cosYaw, n) * pow(-sinYaw, xorder[k]-n) *
-		            pow(sinYaw, m) * pow( cosYaw, yorder[k]-m);
-		newC->a[l] += coeff->a[k] * C;
-		newC->b[l] += coeff->b[k] * C;
-	    }
-	}
-    }
+    rot.apply(coeff->a, newC->a);
+    rot.apply(coeff->b, newC->b);
 
-    afw::geom::Extent2D off = ccd->getCenter().getPixels(ccd->getPixelSize()) - ccd->getCenterPixel();
+    lsst::afw::geom::Extent2D off = ccd->getCenter().getPixels(ccd->getPixelSize()) - ccd->getCenterPixel();
     newC->x0 =  (off[0] + coeff->x0) * cosYaw + (off[1] + coeff->y0) * sinYaw;
     newC->y0 = -(off[0] + coeff->x0) * sinYaw + (off[1] + coeff->y0) * cosYaw;
 
@@ -3635,21 +4959,9 @@ lsst::meas::mosaic::convertCoeff(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::
     memset(ap, 0x0, p->ncoeff*sizeof(double));
     memset(bp, 0x0, p->ncoeff*sizeof(double));
 
-    for (int k = 0; k < p->ncoeff; k++) {
-	for (int n = 0; n <= xorder[k]; n++) {
-	    for (int m = 0; m <= yorder[k]; m++) {
-		int i = n + m;
-		int j = xorder[k] + yorder[k] - n - m;
-		int l = p->getIndex(i, j);
-		double C =  binomial(xorder[k], n) *
-		            binomial(yorder[k], m) *
-		            pow(a, n) * pow(b, xorder[k]-n) *
-		            pow(c, m) * pow(d, yorder[k]-m);
-		ap[l] += coeff->ap[k] * C;
-		bp[l] += coeff->bp[k] * C;
-	    }
-	}
-    }
+    PolyTransform sip(p->order, p->ncoeff, p->xorder, p->yorder, a, b, c, d);
+    sip.apply(coeff->ap, ap);
+    sip.apply(coeff->bp, bp);
     ap[0] += a;
     ap[1] += b;
     bp[0] += c;
@@ -3672,49 +4984,122 @@ lsst::meas::mosaic::convertCoeff(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::
     return newC;
 }
 
-FluxFitParams::Ptr
-lsst::meas::mosaic::convertFluxFitParams(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::Ptr& ccd, FluxFitParams::Ptr& ffp)
+Coeff::Ptr
+lsst::meas::mosaic::convertCoeff(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::Ptr& ccd)
+{
+    return ::convertCoeff(coeff, ccd, rotationTransform(coeff->p, ccd));
+}
+
+ExpCcdCoeffSet
+lsst::meas::mosaic::convertCoeffSet(CoeffSet& coeffSet, CcdSet& ccdSet)
+{
+    std::vector<Coeff::Ptr> coeff;
+    ExpCcdCoeffSet result;
+    for (CoeffSet::iterator it = coeffSet.begin(); it != coeffSet.end(); it++) {
+	coeff.push_back(it->second);
+	result[it->first];
+    }
+    std::vector<lsst::afw::cameraGeom::Ccd::Ptr> ccd;
+    for (CcdSet::iterator it = ccdSet.begin(); it != ccdSet.end(); it++) {
+	ccd.push_back(it->second);
+    }
+    if (coeff.empty() || ccd.empty()) return result;
+
+    int nexp = coeff.size();
+    int nchip = ccd.size();
+
+    // All exposures share the polynomial order
+    std::vector<PolyTransform> rot;
+    for (int j = 0; j < nchip; j++) {
+	rot.push_back(rotationTransform(coeff[0]->p, ccd[j]));
+    }
+
+    std::vector<Coeff::Ptr> newC(nexp*nchip);
+    #pragma omp parallel for schedule(dynamic)
+    for (int n = 0; n < nexp*nchip; n++) {
+	int i = n / nchip;
+	int j = n % nchip;
+	newC[n] = ::convertCoeff(coeff[i], ccd[j], rot[j]);
+    }
+
+    int n = 0;
+    for (ExpCcdCoeffSet::iterator it = result.begin(); it != result.end(); it++) {
+	for (CcdSet::iterator jt = ccdSet.begin(); jt != ccdSet.end(); jt++, n++) {
+	    it->second[jt->first] = newC[n];
+	}
+    }
+
+    return result;
+}
+
+static FluxFitParams::Ptr convertFluxFitParams(Coeff::Ptr const &coeff,
+					       lsst::afw::cameraGeom::Ccd::Ptr const &ccd,
+					       FluxFitParams::Ptr const &ffp,
+					       PolyTransform const &rot)
 {
     FluxFitParams::Ptr newP = FluxFitParams::Ptr(new FluxFitParams(ffp->order, ffp->chebyshev));
     newP->u_max = 1.0;
     newP->v_max = 1.0;
 
-    int *xorder = ffp->xorder;
-    int *yorder = ffp->yorder;
+    rot.apply(ffp->coeff, newP->coeff);
 
     lsst::afw::cameraGeom::Orientation ori = ccd->getOrientation();
     double cosYaw = ori.getCosYaw();
     double sinYaw = ori.getSinYaw();
 
-    // u = cc * u' - ss * v'
-    // v = ss * u' + cc * v'
-    // u^i * v^j = (cc * u' - ss * v')^i * (ss * u' + cc * v')^j
-    //           = \Sigma (i, n) * (cc * u')^n * (-ss * v')^(i-n) *
-    //             \Sigma (j, m) * (ss * u')^m * ( cc * v')^(j-m)
-    for (int k = 0; k < ffp->ncoeff; k++) {
-	for (int n = 0; n <= xorder[k]; n++) {
-	    for (int m = 0; m <= yorder[k]; m++) {
-		int i = n + m;
-		int j = xorder[k] + yorder[k] - n - m;
-		int l = newP->getIndex(i, j);
-		double C =  binomial(xorder[k], n) *
-		            binomial(yorder[k], m) *
-		            pow(cosYaw, n) * pow(-sinYaw, xorder[k]-n) *
-		            pow(sinYaw, m) * pow( cosYaw, yorder[k]-m)
-		            / pow(ffp->u_max, xorder[k])
-		            / pow(ffp->v_max, yorder[k]);
-		newP->coeff[l] += ffp->coeff[k] * C;
-	    }
-	}
-    }
-
-    afw::geom::Extent2D off = ccd->getCenter().getPixels(ccd->getPixelSize()) - ccd->getCenterPixel();
+    lsst::afw::geom::Extent2D off = ccd->getCenter().getPixels(ccd->getPixelSize()) - ccd->getCenterPixel();
     newP->x0 =  (off[0] + coeff->x0) * cosYaw + (off[1] + coeff->y0) * sinYaw;
     newP->y0 = -(off[0] + coeff->x0) * sinYaw + (off[1] + coeff->y0) * cosYaw;
 
     return newP;
 }
 
+FluxFitParams::Ptr
+lsst::meas::mosaic::convertFluxFitParams(Coeff::Ptr& coeff, lsst::afw::cameraGeom::Ccd::Ptr& ccd, FluxFitParams::Ptr& ffp)
+{
+    return ::convertFluxFitParams(coeff, ccd, ffp, rotationTransform(ffp, ccd));
+}
+
+ExpCcdFluxFitParamsSet
+lsst::meas::mosaic::convertFluxFitParamsSet(CoeffSet& coeffSet, CcdSet& ccdSet,
+					    FluxFitParams::Ptr& ffp)
+{
+    FluxFitParams::Ptr power = FluxFitParams::Ptr(new FluxFitParams(*ffp));
+
+    std::vector<Coeff::Ptr> coeff;
+    ExpCcdFluxFitParamsSet result;
+    for (CoeffSet::iterator it = coeffSet.begin(); it != coeffSet.end(); it++) {
+	coeff.push_back(it->second);
+	result[it->first];
+    }
+    std::vector<lsst::afw::cameraGeom::Ccd::Ptr> ccd;
+    std::vector<PolyTransform> rot;
+    for (CcdSet::iterator it = ccdSet.begin(); it != ccdSet.end(); it++) {
+	ccd.push_back(it->second);
+	rot.push_back(rotationTransform(power, it->second));
+    }
+
+    int nexp = coeff.size();
+    int nchip = ccd.size();
+
+    std::vector<FluxFitParams::Ptr> newP(nexp*nchip);
+    #pragma omp parallel for schedule(dynamic)
+    for (int n = 0; n < nexp*nchip; n++) {
+	int i = n / nchip;
+	int j = n % nchip;
+	newP[n] = ::convertFluxFitParams(coeff[i], ccd[j], power, rot[j]);
+    }
+
+    int n = 0;
+    for (ExpCcdFluxFitParamsSet::iterator it = result.begin(); it != result.end(); it++) {
+	for (CcdSet::iterator jt = ccdSet.begin(); jt != ccdSet.end(); jt++, n++) {
+	    it->second[jt->first] = newP[n];
+	}
+    }
+
+    return result;
+}
+
 lsst::afw::image::TanWcs::Ptr
 lsst::meas::mosaic::wcsFromCoeff(Coeff::Ptr& coeff)
 {
@@ -3831,8 +5216,8 @@ Coeff::Ptr lsst::meas::mosaic::coeffFromTanWcs(lsst::afw::image::Wcs::Ptr& wcs)
 	    int j = k - i;
 	    int n = k*(k+1)/2 - 1;
 
-            std::cout << "sipA(" << i << "," << j << "): " << sipA(i,j) << std::endl;
-            std::cout << "sipB(" << i << "," << j << "): " << sipB(i,j) << std::endl;
+            mosaicLog(pexLog::Log::DEBUG, "sipA(%d,%d): %e", i, j, sipA(i,j));
+            mosaicLog(pexLog::Log::DEBUG, "sipB(%d,%d): %e", i, j, sipB(i,j));
             coeff->set_a(n+j, cd00*sipA(i,j)+cd01*sipB(i,j));
             coeff->set_b(n+j, cd10*sipA(i,j)+cd11*sipB(i,j));
 
@@ -3890,6 +5275,241 @@ lsst::meas::mosaic::metadataFromFluxFitParams(FluxFitParams::Ptr& ffp)
     return metadata;
 }
 
+CcdProductsVec
+lsst::meas::mosaic::makeCcdProducts(CoeffSet& coeffSet, CcdSet& ccdSet,
+				    FluxFitParams::Ptr& ffp,
+				    std::map<ExpType, float> &fexp,
+				    std::map<ChipType, float> &fchip)
+{
+    ExpCcdCoeffSet coeffs = convertCoeffSet(coeffSet, ccdSet);
+    ExpCcdFluxFitParamsSet ffps = convertFluxFitParamsSet(coeffSet, ccdSet, ffp);
+
+    CcdProductsVec products;
+    std::vector<Coeff::Ptr> coeff;
+    std::vector<FluxFitParams::Ptr> newP;
+    for (CoeffSet::iterator it = coeffSet.begin(); it != coeffSet.end(); it++) {
+	for (CcdSet::iterator jt = ccdSet.begin(); jt != ccdSet.end(); jt++) {
+	    CcdProducts::Ptr p = CcdProducts::Ptr(new CcdProducts());
+	    p->iexp = it->first;
+	    p->ichip = jt->first;
+	    p->fluxMag0 = 1.0 / (fexp[it->first] * fchip[jt->first]);
+	    products.push_back(p);
+	    coeff.push_back(coeffs[it->first][jt->first]);
+	    newP.push_back(ffps[it->first][jt->first]);
+	}
+    }
+
+    int n = products.size();
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++) {
+	products[i]->wcs = wcsFromCoeff(coeff[i]);
+	products[i]->fcrMetadata = metadataFromFluxFitParams(newP[i]);
+    }
+
+    return products;
+}
+
+/*
+ * Grid-interpolated correction surfaces.  The model is evaluated on a
+ * grid of nodes every spacing pixels (plus the last row and column),
+ * and pixels are filled by bilinear interpolation between the nodes.
+ * The spacing is halved, down to minGridSpacing, until the
+ * interpolation reproduces the model at the cell centres to the given
+ * relative tolerance.  A Model provides
+ *
+ *   void evalRow(int n, double const *x, double y, double *val) const;
+ *
+ * which returns the pixel values at (x[i], y) in CCD pixel coordinates.
+ */
+static int const minGridSpacing = 4;
+
+static void gridNodes(int n, int spacing, std::vector<double> &g)
+{
+    g.clear();
+    for (int i = 0; i < n - 1; i += spacing) {
+	g.push_back(i);
+    }
+    g.push_back(n - 1);
+}
+
+/* Cell index and weight of the upper node for every pixel along an axis */
+static void gridWeights(std::vector<double> const &g, int n,
+			std::vector<int> &cell, std::vector<double> &w)
+{
+    cell.resize(n);
+    w.resize(n);
+    int ng = g.size();
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+	if (ng == 1) {
+	    cell[i] = 0;
+	    w[i] = 0.0;
+	    continue;
+	}
+	while (k < ng - 2 && i > g[k+1]) k++;
+	cell[i] = k;
+	w[i] = (i - g[k]) / (g[k+1] - g[k]);
+    }
+}
+
+template <class Model>
+static lsst::afw::image::Image<float>::Ptr
+gridImg(Model const &model, int width, int height, int spacing, double tolerance)
+{
+    lsst::afw::image::Image<float>::Ptr img(new lsst::afw::image::Image<float>(width, height));
+    if (width <= 0 || height <= 0) return img;
+
+    spacing = std::max(spacing, minGridSpacing);
+
+    std::vector<double> gx, gy, node;
+    int nx, ny;
+    while (true) {
+	gridNodes(width,  spacing, gx);
+	gridNodes(height, spacing, gy);
+	nx = gx.size();
+	ny = gy.size();
+
+	node.resize(nx*ny);
+	#pragma omp parallel for schedule(static)
+	for (int j = 0; j < ny; j++) {
+	    model.evalRow(nx, &gx[0], gy[j], &node[j*nx]);
+	}
+
+	if (tolerance <= 0.0 || spacing <= minGridSpacing || nx < 2 || ny < 2) break;
+
+	std::vector<double> cx(nx-1);
+	for (int i = 0; i < nx - 1; i++) {
+	    cx[i] = 0.5 * (gx[i] + gx[i+1]);
+	}
+
+	double maxErr = 0.0;
+	#pragma omp parallel
+	{
+	    std::vector<double> val(nx-1);
+	    double err = 0.0;
+
+	    #pragma omp for schedule(static)
+	    for (int j = 0; j < ny - 1; j++) {
+		model.evalRow(nx-1, &cx[0], 0.5 * (gy[j] + gy[j+1]), &val[0]);
+		double const *n0 = &node[j*nx];
+		double const *n1 = &node[(j+1)*nx];
+		for (int i = 0; i < nx - 1; i++) {
+		    double interp = 0.25 * (n0[i] + n0[i+1] + n1[i] + n1[i+1]);
+		    if (val[i] != 0.0) {
+			err = std::max(err, fabs(interp - val[i]) / fabs(val[i]));
+		    }
+		}
+	    }
+
+	    #pragma omp critical
+	    maxErr = std::max(maxErr, err);
+	}
+
+	if (maxErr <= tolerance) break;
+	spacing /= 2;
+    }
+
+    std::vector<int> ix, iy;
+    std::vector<double> wx, wy;
+    gridWeights(gx, width,  ix, wx);
+    gridWeights(gy, height, iy, wy);
+
+    #pragma omp parallel
+    {
+	std::vector<double> col(nx+1);
+
+	#pragma omp for schedule(static)
+	for (int y = 0; y < height; y++) {
+	    double const *n0 = &node[iy[y]*nx];
+	    double const *n1 = (ny > 1) ? &node[(iy[y]+1)*nx] : n0;
+	    double t = wy[y];
+	    for (int i = 0; i < nx; i++) {
+		col[i] = n0[i] + (n1[i] - n0[i]) * t;
+	    }
+	    col[nx] = col[nx-1];
+
+	    lsst::afw::image::Image<float>::x_iterator ptr = img->row_begin(y);
+	    for (int x = 0; x < width; x++, ptr++) {
+		int k = ix[x];
+		*ptr = col[k] + (col[k+1] - col[k]) * wx[x];
+	    }
+	}
+    }
+
+    return img;
+}
+
+struct JacobianModel {
+    Coeff::Ptr coeff;
+    lsst::afw::cameraGeom::Ccd::Ptr ccd;
+    double scale2;
+
+    void evalRow(int n, double const *x, double y, double *val) const {
+	for (int i = 0; i < n; i++) {
+	    lsst::afw::geom::Point2D uv
+		= ccd->getPositionFromPixel(lsst::afw::geom::Point2D(x[i], y)).getPixels(ccd->getPixelSize())
+		+ lsst::afw::geom::Extent2D(coeff->x0, coeff->y0);
+	    val[i] = coeff->detJ(uv.getX(), uv.getY()) * scale2;
+	}
+    }
+};
+
+struct FCorModel {
+    FluxFitParams::Ptr p;
+    lsst::afw::cameraGeom::Ccd::Ptr ccd;
+    Coeff::Ptr coeff;
+
+    void evalRow(int n, double const *x, double y, double *val) const {
+	std::vector<double> u(n), v(n);
+	for (int i = 0; i < n; i++) {
+	    lsst::afw::geom::Point2D uv
+		= ccd->getPositionFromPixel(lsst::afw::geom::Point2D(x[i], y)).getPixels(ccd->getPixelSize())
+		+ lsst::afw::geom::Extent2D(coeff->x0, coeff->y0);
+	    u[i] = uv.getX();
+	    v[i] = uv.getY();
+	}
+	p->eval(n, &u[0], &v[0], val);
+	for (int i = 0; i < n; i++) {
+	    val[i] = exp(-0.4 * M_LN10 * val[i]);
+	}
+    }
+};
+
+lsst::afw::image::Image<float>::Ptr
+lsst::meas::mosaic::getJImg(Coeff::Ptr& coeff,
+			   lsst::afw::cameraGeom::Ccd::Ptr& ccd,
+			   int spacing, double tolerance)
+{
+    double deg2pix = 1. / coeff->pixelScale();
+
+    JacobianModel model;
+    model.coeff = coeff;
+    model.ccd = ccd;
+    model.scale2 = deg2pix * deg2pix;
+
+    return gridImg(model,
+		   ccd->getAllPixels(true).getWidth(),
+		   ccd->getAllPixels(true).getHeight(),
+		   spacing, tolerance);
+}
+
+lsst::afw::image::Image<float>::Ptr
+lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p,
+			      lsst::afw::cameraGeom::Ccd::Ptr& ccd,
+			      Coeff::Ptr& coeff,
+			      int spacing, double tolerance)
+{
+    FCorModel model;
+    model.p = p;
+    model.ccd = ccd;
+    model.coeff = coeff;
+
+    return gridImg(model,
+		   ccd->getAllPixels(true).getWidth(),
+		   ccd->getAllPixels(true).getHeight(),
+		   spacing, tolerance);
+}
+
 lsst::afw::image::Image<float>::Ptr
 lsst::meas::mosaic::getJImg(Coeff::Ptr& coeff,
 			   lsst::afw::cameraGeom::Ccd::Ptr& ccd)
@@ -4054,35 +5674,46 @@ lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p,
     return img;
 }
 
+/*
+ * Magnitude correction along one row, evaluated exactly every
+ * interpLength pixels and linearly interpolated in between.
+ */
+static void fcorRow(FluxFitParams::Ptr const &p, int width, double x0, double y, double *vals)
+{
+    int interpLength = 100;
+    int nknot = (width + interpLength - 1) / interpLength;
+    if (nknot == 0) return;
+
+    std::vector<double> u(2*nknot), v(2*nknot, y), val(2*nknot);
+    for (int k = 0; k < nknot; k++) {
+	int x = k * interpLength;
+	int xend = std::min(x + interpLength, width) - 1;
+	u[2*k]   = x + x0;
+	u[2*k+1] = xend + x0;
+    }
+    p->eval(2*nknot, &u[0], &v[0], &val[0]);
+
+    for (int k = 0; k < nknot; k++) {
+	int x = k * interpLength;
+	int interval = std::min(x + interpLength, width) - x;
+	double val0 = val[2*k];
+	double val1 = val[2*k+1];
+	for (int i = 0; i < interval; i++) {
+	    vals[x+i] = val0 + (val1 - val0) / interval * i;
+	}
+    }
+}
+
 lsst::afw::image::Image<float>::Ptr
 lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p, int width, int height)
 {
     lsst::afw::image::Image<float>::Ptr img(new lsst::afw::image::Image<float>(width, height));
 
-    double *vals = new double[width];
-
-    int interpLength = 100;
+    std::vector<double> vals(width);
 
     for (int y = 0; y != height; y++) {
 
-	for (int x = 0; x < width + interpLength; x+= interpLength) {
-	    int interval = interpLength;
-	    int xend = x + interval - 1;
-	    if (xend >= width) {
-		xend = width - 1;
-		interval = xend - x + 1;
-	    }
-
-	    double u = x;
-	    double v = y;
-	    double val0 = p->eval(u, v);
-	    u = xend;
-	    v = y;
-	    double val1 = p->eval(u, v);
-	    for (int i = 0; i < interval; i++) {
-		vals[x+i] = val0 + (val1 - val0) / interval * i;
-	    }
-	}
+	fcorRow(p, width, 0.0, y, &vals[0]);
 
 	lsst::afw::image::Image<float>::x_iterator begin = img->row_begin(y);
 	lsst::afw::image::Image<float>::x_iterator end   = img->row_end(y);
@@ -4103,30 +5734,11 @@ lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p, lsst::afw::geom::Box2I con
 {
     lsst::afw::image::Image<float>::Ptr img(new lsst::afw::image::Image<float>(bbox));
 
-    double *vals = new double[bbox.getWidth()];
-
-    int interpLength = 100;
+    std::vector<double> vals(bbox.getWidth());
 
     for (int y = 0; y != bbox.getHeight(); y++) {
 
-        for (int x = 0; x < bbox.getWidth() + interpLength; x+= interpLength) {
-            int interval = interpLength;
-            int xend = x + interval - 1;
-            if (xend >= bbox.getWidth()) {
-                xend = bbox.getWidth() - 1;
-                interval = xend - x + 1;
-            }
-
-            double u = x + bbox.getBeginX();
-            double v = y + bbox.getBeginY();
-            double val0 = p->eval(u, v);
-            u = xend + bbox.getBeginX();
-            v = y + bbox.getBeginY();
-            double val1 = p->eval(u, v);
-            for (int i = 0; i < interval; i++) {
-                vals[x+i] = val0 + (val1 - val0) / interval * i;
-            }
-        }
+	fcorRow(p, bbox.getWidth(), bbox.getBeginX(), y + bbox.getBeginY(), &vals[0]);
 
 	lsst::afw::image::Image<float>::x_iterator begin = img->row_begin(y);
 	lsst::afw::image::Image<float>::x_iterator end   = img->row_end(y);
@@ -4142,6 +5754,55 @@ lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p, lsst::afw::geom::Box2I con
     return img;
 }
 
+static void applyFCor(FluxFitParams::Ptr const &p,
+		      lsst::afw::image::MaskedImage<float>& mi,
+		      double x0, double y0)
+{
+    int width  = mi.getWidth();
+    int height = mi.getHeight();
+
+    lsst::afw::image::Image<float>::Ptr img = mi.getImage();
+    lsst::afw::image::Image<lsst::afw::image::VariancePixel>::Ptr var = mi.getVariance();
+
+    #pragma omp parallel
+    {
+	std::vector<double> vals(width);
+
+	#pragma omp for schedule(static)
+	for (int y = 0; y < height; y++) {
+	    fcorRow(p, width, x0, y + y0, &vals[0]);
+
+	    lsst::afw::image::Image<float>::x_iterator ip = img->row_begin(y);
+	    lsst::afw::image::Image<lsst::afw::image::VariancePixel>::x_iterator vp = var->row_begin(y);
+	    for (int x = 0; x < width; x++, ip++, vp++) {
+		double f = pow(10., -0.4*vals[x]);
+		*ip *= f;
+		*vp *= f * f;
+	    }
+	}
+    }
+}
+
+void
+lsst::meas::mosaic::applyFCor(FluxFitParams::Ptr& p,
+			     lsst::afw::image::MaskedImage<float>& mi)
+{
+    ::applyFCor(p, mi, 0.0, 0.0);
+}
+
+void
+lsst::meas::mosaic::applyFCor(FluxFitParams::Ptr& p,
+			     lsst::afw::image::MaskedImage<float>& mi,
+			     lsst::afw::geom::Box2I const & bbox)
+{
+    if (bbox.getWidth() != mi.getWidth() || bbox.getHeight() != mi.getHeight()) {
+	throw LSST_EXCEPT(lsst::pex::exceptions::LengthErrorException,
+			  (boost::format("bbox is %dx%d but the image is %dx%d") %
+			   bbox.getWidth() % bbox.getHeight() % mi.getWidth() % mi.getHeight()).str());
+    }
+    ::applyFCor(p, mi, bbox.getBeginX(), bbox.getBeginY());
+}
+
 lsst::afw::image::Image<float>::Ptr
 lsst::meas::mosaic::getFCorImg(FluxFitParams::Ptr& p,
 			      lsst::afw::cameraGeom::Ccd::Ptr& ccd)
@@ -1,4 +1,11 @@
+#include <cstdio>
+#include <cstring>
+#include "boost/thread/thread.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/condition_variable.hpp"
 #include "lsst/meas/mosaic/snapshot.h"
+#include "lsst/meas/mosaic/metrics.h"
+#include "lsst/pex/logging/Log.h"
 #include "lsst/afw/table.h"
 
 namespace lsst { namespace meas { namespace mosaic {
@@ -33,30 +40,238 @@ private:
         {}
 };
 
-void writeObsVec(std::string const & filename, ObsVec const & obsVec) {
+namespace {
+
+/*
+ * The snapshot columns of an ObsVec, copied out so that they can be
+ * written while the solver goes on changing the observations.
+ */
+struct ObsColumns {
+    std::string filename;
+    std::vector<int> id;
+    std::vector<double> ra, dec;
+    std::vector<double> xi, eta;
+    std::vector<double> x, y;
+    std::vector<double> u, v;
+    std::vector<double> u0, v0;
+    std::vector<boost::int64_t> iexp;
+    std::vector<int> ichip;
+    std::vector<int> jexp, jchip;
+
+    size_t size() const { return id.size(); }
+
+    void fill(ObsVec const & obsVec) {
+        size_t const n = obsVec.size();
+        id.resize(n);
+        ra.resize(n); dec.resize(n);
+        xi.resize(n); eta.resize(n);
+        x.resize(n); y.resize(n);
+        u.resize(n); v.resize(n);
+        u0.resize(n); v0.resize(n);
+        iexp.resize(n); ichip.resize(n);
+        jexp.resize(n); jchip.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            Obs const & obs = *obsVec[i];
+            id[i] = obs.id;
+            ra[i] = obs.ra;
+            dec[i] = obs.dec;
+            xi[i] = obs.xi;
+            eta[i] = obs.eta;
+            x[i] = obs.x;
+            y[i] = obs.y;
+            u[i] = obs.u;
+            v[i] = obs.v;
+            u0[i] = obs.u0;
+            v0[i] = obs.v0;
+            iexp[i] = obs.iexp;
+            ichip[i] = obs.ichip;
+            jexp[i] = obs.jexp;
+            jchip[i] = obs.jchip;
+        }
+    }
+};
+
+void writeFits(std::string const & filename, ObsColumns const & c) {
     ObsVecKeys const & keys = ObsVecKeys::get();
     afw::table::BaseCatalog catalog(keys.schema);
-    catalog.reserve(obsVec.size());
-    for (ObsVec::const_iterator iter = obsVec.begin(); iter != obsVec.end(); ++iter) {
-        Obs const & obs = **iter;
+    catalog.reserve(c.size());
+    for (size_t i = 0; i < c.size(); ++i) {
         PTR(afw::table::BaseRecord) record = catalog.addNew();
-        record->set(keys.id, obs.id);
-        record->set(keys.ra, obs.ra);
-        record->set(keys.dec, obs.dec);
-        record->set(keys.xi, obs.xi);
-        record->set(keys.eta, obs.eta);
-        record->set(keys.x, obs.x);
-        record->set(keys.y, obs.y);
-        record->set(keys.u, obs.u);
-        record->set(keys.v, obs.v);
-        record->set(keys.u0, obs.u0);
-        record->set(keys.v0, obs.v0);
-        record->set(keys.iexp, obs.iexp);
-        record->set(keys.ichip, obs.ichip);
-        record->set(keys.jexp, obs.jexp);
-        record->set(keys.jchip, obs.jchip);
+        record->set(keys.id, c.id[i]);
+        record->set(keys.ra, c.ra[i]);
+        record->set(keys.dec, c.dec[i]);
+        record->set(keys.xi, c.xi[i]);
+        record->set(keys.eta, c.eta[i]);
+        record->set(keys.x, c.x[i]);
+        record->set(keys.y, c.y[i]);
+        record->set(keys.u, c.u[i]);
+        record->set(keys.v, c.v[i]);
+        record->set(keys.u0, c.u0[i]);
+        record->set(keys.v0, c.v0[i]);
+        record->set(keys.iexp, static_cast<int>(c.iexp[i]));
+        record->set(keys.ichip, c.ichip[i]);
+        record->set(keys.jexp, c.jexp[i]);
+        record->set(keys.jchip, c.jchip[i]);
     }
     catalog.writeFits(filename);
 }
 
+template <typename T>
+bool writeColumn(std::FILE * fp, char const * name, char type, std::vector<T> const & data) {
+    char header[17];
+    std::memset(header, 0, sizeof(header));
+    std::strncpy(header, name, 16);
+    header[16] = type;
+    if (std::fwrite(header, 1, sizeof(header), fp) != sizeof(header)) return false;
+    return data.empty() || std::fwrite(&data[0], sizeof(T), data.size(), fp) == data.size();
+}
+
+bool writeBinary(std::string const & filename, ObsColumns const & c) {
+    std::FILE * fp = std::fopen(filename.c_str(), "wb");
+    if (fp == NULL) return false;
+
+    boost::int64_t nrow = c.size();
+    boost::int32_t ncol = 15;
+    bool ok = std::fwrite("MOSOBS01", 1, 8, fp) == 8 &&
+              std::fwrite(&nrow, sizeof(nrow), 1, fp) == 1 &&
+              std::fwrite(&ncol, sizeof(ncol), 1, fp) == 1 &&
+              writeColumn(fp, "id", 'i', c.id) &&
+              writeColumn(fp, "ra", 'd', c.ra) &&
+              writeColumn(fp, "dec", 'd', c.dec) &&
+              writeColumn(fp, "xi", 'd', c.xi) &&
+              writeColumn(fp, "eta", 'd', c.eta) &&
+              writeColumn(fp, "x", 'd', c.x) &&
+              writeColumn(fp, "y", 'd', c.y) &&
+              writeColumn(fp, "u", 'd', c.u) &&
+              writeColumn(fp, "v", 'd', c.v) &&
+              writeColumn(fp, "u0", 'd', c.u0) &&
+              writeColumn(fp, "v0", 'd', c.v0) &&
+              writeColumn(fp, "iexp", 'l', c.iexp) &&
+              writeColumn(fp, "ichip", 'i', c.ichip) &&
+              writeColumn(fp, "jexp", 'i', c.jexp) &&
+              writeColumn(fp, "jchip", 'i', c.jchip);
+    if (std::fclose(fp) != 0) ok = false;
+    return ok;
+}
+
+} // anonymous
+
+void writeObsVec(std::string const & filename, ObsVec const & obsVec) {
+    ObsColumns columns;
+    columns.fill(obsVec);
+    writeFits(filename, columns);
+}
+
+void writeObsVecBinary(std::string const & filename, ObsVec const & obsVec) {
+    ObsColumns columns;
+    columns.fill(obsVec);
+    if (!writeBinary(filename, columns)) {
+        mosaicLog(pex::logging::Log::WARN, "failed to write snapshot %s", filename.c_str());
+    }
+}
+
+std::string snapshotExtension(SnapshotFormat format) {
+    return (format == SNAPSHOT_BINARY) ? ".obs" : ".fits";
+}
+
+/*
+ * Two column buffers, filled alternately by write() and emptied in the
+ * same order by the writer thread.
+ */
+class SnapshotWriter::Impl {
+public:
+    explicit Impl(SnapshotFormat format) :
+        format(format), fillNext(0), writeNext(0), stop(false)
+    {
+        pending[0] = pending[1] = false;
+        // Started last, once run() can see all the members initialised
+        thread = boost::thread(&Impl::run, this);
+    }
+
+    ~Impl() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            stop = true;
+            cond.notify_all();
+        }
+        thread.join();
+    }
+
+    void run() {
+        for (;;) {
+            ObsColumns * buffer;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                while (!pending[writeNext] && !stop) cond.wait(lock);
+                if (!pending[writeNext]) return;
+                buffer = &buffers[writeNext];
+            }
+
+            bool ok = true;
+            if (format == SNAPSHOT_BINARY) {
+                ok = writeBinary(buffer->filename, *buffer);
+            } else {
+                try {
+                    writeFits(buffer->filename, *buffer);
+                } catch (std::exception &) {
+                    ok = false;
+                }
+            }
+            if (!ok) {
+                mosaicLog(pex::logging::Log::WARN, "failed to write snapshot %s", buffer->filename.c_str());
+            }
+
+            boost::mutex::scoped_lock lock(mutex);
+            pending[writeNext] = false;
+            writeNext ^= 1;
+            cond.notify_all();
+        }
+    }
+
+    SnapshotFormat format;
+    ObsColumns buffers[2];
+    bool pending[2];
+    int fillNext;
+    int writeNext;
+    bool stop;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread thread;
+};
+
+SnapshotWriter::SnapshotWriter(SnapshotFormat format) :
+    _format(format), _impl(new Impl(format))
+{
+}
+
+SnapshotWriter::~SnapshotWriter() {
+}
+
+void SnapshotWriter::write(std::string const & filename, ObsVec const & obsVec) {
+    ObsColumns * buffer;
+    {
+        ScopedTimer timer("snapshot.wait");
+        boost::mutex::scoped_lock lock(_impl->mutex);
+        while (_impl->pending[_impl->fillNext]) _impl->cond.wait(lock);
+        buffer = &_impl->buffers[_impl->fillNext];
+    }
+
+    {
+        ScopedTimer timer("snapshot.copy");
+        buffer->filename = filename;
+        buffer->fill(obsVec);
+    }
+
+    boost::mutex::scoped_lock lock(_impl->mutex);
+    _impl->pending[_impl->fillNext] = true;
+    _impl->fillNext ^= 1;
+    _impl->cond.notify_all();
+}
+
+void SnapshotWriter::flush() {
+    ScopedTimer timer("snapshot.wait");
+    boost::mutex::scoped_lock lock(_impl->mutex);
+    while (_impl->pending[0] || _impl->pending[1]) _impl->cond.wait(lock);
+}
+
 }}} // namespace lsst::meas::mosaic
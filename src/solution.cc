@@ -0,0 +1,237 @@
+#include "lsst/meas/mosaic/solution.h"
+#include "lsst/afw/table.h"
+
+namespace lsst { namespace meas { namespace mosaic {
+
+namespace {
+
+struct ExposureKeys {
+    afw::table::Schema schema;
+    afw::table::Key<boost::int64_t> iexp;
+    afw::table::Key<int> order;
+    afw::table::Key<double> A, D;
+    afw::table::Key<double> x0, y0;
+    afw::table::Key< afw::table::Array<double> > a, b, ap, bp;
+    afw::table::Key<float> fexp;
+
+    explicit ExposureKeys(int ncoeff) :
+        schema(),
+        iexp(schema.addField<boost::int64_t>("iexp", "exposure id")),
+        order(schema.addField<int>("order", "polynomial order")),
+        A(schema.addField<double>("A", "ra of the tangent point", "radians")),
+        D(schema.addField<double>("D", "dec of the tangent point", "radians")),
+        x0(schema.addField<double>("x0", "offset of the focal plane origin", "pixels")),
+        y0(schema.addField<double>("y0", "offset of the focal plane origin", "pixels")),
+        a(schema.addField< afw::table::Array<double> >("a", "xi polynomial", ncoeff)),
+        b(schema.addField< afw::table::Array<double> >("b", "eta polynomial", ncoeff)),
+        ap(schema.addField< afw::table::Array<double> >("ap", "inverse polynomial for u", ncoeff)),
+        bp(schema.addField< afw::table::Array<double> >("bp", "inverse polynomial for v", ncoeff)),
+        fexp(schema.addField<float>("fexp", "flux scale of the exposure"))
+        {}
+
+    explicit ExposureKeys(afw::table::Schema const & s) :
+        schema(s),
+        iexp(s.find<boost::int64_t>("iexp").key),
+        order(s.find<int>("order").key),
+        A(s.find<double>("A").key), D(s.find<double>("D").key),
+        x0(s.find<double>("x0").key), y0(s.find<double>("y0").key),
+        a(s.find< afw::table::Array<double> >("a").key),
+        b(s.find< afw::table::Array<double> >("b").key),
+        ap(s.find< afw::table::Array<double> >("ap").key),
+        bp(s.find< afw::table::Array<double> >("bp").key),
+        fexp(s.find<float>("fexp").key)
+        {}
+};
+
+struct CcdKeys {
+    afw::table::Schema schema;
+    afw::table::Key<int> ichip;
+    afw::table::Key<double> centerX, centerY;
+    afw::table::Key<double> yaw;
+    afw::table::Key<float> fchip;
+
+    CcdKeys() :
+        schema(),
+        ichip(schema.addField<int>("ichip", "ccd id")),
+        centerX(schema.addField<double>("center.x", "ccd center in the focal plane", "pixels")),
+        centerY(schema.addField<double>("center.y", "ccd center in the focal plane", "pixels")),
+        yaw(schema.addField<double>("yaw", "ccd rotation", "radians")),
+        fchip(schema.addField<float>("fchip", "flux scale of the ccd"))
+        {}
+
+    explicit CcdKeys(afw::table::Schema const & s) :
+        schema(s),
+        ichip(s.find<int>("ichip").key),
+        centerX(s.find<double>("center.x").key),
+        centerY(s.find<double>("center.y").key),
+        yaw(s.find<double>("yaw").key),
+        fchip(s.find<float>("fchip").key)
+        {}
+};
+
+struct FluxFitKeys {
+    afw::table::Schema schema;
+    afw::table::Key<int> order;
+    afw::table::Key<afw::table::Flag> absolute, chebyshev;
+    afw::table::Key<double> uMax, vMax;
+    afw::table::Key<double> x0, y0;
+    afw::table::Key< afw::table::Array<double> > coeff;
+
+    explicit FluxFitKeys(int ncoeff) :
+        schema(),
+        order(schema.addField<int>("order", "flux fit order")),
+        absolute(schema.addField<afw::table::Flag>("absolute", "absolute flux fit")),
+        chebyshev(schema.addField<afw::table::Flag>("chebyshev", "Chebyshev flux fit")),
+        uMax(schema.addField<double>("u_max", "flux fit normalisation", "pixels")),
+        vMax(schema.addField<double>("v_max", "flux fit normalisation", "pixels")),
+        x0(schema.addField<double>("x0", "flux fit origin", "pixels")),
+        y0(schema.addField<double>("y0", "flux fit origin", "pixels")),
+        coeff(schema.addField< afw::table::Array<double> >("coeff", "flux fit coefficients", ncoeff))
+        {}
+
+    explicit FluxFitKeys(afw::table::Schema const & s) :
+        schema(s),
+        order(s.find<int>("order").key),
+        absolute(s.find<afw::table::Flag>("absolute").key),
+        chebyshev(s.find<afw::table::Flag>("chebyshev").key),
+        uMax(s.find<double>("u_max").key),
+        vMax(s.find<double>("v_max").key),
+        x0(s.find<double>("x0").key),
+        y0(s.find<double>("y0").key),
+        coeff(s.find< afw::table::Array<double> >("coeff").key)
+        {}
+};
+
+} // anonymous
+
+void writeSolution(std::string const & filename,
+                   CoeffSet const & coeffSet,
+                   CcdSet const & ccdSet,
+                   std::map<ExpType, float> const & fexp,
+                   std::map<ChipType, float> const & fchip,
+                   FluxFitParams::Ptr const & ffp) {
+    int ncoeff = coeffSet.empty() ? 0 : coeffSet.begin()->second->p->ncoeff;
+
+    ExposureKeys const expKeys(ncoeff);
+    afw::table::BaseCatalog exposures(expKeys.schema);
+    exposures.reserve(coeffSet.size());
+    for (CoeffSet::const_iterator iter = coeffSet.begin(); iter != coeffSet.end(); ++iter) {
+        Coeff const & c = *iter->second;
+        PTR(afw::table::BaseRecord) record = exposures.addNew();
+        record->set(expKeys.iexp, iter->first);
+        record->set(expKeys.order, c.p->order);
+        record->set(expKeys.A, c.A);
+        record->set(expKeys.D, c.D);
+        record->set(expKeys.x0, c.x0);
+        record->set(expKeys.y0, c.y0);
+        for (int i = 0; i < ncoeff; ++i) {
+            record->set(expKeys.a[i], c.a[i]);
+            record->set(expKeys.b[i], c.b[i]);
+            record->set(expKeys.ap[i], c.ap[i]);
+            record->set(expKeys.bp[i], c.bp[i]);
+        }
+        std::map<ExpType, float>::const_iterator f = fexp.find(iter->first);
+        record->set(expKeys.fexp, f != fexp.end() ? f->second : std::numeric_limits<float>::quiet_NaN());
+    }
+
+    CcdKeys const ccdKeys;
+    afw::table::BaseCatalog ccds(ccdKeys.schema);
+    ccds.reserve(ccdSet.size());
+    for (CcdSet::const_iterator iter = ccdSet.begin(); iter != ccdSet.end(); ++iter) {
+        afw::cameraGeom::Ccd const & ccd = *iter->second;
+        afw::geom::Point2D center = ccd.getCenter().getPixels(ccd.getPixelSize());
+        PTR(afw::table::BaseRecord) record = ccds.addNew();
+        record->set(ccdKeys.ichip, iter->first);
+        record->set(ccdKeys.centerX, center.getX());
+        record->set(ccdKeys.centerY, center.getY());
+        record->set(ccdKeys.yaw, ccd.getOrientation().getYaw().asRadians());
+        std::map<ChipType, float>::const_iterator f = fchip.find(iter->first);
+        record->set(ccdKeys.fchip, f != fchip.end() ? f->second : std::numeric_limits<float>::quiet_NaN());
+    }
+
+    FluxFitKeys const ffpKeys(ffp->ncoeff);
+    afw::table::BaseCatalog fluxFit(ffpKeys.schema);
+    PTR(afw::table::BaseRecord) record = fluxFit.addNew();
+    record->set(ffpKeys.order, ffp->order);
+    record->set(ffpKeys.absolute, ffp->absolute);
+    record->set(ffpKeys.chebyshev, ffp->chebyshev);
+    record->set(ffpKeys.uMax, ffp->u_max);
+    record->set(ffpKeys.vMax, ffp->v_max);
+    record->set(ffpKeys.x0, ffp->x0);
+    record->set(ffpKeys.y0, ffp->y0);
+    for (int i = 0; i < ffp->ncoeff; ++i) {
+        record->set(ffpKeys.coeff[i], ffp->coeff[i]);
+    }
+
+    exposures.writeFits(filename);
+    ccds.writeFits(filename, "a");
+    fluxFit.writeFits(filename, "a");
+}
+
+FluxFitParams::Ptr readSolution(std::string const & filename,
+                               CoeffSet & coeffSet,
+                               CcdSet & ccdSet,
+                               std::map<ExpType, float> & fexp,
+                               std::map<ChipType, float> & fchip) {
+    afw::table::BaseCatalog exposures = afw::table::BaseCatalog::readFits(filename, 2);
+    ExposureKeys const expKeys(exposures.getSchema());
+    for (size_t n = 0; n < exposures.size(); ++n) {
+        afw::table::BaseRecord const & record = exposures[n];
+        ExpType iexp = record.get(expKeys.iexp);
+        Coeff::Ptr c = Coeff::Ptr(new Coeff(record.get(expKeys.order)));
+        c->iexp = iexp;
+        c->A = record.get(expKeys.A);
+        c->D = record.get(expKeys.D);
+        c->x0 = record.get(expKeys.x0);
+        c->y0 = record.get(expKeys.y0);
+        for (int i = 0; i < c->p->ncoeff; ++i) {
+            c->a[i] = record.get(expKeys.a[i]);
+            c->b[i] = record.get(expKeys.b[i]);
+            c->ap[i] = record.get(expKeys.ap[i]);
+            c->bp[i] = record.get(expKeys.bp[i]);
+        }
+        coeffSet[iexp] = c;
+        fexp[iexp] = record.get(expKeys.fexp);
+    }
+
+    afw::table::BaseCatalog ccds = afw::table::BaseCatalog::readFits(filename, 3);
+    CcdKeys const ccdKeys(ccds.getSchema());
+    for (size_t n = 0; n < ccds.size(); ++n) {
+        afw::table::BaseRecord const & record = ccds[n];
+        ChipType ichip = record.get(ccdKeys.ichip);
+        fchip[ichip] = record.get(ccdKeys.fchip);
+
+        CcdSet::iterator iter = ccdSet.find(ichip);
+        if (iter == ccdSet.end()) continue;
+        afw::cameraGeom::Ccd::Ptr ccd = iter->second;
+        afw::geom::Point2D center = ccd->getCenter().getPixels(ccd->getPixelSize());
+        afw::geom::Extent2D offset(record.get(ccdKeys.centerX) - center.getX(),
+                                   record.get(ccdKeys.centerY) - center.getY());
+        offset *= ccd->getPixelSize();
+        ccd->shiftCenter(afw::cameraGeom::FpExtent(offset));
+        afw::cameraGeom::Orientation o = ccd->getOrientation();
+        afw::cameraGeom::Orientation o2(o.getNQuarter(),
+                                        o.getPitch(),
+                                        o.getRoll(),
+                                        record.get(ccdKeys.yaw) * afw::geom::radians);
+        ccd->setOrientation(o2);
+    }
+
+    afw::table::BaseCatalog fluxFit = afw::table::BaseCatalog::readFits(filename, 4);
+    FluxFitKeys const ffpKeys(fluxFit.getSchema());
+    afw::table::BaseRecord const & record = fluxFit[0];
+    FluxFitParams::Ptr ffp(new FluxFitParams(record.get(ffpKeys.order),
+                                             record.get(ffpKeys.absolute),
+                                             record.get(ffpKeys.chebyshev)));
+    ffp->u_max = record.get(ffpKeys.uMax);
+    ffp->v_max = record.get(ffpKeys.vMax);
+    ffp->x0 = record.get(ffpKeys.x0);
+    ffp->y0 = record.get(ffpKeys.y0);
+    for (int i = 0; i < ffp->ncoeff; ++i) {
+        ffp->coeff[i] = record.get(ffpKeys.coeff[i]);
+    }
+
+    return ffp;
+}
+
+}}} // namespace lsst::meas::mosaic